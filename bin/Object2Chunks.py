@@ -43,6 +43,7 @@ def main():
     defPort = '3306'
     defDatabase = 'DC3a_catalogs'
     defTable = 'CFHTLSObject'
+    defFormat = 2
     parser = optparse.OptionParser()
     parser.add_option('-z', '--zones_per_degree', type=int, default=defZpd,
                       help='number of zones per degree (default: %d)' % defZpd)
@@ -59,11 +60,17 @@ def main():
                       help='object table name (default: %s)' % defTable)
     parser.add_option('-p', '--policy',
                       help='filename of policy for database authentication')
+    parser.add_option('-f', '--format', type=int, default=defFormat,
+                      help='chunk file format version: 1 (raw records) or ' +
+                           '2 (columnar) (default: %d)' % defFormat)
 
     (options, args) = parser.parse_args()
     if not options.directory:
         print "Output directory must be specified"
         sys.exit(1)
+    if options.format not in (1, 2):
+        print "Chunk file format version must be 1 or 2"
+        sys.exit(1)
 
     # create a decomposition of the unit sphere
     zsc = ap.ZoneStripeChunkDecomposition(options.zones_per_degree, options.zones_per_stripe, 1)
@@ -75,7 +82,8 @@ def main():
                  '-H', options.host,
                  '-P', str(options.port),
                  '-b', options.database,
-                 '-t', options.table ]
+                 '-t', options.table,
+                 '-f', str(options.format) ]
     if options.policy:
         fixedArgs.extend(['-p', options.policy])
 
@@ -44,13 +44,13 @@
 
 #include "DataTraits.h"
 #include "Chunk.h"
+#include "ChunkFormat.h"
 #include "io/FileIo.h"
 
 
 // -- ChunkDescriptor ----------------
 
-template <int MaxBlocksPerChunk>
-void lsst::ap::ChunkDescriptor<MaxBlocksPerChunk>::initialize() {
+inline void lsst::ap::ChunkDescriptor::initialize() {
 
     _chunkId   = -1;
     _visitId   = -1;
@@ -62,9 +62,12 @@ void lsst::ap::ChunkDescriptor<MaxBlocksPerChunk>::initialize() {
     _size      = 0;
     _delta     = 0;
     _curBlockOffset = 0;
+    _generation     = 0;
+    _lastUse        = 0;
+    _prefetcher     = 0;
+    _blocks         = 0;
 
     _interestedParties.clear();
-    std::memset(_blocks, 0, sizeof(_blocks));
 }
 
 
@@ -80,11 +83,15 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::reserve(int const n) {
         }
         int nb = (n + ((1 << ENTRIES_PER_BLOCK_LOG2) - 1)) >> ENTRIES_PER_BLOCK_LOG2;
         int b = _descriptor->_numBlocks;
-        _allocator->allocate(&(_descriptor->_blocks[b]), nb - b);
+        if (nb > _allocator->getMaxBlocksPerChunk()) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                "Requested chunk capacity exceeds the maximum number of blocks per chunk");
+        }
+        _allocator->allocate(blockList() + b, nb - b);
         // zero out the newly allocated blocks
         for (; b < nb; ++b) {
             std::memset(
-                map(_descriptor->_blocks[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)),
+                map(blockList()[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)),
                 0,
                 sizeof(DataT) << ENTRIES_PER_BLOCK_LOG2
             );
@@ -107,7 +114,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::insert(
    if (block == 0 || i >= (1 << ENTRIES_PER_BLOCK_LOG2)) {
        // no current block, or current block is full
        if (block >= _descriptor->_numBlocks) {
-           if (block >= MAX_BLOCKS) {
+           if (block >= _allocator->getMaxBlocksPerChunk()) {
                throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
                    "maximum number of blocks per chunk exceeded");
            }
@@ -118,10 +125,10 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::insert(
                0,
                sizeof(DataT) << ENTRIES_PER_BLOCK_LOG2
            );
-           _descriptor->_blocks[block] = off;
+           blockList()[block] = off;
            _descriptor->_numBlocks = block + 1;
        } else {
-           off = _descriptor->_blocks[block];
+           off = blockList()[block];
        }
        _descriptor->_nextBlock = block + 1;
        _descriptor->_curBlockOffset = off;
@@ -156,7 +163,7 @@ bool lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::pack(int const i) {
     int sz    = _descriptor->_size;
     int dBlk  = i >> ENTRIES_PER_BLOCK_LOG2;
     int ib    = i & ((1 << ENTRIES_PER_BLOCK_LOG2) - 1);
-    std::size_t d     = _descriptor->_blocks[dBlk];
+    std::size_t d     = blockList()[dBlk];
     std::size_t dEnd  = d + BLOCK_SIZE;
 
     ChunkEntryFlag * df = map(d + ib*sizeof(ChunkEntryFlag));
@@ -176,7 +183,7 @@ bool lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::pack(int const i) {
             if ((*sf & IN_DELTA) != 0 && delta == 0x7fffffff) {
                 // set delta
                 delta = (dBlk << ENTRIES_PER_BLOCK_LOG2) +
-                        (d - _descriptor->_blocks[dBlk] - fb)/sizeof(DataT);
+                        (d - blockList()[dBlk] - fb)/sizeof(DataT);
             }
             if (df != sf) {
                 *df = *sf;
@@ -186,7 +193,7 @@ bool lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::pack(int const i) {
             d += sizeof(DataT);
             if (d == dEnd) {
                 ++dBlk;
-                d    = _descriptor->_blocks[dBlk];
+                d    = blockList()[dBlk];
                 dEnd = d + BLOCK_SIZE;
                 df   = map(d);
                 d   += fb;
@@ -196,14 +203,14 @@ bool lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::pack(int const i) {
         if (sBlk >= _descriptor->_nextBlock) {
             break;
         }
-        s    = _descriptor->_blocks[sBlk];
+        s    = blockList()[sBlk];
         sEnd = s + BLOCK_SIZE;
         sf   = map(s);
         s   += fb;
     }
 
     if (sz < _descriptor->_size) {
-        std::size_t const cb = _descriptor->_blocks[dBlk];
+        std::size_t const cb = blockList()[dBlk];
         _descriptor->_curBlockOffset = cb;
         _descriptor->_nextBlock      = dBlk + 1;
         d -= cb + fb;
@@ -249,7 +256,7 @@ bool lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::rollback() {
 
     for (int b = 0; b < _descriptor->_nextBlock; ++b) {
 
-        std::size_t const off = _descriptor->_blocks[b];
+        std::size_t const off = blockList()[b];
         ChunkEntryFlag * const flags = map(off);
 
         for (int i = 0, e = entries(b); i < e; ++i) {
@@ -288,7 +295,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::commit(bool clearDelta) {
     mask = ~mask;
 
     for (int b = 0; b < _descriptor->_nextBlock; ++b) {
-        std::size_t const off = _descriptor->_blocks[b];
+        std::size_t const off = blockList()[b];
         ChunkEntryFlag * const flags = map(off);
         int const e = entries(b);
 
@@ -330,7 +337,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::applyDeletes(
     for (int i = 0; i < numDeletes; ++i) {
         int d = deletes[i];
         ChunkEntryFlag * f = reinterpret_cast<ChunkEntryFlag *>(map(
-            _descriptor->_blocks[d >> ENTRIES_PER_BLOCK_LOG2] +
+            blockList()[d >> ENTRIES_PER_BLOCK_LOG2] +
             (d & ((1 << ENTRIES_PER_BLOCK_LOG2) - 1)) * sizeof(ChunkEntryFlag)
         ));
         *f |= DELETED;
@@ -370,7 +377,9 @@ std::string const badChunkMessage =
 
 /**
  * Reads the data from the binary chunk file @a name into this chunk. Note that this chunk is
- * emptied immediately on entering the function.
+ * emptied immediately on entering the function. Both the original (version 1) and the
+ * columnar (version 2) chunk file formats are supported; the format is detected from the
+ * magic number at the start of the file.
  *
  * @param name         The name of binary chunk file to read into memory
  * @param compressed   Is the binary chunk file compressed? zlib or gzip compression is supported.
@@ -393,34 +402,67 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::read(
         return;
     }
 
-    // read in the header
-    BinChunkHeader header;
-    doRead(*reader, reinterpret_cast<unsigned char *>(&header), sizeof(BinChunkHeader));
-    if (!header.isValid() || header._numDeletes != 0 || header._recordSize != sizeof(DataT)) {
-        throw LSST_EXCEPT(lsst::pex::exceptions::IoError, badChunkMessage);
-    }
-
-    int nr = header._numRecords;
-    if (nr == 0) {
-        return; // nothing to read in
-    }
-    reserve(nr);
+    // read in the magic number, which determines the format of the rest of the header
+    boost::uint32_t magic;
+    doRead(*reader, reinterpret_cast<unsigned char *>(&magic), sizeof(boost::uint32_t));
 
     int b = 0;
     int nd;
+    if (magic == ColumnarChunkHeader::MAGIC) {
+        ColumnarChunkHeader header;
+        doRead(*reader, reinterpret_cast<unsigned char *>(&header) + sizeof(boost::uint32_t),
+               sizeof(ColumnarChunkHeader) - sizeof(boost::uint32_t));
+        if (header._version != ColumnarChunkHeader::VERSION) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::IoError,
+                "Unsupported binary chunk file version - please regenerate the chunk file");
+        }
+        if (header._recordSize != sizeof(DataT) || header._numRecords < 0) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::IoError, badChunkMessage);
+        }
+        int nr = header._numRecords;
+        if (nr == 0) {
+            return; // nothing to read in
+        }
+        reserve(nr);
+        int const numBlocks = (nr + ((1 << ENTRIES_PER_BLOCK_LOG2) - 1)) >> ENTRIES_PER_BLOCK_LOG2;
+        std::vector<DataT *> blocks(numBlocks);
+        for (b = 0; b < numBlocks; ++b) {
+            blocks[b] = getBlock(b);
+        }
+        ColumnarFormat<DataT>::read(*reader, header, &blocks[0], ENTRIES_PER_BLOCK_LOG2);
+        for (b = 0; nr > 0; ++b) {
+            nd  = std::min((1 << ENTRIES_PER_BLOCK_LOG2), nr);
+            nr -= nd;
+            setFlags(b, 0, 0, nd);
+        }
+    } else {
+        BinChunkHeader header;
+        header._magic = magic;
+        doRead(*reader, reinterpret_cast<unsigned char *>(&header) + sizeof(boost::uint32_t),
+               sizeof(BinChunkHeader) - sizeof(boost::uint32_t));
+        if (!header.isValid() || header._numDeletes != 0 || header._recordSize != sizeof(DataT)) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::IoError, badChunkMessage);
+        }
 
-    // read in one memory block at a time
-    do {
-        nd  = std::min((1 << ENTRIES_PER_BLOCK_LOG2), nr);
-        nr -= nd;
-        doRead(*reader, reinterpret_cast<unsigned char *>(getBlock(b)), nd * sizeof(DataT));
-        setFlags(b, 0, 0, nd);
-        ++b;
-    } while (nr > 0);
+        int nr = header._numRecords;
+        if (nr == 0) {
+            return; // nothing to read in
+        }
+        reserve(nr);
+
+        // read in one memory block at a time
+        do {
+            nd  = std::min((1 << ENTRIES_PER_BLOCK_LOG2), nr);
+            nr -= nd;
+            doRead(*reader, reinterpret_cast<unsigned char *>(getBlock(b)), nd * sizeof(DataT));
+            setFlags(b, 0, 0, nd);
+            ++b;
+        } while (nr > 0);
+    }
 
     // update chunk size
     _descriptor->_nextBlock = b;
-    _descriptor->_curBlockOffset = _descriptor->_blocks[b - 1];
+    _descriptor->_curBlockOffset = blockList()[b - 1];
     _descriptor->_index = nd;
     int sz = nd + ((b - 1) << ENTRIES_PER_BLOCK_LOG2);
     _descriptor->_size  = sz;
@@ -499,7 +541,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::readDelta(
 
     // update chunk state to reflect additions
     _descriptor->_nextBlock = b;
-    _descriptor->_curBlockOffset = _descriptor->_blocks[b - 1];
+    _descriptor->_curBlockOffset = blockList()[b - 1];
     _descriptor->_index = nd;
     _descriptor->_size = sz;
 }
@@ -513,8 +555,8 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::readDelta(
  *
  * @param name         The name of binary chunk file to write.
  * @param overwrite    Should an existing file with the given name be overwritten?
- * @param compressed   Should the binary chunk file contents be compressed? A gzip compatible
- *                     algorithm will be used.
+ * @param compressed   Should the binary chunk file contents be compressed? A blocked gzip
+ *                     compatible format is used, so that reads can decompress in parallel.
  * @param withDelta    Should entries marked IN_DELTA be written out?
  */
 template <typename AllocatorT, typename DataT, typename TraitsT>
@@ -526,7 +568,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::write(
 ) const {
     boost::scoped_ptr<io::SequentialWriter> writer;
     if (compressed) {
-        writer.reset(new io::CompressedFileWriter(name, overwrite));
+        writer.reset(new io::BlockedCompressedFileWriter(name, overwrite));
     } else {
         writer.reset(new io::SequentialFileWriter(name, overwrite));
     }
@@ -547,6 +589,35 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::write(
 }
 
 
+/**
+ * Writes the data from this chunk to a columnar (version 2) binary chunk file. Each field of
+ * the chunk entries is stored as its own column, encoded to take advantage of the value
+ * distribution of the field, so the file is much smaller than one written by write().
+ * Entries are written in chunk order; writing spatially sorted entries yields the smallest
+ * files. As with write(), deleted records are written out as well, and entry flags are unchanged.
+ *
+ * @param name         The name of binary chunk file to write.
+ * @param overwrite    Should an existing file with the given name be overwritten?
+ * @param withDelta    Should entries marked IN_DELTA be written out?
+ */
+template <typename AllocatorT, typename DataT, typename TraitsT>
+void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::writeColumnar(
+    std::string const & name,
+    bool        const   overwrite,
+    bool        const   withDelta
+) const {
+    io::SequentialFileWriter writer(name, overwrite);
+    int const nr = withDelta ? size() : delta();
+    int const numBlocks = (nr + ((1 << ENTRIES_PER_BLOCK_LOG2) - 1)) >> ENTRIES_PER_BLOCK_LOG2;
+    std::vector<DataT const *> blocks(numBlocks + 1);
+    for (int b = 0; b < numBlocks; ++b) {
+        blocks[b] = getBlock(b);
+    }
+    ColumnarFormat<DataT>::write(writer, &blocks[0], ENTRIES_PER_BLOCK_LOG2, nr);
+    writer.finish();
+}
+
+
 /**
  * Writes any deletes and inserts in this chunk to a binary delta file named @a name. Note that
  * even on successful function return, uncommitted deletes/inserts are @b not marked as committed
@@ -556,8 +627,8 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::write(
  *
  * @param name         The name of binary chunk file to write
  * @param overwrite    Should an existing file with the given name be overwritten?
- * @param compressed   Should the binary chunk delta file contents be compressed (a gzip
- *                     compatible algorithm will be used)?
+ * @param compressed   Should the binary chunk delta file contents be compressed (a blocked
+ *                     gzip compatible format will be used)?
  */
 template <typename AllocatorT, typename DataT, typename TraitsT>
 void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::writeDelta(
@@ -567,7 +638,7 @@ void lsst::ap::ChunkRef<AllocatorT, DataT, TraitsT>::writeDelta(
 ) const {
     boost::scoped_ptr<io::SequentialWriter> writer;
     if (compressed) {
-        writer.reset(new io::CompressedFileWriter(name, overwrite));
+        writer.reset(new io::BlockedCompressedFileWriter(name, overwrite));
     } else {
         writer.reset(new io::SequentialFileWriter(name, overwrite));
     }
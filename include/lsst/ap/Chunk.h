@@ -79,9 +79,10 @@ struct BinChunkHeader {
  * @brief  A generic descriptor containing state for different kinds of chunks.
  *
  * State is data and memory type agnostic (that is, the structure contains no
- * pointers and can therefore safely be placed in shared memory).
+ * pointers and can therefore safely be placed in shared memory). The offsets of
+ * the memory blocks allocated to a chunk are stored outside of its descriptor, in
+ * a list sized for the maximum number of blocks per chunk of the owning chunk store.
  */
-template <int MaxBlocksPerChunk>
 class ChunkDescriptor : private boost::noncopyable {
 public :
 
@@ -102,10 +103,22 @@ public :
     int _delta;     ///< Index of first entry marked IN_DELTA
     std::size_t _curBlockOffset; ///< Offset of the current block
 
+    /**
+     * Changes whenever the chunk contents are (re)loaded or rolled back, allowing clients that
+     * cache information about chunk entries across visits to detect that it is stale.
+     */
+    boost::uint64_t _generation;
+
+    /// Time stamp of the last use of a chunk retained in memory after its last owner finished
+    boost::uint64_t _lastUse;
+
+    /// Process id of the process prefetching the chunk, or 0 if the chunk is not being prefetched
+    int _prefetcher;
+
     /// FIFO of visits to a FOV that overlaps the chunk
     Fifo<MAX_VISITS_IN_FLIGHT> _interestedParties;
-    /// List of memory block offsets for allocated blocks
-    std::size_t _blocks[MaxBlocksPerChunk];
+    /// Offset (relative to the block allocator) of the list of memory block offsets for allocated blocks
+    std::size_t _blocks;
 
 
     ChunkDescriptor() { initialize(); }
@@ -261,11 +274,10 @@ public  :
     };
 
     static int const ENTRIES_PER_BLOCK_LOG2 = TraitsT::ENTRIES_PER_BLOCK_LOG2;
-    static int const MAX_BLOCKS = TraitsT::MAX_BLOCKS_PER_CHUNK;
     static std::size_t const BLOCK_SIZE =
         (sizeof(DataT) + sizeof(ChunkEntryFlag)) << ENTRIES_PER_BLOCK_LOG2;
 
-    typedef ChunkDescriptor<MAX_BLOCKS> Descriptor;
+    typedef ChunkDescriptor Descriptor;
 
     ChunkRef(Descriptor * desc, AllocatorT * all) : _descriptor(desc), _allocator(all) {}
 
@@ -283,6 +295,9 @@ public  :
     bool isUsable() const {
         return _descriptor->_usable;
     }
+    boost::uint64_t getGeneration() const {
+        return _descriptor->_generation;
+    }
     void setUsable() {
         _descriptor->_usable = true;
     }
@@ -291,7 +306,7 @@ public  :
     DataT const & get(int const i) const {
         assert(i >= 0 && i < _descriptor->_size);
         return *reinterpret_cast<DataT const *>(map(
-            _descriptor->_blocks[i >> ENTRIES_PER_BLOCK_LOG2] +
+            blockList()[i >> ENTRIES_PER_BLOCK_LOG2] +
             sizeof(ChunkEntryFlag)*(1 << ENTRIES_PER_BLOCK_LOG2) +
             (i & ((1 << ENTRIES_PER_BLOCK_LOG2) - 1))*sizeof(DataT)
         ));
@@ -301,7 +316,7 @@ public  :
     DataT const * getBlock(int const b) const {
         assert(b >= 0 && b < _descriptor->_numBlocks);
         return reinterpret_cast<DataT const *>(map(
-            _descriptor->_blocks[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)
+            blockList()[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)
         ));
     }
 
@@ -309,7 +324,7 @@ public  :
     DataT * getBlock(int const b) {
         assert(b >= 0 && b < _descriptor->_numBlocks);
         return reinterpret_cast<DataT *>(map(
-            _descriptor->_blocks[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)
+            blockList()[b] + (sizeof(ChunkEntryFlag) << ENTRIES_PER_BLOCK_LOG2)
         ));
     }
 
@@ -317,7 +332,7 @@ public  :
     ChunkEntryFlag getFlag(int const i) const {
         assert(i >= 0 && i < _descriptor->_size);
         return *reinterpret_cast<ChunkEntryFlag const *>(map(
-            _descriptor->_blocks[i >> ENTRIES_PER_BLOCK_LOG2] +
+            blockList()[i >> ENTRIES_PER_BLOCK_LOG2] +
             (i & ((1u << ENTRIES_PER_BLOCK_LOG2) - 1))*sizeof(ChunkEntryFlag)
         ));
     }
@@ -325,13 +340,13 @@ public  :
     /** Returns a pointer to the @a b-th flag block. */
     ChunkEntryFlag const * getFlagBlock(int const b) const {
         assert(b >= 0 && b < _descriptor->_numBlocks);
-        return reinterpret_cast<ChunkEntryFlag const *>(map(_descriptor->_blocks[b]));
+        return reinterpret_cast<ChunkEntryFlag const *>(map(blockList()[b]));
     }
 
     /** Returns a pointer to the @a b-th flag block. */
     ChunkEntryFlag * getFlagBlock(int const b) {
         assert(b >= 0 && b < _descriptor->_numBlocks);
-        return reinterpret_cast<ChunkEntryFlag *>(map(_descriptor->_blocks[b]));
+        return reinterpret_cast<ChunkEntryFlag *>(map(blockList()[b]));
     }
 
     /** Inserts the given data entry into the chunk, allocating memory if necessary. */
@@ -343,7 +358,7 @@ public  :
     void remove(int const i) {
         assert(i >= 0 && i < _descriptor->_size);
         ChunkEntryFlag * f = reinterpret_cast<ChunkEntryFlag *>(map(
-            _descriptor->_blocks[i >> ENTRIES_PER_BLOCK_LOG2] +
+            blockList()[i >> ENTRIES_PER_BLOCK_LOG2] +
             (i & ((1 << ENTRIES_PER_BLOCK_LOG2) - 1))*sizeof(ChunkEntryFlag)
         ));
         if ((*f & DELETED) == 0) { // removing an entry that is already deleted is a no-op
@@ -396,6 +411,11 @@ public  :
         bool        const   compressed,
         bool        const   withDelta = true
     ) const;
+    void writeColumnar(
+        std::string const & name,
+        bool        const   overwrite,
+        bool        const   withDelta = true
+    ) const;
     void writeDelta(
         std::string const & name,
         bool        const   overwrite,
@@ -422,6 +442,16 @@ private :
         return reinterpret_cast<unsigned char const *>(_allocator) + off;
     }
 
+    /** Returns the offsets of the memory blocks allocated to the chunk. */
+    std::size_t * blockList() {
+        return reinterpret_cast<std::size_t *>(map(_descriptor->_blocks));
+    }
+
+    /** Returns the offsets of the memory blocks allocated to the chunk. */
+    std::size_t const * blockList() const {
+        return reinterpret_cast<std::size_t const *>(map(_descriptor->_blocks));
+    }
+
     void applyDeletes(
         int const * const deletes,
         int const numDeletes,
@@ -0,0 +1,205 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Columnar (version 2) binary chunk file format.
+ *
+ * A version 2 chunk file consists of a ColumnarChunkHeader, followed by one ColumnHeader per
+ * field of the chunk entry type, followed by the encoded data of each column in the same order.
+ * Each column is encoded with whichever of the supported encodings yields the fewest bytes,
+ * and carries a CRC-32 of its encoded data. Version 1 chunk files (a BinChunkHeader followed
+ * by raw entries) are still read.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_CHUNK_FORMAT_H
+#define LSST_AP_CHUNK_FORMAT_H
+
+#include <cstddef>
+#include <vector>
+
+#include "boost/cstdint.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "Common.h"
+#include "Object.h"
+#include "io/FileIo.h"
+
+
+namespace lsst { namespace ap {
+
+/** @brief  Header for columnar binary chunk files. */
+struct ColumnarChunkHeader {
+
+    static boost::uint32_t const MAGIC = 0xdecade20;
+    /// The version of the chunk file format written by this code.
+    static boost::uint16_t const VERSION = 2;
+
+    boost::uint32_t _magic;
+    boost::uint16_t _version;
+    boost::uint16_t _numColumns;
+    int _numRecords;
+    int _recordSize;
+
+    ColumnarChunkHeader() :
+        _magic(MAGIC),
+        _version(VERSION),
+        _numColumns(0),
+        _numRecords(0),
+        _recordSize(0)
+    {}
+
+    bool isValid() const {
+        return _magic == MAGIC;
+    }
+};
+
+
+/** @brief  Describes the encoded data of a single column in a columnar chunk file. */
+struct ColumnHeader {
+
+    /// Ways in which the values of a column are encoded.
+    enum Encoding {
+        RAW = 0,    ///< Values as stored in memory
+        DELTA,      ///< Zig-zag varints of differences between successive values
+        SPARSE,     ///< Varint count, then a varint index gap and raw value per non-zero value
+        BIT_PACKED  ///< Minimum value, then differences from it packed into _width bits each
+    };
+
+    boost::uint8_t  _encoding;
+    boost::uint8_t  _width;    ///< Bits per value of a BIT_PACKED column
+    boost::uint16_t _reserved;
+    boost::uint32_t _checksum; ///< CRC-32 of the encoded column data
+    boost::uint64_t _size;     ///< Number of bytes of encoded column data
+};
+
+
+namespace detail {
+
+void encodeColumn(ColumnHeader & header, std::vector<unsigned char> & out,
+                  boost::int64_t const * values, int const n);
+void encodeColumn(ColumnHeader & header, std::vector<unsigned char> & out,
+                  double const * values, int const n);
+void encodeColumn(ColumnHeader & header, std::vector<unsigned char> & out,
+                  boost::int16_t const * values, int const n);
+
+/**
+ * @brief  Decodes the values of a column into the fields of consecutive chunk entries.
+ *
+ * The values of a column can be decoded in several calls, one per memory block of a chunk.
+ * Malformed column data results in an lsst::pex::exceptions::IoError.
+ */
+class ColumnDecoder {
+public :
+    ColumnDecoder(ColumnHeader const & header, unsigned char const * const data);
+
+    void decode(boost::int64_t * dst, std::size_t const stride, int const n);
+    void decode(double * dst, std::size_t const stride, int const n);
+    void decode(boost::int16_t * dst, std::size_t const stride, int const n);
+
+    void finish() const;
+
+private :
+    unsigned char const * _cur;
+    unsigned char const * _end;
+    int _encoding;
+    int _width;
+    int _index;            ///< Index of the next value to decode
+    int _nextNonZero;      ///< Index of the next non-zero value of a SPARSE column
+    int _numNonZero;       ///< Number of non-zero values of a SPARSE column remaining
+    boost::uint64_t _prev; ///< Last value decoded from a DELTA column
+    int _bit;              ///< Bit offset of the next value of a BIT_PACKED column
+
+    boost::uint64_t decodeVarint();
+    void decodeNextNonZero(int const base);
+};
+
+} // end of namespace detail
+
+
+/**
+ * @brief  Writes and reads chunk entries of a given type in the columnar chunk file format.
+ *
+ * The generic implementation supports no entry types; specializations provide
+ * support for particular ones.
+ */
+template <typename DataT>
+struct ColumnarFormat {
+    static void write(
+        io::SequentialWriter &,
+        DataT const * const *,
+        int const,
+        int const
+    ) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "columnar chunk files are not supported for this entry type");
+    }
+
+    static void read(
+        io::SequentialReader &,
+        ColumnarChunkHeader const &,
+        DataT * const *,
+        int const
+    ) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::IoError,
+                          "columnar chunk files are not supported for this entry type");
+    }
+};
+
+
+/**
+ * @brief  Stores each field of an Object as its own column.
+ *
+ * Positions are delta encoded, so chunk files are much smaller when objects are written in
+ * spatially sorted order. Proper motions, parallaxes and radial velocities are usually zero,
+ * and are then sparse encoded. Variability probabilities are bit-packed.
+ */
+template <>
+struct ColumnarFormat<Object> {
+    /// The number of columns in a file: one per field, with one per filter for the variability probability
+    static int const NUM_COLUMNS = 7 + Object::NUM_FILTERS;
+
+    static void write(
+        io::SequentialWriter & writer,
+        Object const * const * blocks,
+        int const entriesPerBlockLog2,
+        int const numRecords
+    );
+
+    static void read(
+        io::SequentialReader & reader,
+        ColumnarChunkHeader const & header,
+        Object * const * blocks,
+        int const entriesPerBlockLog2
+    );
+};
+
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_CHUNK_FORMAT_H
@@ -0,0 +1,127 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   A pool of threads that reads object chunks in parallel.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_CHUNK_LOADER_H
+#define LSST_AP_CHUNK_LOADER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "boost/noncopyable.hpp"
+#include "boost/shared_ptr.hpp"
+
+#include "Common.h"
+#include "ChunkManager.h"
+#include "Condition.h"
+#include "Mutex.h"
+#include "Thread.h"
+
+
+namespace lsst { namespace ap {
+
+/** @brief  Statistics for a single chunk read by a ChunkLoader. */
+struct ChunkLoadStats {
+    ChunkLoadStats() : _seconds(0.0), _bytes(0) {}
+
+    double _seconds;          ///< time taken to read the chunk and chunk delta files
+    unsigned long long _bytes; ///< total size of the chunk and chunk delta files
+};
+
+
+/**
+ * @brief   A bounded pool of threads that reads (and decompresses) object chunk and chunk
+ *          delta files.
+ *
+ * Worker threads are created once, when the pool is constructed, and are reused by every
+ * call to load(). The thread calling load() reads chunks as well, so a pool of N threads
+ * has N - 1 workers. Each thread repeatedly claims the next unread chunk, reads its chunk
+ * and chunk delta files and marks it usable. Once reading any chunk fails, no further
+ * chunks are claimed.
+ *
+ * Chunks are read concurrently, so the chunks passed to a single call to load() must be
+ * distinct. A chunk read only modifies the descriptor of that chunk, which its visit owns.
+ * Memory blocks are obtained from the block allocator of the chunk manager, which is safe
+ * to call from any thread or process: LockFreeBlockAllocator reserves and claims blocks with
+ * atomic operations, and BlockAllocator serializes allocations with its own process-shared
+ * mutex. No chunk manager lock is therefore held while reading.
+ *
+ * Calls to load() are serialized.
+ */
+class ChunkLoader : private boost::noncopyable {
+public :
+    typedef SharedObjectChunkManager::ObjectChunk ObjectChunk;
+
+    /// The largest number of threads a pool may have.
+    static int const MAX_THREADS = 64;
+
+    explicit ChunkLoader(int const numThreads);
+    ~ChunkLoader();
+
+    /// Returns the number of threads (including the calling thread) that read chunks.
+    int getNumThreads() const {
+        return static_cast<int>(_threads.size()) + 1;
+    }
+
+    void load(
+        std::vector<ObjectChunk> & chunks,
+        std::vector<std::string> const & refNames,
+        std::vector<std::string> const & deltaNames,
+        std::vector<ChunkLoadStats> & stats
+    );
+
+private :
+    Mutex _loadMutex; ///< serializes calls to load()
+    Mutex _mutex;     ///< protects the state of the current load
+    Condition<Mutex> _workAvailable;
+    Condition<Mutex> _workDone;
+    std::vector<boost::shared_ptr<Thread> > _threads;
+
+    std::vector<ObjectChunk> * _chunks;
+    std::vector<std::string> const * _refNames;
+    std::vector<std::string> const * _deltaNames;
+    std::vector<ChunkLoadStats> * _stats;
+    std::size_t _next;  ///< index of the next chunk to claim
+    int _numBusy;       ///< number of threads reading a chunk
+    std::string _failure;
+    bool _stop;
+
+    void work();
+    void readChunks(ScopedLock<Mutex> & lock);
+    bool isIdle() const;
+    bool hasWork() const;
+    void stop();
+};
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_CHUNK_LOADER_H
@@ -34,9 +34,14 @@
 #define LSST_AP_CHUNK_MANAGER_H
 
 #include <iosfwd>
+#include <string>
+#include <utility>
+
+#include "boost/function.hpp"
 
 #include "ChunkManagerImpl.h"
 #include "Object.h"
+#include "SpatialUtil.h"
 
 
 namespace lsst { namespace ap {
@@ -56,8 +61,28 @@ public :
 
     typedef Manager::Chunk ObjectChunk;
 
+    /// Maps a chunk id to the names of the corresponding chunk and chunk delta files.
+    typedef boost::function<std::pair<std::string, std::string> (int)> ChunkFileNamer;
+
+    /// Kinds of pages that can back the shared memory object holding chunks.
+    enum PageMode {
+        NORMAL_PAGES = 0,       ///< Pages of the system default size
+        TRANSPARENT_HUGE_PAGES, ///< Default pages, with the kernel advised to use huge pages
+        HUGETLBFS_PAGES         ///< Explicit huge pages, from a file on a hugetlbfs mount
+    };
+
     SharedObjectChunkManager(std::string const & name);
 
+    static void setPageMode(PageMode const mode, std::string const & hugetlbfsDir = std::string());
+    static char const * getPageModeName(PageMode const mode);
+
+    PageMode getPageMode() const;
+    std::size_t getPageSize() const;
+
+    static void setLayout(detail::ChunkStoreLayout const & layout);
+    static detail::ChunkStoreLayout getDefaultLayout();
+    detail::ChunkStoreLayout const & getLayout() const;
+
     bool isVisitInFlight(int const visitId) {
         return _manager->isVisitInFlight(visitId);
     }
@@ -97,6 +122,23 @@ public :
         return _manager->endVisit(visitId, rollback);
     }
 
+    void setRetentionBudget(std::size_t const numBytes) {
+        _manager->setRetentionBudget(numBytes);
+    }
+    detail::ChunkRetentionStats getRetentionStats() const {
+        return _manager->getRetentionStats();
+    }
+    detail::VisitWaitStats getVisitWaitStats(int const visitId) const {
+        return _manager->getVisitWaitStats(visitId);
+    }
+
+    int prefetch(
+        CircularRegion const & fov,
+        ZoneStripeChunkDecomposition const & decomposition,
+        ChunkFileNamer const & namer
+    );
+    static void waitForPrefetch();
+
     void printVisits(std::ostream & os) const {
         _manager->printVisits(os);
     }
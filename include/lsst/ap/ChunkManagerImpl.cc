@@ -33,7 +33,15 @@
 #ifndef LSST_AP_CHUNK_MANAGER_IMPL_CC
 #define LSST_AP_CHUNK_MANAGER_IMPL_CC
 
+#include <errno.h>
+#include <signal.h>     // for kill
+#include <unistd.h>     // for getpid
+
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 #include "boost/format.hpp"
 
@@ -67,19 +75,60 @@ inline int hash(int key) {
 }
 
 
-template <typename EntryT, int NumEntries>
-HashedSet<EntryT, NumEntries>::HashedSet() :
-    _free(0), _size(0)
+/**
+ * @internal
+ * Returns the number of hash table buckets for a set with the given capacity:
+ * the smallest power of 2 no smaller than twice the capacity.
+ */
+template <typename EntryT>
+int HashedSet<EntryT>::numBuckets(int const capacity) {
+    int n = 2;
+    while (n < 2*capacity) {
+        n <<= 1;
+    }
+    return n;
+}
+
+
+/** Returns the number of bytes of storage required by a set with the given capacity. */
+template <typename EntryT>
+std::size_t HashedSet<EntryT>::storageSize(int const capacity) {
+    std::size_t const tableSize = (sizeof(int)*numBuckets(capacity) + 15) & ~static_cast<std::size_t>(15);
+    return tableSize + sizeof(EntryT)*capacity;
+}
+
+
+/**
+ * Creates an empty set.
+ *
+ * @param[in] capacity  The maximum number of entries in the set, positive and
+ *                      less than 2<sup>29</sup>.
+ * @param[in] storage   At least storageSize(@a capacity) bytes of memory aligned to a multiple
+ *                      of 16 bytes, in which the hash table and entries are stored.
+ */
+template <typename EntryT>
+HashedSet<EntryT>::HashedSet(int const capacity, unsigned char * const storage) :
+    _capacity(capacity),
+    _mask(numBuckets(capacity) - 1),
+    _free(0),
+    _size(0),
+    _hashTable(storage - reinterpret_cast<unsigned char *>(this)),
+    _entries(_hashTable + static_cast<std::ptrdiff_t>(
+        (sizeof(int)*(_mask + 1) + 15) & ~static_cast<std::size_t>(15)))
 {
-    for (int i = 0; i < 2*NumEntries; ++i) {
-        _hashTable[i] = -1;
+    assert(capacity > 0 && capacity < (1 << 29) && "invalid HashedSet capacity");
+    int * const table = hashTable();
+    EntryT * const e = entries();
+    for (int i = 0; i <= _mask; ++i) {
+        table[i] = -1;
     }
     // initialize linked list of free entries (embedded in the entries themselves)
-    for (int i = 0; i < NumEntries - 1; ++i) {
-        _entries[i].setId(-1);
-        _entries[i].setNextInChain(i + 1);
+    for (int i = 0; i < capacity; ++i) {
+        new (&e[i]) EntryT();
+        e[i].setId(-1);
+        e[i].setNextInChain(i + 1);
     }
-    _entries[NumEntries - 1].setNextInChain(-1);
+    e[capacity - 1].setNextInChain(-1);
 }
 
 
@@ -89,14 +138,15 @@ HashedSet<EntryT, NumEntries>::HashedSet() :
  * @param[in] id    The identifier of the entry to find.
  * @return          A pointer to the entry with the given identifier, or null if no such entry was found.
  */
-template <typename EntryT, int NumEntries>
-EntryT const * HashedSet<EntryT, NumEntries>::doFind(int const id) const {
-    int i = _hashTable[hash(id) & (2*NumEntries - 1)];
+template <typename EntryT>
+EntryT const * HashedSet<EntryT>::doFind(int const id) const {
+    EntryT const * const e = entries();
+    int i = hashTable()[hash(id) & _mask];
     while (i >= 0) {
-        if (id == _entries[i].getId()) {
-            return &_entries[i];
+        if (id == e[i].getId()) {
+            return &e[i];
         }
-        i = _entries[i].getNextInChain();
+        i = e[i].getNextInChain();
     }
     return 0;
 }
@@ -111,44 +161,46 @@ EntryT const * HashedSet<EntryT, NumEntries>::doFind(int const id) const {
  *                  or null if either a preexisting entry with the given identifier was found or
  *                  no space for new entries remains.
  */
-template <typename EntryT, int NumEntries>
-EntryT * HashedSet<EntryT, NumEntries>::insert(int const id) {
+template <typename EntryT>
+EntryT * HashedSet<EntryT>::insert(int const id) {
 
     // check that there is space for another entry
     if (_free < 0) {
         return 0;
     }
 
-    int const bucket = hash(id) & (2*NumEntries - 1);
+    int * const table = hashTable();
+    EntryT * const e = entries();
+    int const bucket = hash(id) & _mask;
 
-    int i    = _hashTable[bucket];
+    int i    = table[bucket];
     int last = -1;
 
     while (i >= 0) {
-        if (id == _entries[i].getId()) {
+        if (id == e[i].getId()) {
             return 0; // already have an entry with the given id
         }
         last = i;
-        i    = _entries[i].getNextInChain();
+        i    = e[i].getNextInChain();
     }
 
     // take an entry off the free list
     int const c = _free;
-    _free = _entries[c].getNextInChain();
+    _free = e[c].getNextInChain();
 
     if (last < 0) {
-        _hashTable[bucket] = c;
+        table[bucket] = c;
     } else {
         // hash collision - chain to the end of the bucket
-        _entries[last].setNextInChain(c);
+        e[last].setNextInChain(c);
     }
 
     // basic entry initialization, then return
-    new (&_entries[c]) EntryT();
-    _entries[c].setId(id);
-    _entries[c].setNextInChain(-1);
+    new (&e[c]) EntryT();
+    e[c].setId(id);
+    e[c].setNextInChain(-1);
     ++_size;
-    return &_entries[c];
+    return &e[c];
 }
 
 
@@ -162,20 +214,22 @@ EntryT * HashedSet<EntryT, NumEntries>::insert(int const id) {
  * @return          A pointer to the entry with the given id along with a boolean indicating
  *                  whether the entry was inserted (@c true) or found (@c false).
  */
-template <typename EntryT, int NumEntries>
-std::pair<EntryT *, bool> HashedSet<EntryT, NumEntries>::findOrInsert(int const id) {
+template <typename EntryT>
+std::pair<EntryT *, bool> HashedSet<EntryT>::findOrInsert(int const id) {
 
-    int const bucket = hash(id) & (2*NumEntries - 1);
+    int * const table = hashTable();
+    EntryT * const e = entries();
+    int const bucket = hash(id) & _mask;
 
-    int i    = _hashTable[bucket];
+    int i    = table[bucket];
     int last = -1;
 
     while (i >= 0) {
-        if (id == _entries[i].getId()) {
-            return std::pair<EntryT *, bool>(&_entries[i], false); // found an entry with the given id
+        if (id == e[i].getId()) {
+            return std::pair<EntryT *, bool>(&e[i], false); // found an entry with the given id
         }
         last = i;
-        i    = _entries[i].getNextInChain();
+        i    = e[i].getNextInChain();
     }
 
     // check that there is a free chunk, if so use it
@@ -183,21 +237,21 @@ std::pair<EntryT *, bool> HashedSet<EntryT, NumEntries>::findOrInsert(int const
     if (c < 0) {
         return std::pair<EntryT *, bool>(0, true);
     }
-    _free = _entries[c].getNextInChain();
+    _free = e[c].getNextInChain();
 
     if (last < 0) {
-        _hashTable[bucket] = c;
+        table[bucket] = c;
     } else {
         // hash collision - chain to the end of the bucket
-        _entries[last].setNextInChain(c);
+        e[last].setNextInChain(c);
     }
 
     // basic chunk initialization, then return
-    new (&_entries[c]) EntryT();
-    _entries[c].setId(id);
-    _entries[c].setNextInChain(-1);
+    new (&e[c]) EntryT();
+    e[c].setId(id);
+    e[c].setNextInChain(-1);
     ++_size;
-    return std::pair<EntryT *, bool>(&_entries[c], true);
+    return std::pair<EntryT *, bool>(&e[c], true);
 }
 
 
@@ -207,57 +261,109 @@ std::pair<EntryT *, bool> HashedSet<EntryT, NumEntries>::findOrInsert(int const
  * @param[in] id    The id of the entry to erase.
  * @return          @c true if an entry with the given id was found (and erased).
  */
-template <typename EntryT, int NumEntries>
-bool HashedSet<EntryT, NumEntries>::erase(int const id) {
+template <typename EntryT>
+bool HashedSet<EntryT>::erase(int const id) {
 
-    int const bucket = hash(id) & (2*NumEntries - 1);
+    int * const table = hashTable();
+    EntryT * const e = entries();
+    int const bucket = hash(id) & _mask;
 
-    int i    = _hashTable[bucket];
+    int i    = table[bucket];
     int last = -1;
 
     while (i >= 0) {
-        if (id == _entries[i].getId()) {
+        if (id == e[i].getId()) {
             // found entry to erase, unlink it from the chain for its bucket
             if (last < 0) {
-                _hashTable[bucket] = _entries[i].getNextInChain();
+                table[bucket] = e[i].getNextInChain();
             } else {
-                _entries[last].setNextInChain(_entries[i].getNextInChain());
+                e[last].setNextInChain(e[i].getNextInChain());
             }
             // append the entry to the free list
-            _entries[i].setId(-1);
-            _entries[i].setNextInChain(_free);
+            e[i].setId(-1);
+            e[i].setNextInChain(_free);
             _free = i;
             --_size;
             return true;
         }
         last = i;
-        i    = _entries[i].getNextInChain();
+        i    = e[i].getNextInChain();
     }
     return false;
 }
 
 
+// -- ChunkStoreLayout ----------------
+
+/**
+ * Checks that the layout describes a chunk store that can be created.
+ *
+ * @param[in] entriesPerBlockLog2   The base 2 logarithm of the number of chunk entries per block.
+ *
+ * @throw lsst::pex::exceptions::InvalidParameterError
+ *      Thrown if a capacity is not positive or too large.
+ */
+void ChunkStoreLayout::validate(int const entriesPerBlockLog2) const {
+    if (_numBlocks < 1) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "a chunk store must contain at least one memory block");
+    }
+    if (_maxBlocksPerChunk < 1 || _maxBlocksPerChunk > (1 << (30 - entriesPerBlockLog2))) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+            (boost::format("the maximum number of memory blocks per chunk must be between 1 and %1%")
+             % (1 << (30 - entriesPerBlockLog2))).str());
+    }
+    if (_maxVisitsInFlight < 1 || _maxVisitsInFlight > MAX_VISITS_IN_FLIGHT) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+            (boost::format("the maximum number of visits in flight must be between 1 and %1%")
+             % MAX_VISITS_IN_FLIGHT).str());
+    }
+    if (_maxChunksPerFov < 1 || _maxChunksPerFov > (1 << 22)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+            (boost::format("the maximum number of chunks per FOV must be between 1 and %1%")
+             % (1 << 22)).str());
+    }
+}
+
+
+std::ostream & operator<<(std::ostream & os, ChunkStoreLayout const & layout) {
+    return os << layout._numBlocks << " blocks, " << layout._maxBlocksPerChunk <<
+                 " blocks per chunk, " << layout._maxChunksPerFov << " chunks per FOV, " <<
+                 layout._maxVisitsInFlight << " visits in flight";
+}
+
+
 // -- BlockAllocator ----------------
 
 /**
  * Creates a new BlockAllocator instance. The memory blocks to be tracked by the allocator are located
  * in contiguous memory, starting @a offset bytes after the given @a reference address.
  *
- * @param[in] reference The address relative to which @a offset is specified.
- * @param[in] offset    The location of the first memory block in the pool of contiguous blocks
- *                      to be managed by this allocator instance, specified as an offset in bytes
- *                      relative to the @a reference address.
+ * @param[in] reference     The address relative to which @a bitmapOffset and @a offset are specified.
+ * @param[in] bitmapOffset  The location of bitmapSize() bytes of memory in which the allocator
+ *                          tracks which blocks are in use, specified as an offset in bytes
+ *                          relative to the @a reference address.
+ * @param[in] offset        The location of the first memory block in the pool of contiguous blocks
+ *                          to be managed by this allocator instance, specified as an offset in bytes
+ *                          relative to the @a reference address.
+ * @param[in] layout        The number of blocks in the pool and the maximum number of
+ *                          blocks per allocation request.
  */
 template <typename MutexT, typename DataT, typename TraitsT>
 BlockAllocator<MutexT, DataT, TraitsT>::BlockAllocator(
-    unsigned char const * const reference,
-    std::size_t const offset
+    unsigned char * const reference,
+    std::size_t const bitmapOffset,
+    std::size_t const offset,
+    ChunkStoreLayout const & layout
 ) :
     _mutex(),
-    _allocator(),
-    _offset(static_cast<std::size_t>((reference + offset) - reinterpret_cast<unsigned char * >(this)))
+    _bitmap(static_cast<std::size_t>((reference + bitmapOffset) - reinterpret_cast<unsigned char * >(this))),
+    _offset(static_cast<std::size_t>((reference + offset) - reinterpret_cast<unsigned char * >(this))),
+    _numBlocks(layout._numBlocks),
+    _maxBlocksPerChunk(layout._maxBlocksPerChunk),
+    _numFree(layout._numBlocks)
 {
-    _allocator.reset();
+    std::memset(words(), 0, bitmapSize(_numBlocks));
 }
 
 
@@ -274,9 +380,10 @@ template <typename MutexT, typename DataT, typename TraitsT>
 std::size_t BlockAllocator<MutexT, DataT, TraitsT>::allocate() {
     int i[1];
     ScopedLock<MutexT> lock(_mutex);
-    if (!_allocator.set(i, 1)) {
+    if (!setBits<boost::uint64_t>(i, words(), 1, _numBlocks)) {
         throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError, "no free blocks remain");
     }
+    --_numFree;
     return _offset + i[0]*BLOCK_SIZE;
 }
 
@@ -298,20 +405,30 @@ void BlockAllocator<MutexT, DataT, TraitsT>::allocate(
     std::size_t * const blockOffsets,
     int const n
 ) {
-    if (n < 0 || n > TraitsT::MAX_BLOCKS_PER_CHUNK) {
+    static int const BATCH_SIZE = 64;
+
+    if (n < 0 || n > _maxBlocksPerChunk) {
         throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
             "invalid number of memory blocks in allocation request");
     }
-    int i[TraitsT::MAX_BLOCKS_PER_CHUNK];
+    int i[BATCH_SIZE];
 
     ScopedLock<MutexT> lock(_mutex);
-    if (!_allocator.set(i, n)) {
+    if (n > _numFree) {
         throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
             "number of free blocks too small to satisfy allocation request");
     }
-    for (int j = 0; j < n; ++j) {
-        blockOffsets[j] = _offset + i[j]*BLOCK_SIZE;
+    // there are enough zero bits, so setting them in batches never fails
+    for (int j = 0; j < n; j += BATCH_SIZE) {
+        int const b = std::min(n - j, BATCH_SIZE);
+        bool const set = setBits<boost::uint64_t>(i, words(), b, _numBlocks);
+        assert(set && "block allocator bitmap and free block count disagree");
+        static_cast<void>(set);
+        for (int k = 0; k < b; ++k) {
+            blockOffsets[j + k] = _offset + i[k]*BLOCK_SIZE;
+        }
     }
+    _numFree -= n;
 }
 
 
@@ -328,25 +445,225 @@ void BlockAllocator<MutexT, DataT, TraitsT>::free(
     std::size_t const * const blockOffsets,
     int const n
 ) {
-    assert(n >= 0 && n <= TraitsT::MAX_BLOCKS_PER_CHUNK &&
+    assert(n >= 0 && n <= _maxBlocksPerChunk &&
         "invalid number of memory blocks in free request");
 
-    // translate block offsets to block indexes
-    int i[TraitsT::MAX_BLOCKS_PER_CHUNK];
+    // clear bit corresponding to each block to free
+    boost::uint64_t * const w = words();
+    ScopedLock<MutexT> lock(_mutex);
     for (int j = 0; j < n; ++j) {
         std::size_t off = blockOffsets[j] - _offset;
-        assert(off < TraitsT::NUM_BLOCKS*BLOCK_SIZE &&
+        assert(off < _numBlocks*BLOCK_SIZE &&
                "block was not allocated by this allocator");
         assert(off % BLOCK_SIZE == 0 && "invalid block address");
-        i[j] = static_cast<int>(off/BLOCK_SIZE);
+        int const i = static_cast<int>(off/BLOCK_SIZE);
+        w[wordForBit<boost::uint64_t>(i)] &= ~maskForBit<boost::uint64_t>(i);
     }
+    _numFree += n;
+}
 
-    // clear bit corresponding to each block to free
-    ScopedLock<MutexT> lock(_mutex);
-    _allocator.reset(i, n);
+
+#if LSST_AP_HAVE_SYNC_BUILTINS
+
+// -- LockFreeBlockAllocator ----------------
+
+/**
+ * Creates a new LockFreeBlockAllocator instance. The arguments have the same meaning
+ * as for BlockAllocator.
+ */
+template <typename DataT, typename TraitsT>
+LockFreeBlockAllocator<DataT, TraitsT>::LockFreeBlockAllocator(
+    unsigned char * const reference,
+    std::size_t const bitmapOffset,
+    std::size_t const offset,
+    ChunkStoreLayout const & layout
+) :
+    _numFree(layout._numBlocks),
+    _hint(0),
+    _words(static_cast<std::size_t>((reference + bitmapOffset) - reinterpret_cast<unsigned char * >(this))),
+    _offset(static_cast<std::size_t>((reference + offset) - reinterpret_cast<unsigned char * >(this))),
+    _numWords((layout._numBlocks + 63) >> 6),
+    _numBlocks(layout._numBlocks),
+    _maxBlocksPerChunk(layout._maxBlocksPerChunk)
+{
+    volatile boost::uint64_t * const w = words();
+    for (int i = 0; i < _numWords; ++i) {
+        w[i] = 0;
+    }
+    if ((_numBlocks & 63) != 0) {
+        // bits past the last block are permanently in use
+        w[_numWords - 1] = ~((UINT64_C(1) << (_numBlocks & 63)) - 1);
+    }
+}
+
+
+/**
+ * Allocates a single memory block.
+ *
+ * @return  The offset (in bytes relative to the address of this allocator instance)
+ *          of the newly allocated block.
+ *
+ * @throw lsst::pex::exceptions:::MemoryError
+ *      Thrown if there was no free block available.
+ */
+template <typename DataT, typename TraitsT>
+std::size_t LockFreeBlockAllocator<DataT, TraitsT>::allocate() {
+    std::size_t off;
+    reserve(1);
+    claim(&off, 1);
+    return off;
+}
+
+
+/**
+ * Allocates @a n memory blocks, storing their offsets in the given array.
+ *
+ * @param[out] blockOffsets The array in which the offsets (relative to this allocator instance) of
+ *                          allocated memory blocks are stored. Assumed to be of length at least @a n.
+ * @param[in]  n            The number of memory blocks to allocate.
+ *
+ * @throw lsst::pex::exceptions:::MemoryError
+ *      Thrown if there were less than @a n free blocks available.
+ * @throw lsst::pex::exceptions:::RangeError
+ *      Thrown if the number of blocks to allocate is negative or too large.
+ */
+template <typename DataT, typename TraitsT>
+void LockFreeBlockAllocator<DataT, TraitsT>::allocate(
+    std::size_t * const blockOffsets,
+    int const n
+) {
+    if (n < 0 || n > _maxBlocksPerChunk) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+            "invalid number of memory blocks in allocation request");
+    }
+    if (n == 0) {
+        return;
+    }
+    reserve(n);
+    claim(blockOffsets, n);
+}
+
+
+/**
+ * Frees @a n memory blocks, identified by offsets stored in the given array. Never throws.
+ *
+ * @param[in] blockOffsets  The array in which the offsets (relative to this allocator instance)
+ *                          of the memory blocks to free are stored. Assumed to be of length at
+ *                          least @a n.
+ * @param[in] n     The number of memory blocks to free.
+ */
+template <typename DataT, typename TraitsT>
+void LockFreeBlockAllocator<DataT, TraitsT>::free(
+    std::size_t const * const blockOffsets,
+    int const n
+) {
+    assert(n >= 0 && n <= _maxBlocksPerChunk &&
+        "invalid number of memory blocks in free request");
+    // clear the bits of consecutive blocks living in the same bitmap word with a single atomic op
+    int w = -1;
+    boost::uint64_t mask = 0;
+    for (int j = 0; j < n; ++j) {
+        std::size_t off = blockOffsets[j] - _offset;
+        assert(off < _numBlocks*BLOCK_SIZE &&
+               "block was not allocated by this allocator");
+        assert(off % BLOCK_SIZE == 0 && "invalid block address");
+        int const i = static_cast<int>(off/BLOCK_SIZE);
+        if ((i >> 6) != w) {
+            if (mask != 0) {
+                clear(w, mask);
+            }
+            w = i >> 6;
+            mask = 0;
+        }
+        mask |= UINT64_C(1) << (i & 63);
+    }
+    if (mask != 0) {
+        clear(w, mask);
+    }
+    // only make the blocks available for reservation once their bits are clear
+    __sync_fetch_and_add(&_numFree, n);
+}
+
+
+/**
+ * @internal
+ * Atomically clears the given bits of a word in the in-use bitmap.
+ */
+template <typename DataT, typename TraitsT>
+inline void LockFreeBlockAllocator<DataT, TraitsT>::clear(int const w, boost::uint64_t const mask) {
+    boost::uint64_t const old = __sync_fetch_and_and(&words()[w], ~mask);
+    assert((old & mask) == mask && "block was not allocated");
+    static_cast<void>(old);
+}
+
+
+/**
+ * @internal
+ * Atomically reserves @a n free blocks.
+ *
+ * @throw lsst::pex::exceptions:::MemoryError
+ *      Thrown if there were less than @a n free blocks available.
+ */
+template <typename DataT, typename TraitsT>
+void LockFreeBlockAllocator<DataT, TraitsT>::reserve(int const n) {
+    while (true) {
+        int const numFree = _numFree;
+        if (numFree < n) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
+                              n == 1 ? "no free blocks remain" :
+                              "number of free blocks too small to satisfy allocation request");
+        }
+        if (__sync_bool_compare_and_swap(&_numFree, numFree, numFree - n)) {
+            return;
+        }
+    }
 }
 
 
+/**
+ * @internal
+ * Sets @a n zero bits in the in-use bitmap, storing the offsets of the corresponding blocks in
+ * the given array. Must only be called after @a n blocks have been reserved, which guarantees
+ * that the bits exist.
+ */
+template <typename DataT, typename TraitsT>
+void LockFreeBlockAllocator<DataT, TraitsT>::claim(std::size_t * const blockOffsets, int const n) {
+    volatile boost::uint64_t * const bitmap = words();
+    int numClaimed = 0;
+    int w = _hint;
+    while (true) {
+        boost::uint64_t const old = bitmap[w];
+        if (old != ~UINT64_C(0)) {
+            // take as many of the lowest zero bits in the word as are needed
+            boost::uint64_t bits = 0;
+            boost::uint64_t zeroes = ~old;
+            int k = numClaimed;
+            for (; zeroes != 0 && k < n; ++k) {
+                boost::uint64_t const bit = zeroes & (~zeroes + 1);
+                bits |= bit;
+                zeroes ^= bit;
+            }
+            if (__sync_bool_compare_and_swap(&bitmap[w], old, old | bits)) {
+                for (; bits != 0; bits &= bits - 1) {
+                    std::size_t const i = static_cast<std::size_t>((w << 6) + __builtin_ctzll(bits));
+                    blockOffsets[numClaimed++] = _offset + i*BLOCK_SIZE;
+                }
+                if (numClaimed == n) {
+                    // start the next search here, unless this word is now full
+                    _hint = zeroes != 0 ? w : (w + 1 == _numWords ? 0 : w + 1);
+                    return;
+                }
+            } else {
+                continue; // the word changed - retry it
+            }
+        }
+        w = (w + 1 == _numWords) ? 0 : w + 1;
+    }
+}
+
+#endif // LSST_AP_HAVE_SYNC_BUILTINS
+
+
 // -- VisitTracker ----------------
 
 /**
@@ -361,6 +678,15 @@ bool VisitTracker::isValid(int const visitId) const {
     return !v->failed();
 }
 
+/**
+ * Returns the index of the slot occupied by the given visit, or -1 if the
+ * visit is not being tracked. Slots are stable for the lifetime of a visit.
+ */
+int VisitTracker::getSlot(int const visitId) const {
+    Visit const * v = this->find(visitId);
+    return v == 0 ? -1 : static_cast<int>(v - begin());
+}
+
 void VisitTracker::print(std::ostream & os) const {
     std::vector<int> v;
     v.reserve(size());
@@ -399,12 +725,24 @@ void VisitTracker::print(int const visitId, std::ostream & os) const {
 
 // -- SubManager ----------------
 
+/**
+ * Returns @c false if there is no process with the given id. Process ids can be reused, so
+ * a process that has exited may still appear to be alive.
+ */
+inline bool isProcessAlive(int const pid) {
+    return pid > 0 && (::kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+
 /**
  * Registers the given visit as an interested party of each of the given chunks. If any of the
  * given identifiers doesn't correspond to a chunk, an empty chunk is created. Newly created
  * chunks are stored in the @a toRead list (indicating data for them must be read from disk),
  * previously existing chunks are returned in the @a toWaitFor list (indicating that the
- * visit must wait until it owns those instances before processing can begin).
+ * visit must wait until it owns those instances before processing can begin). Retained
+ * chunks are handed to the visit immediately, so waiting for them never blocks. Chunks that
+ * are queued for prefetching are handed to the visit as well, and returned in @a toRead: the
+ * visit reads them itself rather than waiting for the prefetcher to get to them.
  *
  * @param[out] toRead       Set to the list of chunks that were not found in memory
  *                          and must be read in from disk.
@@ -432,11 +770,30 @@ void SubManager<MutexT, DataT, TraitsT>::createOrRegisterInterest(
                 throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
                                   "too many chunks in flight");
             }
+            bindBlockList(p.first);
             p.first->_visitId = visitId;
             p.first->_usable  = false;
+            newGeneration(p.first);
             toRead.push_back(Chunk(p.first, &_allocator));
+            ++_misses;
+        } else if (p.first->_visitId == UNOWNED) {
+            // retained chunk: its contents are committed, so it can be used as is
+            p.first->_visitId = visitId;
+            --_numRetained;
+            _retainedBlocks -= p.first->_numBlocks;
+            toWaitFor.push_back(Chunk(p.first, &_allocator));
+            ++_hits;
+        } else if (p.first->_visitId == PREFETCH_QUEUED) {
+            // the prefetch has not started: take over the read (see beginPrefetch())
+            p.first->_visitId    = visitId;
+            p.first->_prefetcher = 0;
+            --_numPrefetching;
+            newGeneration(p.first);
+            toRead.push_back(Chunk(p.first, &_allocator));
+            ++_misses;
         } else {
-            // existing chunk descriptor was found
+            // existing chunk descriptor was found - a chunk being prefetched is handed
+            // over once the read completes (see endPrefetch())
             assert(p.first != 0);
             p.first->_interestedParties.enqueue(visitId);
             toWaitFor.push_back(Chunk(p.first, &_allocator));
@@ -476,6 +833,7 @@ bool SubManager<MutexT, DataT, TraitsT>::checkForOwnership(
         } else {
             if (!c.isUsable()) {
                 c.clear();
+                newGeneration(_chunks.find(static_cast<int>(c.getId())));
                 toRead.push_back(c);
             }
             // deletes element i in O(1) time (but changes element ordering)
@@ -516,24 +874,24 @@ void SubManager<MutexT, DataT, TraitsT>::getChunks(
 
 /**
  * Relinquishes ownership of any chunks owned by the given visit (each chunk is passed on to
- * its first interested party that is still in flight).
- *
- * @param[in] visitId   The visit owning the chunks to relinquish ownership of.
- * @param[in] rollback  Flag indicating whether or not in-memory changes to a chunk should
- *                      be rolled back (@c true) or committed (@c false) prior to relinquishing
- *                      ownership.
- * @param[in] tracker   Tracks the status of visits (whether or not a visit is in flight,
- *                      and if so, whether or not it has failed).
+ * its first interested party that is still in flight). Committed chunks without a successor
+ * are retained in memory if the retention budget allows, and are deallocated otherwise.
  *
- * @return      @c true if any chunks changed hands.
+ * @param[out] newOwners The slots (in @a tracker) of visits that acquired chunks are set.
+ * @param[in]  visitId   The visit owning the chunks to relinquish ownership of.
+ * @param[in]  rollback  Flag indicating whether or not in-memory changes to a chunk should
+ *                       be rolled back (@c true) or committed (@c false) prior to relinquishing
+ *                       ownership.
+ * @param[in]  tracker   Tracks the status of visits (whether or not a visit is in flight,
+ *                       and if so, whether or not it has failed).
  */
 template <typename MutexT, typename DataT, typename TraitsT>
-bool SubManager<MutexT, DataT, TraitsT>::relinquishOwnership(
+void SubManager<MutexT, DataT, TraitsT>::relinquishOwnership(
+    VisitSlots & newOwners,
     int const visitId,
     bool const rollback,
     VisitTracker const & tracker
 ) {
-    bool change = false;
     Descriptor * const end = _chunks.end();
     for (Descriptor * i = _chunks.begin(); i != end; ++i) {
         if (i->getId() != -1 && i->_visitId == visitId) {
@@ -542,8 +900,8 @@ bool SubManager<MutexT, DataT, TraitsT>::relinquishOwnership(
                 int const nextVisitId = static_cast<int>(i->_interestedParties.dequeue());
                 if (tracker.isValid(nextVisitId)) {
                     i->_visitId    = nextVisitId;
-                    change         = true;
                     foundSuccessor = true;
+                    newOwners.set(tracker.getSlot(nextVisitId));
                     break;
                 }
             }
@@ -551,17 +909,332 @@ bool SubManager<MutexT, DataT, TraitsT>::relinquishOwnership(
                 Chunk c(i, &_allocator);
                 if (rollback) {
                     c.rollback();
+                    newGeneration(i);
                 } else {
                     c.commit();
                 }
+            } else if (!rollback && i->_usable && _retentionBudget > 0) {
+                // retain chunk until it is needed again or evicted
+                Chunk(i, &_allocator).commit();
+                retain(i);
             } else {
                 // deallocate chunk
-                _allocator.free(i->_blocks, i->_numBlocks);
+                freeBlocks(i);
                 _chunks.erase(i->getId());
             }
         }
     }
-    return change;
+    if (_retainedBlocks > _retentionBudget) {
+        evict(0, 0, std::vector<int>());
+    }
+}
+
+
+/**
+ * Sets the maximum number of memory blocks that retained chunks may occupy, evicting
+ * retained chunks as necessary. A budget of zero disables chunk retention.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::setRetentionBudget(int const numBlocks) {
+    _retentionBudget = std::max(numBlocks, 0);
+    evict(0, 0, std::vector<int>());
+}
+
+
+/**
+ * Creates a chunk for each of the given identifiers that does not correspond to a chunk in
+ * memory, so that it can be read in ahead of the visits that will need it. Such chunks are
+ * owned by no visit, and are queued until the calling process starts reading them with
+ * beginPrefetch(). A visit that registers an interest in a queued chunk takes over its read;
+ * a visit that registers an interest in a chunk being read waits until endPrefetch() is
+ * called. No chunks are created when retention is disabled, and chunk creation stops once the
+ * chunks being prefetched are estimated to exhaust the retention budget or the free blocks.
+ *
+ * @param[out] toRead       Set to the list of chunks that must be read from disk.
+ * @param[out] generations  Set to the generation of each chunk in @a toRead, which identifies
+ *                          the prefetch to beginPrefetch() and endPrefetch().
+ * @param[in]  chunkIds     Identifiers for chunks to prefetch. Assumed to be duplicate free.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::startPrefetch(
+    std::vector<Chunk> & toRead,
+    std::vector<boost::uint64_t> & generations,
+    std::vector<int> const & chunkIds
+) {
+    if (_retentionBudget == 0) {
+        return;
+    }
+    int const blocksPerChunk = estimateBlocksPerChunk();
+    int numFree = _allocator.getNumFree();
+    std::vector<int>::const_iterator const end = chunkIds.end();
+    for (std::vector<int>::const_iterator i = chunkIds.begin(); i != end; ++i) {
+        if (_chunks.find(*i) != 0) {
+            continue;
+        }
+        int const numBlocks = (_numPrefetching + 1)*blocksPerChunk;
+        if (_retainedBlocks + numBlocks > _retentionBudget || numBlocks > numFree ||
+            _chunks.space() <= _maxChunksPerFov) {
+            // leave room for the chunks of visits
+            break;
+        }
+        Descriptor * d = _chunks.insert(*i);
+        assert(d != 0);
+        bindBlockList(d);
+        d->_visitId    = PREFETCH_QUEUED;
+        d->_usable     = false;
+        d->_prefetcher = static_cast<int>(::getpid());
+        newGeneration(d);
+        ++_numPrefetching;
+        toRead.push_back(Chunk(d, &_allocator));
+        generations.push_back(d->_generation);
+    }
+}
+
+
+/**
+ * Starts reading a chunk created by startPrefetch(), unless its read was taken over by a visit.
+ *
+ * @param[in]  chunkId      The identifier of a chunk created by startPrefetch().
+ * @param[in]  generation   The generation of the chunk when it was created.
+ *
+ * @return  @c true if the caller must read the chunk and then call endPrefetch().
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+bool SubManager<MutexT, DataT, TraitsT>::beginPrefetch(
+    int const chunkId,
+    boost::uint64_t const generation
+) {
+    Descriptor * d = _chunks.find(chunkId);
+    if (d == 0 || d->_visitId != PREFETCH_QUEUED || d->_generation != generation) {
+        return false;
+    }
+    d->_visitId = PREFETCHING;
+    return true;
+}
+
+
+/**
+ * Ends the prefetch of a chunk. The chunk is passed on to its first interested party that is
+ * still in flight. If there is none, a successfully prefetched chunk is retained, and a chunk
+ * that could not be read is deallocated. Chunks whose read was taken over by a visit are
+ * left untouched.
+ *
+ * @param[out] newOwners    If the chunk changed hands, the slot (in @a tracker) of its new
+ *                          owner is set.
+ * @param[in]  chunkId      The identifier of a chunk created by startPrefetch().
+ * @param[in]  generation   The generation of the chunk when it was created.
+ * @param[in]  success      Was the chunk completely read in?
+ * @param[in]  tracker      Tracks the status of visits.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::endPrefetch(
+    VisitSlots & newOwners,
+    int const chunkId,
+    boost::uint64_t const generation,
+    bool const success,
+    VisitTracker const & tracker
+) {
+    Descriptor * d = _chunks.find(chunkId);
+    if (d == 0 || (d->_visitId != PREFETCHING && d->_visitId != PREFETCH_QUEUED) ||
+        d->_generation != generation) {
+        return;
+    }
+    assert((!success || d->_visitId == PREFETCHING) && "chunk read was never started");
+    --_numPrefetching;
+    d->_prefetcher = 0;
+    finishPrefetch(newOwners, d, success, tracker);
+}
+
+
+/**
+ * Ends the prefetches of chunks whose prefetching process no longer exists, as if they had
+ * failed: such chunks are marked unusable and passed on to their first interested party
+ * that is still in flight (which must re-read them), or deallocated if there is none.
+ *
+ * @param[out] newOwners The slots (in @a tracker) of visits that acquired chunks are set.
+ * @param[in]  tracker   Tracks the status of visits.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::reclaimPrefetches(
+    VisitSlots & newOwners,
+    VisitTracker const & tracker
+) {
+    if (_numPrefetching == 0) {
+        return;
+    }
+    Descriptor * const end = _chunks.end();
+    for (Descriptor * d = _chunks.begin(); d != end; ++d) {
+        if (d->getId() != -1 && (d->_visitId == PREFETCHING || d->_visitId == PREFETCH_QUEUED) &&
+            !isProcessAlive(d->_prefetcher)) {
+            --_numPrefetching;
+            d->_prefetcher = 0;
+            finishPrefetch(newOwners, d, false, tracker);
+        }
+    }
+}
+
+
+/**
+ * Evicts retained chunks not in the given list until there is space to track every chunk in
+ * the list, and until the block allocator has enough free blocks to read in the chunks that
+ * are not yet in memory. The number of blocks needed per chunk is estimated as the average
+ * over all chunks in memory.
+ *
+ * @param[in] chunkIds  Identifiers for the chunks required by a visit. Assumed to be
+ *                      duplicate free.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::makeRoom(std::vector<int> const & chunkIds) {
+    if (_numRetained == 0) {
+        return;
+    }
+    int numMissing = 0;
+    std::vector<int>::const_iterator const end = chunkIds.end();
+    for (std::vector<int>::const_iterator i = chunkIds.begin(); i != end; ++i) {
+        if (_chunks.find(*i) == 0) {
+            ++numMissing;
+        }
+    }
+    evict(static_cast<int>(chunkIds.size()), numMissing*estimateBlocksPerChunk(), chunkIds);
+}
+
+
+/**
+ * @internal
+ * Returns the number of memory blocks a chunk is expected to occupy: the average over all
+ * usable chunks in memory, rounded up, or 1 if there are none.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+int SubManager<MutexT, DataT, TraitsT>::estimateBlocksPerChunk() const {
+    int numChunks = 0;
+    int numBlocks = 0;
+    Descriptor const * const end = _chunks.end();
+    for (Descriptor const * d = _chunks.begin(); d != end; ++d) {
+        if (d->getId() != -1 && d->_usable) {
+            ++numChunks;
+            numBlocks += d->_numBlocks;
+        }
+    }
+    return numChunks == 0 ? 1 : std::max(1, (numBlocks + numChunks - 1)/numChunks);
+}
+
+
+/**
+ * @internal
+ * Marks the given usable chunk as retained (not owned by any visit) and most recently used.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::retain(Descriptor * const d) {
+    d->_visitId = UNOWNED;
+    d->_lastUse = ++_clock;
+    ++_numRetained;
+    _retainedBlocks += d->_numBlocks;
+}
+
+
+/**
+ * @internal
+ * Passes a chunk that is no longer being prefetched on to its first interested party that is
+ * still in flight. If there is none, a successfully prefetched chunk is retained, and a chunk
+ * that could not be read is deallocated. Retention hits are only counted for chunks that were
+ * read successfully.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::finishPrefetch(
+    VisitSlots & newOwners,
+    Descriptor * const d,
+    bool const success,
+    VisitTracker const & tracker
+) {
+    if (success) {
+        d->_usable = true;
+        ++_prefetches;
+    } else {
+        // successors must re-read the chunk
+        Chunk(d, &_allocator).clear();
+        d->_usable = false;
+        newGeneration(d);
+    }
+    while (!d->_interestedParties.empty()) {
+        int const nextVisitId = static_cast<int>(d->_interestedParties.dequeue());
+        if (tracker.isValid(nextVisitId)) {
+            d->_visitId = nextVisitId;
+            newOwners.set(tracker.getSlot(nextVisitId));
+            if (success) {
+                ++_hits;
+            } else {
+                ++_misses;
+            }
+            return;
+        }
+    }
+    if (success) {
+        retain(d);
+        if (_retainedBlocks > _retentionBudget) {
+            evict(0, 0, std::vector<int>());
+        }
+    } else {
+        freeBlocks(d);
+        _chunks.erase(d->getId());
+    }
+}
+
+
+/**
+ * @internal
+ * Evicts retained chunks in least recently used order while the retention budget is exceeded,
+ * while fewer than @a numChunks chunks can be added, or while fewer than @a numBlocks memory
+ * blocks are free. Chunks with identifiers in @a keep are never evicted.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::evict(
+    int const numChunks,
+    int const numBlocks,
+    std::vector<int> const & keep
+) {
+    if (_numRetained == 0) {
+        return;
+    }
+    std::vector<int> k(keep);
+    std::sort(k.begin(), k.end());
+    std::vector<std::pair<boost::uint64_t, Descriptor *> > lru;
+    lru.reserve(_numRetained);
+    Descriptor * const end = _chunks.end();
+    for (Descriptor * d = _chunks.begin(); d != end; ++d) {
+        if (d->getId() != -1 && d->_visitId == UNOWNED &&
+            !std::binary_search(k.begin(), k.end(), d->getId())) {
+            lru.push_back(std::make_pair(d->_lastUse, d));
+        }
+    }
+    std::sort(lru.begin(), lru.end());
+    typename std::vector<std::pair<boost::uint64_t, Descriptor *> >::const_iterator i = lru.begin();
+    for (; i != lru.end(); ++i) {
+        if (_retainedBlocks <= _retentionBudget &&
+            _chunks.space() >= numChunks &&
+            _allocator.getNumFree() >= numBlocks) {
+            break;
+        }
+        Descriptor * d = i->second;
+        --_numRetained;
+        _retainedBlocks -= d->_numBlocks;
+        ++_evictions;
+        freeBlocks(d);
+        _chunks.erase(d->getId());
+    }
+}
+
+
+/** Returns statistics for chunks retained in memory across visits. */
+template <typename MutexT, typename DataT, typename TraitsT>
+void SubManager<MutexT, DataT, TraitsT>::getRetentionStats(ChunkRetentionStats & stats) const {
+    stats._hits          = _hits;
+    stats._misses        = _misses;
+    stats._evictions     = _evictions;
+    stats._prefetches    = _prefetches;
+    stats._numRetained   = _numRetained;
+    stats._numPrefetching = _numPrefetching;
+    stats._retainedBytes = static_cast<std::size_t>(_retainedBlocks)*Chunk::BLOCK_SIZE;
+    stats._budget        = static_cast<std::size_t>(_retentionBudget)*Chunk::BLOCK_SIZE;
 }
 
 
@@ -583,6 +1256,18 @@ namespace {
                ZoneStripeChunkDecomposition::chunkToStripe(d2->_chunkId);
     }
 
+    void printOwner(std::ostream & os, int const visitId) {
+        if (visitId == -1) {
+            os << "    Retained (not owned by any visit):\n";
+        } else if (visitId == -2) {
+            os << "    Being prefetched:\n";
+        } else if (visitId == -3) {
+            os << "    Queued for prefetching:\n";
+        } else {
+            os << "    Owned by visit " << visitId << ":\n";
+        }
+    }
+
     template <typename DescriptorT>
     void printChunks(std::ostream & os, std::vector<DescriptorT const *> const & v) {
 
@@ -612,7 +1297,7 @@ namespace {
             }
             if (i < sz) {
                 if (c->_visitId != v[i]->_visitId) {
-                    os << "    Owned by visit " << v[i]->_visitId << ":\n";
+                    printOwner(os, v[i]->_visitId);
                 }
                 start = i;
                 c = v[i];
@@ -639,7 +1324,7 @@ void SubManager<MutexT, DataT, TraitsT>::print(std::ostream & os) const {
         os << ": None";
     } else {
         os << ":\n";
-        os << "    Owned by visit " << v[0]->_visitId << ":\n";
+        printOwner(os, v[0]->_visitId);
         printChunks(os, v);
     }
     os << std::endl;
@@ -698,9 +1383,101 @@ void SubManager<MutexT, DataT, TraitsT>::printVisit(int const visitId, std::ostr
 
 // -- ChunkManagerImpl ----------------
 
+namespace {
+
+inline std::size_t alignTo(std::size_t const n, std::size_t const alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+} // end of anonymous namespace
+
+
+/**
+ * Returns the locations (in bytes relative to the manager address) of the visit tracker entries,
+ * chunk descriptors, descriptor block lists, block allocator bitmap and memory blocks of a manager
+ * with the given capacities.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+ChunkStoreOffsets ChunkManagerImpl<MutexT, DataT, TraitsT>::getOffsets(ChunkStoreLayout const & layout) {
+    ChunkStoreOffsets off;
+    off._visits     = alignTo(sizeof(ChunkManagerImpl), 64);
+    off._chunks     = alignTo(off._visits + HashedSet<Visit>::storageSize(layout._maxVisitsInFlight), 64);
+    off._blockLists = alignTo(off._chunks +
+                              HashedSet<typename Manager::Descriptor>::storageSize(layout.getMaxChunks()), 64);
+    off._bitmap     = alignTo(off._blockLists + sizeof(std::size_t)*
+                              static_cast<std::size_t>(layout.getMaxChunks())*
+                              static_cast<std::size_t>(layout._maxBlocksPerChunk), 64);
+    off._blocks     = alignTo(off._bitmap + Manager::Allocator::bitmapSize(layout._numBlocks), 512);
+    off._end        = off._blocks + Chunk::BLOCK_SIZE*static_cast<std::size_t>(layout._numBlocks);
+    return off;
+}
+
+
+/**
+ * Checks that the given memory holds a manager that can be used by this process: that it
+ * was created for chunks with the same entry type and block size and, if @a layout is not null,
+ * with the given capacities.
+ *
+ * @param[in] mem       The address of the manager.
+ * @param[in] numBytes  The number of bytes of memory available at @a mem.
+ * @param[in] layout    The capacities the manager must have, or null to accept any.
+ *
+ * @throw lsst::pex::exceptions::RuntimeError
+ *      Thrown if the memory does not contain a compatible manager.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::validate(
+    void const * const mem,
+    std::size_t const numBytes,
+    ChunkStoreLayout const * const layout
+) {
+    if (numBytes < sizeof(ChunkManagerImpl)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+            (boost::format("shared memory object of %1% bytes is too small to contain a chunk manager")
+             % numBytes).str());
+    }
+    ChunkManagerImpl const * m = static_cast<ChunkManagerImpl const *>(mem);
+    if (m->_magic != MAGIC) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+            "shared memory object does not contain a chunk manager with a compatible memory layout");
+    }
+    if (m->_entrySize != sizeof(DataT) || m->_entriesPerBlockLog2 != TraitsT::ENTRIES_PER_BLOCK_LOG2) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+            (boost::format("chunk manager stores %1% byte entries in blocks of 2^%2%, expecting "
+                           "%3% byte entries in blocks of 2^%4%") % m->_entrySize %
+             m->_entriesPerBlockLog2 % sizeof(DataT) %
+             static_cast<int>(TraitsT::ENTRIES_PER_BLOCK_LOG2)).str());
+    }
+    if (m->_size > numBytes || m->_size != size(m->_layout)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+            (boost::format("chunk manager requires %1% bytes, but its shared memory object "
+                           "contains %2% bytes") % m->_size % numBytes).str());
+    }
+    if (layout != 0 && *layout != m->_layout) {
+        std::ostringstream msg;
+        msg << "chunk manager was created with " << m->_layout << ", expecting " << *layout;
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError, msg.str());
+    }
+}
+
+
+/**
+ * Creates a manager with the given capacities. The memory following the manager must contain
+ * at least size(@a layout) bytes, starting at the manager address.
+ *
+ * @throw lsst::pex::exceptions::InvalidParameterError
+ *      Thrown if a capacity is not positive or too large.
+ */
 template <typename MutexT, typename DataT, typename TraitsT>
-ChunkManagerImpl<MutexT, DataT, TraitsT>::ChunkManagerImpl() :
-    _data(reinterpret_cast<unsigned char *>(this), blocks())
+ChunkManagerImpl<MutexT, DataT, TraitsT>::ChunkManagerImpl(ChunkStoreLayout const & layout) :
+    _magic((layout.validate(TraitsT::ENTRIES_PER_BLOCK_LOG2), MAGIC)),
+    _entrySize(sizeof(DataT)),
+    _entriesPerBlockLog2(TraitsT::ENTRIES_PER_BLOCK_LOG2),
+    _layout(layout),
+    _size(size(layout)),
+    _mutex(),
+    _visits(layout._maxVisitsInFlight, reinterpret_cast<unsigned char *>(this) + getOffsets(layout)._visits),
+    _data(reinterpret_cast<unsigned char *>(this), getOffsets(layout), layout)
 {}
 
 
@@ -755,9 +1532,12 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::registerVisit(int const visitId)
  * identifier in the given list. If any identifier in the list does not have a corresponding chunk,
  * a new chunk (owned by the specified visit) is created.
  *
+ * Retained chunks that are not required by the visit may be evicted to make room for the chunks
+ * that must be read in.
+ *
  * Note that the @a toWaitFor and @a toRead output vectors are cleared immediately on entry to the
  * function. Under the assumption that these vectors are empty to begin with, strong exception safety
- * is guaranteed.
+ * is guaranteed (evicting retained chunks does not change the state visible to visits).
  *
  * @param[out] toRead      Set to the list of newly created chunks that must be read from disk.
  * @param[out] toWaitFor   Set to the list of chunks that are already in memory and must be waited on.
@@ -783,16 +1563,20 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::startVisit(
     toRead.reserve(chunkIds.size());
     toWaitFor.reserve(chunkIds.size());
 
+    Stopwatch watch(true);
     ScopedLock<MutexT> lock(_mutex);
+    Visit * v = _visits.find(visitId);
+    if (v == 0 || v->failed()) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+            (boost::format("Cannot start processing for visit %1%: visit is not in-flight") % visitId).str());
+    }
+    v->addLockWait(watch.seconds());
     // ensure internal resources necessary for success are available
+    _data.makeRoom(chunkIds);
     if (_data.space() < static_cast<int>(chunkIds.size())) {
         throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
                           "requested additional chunks exceed chunk manager capacity");
     }
-    if (!_visits.isValid(visitId)) {
-        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
-            (boost::format("Cannot start processing for visit %1%: visit is not in-flight") % visitId).str());
-    }
     // having pre-allocated/checked that there is space for everything,
     // manager state can be modified without throwing
     _data.createOrRegisterInterest(toRead, toWaitFor, visitId, chunkIds);
@@ -800,7 +1584,8 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::startVisit(
 
 
 /**
- * Blocks the calling thread until the given visit owns every one of the given chunks.
+ * Blocks the calling thread until the given visit owns every one of the given chunks. The
+ * thread is only woken up when a chunk is handed to the visit or the visit ends.
  *
  * Note that the vector @a toRead passed into the method is assumed to be empty -
  * it is immediately cleared upon entry to the function.
@@ -813,6 +1598,10 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::startVisit(
  * @param[in]     visitId   The visit that must wait for chunk ownership.
  * @param[in]     deadline  The point in time after which chunk acquisition should be abandoned.
  *
+ * @throw lsst::pex::exceptions::InvalidParameterError
+ *      Thrown if the given visit is not currently in-flight.
+ * @throw lsst::pex::exceptions::RuntimeError
+ *      Thrown if the given visit ended while waiting to acquire chunks.
  * @throw lsst::pex::exceptions::TimeoutError
  *      Thrown if the visit deadline expired while waiting to acquire chunks.
  */
@@ -826,13 +1615,35 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::waitForOwnership(
     toRead.clear();
     toRead.reserve(toWaitFor.size());
 
+    Stopwatch watch(true);
     ScopedLock<MutexT> lock(_mutex);
+    double const lockWait = watch.seconds();
+    int const slot = _visits.getSlot(visitId);
+    if (slot < 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+            (boost::format("Cannot wait for chunks of visit %1%: visit is not in-flight") % visitId).str());
+    }
+    Visit * const v = _visits.begin() + slot;
+    v->addLockWait(lockWait);
+    int numWakeups = 0;
     while (true) {
         if (_data.checkForOwnership(toRead, toWaitFor, visitId)) {
             break; // all chunks belong to the visit - ok to proceed
         }
-        // wait for ownership
-        if (!_ownerCondition.wait(lock, deadline)) {
+        // wait for a chunk to be handed to the visit
+        bool const woken = _ownerConditions[slot].wait(lock, deadline);
+        if (v->getId() != visitId) {
+            // the slot was vacated (and possibly reused) while waiting
+            throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                (boost::format("Visit %1% ended while waiting for chunk ownership") % visitId).str());
+        }
+        if (!woken) {
+            // chunks whose prefetching process died are never handed over by it
+            reclaimPrefetches();
+            if (_data.checkForOwnership(toRead, toWaitFor, visitId)) {
+                break;
+            }
+            v->addOwnershipWait(watch.seconds() - lockWait, numWakeups);
             // TODO: this is a short-term DC3a hack, necessary because there is no way for
             // the pipeline framework to communicate exceptions arising outside of the implementation
             // of AP (e.g. in an IOStage) back to the pipeline itself. This results in visits that
@@ -842,7 +1653,9 @@ void ChunkManagerImpl<MutexT, DataT, TraitsT>::waitForOwnership(
             throw LSST_EXCEPT(lsst::pex::exceptions::TimeoutError,
                 (boost::format("Deadline for visit %1% expired") % visitId).str());
         }
+        ++numWakeups;
     }
+    v->addOwnershipWait(watch.seconds() - lockWait, numWakeups);
 }
 
 
@@ -882,32 +1695,180 @@ bool ChunkManagerImpl<MutexT, DataT, TraitsT>::endVisit(
 ) {
     ScopedLock<MutexT> lock(_mutex);
     bool roll = rollback || !_visits.isValid(visitId);
+    int const slot = _visits.getSlot(visitId);
     if (!_visits.erase(visitId)) {
         return false;
     }
-    // relinquish chunk ownership: if any chunks change hands, notify all threads
-    // waiting on chunk ownership to check whether they can proceed
-    if (_data.relinquishOwnership(visitId, roll, _visits)) {
-        _ownerCondition.notifyAll();
-    }
+    // wake up workers of the visit that are still waiting on chunks (so they notice the
+    // visit has ended) and workers of visits that acquire chunks from the visit
+    VisitSlots newOwners;
+    newOwners.reset();
+    newOwners.set(slot);
+    _data.relinquishOwnership(newOwners, visitId, roll, _visits);
+    notifyOwners(newOwners);
     return !roll;
 }
 
 
+/**
+ * Sets the amount of memory that chunks may continue to occupy after their last owning visit
+ * has ended. Such chunks are handed to later visits without being re-read from disk, and are
+ * evicted in least recently used order when the budget is exceeded or when their memory is
+ * needed for other chunks. A budget of zero (the default) disables chunk retention.
+ *
+ * @param[in] numBytes  The retention budget in bytes, rounded down to a multiple of the
+ *                      memory block size.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::setRetentionBudget(std::size_t const numBytes) {
+    std::size_t const numBlocks = std::min(numBytes/Chunk::BLOCK_SIZE,
+                                           static_cast<std::size_t>(_layout._numBlocks));
+    ScopedLock<MutexT> lock(_mutex);
+    _data.setRetentionBudget(static_cast<int>(numBlocks));
+}
+
+
+/** Returns hit, miss and eviction counts for chunks retained across visits. */
+template <typename MutexT, typename DataT, typename TraitsT>
+ChunkRetentionStats ChunkManagerImpl<MutexT, DataT, TraitsT>::getRetentionStats() const {
+    ChunkRetentionStats stats;
+    ScopedLock<MutexT> lock(_mutex);
+    _data.getRetentionStats(stats);
+    return stats;
+}
+
+
+/**
+ * Creates chunks for the identifiers in the given list that do not correspond to chunks in
+ * memory, so that they can be read in before any visit needs them (see
+ * SubManager::startPrefetch()). For each chunk returned in @a toRead, the caller must call
+ * beginPrefetch(), read the chunk if that succeeds, and then call endPrefetch().
+ *
+ * @param[out] toRead       Set to the list of chunks to prefetch.
+ * @param[out] generations  Set to the generation of each chunk in @a toRead.
+ * @param[in]  chunkIds     Identifiers for chunks to prefetch. Assumed to be duplicate free.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::startPrefetch(
+    std::vector<Chunk> & toRead,
+    std::vector<boost::uint64_t> & generations,
+    std::vector<int> const & chunkIds
+) {
+    toRead.clear();
+    toRead.reserve(chunkIds.size());
+    generations.clear();
+    generations.reserve(chunkIds.size());
+    ScopedLock<MutexT> lock(_mutex);
+    _data.startPrefetch(toRead, generations, chunkIds);
+}
+
+
+/**
+ * Starts reading a chunk returned by startPrefetch(). Returns @c false if a visit has taken
+ * over the read, in which case the caller must not touch the chunk.
+ *
+ * @param[in] chunk         A chunk returned by startPrefetch().
+ * @param[in] generation    The generation of the chunk when it was returned by startPrefetch().
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+bool ChunkManagerImpl<MutexT, DataT, TraitsT>::beginPrefetch(
+    Chunk const & chunk,
+    boost::uint64_t const generation
+) {
+    ScopedLock<MutexT> lock(_mutex);
+    return _data.beginPrefetch(static_cast<int>(chunk.getId()), generation);
+}
+
+
+/**
+ * Ends the prefetch of a chunk returned by startPrefetch(), handing it to a waiting visit or
+ * retaining it if no visit is waiting. Chunks that were never read with beginPrefetch() must
+ * be ended unsuccessfully.
+ *
+ * @param[in] chunk         The prefetched chunk.
+ * @param[in] generation    The generation of the chunk when it was returned by startPrefetch().
+ * @param[in] success       Was the chunk completely read in?
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::endPrefetch(
+    Chunk const & chunk,
+    boost::uint64_t const generation,
+    bool const success
+) {
+    VisitSlots newOwners;
+    newOwners.reset();
+    ScopedLock<MutexT> lock(_mutex);
+    _data.endPrefetch(newOwners, static_cast<int>(chunk.getId()), generation, success, _visits);
+    notifyOwners(newOwners);
+}
+
+
+/**
+ * Returns the time the workers of the given visit have spent waiting on the chunk manager
+ * mutex and on chunk ownership so far. All times are zero if the visit is not in flight.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+VisitWaitStats ChunkManagerImpl<MutexT, DataT, TraitsT>::getVisitWaitStats(int const visitId) const {
+    VisitWaitStats stats = VisitWaitStats();
+    ScopedLock<MutexT> lock(_mutex);
+    Visit const * v = _visits.find(visitId);
+    if (v != 0) {
+        stats = v->getWaitStats();
+    }
+    return stats;
+}
+
+
 /**
  * @internal
- * Rolls back all visits currently being tracked except for the specified one.
- * Assumes the chunk manager mutex has been acquired.
+ * Rolls back all visits currently being tracked except for the specified one, and reclaims
+ * chunks being prefetched by processes that no longer exist. Assumes the chunk manager mutex
+ * has been acquired.
  *
  * @param[in] visitId	Identifier of sole surving visit.
  */
 template <typename MutexT, typename DataT, typename TraitsT>
 void ChunkManagerImpl<MutexT, DataT, TraitsT>::rollbackAllExcept(int const visitId) {
+    VisitSlots newOwners;
+    newOwners.reset();
     for (Visit const * v = _visits.begin(); v != _visits.end(); ++v) {
         int id = v->getId();
         if (id >= 0 && id != visitId) {
+            newOwners.set(static_cast<int>(v - _visits.begin()));
             _visits.erase(id);
-            _data.relinquishOwnership(id, true, _visits);
+            _data.relinquishOwnership(newOwners, id, true, _visits);
+        }
+    }
+    _data.reclaimPrefetches(newOwners, _visits);
+    notifyOwners(newOwners);
+}
+
+
+/**
+ * @internal
+ * Reclaims chunks being prefetched by processes that no longer exist (see
+ * SubManager::reclaimPrefetches()). Assumes the chunk manager mutex has been acquired.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::reclaimPrefetches() {
+    VisitSlots newOwners;
+    newOwners.reset();
+    _data.reclaimPrefetches(newOwners, _visits);
+    notifyOwners(newOwners);
+}
+
+
+/**
+ * @internal
+ * Wakes up the workers of the visits occupying the given VisitTracker slots.
+ * Assumes the chunk manager mutex has been acquired.
+ */
+template <typename MutexT, typename DataT, typename TraitsT>
+void ChunkManagerImpl<MutexT, DataT, TraitsT>::notifyOwners(VisitSlots const & newOwners) {
+    int const n = _visits.capacity();
+    for (int i = 0; i < n; ++i) {
+        if (newOwners.test(i)) {
+            _ownerConditions[i].notifyAll();
         }
     }
 }
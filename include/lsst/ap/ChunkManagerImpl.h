@@ -34,6 +34,7 @@
 #define LSST_AP_CHUNK_MANAGER_IMPL_H
 
 #include <climits>
+#include <cstddef>
 #include <iosfwd>
 
 #include "boost/noncopyable.hpp"
@@ -53,12 +54,15 @@
 namespace lsst { namespace ap { namespace detail {
 
 /**
- * @brief  A set of up to @a NumEntries elements of type @a EntryT, hashed by an integer identifier.
+ * @brief  A set of up to a fixed number of elements of type @a EntryT, hashed by an integer identifier.
+ *
+ * The capacity of the set is chosen at construction time. The hash table and entries are stored
+ * in memory provided by the creator of the set, which is referred to by offset rather than by
+ * address - a set and its storage can therefore be placed in shared memory.
  *
  * The hash table implementation is chained and intrusive -- requirements follow:
  *
  * <ul>
- * <li>@a NumEntries must be a positive power of 2</li>
  * <li>@a EntryT must have @code int64_t getId() @endcode and @code void setId(int64_t) @endcode
  *     methods which get/set an int64_t member field and never throw. An id value of -1 is reserved
  *     for invalid entries.</li>
@@ -68,15 +72,15 @@ namespace lsst { namespace ap { namespace detail {
  * <li>@a EntryT must have a trivial destructor, and a default constructor that doesn't throw</li>
  * </ul>
  */
-template <typename EntryT, int NumEntries>
+template <typename EntryT>
 class HashedSet : private boost::noncopyable {
-    BOOST_STATIC_ASSERT(NumEntries > 0 && (NumEntries & (NumEntries - 1)) == 0);
-    BOOST_STATIC_ASSERT(NumEntries < INT_MAX);
 //    BOOST_STATIC_ASSERT(boost::has_nothrow_constructor<EntryT>::value);
 //    BOOST_STATIC_ASSERT(boost::has_trivial_destructor<EntryT>::value);
 
 public :
-    HashedSet();
+    static std::size_t storageSize(int const capacity);
+
+    HashedSet(int const capacity, unsigned char * const storage);
 
     /// Returns a pointer to the entry with the given identifier, or null if there is no such entry.
     EntryT * find(int const id) {
@@ -101,7 +105,12 @@ public :
 
     /** Returns the number of additional entries there is space for in the set */
     int space() const {
-        return NumEntries - _size;
+        return _capacity - _size;
+    }
+
+    /** Returns the maximum number of entries in the set */
+    int capacity() const {
+        return _capacity;
     }
 
     /**
@@ -110,36 +119,112 @@ public :
      * has been added to the set via insert() or findOrInsert() - are marked with an id value of -1.
      */
     EntryT * begin() {
-        return _entries;
+        return entries();
     }
     EntryT const * begin() const {
-        return _entries;
+        return entries();
     }
 
     /** Returns a pointer to the end of the underlying array of entries. */
     EntryT * end() {
-        return _entries + NumEntries;
+        return entries() + _capacity;
     }
     EntryT const * end() const {
-        return _entries + NumEntries;
+        return entries() + _capacity;
     }
 
 private :
-    int _hashTable[2*NumEntries];
+    int _capacity;
+    int _mask;   ///< Number of hash table buckets minus one
     int _free;
     int _size;
-    EntryT _entries[NumEntries];
+    std::ptrdiff_t _hashTable; ///< Offset of the hash table relative to this set
+    std::ptrdiff_t _entries;   ///< Offset of the entry array relative to this set
+
+    static int numBuckets(int const capacity);
+
+    int * hashTable() {
+        return reinterpret_cast<int *>(reinterpret_cast<unsigned char *>(this) + _hashTable);
+    }
+    int const * hashTable() const {
+        return reinterpret_cast<int const *>(reinterpret_cast<unsigned char const *>(this) + _hashTable);
+    }
+    EntryT * entries() {
+        return reinterpret_cast<EntryT *>(reinterpret_cast<unsigned char *>(this) + _entries);
+    }
+    EntryT const * entries() const {
+        return reinterpret_cast<EntryT const *>(reinterpret_cast<unsigned char const *>(this) + _entries);
+    }
 
     EntryT const * doFind(int const id) const;
 };
 
 
 /**
- * @brief  A thread-safe memory block allocator that uses a Bitset to track which blocks (out of a
+ * @brief  Capacities of a chunk store, chosen when the memory holding it is created.
+ *
+ * The defaults are taken from the DataTraits of the chunk entry type. The number of entries
+ * per memory block is not part of the layout: it is fixed at compile time.
+ */
+struct ChunkStoreLayout {
+    int _numBlocks;         ///< Total number of allocatable memory blocks
+    int _maxBlocksPerChunk; ///< Maximum number of memory blocks a single chunk may occupy
+    int _maxChunksPerFov;   ///< Maximum number of chunks overlapping a single FOV
+    int _maxVisitsInFlight; ///< Maximum number of visits in flight, at most MAX_VISITS_IN_FLIGHT
+
+    /// Returns the default layout for chunks with the given traits.
+    template <typename TraitsT> static ChunkStoreLayout fromTraits() {
+        ChunkStoreLayout layout = {
+            TraitsT::NUM_BLOCKS,
+            TraitsT::MAX_BLOCKS_PER_CHUNK,
+            TraitsT::MAX_CHUNKS_PER_FOV,
+            DEFAULT_VISITS_IN_FLIGHT
+        };
+        return layout;
+    }
+
+    /// Returns the maximum number of chunks that can be tracked at once.
+    int getMaxChunks() const {
+        return _maxChunksPerFov*_maxVisitsInFlight;
+    }
+
+    bool operator==(ChunkStoreLayout const & layout) const {
+        return _numBlocks == layout._numBlocks &&
+               _maxBlocksPerChunk == layout._maxBlocksPerChunk &&
+               _maxChunksPerFov == layout._maxChunksPerFov &&
+               _maxVisitsInFlight == layout._maxVisitsInFlight;
+    }
+    bool operator!=(ChunkStoreLayout const & layout) const {
+        return !(*this == layout);
+    }
+
+    void validate(int const entriesPerBlockLog2) const;
+};
+
+std::ostream & operator<<(std::ostream & os, ChunkStoreLayout const & layout);
+
+
+/**
+ * @brief  Locations of the parts of a chunk store, in bytes relative to the
+ *         start of the memory holding it.
+ */
+struct ChunkStoreOffsets {
+    std::size_t _visits;     ///< Storage for the visit tracker
+    std::size_t _chunks;     ///< Storage for the set of chunk descriptors
+    std::size_t _blockLists; ///< Block offset lists of the chunk descriptors
+    std::size_t _bitmap;     ///< In-use bitmap of the block allocator
+    std::size_t _blocks;     ///< Pool of memory blocks
+    std::size_t _end;        ///< Total size of the chunk store
+};
+
+
+/**
+ * @brief  A thread-safe memory block allocator that uses a bitmap to track which blocks (out of a
  *         fixed size pool of blocks) are in-use/free.
  *
  * The allocator never returns raw pointers - instead, blocks are identified by an offset in bytes
- * relative to the address of the allocator instance.
+ * relative to the address of the allocator instance. The bitmap is stored outside of the
+ * allocator, since its size depends on the number of blocks in the pool.
  *
  * This scheme allows an allocator instance, the memory blocks it manages, and offsets referencing
  * them to be stored in shared memory. Clients then map these offsets to an actual block address
@@ -148,30 +233,130 @@ private :
 template <typename MutexT, typename DataT, typename TraitsT = DataTraits<DataT> >
 class BlockAllocator : private boost::noncopyable {
 public :
-    BlockAllocator(unsigned char const * const ref, std::size_t const offset);
+    static std::size_t bitmapSize(int const numBlocks) {
+        return sizeof(boost::uint64_t)*((numBlocks + 63) >> 6);
+    }
+
+    BlockAllocator(
+        unsigned char * const ref,
+        std::size_t const bitmapOffset,
+        std::size_t const offset,
+        ChunkStoreLayout const & layout
+    );
 
     std::size_t allocate();
     void allocate(std::size_t * const blockOffsets, int const n);
     void free(std::size_t const * const blockOffsets, int const n);
 
+    /// Returns the number of memory blocks that are currently free.
+    int getNumFree() const {
+        ScopedLock<MutexT> lock(_mutex);
+        return _numFree;
+    }
+
+    /// Returns the maximum number of memory blocks that may be allocated to a single chunk.
+    int getMaxBlocksPerChunk() const {
+        return _maxBlocksPerChunk;
+    }
+
 private :
-    typedef Bitset<boost::uint64_t, TraitsT::NUM_BLOCKS> Allocator;
+    BOOST_STATIC_ASSERT(TraitsT::ENTRIES_PER_BLOCK_LOG2 >= 9);
+
+    static std::size_t const BLOCK_SIZE =
+        (sizeof(DataT) + sizeof(ChunkEntryFlag)) << TraitsT::ENTRIES_PER_BLOCK_LOG2;
+
+    mutable MutexT _mutex;
+    std::size_t const _bitmap; ///< offset of the in-use bitmap, 1 bits are allocated
+    std::size_t const _offset;
+    int const _numBlocks;
+    int const _maxBlocksPerChunk;
+    int _numFree;
+
+    boost::uint64_t * words() {
+        return reinterpret_cast<boost::uint64_t *>(reinterpret_cast<unsigned char *>(this) + _bitmap);
+    }
+};
+
+
+#if LSST_AP_HAVE_SYNC_BUILTINS
+
+/**
+ * @brief  A memory block allocator with the same interface and pointer-free layout as
+ *         BlockAllocator, but which uses atomic operations rather than a mutex.
+ *
+ * A request for @a n blocks first reserves @a n blocks by atomically decrementing a count of
+ * free blocks, and then claims @a n zero bits in the in-use bitmap by compare-and-swap, as
+ * many per word as possible. Frees clear bits before returning them to the free count. The
+ * number of zero bits is therefore never smaller than the number of reserved but unclaimed
+ * blocks, so that a successful reservation always finds its blocks.
+ */
+template <typename DataT, typename TraitsT = DataTraits<DataT> >
+class LockFreeBlockAllocator : private boost::noncopyable {
+public :
+    static std::size_t bitmapSize(int const numBlocks) {
+        return sizeof(boost::uint64_t)*((numBlocks + 63) >> 6);
+    }
+
+    LockFreeBlockAllocator(
+        unsigned char * const ref,
+        std::size_t const bitmapOffset,
+        std::size_t const offset,
+        ChunkStoreLayout const & layout
+    );
+
+    std::size_t allocate();
+    void allocate(std::size_t * const blockOffsets, int const n);
+    void free(std::size_t const * const blockOffsets, int const n);
 
+    /// Returns the number of memory blocks that are currently free.
+    int getNumFree() const {
+        return _numFree;
+    }
+
+    /// Returns the maximum number of memory blocks that may be allocated to a single chunk.
+    int getMaxBlocksPerChunk() const {
+        return _maxBlocksPerChunk;
+    }
+
+private :
     BOOST_STATIC_ASSERT(TraitsT::ENTRIES_PER_BLOCK_LOG2 >= 9);
 
     static std::size_t const BLOCK_SIZE =
         (sizeof(DataT) + sizeof(ChunkEntryFlag)) << TraitsT::ENTRIES_PER_BLOCK_LOG2;
 
-    MutexT _mutex;
-    Allocator _allocator;
+    volatile int _numFree;                      ///< number of unreserved free blocks
+    volatile int _hint;                         ///< word at which to start looking for zero bits
+    std::size_t const _words;                   ///< offset of the in-use bitmap, 1 bits are allocated
     std::size_t const _offset;
+    int const _numWords;
+    int const _numBlocks;
+    int const _maxBlocksPerChunk;
+
+    volatile boost::uint64_t * words() {
+        return reinterpret_cast<volatile boost::uint64_t *>(
+            reinterpret_cast<unsigned char *>(this) + _words);
+    }
+
+    void reserve(int const n);
+    void claim(std::size_t * const blockOffsets, int const n);
+    void clear(int const w, boost::uint64_t const mask);
+};
+
+#endif
+
+
+/** @brief  Time spent by the workers of a visit waiting on the chunk manager. */
+struct VisitWaitStats {
+    double _lockWait;      ///< Seconds spent acquiring the chunk manager mutex
+    double _ownershipWait; ///< Seconds spent waiting for other visits to hand over chunks
+    int _numWakeups;       ///< Number of times a wait for chunk ownership was woken up
 };
 
 
 /** @brief  State for a single visit to a field of view. */
 class Visit {
 public :
-    Visit() : _id(-1), _next(-1), _failed(false) {}
+    Visit() : _id(-1), _next(-1), _failed(false), _waits() {}
 
     bool failed() const {
         return _failed;
@@ -180,6 +365,17 @@ public :
         _failed = true;
     }
 
+    VisitWaitStats const & getWaitStats() const {
+        return _waits;
+    }
+    void addLockWait(double const seconds) {
+        _waits._lockWait += seconds;
+    }
+    void addOwnershipWait(double const seconds, int const numWakeups) {
+        _waits._ownershipWait += seconds;
+        _waits._numWakeups    += numWakeups;
+    }
+
     // HashedSet requirements
     int getId() const {
         return _id;
@@ -198,18 +394,41 @@ private :
     int _id;
     int _next;
     bool _failed;
+    VisitWaitStats _waits;
 };
 
 
+/** @brief  A set of visits, identified by their slots in a VisitTracker. */
+typedef Bitset<boost::uint32_t, MAX_VISITS_IN_FLIGHT> VisitSlots;
+
+
 /** @brief  Tracks a set of visits. */
-class VisitTracker : public HashedSet<Visit, MAX_VISITS_IN_FLIGHT> {
+class VisitTracker : public HashedSet<Visit> {
 public :
+    VisitTracker(int const capacity, unsigned char * const storage) :
+        HashedSet<Visit>(capacity, storage)
+    {}
+
     bool isValid(int const visitId) const;
+    int getSlot(int const visitId) const;
     void print(std::ostream & os) const;
     void print(int const visitId, std::ostream & os) const;
 };
 
 
+/** @brief  Statistics for chunks retained in memory after their last owning visit ended. */
+struct ChunkRetentionStats {
+    boost::uint64_t _hits;      ///< Number of chunk requests satisfied by a retained chunk
+    boost::uint64_t _misses;    ///< Number of chunk requests that required a read from disk
+    boost::uint64_t _evictions; ///< Number of retained chunks evicted
+    boost::uint64_t _prefetches;///< Number of chunks successfully prefetched
+    int _numRetained;           ///< Number of chunks currently retained
+    int _numPrefetching;        ///< Number of chunks currently being prefetched
+    std::size_t _retainedBytes; ///< Memory used by retained chunks
+    std::size_t _budget;        ///< Maximum amount of memory retained chunks may use
+};
+
+
 /**
  * @brief   Helper class for managing chunks of a particular type.
  *
@@ -218,20 +437,60 @@ public :
 template <typename MutexT, typename DataT, typename TraitsT = DataTraits<DataT> >
 class SubManager : private boost::noncopyable {
 public :
+#if LSST_AP_HAVE_SYNC_BUILTINS
+    typedef LockFreeBlockAllocator<DataT, TraitsT> Allocator;
+#else
     typedef BlockAllocator<MutexT, DataT, TraitsT> Allocator;
+#endif
     typedef ChunkRef<Allocator, DataT, TraitsT> Chunk;
-    typedef ChunkDescriptor<TraitsT::MAX_BLOCKS_PER_CHUNK> Descriptor;
+    typedef ChunkDescriptor Descriptor;
 
     // -- fields ----------------
 
-    static int const NUM_CHUNKS = TraitsT::MAX_CHUNKS_PER_FOV * MAX_VISITS_IN_FLIGHT;
+    /// Owner of chunks that are retained in memory, but not owned by any visit
+    static int const UNOWNED = -1;
+    /// Owner of chunks that are being read in ahead of the visits that need them
+    static int const PREFETCHING = -2;
+    /// Owner of chunks that are queued for reading ahead of the visits that need them
+    static int const PREFETCH_QUEUED = -3;
 
-    HashedSet<Descriptor, NUM_CHUNKS> _chunks;
+    HashedSet<Descriptor> _chunks;
     Allocator _allocator;
+    /// Offset (relative to the allocator) of the block offset list of the first chunk descriptor
+    std::size_t const _blockLists;
+    int const _maxBlocksPerChunk;
+    int const _maxChunksPerFov;
+    boost::uint64_t _generation; ///< Last chunk generation number handed out
+    boost::uint64_t _clock;      ///< Last chunk use time stamp handed out
+    boost::uint64_t _hits;
+    boost::uint64_t _misses;
+    boost::uint64_t _evictions;
+    boost::uint64_t _prefetches;
+    int _retentionBudget;        ///< Maximum number of blocks used by retained chunks
+    int _numRetained;
+    int _retainedBlocks;
+    int _numPrefetching;
 
     // -- methods ----------------
 
-    SubManager(unsigned char const * const ref, std::size_t const offset) : _allocator(ref, offset) {}
+    SubManager(unsigned char * const ref, ChunkStoreOffsets const & offsets, ChunkStoreLayout const & layout) :
+        _chunks(layout.getMaxChunks(), ref + offsets._chunks),
+        _allocator(ref, offsets._bitmap, offsets._blocks, layout),
+        _blockLists(static_cast<std::size_t>(
+            (ref + offsets._blockLists) - reinterpret_cast<unsigned char *>(&_allocator))),
+        _maxBlocksPerChunk(layout._maxBlocksPerChunk),
+        _maxChunksPerFov(layout._maxChunksPerFov),
+        _generation(0),
+        _clock(0),
+        _hits(0),
+        _misses(0),
+        _evictions(0),
+        _prefetches(0),
+        _retentionBudget(0),
+        _numRetained(0),
+        _retainedBlocks(0),
+        _numPrefetching(0)
+    {}
 
     /// Returns the number of chunks under management.
     int size()  const { return _chunks.size();  }
@@ -256,15 +515,64 @@ public :
         std::vector<int> const & chunkIds
     );
 
-    bool relinquishOwnership(
+    void relinquishOwnership(
+        VisitSlots & newOwners,
         int const visitId,
         bool const rollback,
         VisitTracker const & tracker
     );
 
+    void setRetentionBudget(int const numBlocks);
+    void makeRoom(std::vector<int> const & chunkIds);
+    void getRetentionStats(ChunkRetentionStats & stats) const;
+
+    void startPrefetch(
+        std::vector<Chunk> & toRead,
+        std::vector<boost::uint64_t> & generations,
+        std::vector<int> const & chunkIds
+    );
+    bool beginPrefetch(int const chunkId, boost::uint64_t const generation);
+    void endPrefetch(
+        VisitSlots & newOwners,
+        int const chunkId,
+        boost::uint64_t const generation,
+        bool const success,
+        VisitTracker const & tracker
+    );
+    void reclaimPrefetches(VisitSlots & newOwners, VisitTracker const & tracker);
+
     void print(std::ostream & os) const;
     void print(int const chunkId, std::ostream & os) const;
     void printVisit(int const visitId, std::ostream & os) const;
+
+private :
+
+    /// Marks the contents of the given chunk as having changed wholesale.
+    void newGeneration(Descriptor * const d) {
+        d->_generation = ++_generation;
+    }
+
+    /// Points a freshly inserted descriptor at the block offset list for its slot.
+    void bindBlockList(Descriptor * const d) {
+        d->_blocks = _blockLists + static_cast<std::size_t>(d - _chunks.begin())*
+                                   _maxBlocksPerChunk*sizeof(std::size_t);
+    }
+
+    /// Returns the memory blocks of the given chunk to the allocator.
+    void freeBlocks(Descriptor * const d) {
+        _allocator.free(reinterpret_cast<std::size_t const *>(
+            reinterpret_cast<unsigned char const *>(&_allocator) + d->_blocks), d->_numBlocks);
+    }
+
+    void retain(Descriptor * const d);
+    void finishPrefetch(
+        VisitSlots & newOwners,
+        Descriptor * const d,
+        bool const success,
+        VisitTracker const & tracker
+    );
+    void evict(int const numChunks, int const numBlocks, std::vector<int> const & keep);
+    int estimateBlocksPerChunk() const;
 };
 
 
@@ -279,10 +587,19 @@ public :
  * data alignment issues, M should begin at an address that is a multiple of 16 bytes (or
  * some larger power of 2).
  *
+ * The capacities of the manager (see ChunkStoreLayout) determine the size of M, and are
+ * recorded at the beginning of M along with the chunk entry size. Processes that attach to
+ * an existing M check them with validate() before using the manager.
+ *
  * Finally, note that instances of this class do not contain a single pointer - when necessary, offsets
  * (relative to some known address, e.g. of the manager instance itself) are stored instead. This, in
  * conjunction with an appropriate choice of mutex type, makes the class suitable for placement into
  * shared memory.
+ *
+ * Manager state is protected by a single mutex that is never held while chunk data is read or
+ * written. There is no condition variable shared by all visits: each chunk queues the visits
+ * interested in it, and when it changes hands only the workers of the visit receiving it are
+ * woken up.
  */
 template <
     typename MutexT,
@@ -294,22 +611,31 @@ public :
     typedef SubManager<MutexT, DataT, TraitsT> Manager;
     typedef typename Manager::Chunk Chunk;
 
-private :
-    /// Returns the offset of the first data block (relative to its manager).
-    static std::size_t blocks() {
-        return (sizeof(ChunkManagerImpl) + 511) & ~static_cast<size_t>(511);
-    }
+    /// Identifies memory holding a chunk manager; changes whenever the memory layout does.
+    static boost::uint32_t const MAGIC = 0xdecade24;
+
+    static ChunkStoreOffsets getOffsets(ChunkStoreLayout const & layout);
 
-public :
     /**
-     * Returns the total number of bytes required for a ChunkManagerImpl
-     * instance and it's associated pool of memory blocks.
+     * Returns the total number of bytes required for a ChunkManagerImpl instance
+     * with the given capacities and it's associated pool of memory blocks.
      */
-    static std::size_t size() {
-        return blocks() + Chunk::BLOCK_SIZE * TraitsT::NUM_BLOCKS;
+    static std::size_t size(ChunkStoreLayout const & layout) {
+        return getOffsets(layout)._end;
     }
 
-    ChunkManagerImpl();
+    static void validate(
+        void const * const mem,
+        std::size_t const numBytes,
+        ChunkStoreLayout const * const layout
+    );
+
+    explicit ChunkManagerImpl(ChunkStoreLayout const & layout);
+
+    /// Returns the capacities the manager was created with.
+    ChunkStoreLayout const & getLayout() const {
+        return _layout;
+    }
 
     bool isVisitInFlight(int const visitId);
     void failVisit(int const visitId);
@@ -336,6 +662,19 @@ public :
 
     bool endVisit(int const visitId, bool const rollback);
 
+    void setRetentionBudget(std::size_t const numBytes);
+    ChunkRetentionStats getRetentionStats() const;
+
+    void startPrefetch(
+        std::vector<Chunk> & toRead,
+        std::vector<boost::uint64_t> & generations,
+        std::vector<int> const & chunkIds
+    );
+    bool beginPrefetch(Chunk const & chunk, boost::uint64_t const generation);
+    void endPrefetch(Chunk const & chunk, boost::uint64_t const generation, bool const success);
+
+    VisitWaitStats getVisitWaitStats(int const visitId) const;
+
     void printVisits(std::ostream & os) const;
     void printChunks(std::ostream & os) const;
     void printVisit(int const visitId, std::ostream & os) const;
@@ -343,9 +682,19 @@ public :
 
 private :
     void rollbackAllExcept(int const visitId);
+    void reclaimPrefetches();
+    void notifyOwners(VisitSlots const & newOwners);
+
+    // header fields - these must remain at the beginning of the manager
+    boost::uint32_t const  _magic;
+    boost::uint32_t const  _entrySize;
+    int const              _entriesPerBlockLog2;
+    ChunkStoreLayout const _layout;
+    std::size_t const      _size;
 
     mutable MutexT    _mutex;
-    Condition<MutexT> _ownerCondition;
+    /// Workers of the visit in a VisitTracker slot wait on the condition for that slot
+    Condition<MutexT> _ownerConditions[MAX_VISITS_IN_FLIGHT];
     VisitTracker      _visits;
     Manager           _data;
 };
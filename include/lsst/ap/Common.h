@@ -47,11 +47,15 @@ namespace lsst { namespace ap { namespace {
 double const FOV_RADIUS = 1.75;
 
 /**
- * The maximum number of LSST visits in-flight in the association pipeline. In-flight visits
- * are defined as those for which data is actively being read, processed, or written out.
+ * An upper bound on the number of LSST visits in-flight in the association pipeline. In-flight
+ * visits are defined as those for which data is actively being read, processed, or written out.
+ * The number actually supported is chosen when a chunk store is created (see ChunkStoreLayout).
  * @b Must be a power of 2.
  */
-int const MAX_VISITS_IN_FLIGHT = 16;
+int const MAX_VISITS_IN_FLIGHT = 64;
+
+/// The number of in-flight visits chunk stores support unless told otherwise.
+int const DEFAULT_VISITS_IN_FLIGHT = 16;
 
 }}} // end of namespace lsst::ap::<anonymous>
 
@@ -42,6 +42,10 @@ namespace lsst { namespace ap {
 /**
  * @brief  Provides basic chunk parameters at compile time.
  *
+ * Only the block size is fixed at compile time: the remaining parameters are the default
+ * capacities of a chunk store, which can be changed when the chunk store is created (see
+ * ChunkStoreLayout).
+ *
  * Specializations of DataTraits must provide the following data type specific parameters:
  * <dl>
  * <dt><b> ENTRIES_PER_BLOCK_LOG2 </b></dt>
@@ -100,7 +100,7 @@ void lsst::ap::EllipseList<DataT>::prepareForMatch(ZoneStripeChunkDecomposition
     for (size_type i = 0; i < sz; ++i) {
         Ellipse<DataT> & e = this->operator[](i);
         double dec  = e._data->getDec();
-        double smaa = e._data->getSemiMajorAxisLength();
+        double smaa = e._data->getSemiMajorAxisLength()/3600.0; // arcsec to deg, as in Ellipse()
         // Note - this actually computes the min/max zone of the ellipses bounding circle
         double d = dec - smaa;
         e._minZone = zsc.decToZone(d <= -90.0 ? -90.0 : d);
@@ -84,6 +84,47 @@ public :
         // now in position to use standard 2D axis-aligned formulation for an ellipse
         return (xr*xr*_invMajor2 + yr*yr*_invMinor2 <= 1.0);
     }
+
+    /// Maximum number of unit vectors that can be tested by a single call to contains(x, y, z, n).
+    static int const MAX_BATCH = 64;
+
+    /**
+     * Tests @a n consecutive unit vectors, given as separate coordinate arrays, for
+     * containment in the ellipse. Bit @c i of the return value is set if and only if
+     * the ellipse contains (@a x[i], @a y[i], @a z[i]). The loop bodies are branch-free,
+     * so the containment tests can be vectorized across points.
+     *
+     * @pre @code n >= 0 && n <= MAX_BATCH @endcode
+     */
+    boost::uint64_t contains(
+        double const * const __restrict x,
+        double const * const __restrict y,
+        double const * const __restrict z,
+        int const n
+    ) const {
+        assert(n >= 0 && n <= MAX_BATCH);
+        double const sinDec = _sinDec;
+        double const cosDec = _cosDec;
+        double const sinRa  = _sinRa;
+        double const cosRa  = _cosRa;
+        double const sinPa  = _sinPa;
+        double const cosPa  = _cosPa;
+        double const invMajor2 = _invMajor2;
+        double const invMinor2 = _invMinor2;
+        double q[MAX_BATCH];
+        for (int i = 0; i < n; ++i) {
+            double const xne = cosDec*z[i] - sinDec*(sinRa*y[i] + cosRa*x[i]);
+            double const yne = cosRa*y[i] - sinRa*x[i];
+            double const xr  = sinPa*yne + cosPa*xne;
+            double const yr  = cosPa*yne - sinPa*xne;
+            q[i] = xr*xr*invMajor2 + yr*yr*invMinor2;
+        }
+        boost::uint64_t mask = 0;
+        for (int i = 0; i < n; ++i) {
+            mask |= static_cast<boost::uint64_t>(q[i] <= 1.0) << i;
+        }
+        return mask;
+    }
 };
 
 template <typename DataT>
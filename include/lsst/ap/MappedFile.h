@@ -0,0 +1,80 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Read-only memory mapping of a file.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_MAPPED_FILE_H
+#define LSST_AP_MAPPED_FILE_H
+
+#include <string>
+
+#include "boost/noncopyable.hpp"
+
+#include "Common.h"
+
+
+namespace lsst { namespace ap {
+
+/**
+ * @brief   Maps the entire contents of a file into memory, read-only.
+ *
+ * The mapping is shared, so any number of processes can map the same file (which may live
+ * on a memory backed file system such as /dev/shm) without duplicating its pages. The file
+ * is unmapped on destruction.
+ */
+class MappedFile : private boost::noncopyable {
+
+public :
+
+    explicit MappedFile(std::string const & path);
+
+    ~MappedFile();
+
+    /// Returns a pointer to the first byte of the mapped file.
+    unsigned char const * getData() const { return _data; }
+
+    /// Returns the size of the mapped file in bytes.
+    std::size_t size() const { return _size; }
+
+    /// Returns the path of the mapped file.
+    std::string const & getPath() const { return _path; }
+
+private :
+
+    std::string _path;
+    unsigned char const * _data;
+    std::size_t _size;
+};
+
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_MAPPED_FILE_H
@@ -41,7 +41,9 @@
  *
  * Note that a single match pair/list processor instance is used by all threads involved
  * in a parallel match. Ensuring that this doesn't cause problems is the responsibility of the
- * match pair/list processor author.
+ * match pair/list processor author. When only the list of match pairs is required, a
+ * MatchCollector can be used instead: it accumulates matches in per-thread buffers, and
+ * therefore needs no locking.
  *
  * @ingroup ap
  */
@@ -53,12 +55,22 @@
 #   include <omp.h>
 #endif
 
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "boost/static_assert.hpp"
+
 #include "Common.h"
 #include "EllipseTypes.h"
+#include "ScopeGuard.h"
 #include "SpatialUtil.h"
+#include "Thread.h"
+#include "Time.h"
+#include "WorkScheduler.h"
 #include "ZoneTypes.h"
 
 
@@ -124,239 +136,1686 @@ struct EmptyMatchPairProcessor {
 };
 
 
+namespace detail {
+
+/**
+ * Tests @a n consecutive zone entries, given by their unit vector coordinate columns, against
+ * the unit vector (@a fx, @a fy, @a fz). The index (relative to the start of the columns) and
+ * squared chord length of every entry that is closer than the square root of @a d2Limit are
+ * stored in @a hits and @a d2s, both of which must have space for @a n values.
+ *
+ * Entries are processed in fixed size blocks with branch-free loop bodies, so that the
+ * compiler can map each block onto SIMD instructions (AVX2 processes 4 and AVX-512 8
+ * candidates per instruction when the build targets those instruction sets). Distances
+ * are computed with the precision of the coordinate columns (@a CoordT), so single
+ * precision columns process twice as many candidates per instruction.
+ *
+ * @return  The number of entries within the distance limit.
+ */
+template <typename CoordT>
+inline int distanceKernel(
+    CoordT const * const __restrict x,
+    CoordT const * const __restrict y,
+    CoordT const * const __restrict z,
+    int const n,
+    CoordT const fx,
+    CoordT const fy,
+    CoordT const fz,
+    CoordT const d2Limit,
+    int * const __restrict hits,
+    double * const __restrict d2s
+) {
+    static int const BLOCK = 8;
+
+    int nh = 0;
+    int i  = 0;
+    for ( ; i + BLOCK <= n; i += BLOCK) {
+        CoordT d2[BLOCK];
+        for (int j = 0; j < BLOCK; ++j) {
+            CoordT const xd = fx - x[i + j];
+            CoordT const yd = fy - y[i + j];
+            CoordT const zd = fz - z[i + j];
+            d2[j] = xd*xd + yd*yd + zd*zd;
+        }
+        for (int j = 0; j < BLOCK; ++j) {
+            hits[nh] = i + j;
+            d2s[nh]  = d2[j];
+            nh += (d2[j] < d2Limit);
+        }
+    }
+    for ( ; i < n; ++i) {
+        CoordT const xd = fx - x[i];
+        CoordT const yd = fy - y[i];
+        CoordT const zd = fz - z[i];
+        CoordT const d2 = xd*xd + yd*yd + zd*zd;
+        hits[nh] = i;
+        d2s[nh]  = d2;
+        nh += (d2 < d2Limit);
+    }
+    return nh;
+}
+
+
+/** Returns the index of the least significant bit set in @a mask, which must be non-zero. */
+inline int lowestSetBit(boost::uint64_t const mask) {
+    assert(mask != 0);
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while (((mask >> i) & 1) == 0) {
+        ++i;
+    }
+    return i;
+#endif
+}
+
+
+/** Returns the maximum number of threads available to a parallel region. */
+inline int maxThreads() {
+#if LSST_AP_HAVE_OPEN_MP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+
+/** Returns the index of the calling thread within its parallel region. */
+inline int threadNum() {
+#if LSST_AP_HAVE_OPEN_MP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * Returns the expected number of entries within @a deltaRa of an arbitrary position,
+ * for a zone containing @a size entries distributed uniformly in right ascension.
+ */
+inline double expectedRaRangeCount(int const size, boost::uint32_t const deltaRa) {
+    double const f = 2.0*static_cast<double>(deltaRa)/4294967296.0;
+    return size*(f < 1.0 ? f : 1.0);
+}
+
+
+/**
+ * Estimates the cost of matching each zone of @a first against @a second with the given
+ * match radius (in degrees), as the number of entries in the zone times the expected number
+ * of distance tests per entry. The match parameters of @a second must have been computed
+ * for @a radius.
+ */
+template <typename FirstEntryT, typename SecondEntryT>
+void estimateZoneCosts(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    double const              radius,
+    std::vector<double>     & costs
+) {
+    typedef typename ZoneIndex<FirstEntryT>::Zone  FirstZone;
+    typedef typename ZoneIndex<SecondEntryT>::Zone SecondZone;
+
+    int const minZone = first.getMinZone();
+    int const maxZone = first.getMaxZone();
+
+    costs.assign(maxZone - minZone + 1, 0.0);
+    for (int fzi = minZone; fzi <= maxZone; ++fzi) {
+        FirstZone * const fz = first.getZone(fzi);
+        int const nfze = fz->_size;
+        if (nfze <= 0) {
+            continue;
+        }
+        double d = first.getDecomposition().getZoneDecMin(fz->_zone) - radius;
+        int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
+        d = first.getDecomposition().getZoneDecMax(fz->_zone) + radius;
+        int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
+        SecondZone *       sz    = second.firstZone(minz, maxz);
+        SecondZone * const szend = second.endZone(minz, maxz);
+        double c = 1.0;
+        for ( ; sz < szend; ++sz) {
+            c += expectedRaRangeCount(sz->_size, sz->_deltaRa);
+        }
+        costs[fzi - minZone] = nfze*c;
+    }
+}
+
+
+/** @brief  A nearest neighbour candidate: a zone entry and its squared chord distance. */
+template <typename EntryT>
+struct NearestCandidate {
+    double   _d2;
+    EntryT * _entry;
+};
+
+/** Orders candidates by distance, so that a heap of candidates has the farthest on top. */
+template <typename EntryT>
+inline bool operator<(NearestCandidate<EntryT> const & a, NearestCandidate<EntryT> const & b) {
+    return a._d2 < b._d2;
+}
+
+/** Returns the squared chord length corresponding to an angular separation of @a a radians. */
+inline double angleToChord2(double const a) {
+    double const s = std::sin(0.5*a);
+    return 4.0*s*s;
+}
+
+/**
+ * Computes the squared chord length limits that distances computed from the zone columns
+ * of @c EntryT entries are classified with, given the exact limit @a d2Limit. Candidates
+ * closer than the square root of @a d2Low are within the exact limit, and candidates at or
+ * beyond the square root of @a d2High are not. Candidates in between must be re-tested
+ * with @c EntryT::exactDistance2(). Both bounds equal @a d2Limit for full precision entries.
+ */
+template <typename EntryT>
+inline void columnDistanceBounds(double const d2Limit, double & d2Low, double & d2High) {
+    double const error = EntryT::getCoordinateError();
+    d2Low  = d2Limit;
+    d2High = d2Limit;
+    if (error > 0.0) {
+        double const chord = std::sqrt(d2Limit);
+        d2Low  = (chord > error) ? (chord - error)*(chord - error) : 0.0;
+        d2High = (chord + error)*(chord + error);
+    }
+}
+
+} // end of namespace detail
+
+
+/** @brief  A compact match pair record: pointers to the matching entries and their distance. */
+template <typename FirstEntryT, typename SecondEntryT>
+struct MatchRecord {
+    FirstEntryT  * _first;
+    SecondEntryT * _second;
+    double         _distance; ///< angular separation of the entries (radians)
+};
+
+namespace detail {
+
+/** Returns the id of the data object of a full precision entry. */
+template <typename ChunkT>
+inline boost::int64_t getEntryId(ZoneEntry<ChunkT> const & e) {
+    return e._data->getId();
+}
+
+/**
+ * Returns an id for a compact entry, which has no data pointer: its chunk slot and index,
+ * which identify it within its zone index.
+ */
+template <typename ChunkT>
+inline boost::int64_t getEntryId(CompactZoneEntry<ChunkT> const & e) {
+    return static_cast<boost::int64_t>((static_cast<boost::uint64_t>(e._chunkSlot) << 32) |
+                                       static_cast<boost::uint32_t>(e._index));
+}
+
+/**
+ * Orders match records by the positions of their first and second entries, then by distance,
+ * and finally by the ids of their first and second entries (see getEntryId()). The order is
+ * therefore independent of the order in which matches were found, even for entries at
+ * identical positions.
+ */
+template <typename FirstEntryT, typename SecondEntryT>
+struct MatchRecordLess {
+    bool operator()(
+        MatchRecord<FirstEntryT, SecondEntryT> const & a,
+        MatchRecord<FirstEntryT, SecondEntryT> const & b
+    ) const {
+        if (a._first->_dec != b._first->_dec) {
+            return a._first->_dec < b._first->_dec;
+        }
+        if (a._first->_ra != b._first->_ra) {
+            return a._first->_ra < b._first->_ra;
+        }
+        if (a._second->_dec != b._second->_dec) {
+            return a._second->_dec < b._second->_dec;
+        }
+        if (a._second->_ra != b._second->_ra) {
+            return a._second->_ra < b._second->_ra;
+        }
+        if (a._distance != b._distance) {
+            return a._distance < b._distance;
+        }
+        boost::int64_t const firstA = getEntryId(*a._first);
+        boost::int64_t const firstB = getEntryId(*b._first);
+        if (firstA != firstB) {
+            return firstA < firstB;
+        }
+        return getEntryId(*a._second) < getEntryId(*b._second);
+    }
+};
+
+} // end of namespace detail
+
+
+/**
+ * @brief  Collects match pairs found by a parallel match routine without locking.
+ *
+ * A collector can be passed to distanceMatch(), variableDistanceMatch() and nearestMatch()
+ * as a match list processor, or to distanceSelfMatch() as a match pair processor, for both
+ * full precision (ZoneEntry) and compact (CompactZoneEntry) entries. Rather
+ * than processing matches as they are found, each thread appends compact MatchRecord
+ * instances to a buffer of its own. Once matching is done, collect() concatenates the
+ * per-thread buffers, optionally sorting the result into an order that does not depend
+ * on how work was distributed across threads.
+ */
+template <typename FirstEntryT, typename SecondEntryT>
+class MatchCollector : private boost::noncopyable {
+public :
+    typedef MatchWithDistance<SecondEntryT> Match;
+    typedef typename std::vector<Match>::iterator MatchIterator;
+    typedef MatchRecord<FirstEntryT, SecondEntryT> Record;
+
+    /**
+     * Creates a collector with one buffer per thread available to parallel regions,
+     * each with space for @a capacity records.
+     */
+    explicit MatchCollector(std::size_t const capacity = 4096) :
+        _buffers(detail::maxThreads())
+    {
+        for (std::size_t i = 0; i < _buffers.size(); ++i) {
+            _buffers[i]._records.reserve(capacity);
+        }
+    }
+
+    /** Records a list of matches for @a first. */
+    void operator()(FirstEntryT & first, MatchIterator begin, MatchIterator end) {
+        std::vector<Record> & records = buffer();
+        for ( ; begin != end; ++begin) {
+            Record r = { &first, begin->_match, begin->_distance };
+            records.push_back(r);
+        }
+    }
+
+    /** Records a match pair, computing the distance between the two entries. */
+    void operator()(FirstEntryT & first, SecondEntryT & second) {
+        double x, y, z;
+        first.getUnitVector(x, y, z);
+        double const d2 = second.exactDistance2(x, y, z);
+        Record r = { &first, &second, 2.0*std::asin(0.5*std::sqrt(d2)) };
+        buffer().push_back(r);
+    }
+
+    /** Returns the total number of records in the per-thread buffers. */
+    std::size_t size() const {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < _buffers.size(); ++i) {
+            n += _buffers[i]._records.size();
+        }
+        return n;
+    }
+
+    /** Empties the per-thread buffers (without deallocating memory). */
+    void clear() {
+        for (std::size_t i = 0; i < _buffers.size(); ++i) {
+            _buffers[i]._records.clear();
+        }
+    }
+
+    /**
+     * Moves all records from the per-thread buffers to @a records, replacing its contents.
+     * If @a ordered is @c true, records are sorted by position of their first and then second
+     * entries (see detail::MatchRecordLess), so that the output only depends on the inputs
+     * to the match.
+     */
+    void collect(std::vector<Record> & records, bool const ordered = false) {
+        int const nb = static_cast<int>(_buffers.size());
+        std::vector<std::size_t> offsets(nb + 1, 0);
+        for (int i = 0; i < nb; ++i) {
+            offsets[i + 1] = offsets[i] + _buffers[i]._records.size();
+        }
+        records.resize(offsets[nb]);
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared)
+#endif
+        for (int i = 0; i < nb; ++i) {
+            std::copy(_buffers[i]._records.begin(), _buffers[i]._records.end(),
+                      records.begin() + offsets[i]);
+            _buffers[i]._records.clear();
+        }
+        if (ordered) {
+            std::sort(records.begin(), records.end(),
+                      detail::MatchRecordLess<FirstEntryT, SecondEntryT>());
+        }
+    }
+
+private :
+    // buffers are padded to avoid false sharing between threads
+    struct Buffer {
+        std::vector<Record> _records;
+        char _pad[64];
+    };
+
+    std::vector<Buffer> _buffers;
+
+    std::vector<Record> & buffer() {
+        int const t = detail::threadNum();
+        assert(t < static_cast<int>(_buffers.size()) && "more threads than match buffers");
+        return _buffers[t]._records;
+    }
+};
+
+
+/**
+ * Spatial cross-match routine -- finds match pairs in a first and a second set of
+ * entities (both subject to filtering), where both sets consist of points. An entity from
+ * the second set is deemed a match to an entity from the first set if the two are within
+ * the given angle of eachother. All matches for a given entity in the first set are found
+ * at once, and sent off to a match list processor for further inspection.
+ *
+ * This routine is optimized for the case where few matches are expected for any given entity.
+ * Candidates from the second set are located using the zone columns of @a second (see
+ * ZoneEntryArray), and distance tests are performed over runs of candidates with
+ * detail::distanceKernel(). Zones of the first set are split into batches of adjacent zones
+ * with roughly equal estimated cost, and handed out to threads by a WorkScheduler.
+ *
+ * Either set may consist of full precision (ZoneEntry) or compact (CompactZoneEntry) entries.
+ * When the second set is compact, distance tests are performed in single precision against a
+ * radius enlarged by CompactZoneEntry::getCoordinateError(), and candidates within rounding
+ * error of the match radius are re-tested in double precision (see
+ * CompactZoneEntry::exactDistance2()).
+ *
+ * @pre @code radius >= 0 @endcode
+ * @pre Both @a first and @a second have been sorted.
+ *
+ * @param[in] first                 A first set of entities.
+ * @param[in] second                A second set of entities.
+ * @param[in] radius                The match-radius (in degrees).
+ * @param[in] firstFilter           A filter on the first set of entities.
+ * @param[in] secondFilter          A filter on the second set of entities.
+ * @param[in] matchListProcessor    A processor for match lists.
+ * @param[out] busyTimes            Set to the time (in seconds) each thread spent matching,
+ *                                  which allows load imbalance to be measured.
+ * @return                          The number of match pairs found.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstFilterT,        // = PassthroughFilter<FirstEntryT>,
+    typename SecondFilterT,       // = PassthroughFilter<SecondEntryT>,
+    typename MatchListProcessorT  // = EmptyMatchListProcessor<FirstEntryT, MatchWithoutDistance<SecondEntryT> >
+>
+std::size_t distanceMatch(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    double const              radius,
+    FirstFilterT            & firstFilter,
+    SecondFilterT           & secondFilter,
+    MatchListProcessorT     & matchListProcessor,
+    std::vector<double>     & busyTimes
+) {
+    typedef typename ZoneIndex<FirstEntryT>::Zone  FirstZone;
+    typedef typename ZoneIndex<SecondEntryT>::Zone SecondZone;
+    typedef typename MatchListProcessorT::Match    Match;
+    typedef typename SecondZone::Coordinate        Coordinate;
+
+    if (radius < 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+                          "match radius must be greater than or equal to zero degrees");
+    }
+
+    double const shr     = std::sin(radians(radius*0.5));
+    double const d2Limit = 4.0*shr*shr;
+    int const minZone = first.getMinZone();
+
+    // Candidates closer than the square root of d2Low are matches, candidates farther than
+    // the square root of d2High are not. Candidates in between are re-tested exactly.
+    double d2Low;
+    double d2High;
+    detail::columnDistanceBounds<SecondEntryT>(d2Limit, d2Low, d2High);
+    Coordinate const kernelLimit = static_cast<Coordinate>(d2High);
+
+    std::size_t numMatchPairs = 0;
+
+    second.computeMatchParams(radius);
+
+    std::vector<double> costs;
+    detail::estimateZoneCosts(first, second, radius, costs);
+    WorkScheduler scheduler(costs, detail::maxThreads());
+
+    // loop over first set of zones in parallel
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs)
+#endif
+    {
+        // allocate per-thread data structures
+        std::vector<SecondZone *> zones;
+        std::vector<int> limits;
+        std::vector<Match> matches;
+        std::vector<int> hits(256);
+        std::vector<double> hitDistances(256);
+        matches.reserve(32);
+
+        // obtain batches of adjacent zones with roughly equal cost from the scheduler,
+        // stealing from other threads once the batches assigned to this thread are exhausted
+        int const thread = detail::threadNum();
+        int zb = 0;
+        int ze = 0;
+        while (scheduler.next(thread, zb, ze)) {
+
+            TimeSpec t0;
+            t0.now();
+
+            for (int fzi = minZone + zb; fzi < minZone + ze; ++fzi) {
+
+                FirstZone   * const __restrict fz = first.getZone(fzi);
+                FirstEntryT * const __restrict fze = fz->_entries;
+                int const nfze = fz->_size;
+                if (nfze <= 0) {
+                    continue; // no entries in first zone
+                }
+
+                // populate secondary zone array with potentially matching zones
+                zones.clear();
+                limits.clear();
+                {
+                    double d = first.getDecomposition().getZoneDecMin(fz->_zone) - radius;
+                    int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
+                    d = first.getDecomposition().getZoneDecMax(fz->_zone) + radius;
+                    int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
+
+                    SecondZone *       sz    = second.firstZone(minz, maxz);
+                    SecondZone * const szend = second.endZone(minz, maxz);
+
+                    for ( ; sz < szend; ++sz) {
+                        int const nsze = sz->_size;
+                        if (nsze > 0) {
+                            zones.push_back(sz);
+                            if ((nsze >> 4) > nfze) {
+                                // second set much larger than first, use binary search in inner loop
+                                limits.push_back(-1);
+                            } else {
+                                // use linear walk in inner loop, find starting point now
+                                limits.push_back(sz->findGte(fze[0]._ra - sz->_deltaRa));
+                            }
+                        }
+                    }
+                }
+                int const nsz = static_cast<int>(zones.size());
+
+                if (nsz == 0) {
+                    // no entries in any potentially matching zones
+                    continue;
+                }
+
+                // loop over entries in first zone
+                for (int fe = 0; fe < nfze; ++fe) {
+
+                    if (!firstFilter(fze[fe])) {
+                        continue; // entry was filtered out
+                    }
+
+                    matches.clear();
+
+                    boost::uint32_t const ra = fze[fe]._ra;
+                    double fx, fy, fz;
+                    fze[fe].getUnitVector(fx, fy, fz);
+
+                    // loop over all potentially matching zones.
+                    for (int szi = 0; szi < nsz; ++szi) {
+
+                        SecondZone * const __restrict sz = zones[szi];
+                        boost::uint32_t const * const __restrict sra = sz->_ra;
+
+                        int const seWrap = sz->_size;
+                        boost::uint32_t const deltaRa = sz->_deltaRa;
+                        boost::uint32_t const deltaRaWrap = -deltaRa;
+
+                        int start = limits[szi];
+                        int se;
+                        boost::uint32_t dra;
+
+                        if (start >= 0) {
+
+                            // use linear walk from last starting point
+                            // to get to first point in ra range
+                            se  = start;
+                            dra = ra - sra[se];
+                            if (dra > deltaRa && dra < deltaRaWrap) {
+
+                                bool cont = false;
+                                do {
+                                    ++se;
+                                    if (se == seWrap) {
+                                        se = 0; // ra wrap around
+                                    }
+                                    if (se == start) {
+                                        cont = true;
+                                        break; // avoid infinite loops
+                                    }
+                                    dra = ra - sra[se];
+                                } while (dra > deltaRa && dra < deltaRaWrap);
+
+                                if (cont) {
+                                    continue; // no starting point found
+                                }
+                                // found starting point -- remember it
+                                limits[szi] = se;
+                            }
+
+                        } else {
+
+                            // use binary search to find starting point
+                            se  = sz->findGte(ra - deltaRa);
+                            dra = ra - sra[se];
+                            if (dra > deltaRa && dra < deltaRaWrap) {
+                                continue; // no starting point found
+                            }
+
+                        }
+
+                        // At this point, entry se is within ra range of fe -- find the
+                        // (possibly wrapped) run of zone entries within ra range
+                        int n = sz->countInRaRange(se, ra, deltaRa);
+
+                        // perform detailed distance tests on the run, which consists
+                        // of at most 2 contiguous segments of the zone columns
+                        while (n > 0) {
+                            int const ns = (se + n > seWrap) ? seWrap - se : n;
+                            if (static_cast<int>(hits.size()) < ns) {
+                                hits.resize(ns);
+                                hitDistances.resize(ns);
+                            }
+                            int const nh = detail::distanceKernel(
+                                sz->_x + se, sz->_y + se, sz->_z + se, ns,
+                                static_cast<Coordinate>(fx),
+                                static_cast<Coordinate>(fy),
+                                static_cast<Coordinate>(fz - sz->_refZ),
+                                kernelLimit, &hits[0], &hitDistances[0]);
+                            SecondEntryT * const __restrict sze = sz->_entries + se;
+                            for (int h = 0; h < nh; ++h) {
+                                double d2 = hitDistances[h];
+                                if (d2 >= d2Low) {
+                                    // borderline candidate -- re-test in double precision
+                                    d2 = sze[hits[h]].exactDistance2(fx, fy, fz);
+                                    if (d2 >= d2Limit) {
+                                        continue;
+                                    }
+                                }
+                                // Note: this isn't necessarily the best place for the second filter test...
+                                if (secondFilter(sze[hits[h]])) {
+                                    // found a match, record it
+                                    matches.push_back(Match(&sze[hits[h]], d2));
+                                }
+                            }
+                            n -= ns;
+                            se = 0; // ra wrap around
+                        }
+
+                    } // end of loop over potentially matching zones
+
+                    // All matches (if any) for fe are found
+                    std::size_t nm = matches.size();
+                    if (nm > 0) {
+                        // pass them on to the match processor
+                        numMatchPairs = numMatchPairs + nm;
+                        matchListProcessor(fze[fe], matches.begin(), matches.end());
+                    }
+
+                } // end of loop over entries in first zone
+
+            } // end of loop over zones in batch
+
+            TimeSpec t1;
+            t1.now() -= t0;
+            scheduler.addBusyTime(thread, t1.seconds());
+
+        } // end of loop over batches
+    } // end of omp parallel
+
+    scheduler.getBusyTimes(busyTimes);
+
+    return numMatchPairs;
+}
+
+
+/**
+ * Spatial cross-match routine -- equivalent to the distanceMatch() overload above, but
+ * discards per-thread timing information.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+inline std::size_t distanceMatch(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    double const              radius,
+    FirstFilterT            & firstFilter,
+    SecondFilterT           & secondFilter,
+    MatchListProcessorT     & matchListProcessor
+) {
+    std::vector<double> busyTimes;
+    return distanceMatch(first, second, radius, firstFilter, secondFilter,
+                         matchListProcessor, busyTimes);
+}
+
+
+namespace detail {
+
+/**
+ * Loads one declination stripe worth of both inputs of stripedDistanceMatch() into a pair of
+ * zone indexes: the zones of the stripe (within the overall match bounds) for the first set,
+ * and the same zones widened by the match radius for the second set.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstLoaderT,
+    typename SecondLoaderT
+>
+struct StripeLoad {
+    ZoneIndex<FirstEntryT>  * _first;
+    ZoneIndex<SecondEntryT> * _second;
+    FirstLoaderT            * _firstLoader;
+    SecondLoaderT           * _secondLoader;
+    double _radius;
+    int _slot;
+    int _minZone;
+    int _maxZone;
+
+    void operator()() const {
+        ZoneStripeChunkDecomposition const & zsc = _first->getDecomposition();
+        double const minDec = zsc.getZoneDecMin(_minZone);
+        double const maxDec = zsc.getZoneDecMax(_maxZone);
+        double const minBand = minDec - _radius;
+        double const maxBand = maxDec + _radius;
+        // zone mid-points are used to avoid rounding a zone boundary into a neighbouring zone
+        _first->setDecBounds(0.5*(minDec + zsc.getZoneDecMax(_minZone)),
+                             0.5*(zsc.getZoneDecMin(_maxZone) + maxDec));
+        _second->setDecBounds(minBand <= -90.0 ? -90.0 : minBand,
+                              maxBand >=  90.0 ?  90.0 : maxBand);
+        // evict whatever stripe was previously loaded into the slot before loading the next
+        _firstLoader->release(_slot);
+        _secondLoader->release(_slot);
+        _firstLoader->load(*_first, _slot, minDec, maxDec);
+        _secondLoader->load(*_second, _slot, minBand <= -90.0 ? -90.0 : minBand,
+                            maxBand >= 90.0 ? 90.0 : maxBand);
+        _first->sort();
+        _second->sort();
+    }
+};
+
+
+/** Releases both load slots of the loaders passed to stripedDistanceMatch(). */
+template <typename FirstLoaderT, typename SecondLoaderT>
+void releaseStripes(FirstLoaderT * firstLoader, SecondLoaderT * secondLoader) {
+    for (int i = 0; i < 2; ++i) {
+        firstLoader->release(i);
+        secondLoader->release(i);
+    }
+}
+
+} // end of namespace detail
+
+
+/**
+ * Out-of-core spatial cross-match routine -- produces the same match lists as distanceMatch(),
+ * but never requires either input to be fully resident in memory. The declination range
+ * [@a minDec, @a maxDec] is processed one stripe of @a zsc at a time: the first set entities
+ * of a stripe are matched against the second set entities of the stripe widened by a
+ * radius-wide overlap band. While a stripe is being matched, the next stripe is loaded into
+ * a second pair of zone indexes by a background thread, so at most two stripes (plus
+ * overlap bands) of each input are resident at any time.
+ *
+ * Entities are obtained from loaders, which must provide the following methods:
+ * @code
+ * void load(ZoneIndex<EntryT> & index, int slot, double minDec, double maxDec);
+ * void release(int slot);
+ * @endcode
+ * @c load inserts entities with declination in [@a minDec, @a maxDec] into @a index (entities
+ * outside of the zones accepted by @a index are discarded, so loading whole chunks is fine).
+ * Anything loaded into a slot (0 or 1) must stay valid until @c release is called for that
+ * slot, which happens before the slot is reused and once matching has finished or failed.
+ * Since loads run on a background thread concurrently with matching, loaders must not share
+ * unprotected state between slots. Zone entries passed to @a matchListProcessor are only valid for the
+ * duration of the call, so match results must be consumed or copied out immediately (a
+ * MatchCollector cannot be used). If a load or @a matchListProcessor fails, both slots are
+ * released before the exception propagates (@a matchListProcessor must not throw in OpenMP
+ * builds, since exceptions cannot escape the parallel regions of distanceMatch()).
+ *
+ * @pre @code radius >= 0 && minDec <= maxDec @endcode
+ *
+ * @param[in] zsc                   Zone/stripe decomposition for both inputs.
+ * @param[in] minDec                Minimum declination of first set entities to match.
+ * @param[in] maxDec                Maximum declination of first set entities to match.
+ * @param[in] radius                The match-radius (in degrees).
+ * @param[in] firstLoader           Loads stripes of the first set of entities.
+ * @param[in] secondLoader          Loads stripes of the second set of entities.
+ * @param[in] firstFilter           A filter on the first set of entities.
+ * @param[in] secondFilter          A filter on the second set of entities.
+ * @param[in] matchListProcessor    A processor for match lists.
+ * @return                          The number of match pairs found.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstLoaderT,
+    typename SecondLoaderT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+std::size_t stripedDistanceMatch(
+    ZoneStripeChunkDecomposition const & zsc,
+    double const                         minDec,
+    double const                         maxDec,
+    double const                         radius,
+    FirstLoaderT                       & firstLoader,
+    SecondLoaderT                      & secondLoader,
+    FirstFilterT                       & firstFilter,
+    SecondFilterT                      & secondFilter,
+    MatchListProcessorT                & matchListProcessor
+) {
+    typedef detail::StripeLoad<FirstEntryT, SecondEntryT, FirstLoaderT, SecondLoaderT> Load;
+
+    if (radius < 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+                          "match radius must be greater than or equal to zero degrees");
+    }
+    if (minDec > maxDec || minDec < -90.0 || maxDec > 90.0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "invalid declination range");
+    }
+
+    int const zpd = zsc.getZonesPerDegree();
+    int const zps = zsc.getZonesPerStripe();
+    int const est = zsc.getMaxEntriesPerZoneEstimate();
+    ZoneIndex<FirstEntryT>  first0(zpd, zps, est);
+    ZoneIndex<FirstEntryT>  first1(zpd, zps, est);
+    ZoneIndex<SecondEntryT> second0(zpd, zps, est);
+    ZoneIndex<SecondEntryT> second1(zpd, zps, est);
+    ZoneIndex<FirstEntryT>  * first[2]  = { &first0, &first1 };
+    ZoneIndex<SecondEntryT> * second[2] = { &second0, &second1 };
+
+    int const minZone   = zsc.decToZone(minDec);
+    int const maxZone   = zsc.decToZone(maxDec);
+    int const minStripe = zsc.decToStripe(minDec);
+    int const maxStripe = zsc.decToStripe(maxDec);
+
+    Load loads[2];
+    for (int i = 0; i < 2; ++i) {
+        loads[i]._first        = first[i];
+        loads[i]._second       = second[i];
+        loads[i]._firstLoader  = &firstLoader;
+        loads[i]._secondLoader = &secondLoader;
+        loads[i]._radius       = radius;
+        loads[i]._slot         = i;
+    }
+
+    std::size_t numMatchPairs = 0;
+
+    // release both slots even if a load or match fails. The guard is triggered after any
+    // in-flight prefetch has been joined (by the destructor of its Thread).
+    ScopeGuard releaseGuard(boost::bind(&detail::releaseStripes<FirstLoaderT, SecondLoaderT>,
+                                        &firstLoader, &secondLoader));
+    loads[0]._minZone = std::max(minZone, zsc.getStripeZoneMin(minStripe));
+    loads[0]._maxZone = std::min(maxZone, zsc.getStripeZoneMax(minStripe));
+    loads[0]();
+    for (int s = minStripe; s <= maxStripe; ++s) {
+        int const slot = (s - minStripe) & 1;
+        boost::scoped_ptr<Thread> prefetch;
+        if (s < maxStripe) {
+            Load & next = loads[slot ^ 1];
+            next._minZone = std::max(minZone, zsc.getStripeZoneMin(s + 1));
+            next._maxZone = std::min(maxZone, zsc.getStripeZoneMax(s + 1));
+            prefetch.reset(new Thread(next));
+        }
+        numMatchPairs += distanceMatch(*first[slot], *second[slot], radius,
+                                       firstFilter, secondFilter, matchListProcessor);
+        if (prefetch) {
+            prefetch->join();
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        first[i]->clear();
+        second[i]->clear();
+    }
+    detail::releaseStripes(&firstLoader, &secondLoader);
+    releaseGuard.dismiss();
+    return numMatchPairs;
+}
+
+
+/**
+ * Spatial cross-match routine -- equivalent to distanceMatch(), except that each entity
+ * in the first set carries its own match radius, obtained by calling
+ * @code double operator()(FirstEntryT const &) @endcode on @a radiusFunction. This allows,
+ * for example, matching each entity out to some multiple of its positional error.
+ *
+ * Radii are evaluated once per (unfiltered) entity. The declination range of second set
+ * zones searched for a first zone is derived from the largest radius of any entity in that
+ * zone, but each entity only tests the zones and right ascension range covered by its own
+ * search circle. The candidate volume of entities with small radii is therefore not
+ * inflated by a few entities with large radii. Compact second set entries are handled as
+ * in distanceMatch(), using the radius of each entity.
+ *
+ * @pre @a radiusFunction returns radii in the range [0, 10) degrees.
+ * @pre Both @a first and @a second have been sorted.
+ *
+ * @param[in] first                 A first set of entities.
+ * @param[in] second                A second set of entities.
+ * @param[in] radiusFunction        Returns the match-radius (in degrees) of a first set entity.
+ * @param[in] firstFilter           A filter on the first set of entities.
+ * @param[in] secondFilter          A filter on the second set of entities.
+ * @param[in] matchListProcessor    A processor for match lists.
+ * @param[out] busyTimes            Set to the time (in seconds) each thread spent matching,
+ *                                  which allows load imbalance to be measured.
+ * @return                          The number of match pairs found.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename RadiusFunctionT,
+    typename FirstFilterT,        // = PassthroughFilter<FirstEntryT>,
+    typename SecondFilterT,       // = PassthroughFilter<SecondEntryT>,
+    typename MatchListProcessorT  // = EmptyMatchListProcessor<FirstEntryT, MatchWithoutDistance<SecondEntryT> >
+>
+std::size_t variableDistanceMatch(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    RadiusFunctionT         & radiusFunction,
+    FirstFilterT            & firstFilter,
+    SecondFilterT           & secondFilter,
+    MatchListProcessorT     & matchListProcessor,
+    std::vector<double>     & busyTimes
+) {
+    typedef typename ZoneIndex<FirstEntryT>::Zone  FirstZone;
+    typedef typename ZoneIndex<SecondEntryT>::Zone SecondZone;
+    typedef typename MatchListProcessorT::Match    Match;
+    typedef typename SecondZone::Coordinate        Coordinate;
+
+    int const minZone  = first.getMinZone();
+    int const maxZone  = first.getMaxZone();
+    int const numZones = maxZone - minZone + 1;
+
+    std::size_t numMatchPairs = 0;
+
+    // evaluate the squared chord length limit and ra search range of every first set entry,
+    // along with the largest radius and the total ra range fraction of every first zone.
+    // Entries that are filtered out or have zero radius are given a negative limit.
+    std::vector<int> offsets(numZones + 1, 0);
+    for (int fzi = minZone; fzi <= maxZone; ++fzi) {
+        offsets[fzi - minZone + 1] = offsets[fzi - minZone] + first.getZone(fzi)->_size;
+    }
+    std::vector<double> entryD2Limits(offsets[numZones]);
+    std::vector<boost::uint32_t> entryDeltaRas(offsets[numZones]);
+    std::vector<double> zoneMaxRadius(numZones, 0.0);
+    std::vector<double> zoneRaFraction(numZones, 0.0);
+    int numInvalid = 0;
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               reduction(+:numInvalid) \
+               schedule(dynamic,4)
+#endif
+    for (int t = 0; t < numZones; ++t) {
+        FirstZone   * const fz  = first.getZone(minZone + t);
+        FirstEntryT * const fze = fz->_entries;
+        int const nfze = fz->_size;
+        double maxRadius  = 0.0;
+        double raFraction = 0.0;
+        for (int fe = 0; fe < nfze; ++fe) {
+            int const i = offsets[t] + fe;
+            entryD2Limits[i] = -1.0;
+            entryDeltaRas[i] = 0;
+            if (!firstFilter(fze[fe])) {
+                continue; // entry was filtered out
+            }
+            double const r = radiusFunction(fze[fe]);
+            if (!(r >= 0.0 && r < 10.0)) {
+                ++numInvalid;
+                continue;
+            }
+            if (r == 0.0) {
+                continue; // nothing can match
+            }
+            double x, y, z;
+            fze[fe].getUnitVector(x, y, z);
+            double const dec = degrees(std::asin(z < -1.0 ? -1.0 : (z > 1.0 ? 1.0 : z)));
+            boost::uint32_t const deltaRa = deltaRaToScaledInteger(maxAlpha(r, dec));
+            entryD2Limits[i] = detail::angleToChord2(radians(r));
+            entryDeltaRas[i] = deltaRa;
+            maxRadius   = (r > maxRadius) ? r : maxRadius;
+            raFraction += detail::expectedRaRangeCount(1, deltaRa);
+        }
+        zoneMaxRadius[t]  = maxRadius;
+        zoneRaFraction[t] = raFraction;
+    }
+    if (numInvalid > 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+                          "match radii must be in the range [0, 10) degrees");
+    }
+
+    // estimate the cost of each first zone as the number of entries it contains plus
+    // the expected number of distance tests performed for them
+    std::vector<double> costs(numZones, 0.0);
+    for (int t = 0; t < numZones; ++t) {
+        FirstZone * const fz = first.getZone(minZone + t);
+        if (fz->_size <= 0 || zoneMaxRadius[t] <= 0.0) {
+            continue;
+        }
+        double d = first.getDecomposition().getZoneDecMin(fz->_zone) - zoneMaxRadius[t];
+        int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
+        d = first.getDecomposition().getZoneDecMax(fz->_zone) + zoneMaxRadius[t];
+        int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
+        SecondZone *       sz    = second.firstZone(minz, maxz);
+        SecondZone * const szend = second.endZone(minz, maxz);
+        double n = 0.0;
+        for ( ; sz < szend; ++sz) {
+            n += sz->_size;
+        }
+        costs[t] = fz->_size + zoneRaFraction[t]*n;
+    }
+    WorkScheduler scheduler(costs, detail::maxThreads());
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs)
+#endif
+    {
+        // allocate per-thread data structures
+        std::vector<SecondZone *> zones;
+        std::vector<double> zoneDecMin;
+        std::vector<double> zoneDecMax;
+        std::vector<Match> matches;
+        std::vector<int> hits(256);
+        std::vector<double> hitDistances(256);
+        matches.reserve(32);
+
+        int const thread = detail::threadNum();
+        int zb = 0;
+        int ze = 0;
+        while (scheduler.next(thread, zb, ze)) {
+
+            TimeSpec t0;
+            t0.now();
+
+            for (int t = zb; t < ze; ++t) {
+
+                FirstZone   * const __restrict fz = first.getZone(minZone + t);
+                FirstEntryT * const __restrict fze = fz->_entries;
+                int const nfze = fz->_size;
+                if (nfze <= 0 || zoneMaxRadius[t] <= 0.0) {
+                    continue; // no entries with a non-zero radius in first zone
+                }
+                double const * const __restrict d2Limits = &entryD2Limits[offsets[t]];
+                boost::uint32_t const * const __restrict deltaRas = &entryDeltaRas[offsets[t]];
+
+                // populate secondary zone arrays with zones that are potentially matched by
+                // the entry with the largest radius, along with their declination bounds
+                zones.clear();
+                zoneDecMin.clear();
+                zoneDecMax.clear();
+                {
+                    double d = first.getDecomposition().getZoneDecMin(fz->_zone) - zoneMaxRadius[t];
+                    int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
+                    d = first.getDecomposition().getZoneDecMax(fz->_zone) + zoneMaxRadius[t];
+                    int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
+
+                    SecondZone *       sz    = second.firstZone(minz, maxz);
+                    SecondZone * const szend = second.endZone(minz, maxz);
+                    for ( ; sz < szend; ++sz) {
+                        if (sz->_size > 0) {
+                            zones.push_back(sz);
+                            zoneDecMin.push_back(radians(second.getDecomposition().getZoneDecMin(sz->_zone)));
+                            zoneDecMax.push_back(radians(second.getDecomposition().getZoneDecMax(sz->_zone)));
+                        }
+                    }
+                }
+                int const nsz = static_cast<int>(zones.size());
+                if (nsz == 0) {
+                    // no entries in any potentially matching zones
+                    continue;
+                }
+
+                // loop over entries in first zone
+                for (int fe = 0; fe < nfze; ++fe) {
+
+                    double const d2Limit = d2Limits[fe];
+                    if (d2Limit < 0.0) {
+                        continue; // entry was filtered out or has a zero radius
+                    }
+
+                    matches.clear();
+
+                    boost::uint32_t const ra = fze[fe]._ra;
+                    boost::uint32_t const deltaRa = deltaRas[fe];
+                    double fx, fy, fz;
+                    fze[fe].getUnitVector(fx, fy, fz);
+                    double const dec = std::asin(fz < -1.0 ? -1.0 : (fz > 1.0 ? 1.0 : fz));
+                    double d2Low;
+                    double d2High;
+                    detail::columnDistanceBounds<SecondEntryT>(d2Limit, d2Low, d2High);
+                    Coordinate const kernelLimit = static_cast<Coordinate>(d2High);
+
+                    // loop over potentially matching zones, skipping those
+                    // that do not intersect the search circle of fe
+                    for (int szi = 0; szi < nsz; ++szi) {
+                        double const sep = (zoneDecMin[szi] > dec) ? zoneDecMin[szi] - dec :
+                                           (dec > zoneDecMax[szi] ? dec - zoneDecMax[szi] : 0.0);
+                        if (sep > 0.0 && detail::angleToChord2(sep) >= d2Limit) {
+                            continue;
+                        }
+
+                        SecondZone * const __restrict sz = zones[szi];
+                        int const seWrap = sz->_size;
+                        int se = sz->findGte(ra - deltaRa);
+                        int n  = sz->countInRaRange(se, ra, deltaRa);
+
+                        while (n > 0) {
+                            int const ns = (se + n > seWrap) ? seWrap - se : n;
+                            if (static_cast<int>(hits.size()) < ns) {
+                                hits.resize(ns);
+                                hitDistances.resize(ns);
+                            }
+                            int const nh = detail::distanceKernel(
+                                sz->_x + se, sz->_y + se, sz->_z + se, ns,
+                                static_cast<Coordinate>(fx),
+                                static_cast<Coordinate>(fy),
+                                static_cast<Coordinate>(fz - sz->_refZ),
+                                kernelLimit, &hits[0], &hitDistances[0]);
+                            SecondEntryT * const __restrict sze = sz->_entries + se;
+                            for (int h = 0; h < nh; ++h) {
+                                double d2 = hitDistances[h];
+                                if (d2 >= d2Low) {
+                                    // borderline candidate -- re-test in double precision
+                                    d2 = sze[hits[h]].exactDistance2(fx, fy, fz);
+                                    if (d2 >= d2Limit) {
+                                        continue;
+                                    }
+                                }
+                                if (secondFilter(sze[hits[h]])) {
+                                    matches.push_back(Match(&sze[hits[h]], d2));
+                                }
+                            }
+                            n -= ns;
+                            se = 0; // ra wrap around
+                        }
+
+                    } // end of loop over potentially matching zones
+
+                    // All matches (if any) for fe are found
+                    std::size_t nm = matches.size();
+                    if (nm > 0) {
+                        // pass them on to the match processor
+                        numMatchPairs = numMatchPairs + nm;
+                        matchListProcessor(fze[fe], matches.begin(), matches.end());
+                    }
+
+                } // end of loop over entries in first zone
+
+            } // end of loop over zones in batch
+
+            TimeSpec t1;
+            t1.now() -= t0;
+            scheduler.addBusyTime(thread, t1.seconds());
+
+        } // end of loop over batches
+    } // end of omp parallel
+
+    scheduler.getBusyTimes(busyTimes);
+
+    return numMatchPairs;
+}
+
+
+/**
+ * Spatial cross-match routine -- equivalent to the variableDistanceMatch() overload above,
+ * but discards per-thread timing information.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename RadiusFunctionT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+inline std::size_t variableDistanceMatch(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    RadiusFunctionT         & radiusFunction,
+    FirstFilterT            & firstFilter,
+    SecondFilterT           & secondFilter,
+    MatchListProcessorT     & matchListProcessor
+) {
+    std::vector<double> busyTimes;
+    return variableDistanceMatch(first, second, radiusFunction, firstFilter, secondFilter,
+                                 matchListProcessor, busyTimes);
+}
+
+
 /**
- * Spatial cross-match routine -- finds match pairs in a first and a second set of
- * entities (both subject to filtering), where both sets consist of points. An entity from
- * the second set is deemed a match to an entity from the first set if the two are within
- * the given angle of eachother. All matches for a given entity in the first set are found
- * at once, and sent off to a match list processor for further inspection.
+ * Spatial cross-match routine -- finds the (at most) @a K nearest neighbours of each entity
+ * in a first set amongst the entities of a second set (both subject to filtering), where
+ * both sets consist of points. Only entities from the second set that are within the given
+ * angle of an entity from the first set are considered. The nearest neighbours of a given
+ * entity are sent off to a match list processor in order of increasing distance.
  *
- * This routine is optimized for the case where few matches are expected for any given entity.
+ * Unlike distanceMatch(), this routine never materializes the full list of matches within
+ * the match radius. Instead, each thread keeps a bounded heap of the @a K nearest candidates
+ * found so far. Once the heap is full, the distance to its farthest candidate becomes the
+ * effective match radius: distance tests are performed against it, and zones are visited
+ * in order of increasing declination separation, so that zones which cannot contain a
+ * nearer candidate are skipped altogether. Work is distributed across threads exactly as
+ * in distanceMatch(). When the second set is compact, candidates are ranked by their distance
+ * recomputed in double precision (see CompactZoneEntry::exactDistance2()).
  *
  * @pre @code radius >= 0 @endcode
+ * @pre Both @a first and @a second have been sorted.
  *
  * @param[in] first                 A first set of entities.
  * @param[in] second                A second set of entities.
  * @param[in] radius                The match-radius (in degrees).
  * @param[in] firstFilter           A filter on the first set of entities.
  * @param[in] secondFilter          A filter on the second set of entities.
- * @param[in] matchListProcessor    A processor for match lists.
+ * @param[in] matchListProcessor    A processor for lists of nearest neighbours.
+ * @param[out] busyTimes            Set to the time (in seconds) each thread spent matching,
+ *                                  which allows load imbalance to be measured.
  * @return                          The number of match pairs found.
  */
 template <
+    int K,
     typename FirstEntryT,
     typename SecondEntryT,
     typename FirstFilterT,        // = PassthroughFilter<FirstEntryT>,
     typename SecondFilterT,       // = PassthroughFilter<SecondEntryT>,
-    typename MatchListProcessorT  // = EmptyMatchListProcessor<FirstEntryT, MatchWithoutDistance<SecondEntryT> >
+    typename MatchListProcessorT  // = EmptyMatchListProcessor<FirstEntryT, MatchWithDistance<SecondEntryT> >
 >
-std::size_t distanceMatch(
+std::size_t nearestMatch(
     ZoneIndex<FirstEntryT>  & first,
     ZoneIndex<SecondEntryT> & second,
     double const              radius,
     FirstFilterT            & firstFilter,
     SecondFilterT           & secondFilter,
-    MatchListProcessorT     & matchListProcessor
+    MatchListProcessorT     & matchListProcessor,
+    std::vector<double>     & busyTimes
 ) {
     typedef typename ZoneIndex<FirstEntryT>::Zone  FirstZone;
     typedef typename ZoneIndex<SecondEntryT>::Zone SecondZone;
     typedef typename MatchListProcessorT::Match    Match;
+    typedef typename SecondZone::Coordinate        Coordinate;
+    typedef detail::NearestCandidate<SecondEntryT> Candidate;
+
+    BOOST_STATIC_ASSERT(K > 0);
 
     if (radius < 0) {
         throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
                           "match radius must be greater than or equal to zero degrees");
     }
 
-    double const shr     = std::sin(radians(radius*0.5));
-    double const d2Limit = 4.0*shr*shr;
+    double const d2Limit = detail::angleToChord2(radians(radius));
     int const minZone = first.getMinZone();
-    int const maxZone = first.getMaxZone();
-    boost::int32_t const deltaDec = deltaDecToScaledInteger(radius);
 
     std::size_t numMatchPairs = 0;
 
     second.computeMatchParams(radius);
 
-    // loop over first set of zones in parallel
+    std::vector<double> costs;
+    detail::estimateZoneCosts(first, second, radius, costs);
+    WorkScheduler scheduler(costs, detail::maxThreads());
+
 #if LSST_AP_HAVE_OPEN_MP
-#   pragma omp parallel default(shared)
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs)
 #endif
     {
         // allocate per-thread data structures
-        SecondZone * zones[2048];
-        int limits[2048];
+        std::vector<SecondZone *> zones;
+        std::vector<double> zoneDecMin;
+        std::vector<double> zoneDecMax;
         std::vector<Match> matches;
-        matches.reserve(32);
-
-        // loop over the first set of zones in parallel, assigning batches of
-        // adjacent zones to threads (for cache coherency)
-#if LSST_AP_HAVE_OPEN_MP
-#   pragma omp for \
-               reduction(+:numMatchPairs) \
-               schedule(static,8)
-#endif
-        for (int fzi = minZone; fzi <= maxZone; ++fzi) {
+        std::vector<int> hits(256);
+        std::vector<double> hitDistances(256);
+        Candidate heap[K];
+        matches.reserve(K);
+
+        int const thread = detail::threadNum();
+        int zb = 0;
+        int ze = 0;
+        while (scheduler.next(thread, zb, ze)) {
+
+            TimeSpec t0;
+            t0.now();
+
+            for (int fzi = minZone + zb; fzi < minZone + ze; ++fzi) {
+
+                FirstZone   * const __restrict fz = first.getZone(fzi);
+                FirstEntryT * const __restrict fze = fz->_entries;
+                int const nfze = fz->_size;
+                if (nfze <= 0) {
+                    continue; // no entries in first zone
+                }
 
-            FirstZone   * const __restrict fz = first.getZone(fzi);
-            FirstEntryT * const __restrict fze = fz->_entries;
-            int const nfze = fz->_size;
-            if (nfze <= 0) {
-                continue; // no entries in first zone
-            }
+                // populate secondary zone arrays with potentially matching zones
+                // and their declination bounds (in radians)
+                zones.clear();
+                zoneDecMin.clear();
+                zoneDecMax.clear();
+                {
+                    double d = first.getDecomposition().getZoneDecMin(fz->_zone) - radius;
+                    int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
+                    d = first.getDecomposition().getZoneDecMax(fz->_zone) + radius;
+                    int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
+
+                    SecondZone *       sz    = second.firstZone(minz, maxz);
+                    SecondZone * const szend = second.endZone(minz, maxz);
+                    for ( ; sz < szend; ++sz) {
+                        if (sz->_size > 0) {
+                            zones.push_back(sz);
+                            zoneDecMin.push_back(radians(second.getDecomposition().getZoneDecMin(sz->_zone)));
+                            zoneDecMax.push_back(radians(second.getDecomposition().getZoneDecMax(sz->_zone)));
+                        }
+                    }
+                }
+                int const nsz = static_cast<int>(zones.size());
+                if (nsz == 0) {
+                    // no entries in any potentially matching zones
+                    continue;
+                }
 
-            // populate secondary zone array with potentially matching zones
-            int nsz = 0;
-            {
-                double d = first.getDecomposition().getZoneDecMin(fz->_zone) - radius;
-                int const minz = second.getDecomposition().decToZone(d <= -90.0 ? -90.0 : d);
-                d = first.getDecomposition().getZoneDecMax(fz->_zone) + radius;
-                int const maxz = second.getDecomposition().decToZone(d >= 90.0 ? 90.0 : d);
-                // A search circle should never cover more than 2048 zones
-                assert(maxz - minz + 1 <= 2048 && "match radius too large");
+                // loop over entries in first zone
+                for (int fe = 0; fe < nfze; ++fe) {
 
-                SecondZone *       __restrict sz    = second.firstZone(minz, maxz);
-                SecondZone * const __restrict szend = second.endZone(minz, maxz);
+                    if (!firstFilter(fze[fe])) {
+                        continue; // entry was filtered out
+                    }
 
-                for ( ; sz < szend; ++sz) {
-                    int const nsze = sz->_size;
-                    if (nsze > 0) {
-                        zones[nsz] = sz;
-                        if ((nsze >> 4) > nfze) {
-                            // second set much larger than first, use binary search in inner loop
-                            limits[nsz] = -1;
+                    boost::uint32_t const ra = fze[fe]._ra;
+                    double fx, fy, fz;
+                    fze[fe].getUnitVector(fx, fy, fz);
+                    double const dec = std::asin(fz < -1.0 ? -1.0 : (fz > 1.0 ? 1.0 : fz));
+
+                    int nc = 0;
+                    double limit = d2Limit;
+                    double limitLow;
+                    double limitHigh;
+                    detail::columnDistanceBounds<SecondEntryT>(limit, limitLow, limitHigh);
+
+                    // visit zones in order of increasing declination separation from fe,
+                    // starting with the first zone not entirely south of fe
+                    int hi = static_cast<int>(std::lower_bound(zoneDecMax.begin(), zoneDecMax.end(), dec) -
+                                              zoneDecMax.begin());
+                    int lo = hi - 1;
+                    while (true) {
+                        double const sepHi = (hi < nsz) ?
+                            detail::angleToChord2(zoneDecMin[hi] > dec ? zoneDecMin[hi] - dec : 0.0) : 4.0;
+                        double const sepLo = (lo >= 0) ?
+                            detail::angleToChord2(dec > zoneDecMax[lo] ? dec - zoneDecMax[lo] : 0.0) : 4.0;
+                        int szi;
+                        if (sepHi <= sepLo) {
+                            if (sepHi >= limit) {
+                                break; // no remaining zone can contain a nearer candidate
+                            }
+                            szi = hi++;
                         } else {
-                            // use linear walk in inner loop, find starting point now
-                            limits[nsz] = sz->findGte(fze[0]._ra - sz->_deltaRa);
+                            if (sepLo >= limit) {
+                                break;
+                            }
+                            szi = lo--;
+                        }
+
+                        SecondZone * const __restrict sz = zones[szi];
+                        boost::uint32_t const deltaRa = sz->_deltaRa;
+                        int const seWrap = sz->_size;
+
+                        int se = sz->findGte(ra - deltaRa);
+                        int n  = sz->countInRaRange(se, ra, deltaRa);
+
+                        // perform detailed distance tests against the current effective radius
+                        while (n > 0) {
+                            int const ns = (se + n > seWrap) ? seWrap - se : n;
+                            if (static_cast<int>(hits.size()) < ns) {
+                                hits.resize(ns);
+                                hitDistances.resize(ns);
+                            }
+                            int const nh = detail::distanceKernel(
+                                sz->_x + se, sz->_y + se, sz->_z + se, ns,
+                                static_cast<Coordinate>(fx),
+                                static_cast<Coordinate>(fy),
+                                static_cast<Coordinate>(fz - sz->_refZ),
+                                static_cast<Coordinate>(limitHigh), &hits[0], &hitDistances[0]);
+                            SecondEntryT * const __restrict sze = sz->_entries + se;
+                            for (int h = 0; h < nh; ++h) {
+                                double d2 = hitDistances[h];
+                                if (limitLow != limitHigh) {
+                                    // candidates are ranked by distance, so always use exact
+                                    // distances for entries with reduced precision columns
+                                    d2 = sze[hits[h]].exactDistance2(fx, fy, fz);
+                                }
+                                if (d2 >= limit || !secondFilter(sze[hits[h]])) {
+                                    continue;
+                                }
+                                if (nc == K) {
+                                    // replace the farthest candidate
+                                    std::pop_heap(heap, heap + K);
+                                    --nc;
+                                }
+                                heap[nc]._d2    = d2;
+                                heap[nc]._entry = &sze[hits[h]];
+                                std::push_heap(heap, heap + ++nc);
+                                if (nc == K) {
+                                    // shrink the effective match radius
+                                    limit = heap[0]._d2;
+                                    detail::columnDistanceBounds<SecondEntryT>(limit, limitLow, limitHigh);
+                                }
+                            }
+                            n -= ns;
+                            se = 0; // ra wrap around
                         }
-                        ++nsz;
+                    } // end of loop over potentially matching zones
+
+                    if (nc > 0) {
+                        // pass the nearest neighbours, ordered by distance, to the match processor
+                        std::sort_heap(heap, heap + nc);
+                        matches.clear();
+                        for (int c = 0; c < nc; ++c) {
+                            matches.push_back(Match(heap[c]._entry, heap[c]._d2));
+                        }
+                        numMatchPairs = numMatchPairs + nc;
+                        matchListProcessor(fze[fe], matches.begin(), matches.end());
                     }
-                }
-            }
 
-            if (nsz == 0) {
-                // no entries in any potentially matching zones
-                continue;
-            }
+                } // end of loop over entries in first zone
 
-            // loop over entries in first zone
-            for (int fe = 0; fe < nfze; ++fe) {
+            } // end of loop over zones in batch
 
-                if (!firstFilter(fze[fe])) {
-                    continue; // entry was filtered out
-                }
+            TimeSpec t1;
+            t1.now() -= t0;
+            scheduler.addBusyTime(thread, t1.seconds());
 
-                matches.clear();
+        } // end of loop over batches
+    } // end of omp parallel
+
+    scheduler.getBusyTimes(busyTimes);
+
+    return numMatchPairs;
+}
+
+
+/**
+ * Spatial cross-match routine -- equivalent to the nearestMatch() overload above, but
+ * discards per-thread timing information.
+ */
+template <
+    int K,
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+inline std::size_t nearestMatch(
+    ZoneIndex<FirstEntryT>  & first,
+    ZoneIndex<SecondEntryT> & second,
+    double const              radius,
+    FirstFilterT            & firstFilter,
+    SecondFilterT           & secondFilter,
+    MatchListProcessorT     & matchListProcessor
+) {
+    std::vector<double> busyTimes;
+    return nearestMatch<K>(first, second, radius, firstFilter, secondFilter,
+                           matchListProcessor, busyTimes);
+}
 
-                boost::uint32_t const ra  = fze[fe]._ra;
-                boost::int32_t  const dec = fze[fe]._dec;
-                double const fx = fze[fe]._x;
-                double const fy = fze[fe]._y;
-                double const fz = fze[fe]._z;
 
-                // loop over all potentially matching zones.
-                for (int szi = 0; szi < nsz; ++szi) {
+/**
+ * Spatial self-match routine -- finds all pairs of distinct entities in a single set of
+ * points (subject to filtering) that are within the given angle of eachother, and sends
+ * them off to a match pair processor in no particular order.
+ *
+ * Calling distanceMatch() with the same index for both sets visits every pair twice and
+ * compares each entry with itself. This routine visits each unordered pair exactly once:
+ * for every entry, only zones north of the entry's zone are searched over their full
+ * right ascension range, whereas the entry's own zone is searched only from the entry
+ * onwards (in order of increasing right ascension, with wrap-around). Zones are split into
+ * batches of adjacent zones with roughly equal estimated cost, and handed out to threads
+ * by a WorkScheduler. Compact entries are handled as in distanceMatch().
+ *
+ * @pre @code radius >= 0 @endcode
+ * @pre @a index has been sorted.
+ *
+ * @param[in] index                 A set of entities.
+ * @param[in] radius                The match-radius (in degrees).
+ * @param[in] filter                A filter on the set of entities.
+ * @param[in] matchPairProcessor    A processor for match pairs.
+ * @param[out] busyTimes            Set to the time (in seconds) each thread spent matching,
+ *                                  which allows load imbalance to be measured.
+ * @return                          The number of match pairs found.
+ */
+template <
+    typename EntryT,
+    typename FilterT,             // = PassthroughFilter<EntryT>,
+    typename MatchPairProcessorT  // = EmptyMatchPairProcessor<EntryT, EntryT>
+>
+std::size_t distanceSelfMatch(
+    ZoneIndex<EntryT>   & index,
+    double const          radius,
+    FilterT             & filter,
+    MatchPairProcessorT & matchPairProcessor,
+    std::vector<double> & busyTimes
+) {
+    typedef typename ZoneIndex<EntryT>::Zone Zone;
+    typedef typename Zone::Coordinate        Coordinate;
 
-                    SecondZone   * const __restrict sz  = zones[szi];
-                    SecondEntryT * const __restrict sze = sz->_entries;
+    if (radius < 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+                          "match radius must be greater than or equal to zero degrees");
+    }
 
-                    int const seWrap = sz->_size;
-                    boost::uint32_t const deltaRa = sz->_deltaRa;
-                    boost::uint32_t const deltaRaWrap = -deltaRa;
+    double const d2Limit = detail::angleToChord2(radians(radius));
+    int const minZone = index.getMinZone();
+    int const maxZone = index.getMaxZone();
+    ZoneStripeChunkDecomposition const & zsc = index.getDecomposition();
 
-                    int start = limits[szi];
-                    int se;
-                    boost::uint32_t dra;
+    // candidates with column distances between the square roots of d2Low and d2High
+    // are re-tested exactly (see distanceMatch())
+    double d2Low;
+    double d2High;
+    detail::columnDistanceBounds<EntryT>(d2Limit, d2Low, d2High);
+    Coordinate const kernelLimit = static_cast<Coordinate>(d2High);
 
-                    if (start >= 0) {
+    std::size_t numMatchPairs = 0;
 
-                        // use linear walk from last starting point
-                        // to get to first point in ra range
-                        se  = start;
-                        dra = ra - sze[se]._ra;
-                        if (dra > deltaRa && dra < deltaRaWrap) {
+    index.computeMatchParams(radius);
 
-                            bool cont = false;
-                            do {
-                                ++se;
-                                if (se == seWrap) {
-                                    se = 0; // ra wrap around
-                                }
-                                if (se == start) {
-                                    cont = true;
-                                    break; // avoid infinite loops
-                                }
-                                dra = ra - sze[se]._ra;
-                            } while (dra > deltaRa && dra < deltaRaWrap);
+    // estimate the cost of each zone as the number of entries it contains times the
+    // expected number of distance tests per entry (half the expected number of tests
+    // within the zone itself, plus the expected number of tests in zones to the north)
+    std::vector<double> costs(maxZone - minZone + 1, 0.0);
+    for (int zi = minZone; zi <= maxZone; ++zi) {
+        Zone * const z = index.getZone(zi);
+        if (z->_size <= 0) {
+            continue;
+        }
+        double const d = zsc.getZoneDecMax(z->_zone) + radius;
+        int const maxz = zsc.decToZone(d >= 90.0 ? 90.0 : d);
+        double c = 1.0 + 0.5*detail::expectedRaRangeCount(z->_size, z->_deltaRa);
+        for (Zone * sz = z + 1; sz < index.endZone(zi, maxz); ++sz) {
+            c += detail::expectedRaRangeCount(sz->_size, sz->_deltaRa);
+        }
+        costs[zi - minZone] = z->_size*c;
+    }
+    WorkScheduler scheduler(costs, detail::maxThreads());
 
-                            if (cont) {
-                                continue; // no starting point found
-                            }
-                            // found starting point -- remember it
-                            limits[szi] = se;
-                            start = se;
-                        }
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs)
+#endif
+    {
+        // allocate per-thread data structures
+        std::vector<int> hits(256);
+        std::vector<double> hitDistances(256);
 
-                    } else {
+        int const thread = detail::threadNum();
+        int zb = 0;
+        int ze = 0;
+        while (scheduler.next(thread, zb, ze)) {
 
-                        // use binary search to find starting point
-                        start = sz->findGte(ra - deltaRa);
-                        se    = start;
-                        dra   = ra - sze[se]._ra;
-                        if (dra > deltaRa && dra < deltaRaWrap) {
-                            continue; // no starting point found
-                        }
+            TimeSpec t0;
+            t0.now();
+
+            for (int zi = minZone + zb; zi < minZone + ze; ++zi) {
 
+                Zone   * const __restrict z  = index.getZone(zi);
+                EntryT * const __restrict entries = z->_entries;
+                boost::uint32_t const * const __restrict zra = z->_ra;
+                int const nze = z->_size;
+                if (nze <= 0) {
+                    continue; // no entries in zone
+                }
+                boost::uint32_t const zDeltaRa = z->_deltaRa;
+
+                // potentially matching zones to the north
+                Zone * szbegin = z + 1;
+                Zone * szend   = szbegin;
+                {
+                    double const d = zsc.getZoneDecMax(z->_zone) + radius;
+                    int const maxz = zsc.decToZone(d >= 90.0 ? 90.0 : d);
+                    if (maxz > zi) {
+                        szend = index.endZone(zi + 1, maxz);
                     }
+                }
 
-                    // At this point, entry se is within ra range of fe --
-                    // loop over all zone entries within ra range
-                    do {
-
-                        // test whether entry se is within dec range
-                        if (abs(dec - sze[se]._dec) <= deltaDec) {
-                            // yes -- perform detailed distance test
-                            double xd = (fx - sze[se]._x);
-                            double yd = (fy - sze[se]._y);
-                            double zd = (fz - sze[se]._z);
-                            double d2 = xd*xd + yd*yd + zd*zd;
-                            if (d2 < d2Limit) {
-                                // Note: this isn't necessarily the best place for the second filter test...
-                                if (secondFilter(sze[se])) {
-                                    // found a match, record it
-                                    matches.push_back(Match(&sze[se], d2));
-                                }
+                // loop over entries in zone
+                for (int e = 0; e < nze; ++e) {
+
+                    if (!filter(entries[e])) {
+                        continue; // entry was filtered out
+                    }
+
+                    boost::uint32_t const ra = zra[e];
+                    double fx, fy, fz;
+                    entries[e].getUnitVector(fx, fy, fz);
+
+                    // find entries following e in the same zone. If the ra range of the zone
+                    // covers half the circle or more, all entries with larger indexes are
+                    // candidates. Otherwise, candidates are the (possibly wrapped) run of
+                    // entries within deltaRa of e in the direction of increasing ra.
+                    int n = 0;
+                    if (zDeltaRa >= 0x80000000u) {
+                        n = nze - e - 1;
+                    } else {
+                        for (int se = e + 1; n < nze - 1; ++n, ++se) {
+                            if (se == nze) {
+                                se = 0; // ra wrap around
+                            }
+                            if (zra[se] - ra > zDeltaRa) {
+                                break;
                             }
                         }
-                        ++se;
-                        if (se == seWrap) {
+                    }
+                    int se = e + 1;
+                    while (n > 0) {
+                        if (se == nze) {
                             se = 0; // ra wrap around
                         }
-                        if (se == start) {
-                            break; // avoid infinite loops
+                        int const ns = (se + n > nze) ? nze - se : n;
+                        if (static_cast<int>(hits.size()) < ns) {
+                            hits.resize(ns);
+                            hitDistances.resize(ns);
+                        }
+                        int const nh = detail::distanceKernel(
+                            z->_x + se, z->_y + se, z->_z + se, ns,
+                            static_cast<Coordinate>(fx),
+                            static_cast<Coordinate>(fy),
+                            static_cast<Coordinate>(fz - z->_refZ),
+                            kernelLimit, &hits[0], &hitDistances[0]);
+                        for (int h = 0; h < nh; ++h) {
+                            int const s = se + hits[h];
+                            // after wrapping around, entries with the same ra as e precede e
+                            // in the zone; these pairs are visited from the earlier entry
+                            if (s < e && zra[s] == ra) {
+                                continue;
+                            }
+                            if (hitDistances[h] >= d2Low &&
+                                entries[s].exactDistance2(fx, fy, fz) >= d2Limit) {
+                                continue;
+                            }
+                            if (filter(entries[s])) {
+                                matchPairProcessor(entries[e], entries[s]);
+                                ++numMatchPairs;
+                            }
                         }
-                        dra = ra - sze[se]._ra;
+                        n  -= ns;
+                        se += ns;
+                    }
 
-                    } while (dra <= deltaRa || dra >= deltaRaWrap);
+                    // loop over potentially matching zones to the north
+                    for (Zone * __restrict sz = szbegin; sz < szend; ++sz) {
+                        int const seWrap = sz->_size;
+                        if (seWrap == 0) {
+                            continue;
+                        }
+                        boost::uint32_t const deltaRa = sz->_deltaRa;
+                        int se = sz->findGte(ra - deltaRa);
+                        int n  = sz->countInRaRange(se, ra, deltaRa);
+                        while (n > 0) {
+                            int const ns = (se + n > seWrap) ? seWrap - se : n;
+                            if (static_cast<int>(hits.size()) < ns) {
+                                hits.resize(ns);
+                                hitDistances.resize(ns);
+                            }
+                            int const nh = detail::distanceKernel(
+                                sz->_x + se, sz->_y + se, sz->_z + se, ns,
+                                static_cast<Coordinate>(fx),
+                                static_cast<Coordinate>(fy),
+                                static_cast<Coordinate>(fz - sz->_refZ),
+                                kernelLimit, &hits[0], &hitDistances[0]);
+                            EntryT * const __restrict sze = sz->_entries + se;
+                            for (int h = 0; h < nh; ++h) {
+                                if (hitDistances[h] >= d2Low &&
+                                    sze[hits[h]].exactDistance2(fx, fy, fz) >= d2Limit) {
+                                    continue; // borderline candidate failed the exact re-test
+                                }
+                                if (filter(sze[hits[h]])) {
+                                    matchPairProcessor(entries[e], sze[hits[h]]);
+                                    ++numMatchPairs;
+                                }
+                            }
+                            n -= ns;
+                            se = 0; // ra wrap around
+                        }
+                    } // end of loop over potentially matching zones
 
-                } // end of loop over potentially matching zones
+                } // end of loop over entries in zone
 
-                // All matches (if any) for fe are found
-                std::size_t nm = matches.size();
-                if (nm > 0) {
-                    // pass them on to the match processor
-                    numMatchPairs = numMatchPairs + nm;
-                    matchListProcessor(fze[fe], matches.begin(), matches.end());
-                }
+            } // end of loop over zones in batch
 
-            } // end of loop over entries in first zone
+            TimeSpec t1;
+            t1.now() -= t0;
+            scheduler.addBusyTime(thread, t1.seconds());
 
-        } // end of omp for
+        } // end of loop over batches
     } // end of omp parallel
 
+    scheduler.getBusyTimes(busyTimes);
+
     return numMatchPairs;
 }
 
 
+/**
+ * Spatial self-match routine -- equivalent to the distanceSelfMatch() overload above,
+ * but discards per-thread timing information.
+ */
+template <typename EntryT, typename FilterT, typename MatchPairProcessorT>
+inline std::size_t distanceSelfMatch(
+    ZoneIndex<EntryT>   & index,
+    double const          radius,
+    FilterT             & filter,
+    MatchPairProcessorT & matchPairProcessor
+) {
+    std::vector<double> busyTimes;
+    return distanceSelfMatch(index, radius, filter, matchPairProcessor, busyTimes);
+}
+
+
 /**
  * Spatial cross-match routine -- finds match pairs in a first and a second set of entities
  * (both subject to filtering), where the first set consists of ellipses and the second of
@@ -439,35 +1898,32 @@ std::size_t ellipseMatch(
 #endif
             if (seWrap > 0) {
                 // find entries within ra range of the active ellipse
-                boost::uint32_t const ra          = active->_ra;
-                boost::uint32_t const deltaRa     = active->_deltaRa;
-                boost::uint32_t const deltaRaWrap = -deltaRa;
-                int const start = sz->findGte(ra - deltaRa);
-
-                int se  = start;
-                boost::uint32_t dra = ra - sze[se]._ra;
-                while (dra <= deltaRa || dra >= deltaRaWrap) {
-
-                    // check whether entry is within dec range
-                    boost::int32_t const dec = sze[se]._dec;
-                    if (dec >= active->_minDec && dec <= active->_maxDec) {
-                        // perform detailed in ellipse test
-                        if (active->contains(sze[se]._x, sze[se]._y, sze[se]._z)) {
-                            if (secondFilter(sze[se])) {
-                                // process match pair
-                                matchPairProcessor(*active, sze[se]);
-                                ++numMatchPairs;
-                            }
+                boost::uint32_t const ra      = active->_ra;
+                boost::uint32_t const deltaRa = active->_deltaRa;
+                int se = sz->findGte(ra - deltaRa);
+                int n  = sz->countInRaRange(se, ra, deltaRa);
+
+                // perform detailed in ellipse tests on batches of consecutive entries
+                while (n > 0) {
+                    int ns = (se + n > seWrap) ? seWrap - se : n;
+                    if (ns > Ellipse<FirstEntryT>::MAX_BATCH) {
+                        ns = Ellipse<FirstEntryT>::MAX_BATCH;
+                    }
+                    boost::uint64_t mask = active->contains(sz->_x + se, sz->_y + se, sz->_z + se, ns);
+                    while (mask != 0) {
+                        int const e = se + detail::lowestSetBit(mask);
+                        mask &= mask - 1;
+                        if (secondFilter(sze[e])) {
+                            // process match pair
+                            matchPairProcessor(*active, sze[e]);
+                            ++numMatchPairs;
                         }
                     }
-                    ++se;
+                    n  -= ns;
+                    se += ns;
                     if (se == seWrap) {
                         se = 0; // ra wrap around
                     }
-                    if (se == start) {
-                        break; // avoid infinite loops
-                    }
-                    dra = ra - sze[se]._ra;
                 }
             }
 
@@ -511,6 +1967,81 @@ std::size_t ellipseMatch(
 }
 
 
+/**
+ * @brief  Time spent by ellipseGroupedMatch() on each size class of ellipses.
+ *
+ * Small ellipses are handed out to threads in batches of adjacent ellipses. Large ellipses
+ * (those covering at least LARGE_ELLIPSE_ZONES zones) are split into one task per covered
+ * zone, and tasks are handed out to threads independently of the ellipse they belong to.
+ */
+struct EllipseClassTimes {
+    static int const LARGE_ELLIPSE_ZONES = 16;
+
+    int    _numSmall;    ///< number of small ellipses that passed the filter
+    int    _numLarge;    ///< number of large ellipses that passed the filter
+    int    _numTasks;    ///< number of per-zone tasks large ellipses were split into
+    double _smallTime;   ///< wall-clock time (in seconds) spent matching small ellipses
+    double _largeTime;   ///< wall-clock time (in seconds) spent matching large ellipses
+    double _mergeTime;   ///< wall-clock time (in seconds) spent merging and processing large
+                         ///  ellipse match lists
+
+    EllipseClassTimes() :
+        _numSmall(0), _numLarge(0), _numTasks(0),
+        _smallTime(0.0), _largeTime(0.0), _mergeTime(0.0)
+    {}
+};
+
+
+namespace detail {
+
+/**
+ * Appends matches for the given ellipse from a single zone of entities to @a matches, in
+ * order of increasing right ascension (starting from the western edge of the ellipse).
+ */
+template <typename FirstEntryT, typename SecondZoneT, typename SecondFilterT, typename MatchT>
+inline void ellipseZoneMatch(
+    Ellipse<FirstEntryT> const & ell,
+    SecondZoneT                & zone,
+    SecondFilterT              & secondFilter,
+    std::vector<MatchT>        & matches
+) {
+    int const seWrap = zone._size;
+    if (seWrap == 0) {
+        return;
+    }
+    boost::uint32_t const ra      = ell._ra;
+    boost::uint32_t const deltaRa = ell._deltaRa;
+
+    // find starting point within ra range of the ellipse
+    int se = zone.findGte(ra - deltaRa);
+    int n  = zone.countInRaRange(se, ra, deltaRa);
+
+    // perform detailed in ellipse tests on batches of consecutive entries
+    while (n > 0) {
+        int ns = (se + n > seWrap) ? seWrap - se : n;
+        if (ns > Ellipse<FirstEntryT>::MAX_BATCH) {
+            ns = Ellipse<FirstEntryT>::MAX_BATCH;
+        }
+        boost::uint64_t mask = ell.contains(zone._x + se, zone._y + se, zone._z + se, ns);
+        while (mask != 0) {
+            int const e = se + lowestSetBit(mask);
+            mask &= mask - 1;
+            if (secondFilter(zone._entries[e])) {
+                // record match
+                matches.push_back(MatchT(&zone._entries[e]));
+            }
+        }
+        n  -= ns;
+        se += ns;
+        if (se == seWrap) {
+            se = 0; // ra wrap around
+        }
+    }
+}
+
+} // end of namespace detail
+
+
 /**
  * Spatial cross-match routine -- finds match pairs in a first and a second set of entities
  * (both subject to filtering), where the first set consists of ellipses and the second of
@@ -518,11 +2049,23 @@ std::size_t ellipseMatch(
  * is within the ellipse defined by the first entity. All matches for a given ellipse are found
  * at once and sent off to a match list processor for further inspection.
  *
+ * Ellipses are partitioned into two size classes. Small ellipses are split into batches of
+ * adjacent ellipses with roughly equal estimated cost, and handed out to threads by a
+ * WorkScheduler. A single large ellipse (e.g. the position error ellipse of a badly
+ * constrained orbit) can cover hundreds of zones, and would serialize the tail of the small
+ * ellipse loop. Large ellipses are therefore split into one task per covered zone, tasks are
+ * scheduled independently, and the per-zone match lists of each large ellipse are then merged
+ * (in zone order) before being handed to the match list processor.
+ *
  * @param[in] first                 A first set of entities.
  * @param[in] second                A second set of entities.
  * @param[in] firstFilter           A filter on the first set of entities.
  * @param[in] secondFilter          A filter on the second set of entities.
  * @param[in] matchListProcessor    A processor for match lists.
+ * @param[out] busyTimes            Set to the time (in seconds) each thread spent matching,
+ *                                  which allows load imbalance to be measured.
+ * @param[out] classTimes           Set to the number of ellipses in and time spent on
+ *                                  each size class.
  * @return                          The number of match pairs found.
  */
 template <
@@ -537,99 +2080,240 @@ std::size_t ellipseGroupedMatch(
     ZoneIndex<SecondEntryT>  & second,
     FirstFilterT             & firstFilter,
     SecondFilterT            & secondFilter,
-    MatchListProcessorT      & matchListProcessor
+    MatchListProcessorT      & matchListProcessor,
+    std::vector<double>      & busyTimes,
+    EllipseClassTimes        & classTimes
 ) {
     typedef typename ZoneIndex<SecondEntryT>::Zone SecondZone;
     typedef typename MatchListProcessorT::Match Match;
 
-    std::size_t const numEllipses   = first.size();
-    std::size_t       numMatchPairs = 0;
+    int const numEllipses = static_cast<int>(first.size());
+    std::size_t numMatchPairs = 0;
 
     first.prepareForMatch(second.getDecomposition());
+    classTimes = EllipseClassTimes();
+
+    // partition ellipses into size classes. The cost of a small ellipse is estimated as the
+    // expected number of entries within its ra range, summed over the zones it covers. Large
+    // ellipses are split into per-zone tasks, each with a cost estimated in the same way.
+    // Ellipses are sorted by minimum zone, so batches of adjacent small ellipses (and of
+    // adjacent tasks) touch nearby zones.
+    std::vector<double> costs(numEllipses, 0.0);
+    std::vector<char> large(numEllipses, 0);
+    std::vector<int> largeEllipses;
+    std::vector<int> taskOffsets(1, 0); ///< tasks for large ellipse i: [taskOffsets[i], taskOffsets[i + 1])
+    std::vector<SecondZone *> taskZones;
+    std::vector<double> taskCosts;
+    for (int i = 0; i < numEllipses; ++i) {
+        Ellipse<FirstEntryT> & ell = first[i];
+        SecondZone *       sz    = second.firstZone(ell._minZone, ell._maxZone);
+        SecondZone * const szend = second.endZone(ell._minZone, ell._maxZone);
+        if (szend - sz < EllipseClassTimes::LARGE_ELLIPSE_ZONES) {
+            double c = 1.0;
+            for ( ; sz < szend; ++sz) {
+                c += detail::expectedRaRangeCount(sz->_size, ell._deltaRa);
+            }
+            costs[i] = c;
+        } else if (firstFilter(ell)) {
+            large[i] = 1;
+            largeEllipses.push_back(i);
+            for ( ; sz < szend; ++sz) {
+                taskZones.push_back(sz);
+                taskCosts.push_back(1.0 + detail::expectedRaRangeCount(sz->_size, ell._deltaRa));
+            }
+            taskOffsets.push_back(static_cast<int>(taskZones.size()));
+        } else {
+            large[i] = 1; // filtered out
+        }
+    }
+    int const numLarge = static_cast<int>(largeEllipses.size());
+    int const numTasks = static_cast<int>(taskZones.size());
+    classTimes._numLarge = numLarge;
+    classTimes._numTasks = numTasks;
+
+    // match small ellipses
+    int numSmall = 0;
+    Stopwatch smallWatch(true);
+    WorkScheduler scheduler(costs, detail::maxThreads());
 
 #if LSST_AP_HAVE_OPEN_MP
-#   pragma omp parallel default(shared)
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs, numSmall)
 #endif
     {
         // allocate per-thread match list
         std::vector<Match> matches;
         matches.reserve(2048);
 
-        // loop over the list of ellipses in parallel
-#if LSST_AP_HAVE_OPEN_MP
-#   pragma omp for \
-               reduction(+:numMatchPairs) \
-               schedule(static,128)
-#endif
-        for (std::size_t i = 0; i < numEllipses; ++i) {
-
-            if (!firstFilter(first[i])) {
-                continue; // ellipse was filtered out
-            }
+        // obtain batches of adjacent ellipses with roughly equal cost from the scheduler,
+        // stealing from other threads once the batches assigned to this thread are exhausted
+        int const thread = detail::threadNum();
+        int eb = 0;
+        int ee = 0;
+        while (scheduler.next(thread, eb, ee)) {
 
-            Ellipse<FirstEntryT> * const __restrict ell = &first[i];
-            SecondZone * __restrict sz = second.firstZone(ell->_minZone, ell->_maxZone);
-            SecondZone * const __restrict szend = second.endZone(ell->_minZone, ell->_maxZone);
+            TimeSpec t0;
+            t0.now();
 
-            boost::uint32_t const ra          = ell->_ra;
-            boost::uint32_t const deltaRa     = ell->_deltaRa;
-            boost::uint32_t const deltaRaWrap = -deltaRa;
+            for (int i = eb; i < ee; ++i) {
 
-            matches.clear();
+                if (large[i] != 0 || !firstFilter(first[i])) {
+                    continue; // ellipse is large or was filtered out
+                }
+                numSmall = numSmall + 1;
 
-            // loop over zones covered by the ellipse
-            for ( ; sz < szend; ++sz) {
+                Ellipse<FirstEntryT> & ell = first[i];
+                SecondZone * sz = second.firstZone(ell._minZone, ell._maxZone);
+                SecondZone * const szend = second.endZone(ell._minZone, ell._maxZone);
 
-                int const seWrap = sz->_size;
-                if (seWrap == 0) {
-                    continue;
+                // loop over zones covered by the ellipse
+                matches.clear();
+                for ( ; sz < szend; ++sz) {
+                    detail::ellipseZoneMatch(ell, *sz, secondFilter, matches);
                 }
 
-                // find starting point within ra range of the ellipse
-                SecondEntryT * const __restrict sze = sz->_entries;
-                int const start = sz->findGte(ra - deltaRa);
-                int se = start;
-                boost::uint32_t dra = ra - sze[se]._ra;
-
-                while (dra <= deltaRa || dra >= deltaRaWrap) {
-
-                    // check whether entry is within dec range
-                    boost::int32_t const dec = sze[se]._dec;
-                    if (dec >= ell->_minDec && dec <= ell->_maxDec) {
-                        // perform detailed in ellipse test
-                        if (ell->contains(sze[se]._x, sze[se]._y, sze[se]._z)) {
-                            if (secondFilter(sze[se])) {
-                                // record match
-                                matches.push_back(Match(&sze[se]));
-                            }
-                        }
-                    }
-                    ++se;
-                    if (se == seWrap) {
-                        se = 0; // ra wrap around
-                    }
-                    if (se == start) {
-                        break; // avoid infinite loops
-                    }
-                    dra = ra - sze[se]._ra;
+                // All matches (if any) for ell are found
+                std::size_t nm = matches.size();
+                if (nm > 0) {
+                    // pass them on to the match processor
+                    numMatchPairs = numMatchPairs + nm;
+                    matchListProcessor(ell, matches.begin(), matches.end());
                 }
+
+            } // end of loop over ellipses in batch
+
+            TimeSpec t1;
+            t1.now() -= t0;
+            scheduler.addBusyTime(thread, t1.seconds());
+
+        } // end of loop over batches
+    } // end of omp parallel
+
+    classTimes._numSmall  = numSmall;
+    classTimes._smallTime = smallWatch.seconds();
+    scheduler.getBusyTimes(busyTimes);
+    if (numLarge == 0) {
+        return numMatchPairs;
+    }
+
+    // match large ellipses, one zone per task
+    Stopwatch largeWatch(true);
+    std::vector<std::vector<Match> > taskMatches(numTasks);
+    std::vector<int> taskEllipses(numTasks);
+    for (int l = 0; l < numLarge; ++l) {
+        std::fill(taskEllipses.begin() + taskOffsets[l], taskEllipses.begin() + taskOffsets[l + 1],
+                  largeEllipses[l]);
+    }
+    WorkScheduler taskScheduler(taskCosts, detail::maxThreads());
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared)
+#endif
+    {
+        int const thread = detail::threadNum();
+        int tb = 0;
+        int te = 0;
+        while (taskScheduler.next(thread, tb, te)) {
+            TimeSpec t0;
+            t0.now();
+            for (int t = tb; t < te; ++t) {
+                detail::ellipseZoneMatch(first[taskEllipses[t]], *taskZones[t], secondFilter, taskMatches[t]);
             }
+            TimeSpec t1;
+            t1.now() -= t0;
+            taskScheduler.addBusyTime(thread, t1.seconds());
+        }
+    } // end of omp parallel
+
+    classTimes._largeTime = largeWatch.seconds();
+    std::vector<double> taskBusyTimes;
+    taskScheduler.getBusyTimes(taskBusyTimes);
+    for (std::size_t i = 0; i < busyTimes.size() && i < taskBusyTimes.size(); ++i) {
+        busyTimes[i] += taskBusyTimes[i];
+    }
+
+    // merge per-zone match lists of each large ellipse and hand them to the match processor
+    Stopwatch mergeWatch(true);
 
-            // All matches (if any) for ell are found
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared) \
+                        reduction(+:numMatchPairs)
+#endif
+    {
+        std::vector<Match> matches;
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp for schedule(dynamic,1)
+#endif
+        for (int l = 0; l < numLarge; ++l) {
+            matches.clear();
+            for (int t = taskOffsets[l]; t < taskOffsets[l + 1]; ++t) {
+                matches.insert(matches.end(), taskMatches[t].begin(), taskMatches[t].end());
+                std::vector<Match>().swap(taskMatches[t]);
+            }
             std::size_t nm = matches.size();
             if (nm > 0) {
-                // pass them on to the match processor
                 numMatchPairs = numMatchPairs + nm;
-                matchListProcessor(*ell, matches.begin(), matches.end());
+                matchListProcessor(first[largeEllipses[l]], matches.begin(), matches.end());
             }
-
         } // end of omp for
     } // end of omp parallel
 
+    classTimes._mergeTime = mergeWatch.seconds();
+
     return numMatchPairs;
 }
 
 
+/**
+ * Spatial cross-match routine -- equivalent to the ellipseGroupedMatch() overload above,
+ * but discards per size class timing information.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+inline std::size_t ellipseGroupedMatch(
+    EllipseList<FirstEntryT> & first,
+    ZoneIndex<SecondEntryT>  & second,
+    FirstFilterT             & firstFilter,
+    SecondFilterT            & secondFilter,
+    MatchListProcessorT      & matchListProcessor,
+    std::vector<double>      & busyTimes
+) {
+    EllipseClassTimes classTimes;
+    return ellipseGroupedMatch(first, second, firstFilter, secondFilter,
+                               matchListProcessor, busyTimes, classTimes);
+}
+
+
+/**
+ * Spatial cross-match routine -- equivalent to the ellipseGroupedMatch() overload above,
+ * but discards per-thread timing information.
+ */
+template <
+    typename FirstEntryT,
+    typename SecondEntryT,
+    typename FirstFilterT,
+    typename SecondFilterT,
+    typename MatchListProcessorT
+>
+inline std::size_t ellipseGroupedMatch(
+    EllipseList<FirstEntryT> & first,
+    ZoneIndex<SecondEntryT>  & second,
+    FirstFilterT             & firstFilter,
+    SecondFilterT            & secondFilter,
+    MatchListProcessorT      & matchListProcessor
+) {
+    std::vector<double> busyTimes;
+    return ellipseGroupedMatch(first, second, firstFilter, secondFilter,
+                               matchListProcessor, busyTimes);
+}
+
+
 }}  // end of namespace lsst::ap
 
 #endif // LSST_AP_MATCH_H
@@ -0,0 +1,251 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Proper motion correction of object positions, and zone indexes of object chunks.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_OBJECT_INDEX_H
+#define LSST_AP_OBJECT_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/noncopyable.hpp"
+
+#include "Common.h"
+#include "ChunkManager.h"
+#include "Object.h"
+#include "SpatialUtil.h"
+#include "ZoneTypes.h"
+
+
+namespace lsst { namespace ap { namespace detail {
+
+typedef SharedObjectChunkManager::ObjectChunk ObjectChunk;
+
+typedef std::vector<ObjectChunk> ObjectChunkVector;
+
+typedef ZoneEntry<ObjectChunk> ObjectEntry;
+
+typedef ZoneIndex<ObjectEntry> ObjectIndex;
+
+
+// -- Proper motion correction for objects ----------------
+
+std::pair<double, double> correctProperMotion(Object const & obj, double const epoch);
+
+
+/** @return the total proper motion (mas/year) of the given object */
+inline double totalProperMotion(Object const & obj) {
+    double const muRa   = obj.getMuRa();
+    double const muDecl = obj.getMuDecl();
+    return std::sqrt(muRa*muRa + muDecl*muDecl);
+}
+
+
+/**
+ * Returns @c true if the given object should be indexed at its catalog position rather than
+ * at its proper motion corrected position. This is the case if the object has no proper
+ * motion (the radial component of the space motion alone does not change the direction of an
+ * object), or if lazy proper motion correction is enabled (@a maxLazyMu >= 0), the object has
+ * no radial motion, and its total proper motion is at most @a maxLazyMu (mas/year).
+ */
+inline bool isLazyProperMotion(Object const & obj, double const maxLazyMu) {
+    if (obj.getMuRa() == 0.0 && obj.getMuDecl() == 0.0) {
+        return true;
+    }
+    return maxLazyMu >= 0.0 &&
+           obj.getParallax()*obj.getRadialVelocity() == 0.0 &&
+           totalProperMotion(obj) <= maxLazyMu;
+}
+
+
+double maxProperMotionDisplacement(double const mu, double const epoch);
+
+
+/**
+ * Re-tests match candidates, found with a match radius padded by the largest proper motion
+ * displacement of objects indexed at their catalog positions, against proper motion corrected
+ * object positions. Candidates at or beyond @a radius (radians) from their first entry are
+ * removed, as they are by the match routines. Only candidate objects with non-zero proper
+ * motion that were indexed at their catalog positions are corrected (and have their match
+ * distance updated), the distances of all other candidates are exact.
+ *
+ * @return  the number of candidates that were proper motion corrected.
+ */
+template <typename RecordT>
+int retestLazyProperMotionMatches(
+    std::vector<RecordT> & records,
+    double const radius,
+    double const epoch,
+    double const maxLazyMu
+) {
+    typedef typename std::vector<RecordT>::iterator RecordIterator;
+    int numCorrected = 0;
+    RecordIterator out = records.begin();
+    for (RecordIterator r = records.begin(), end = records.end(); r != end; ++r) {
+        Object const & obj = *r->_second->_data;
+        if ((obj.getMuRa() != 0.0 || obj.getMuDecl() != 0.0) && isLazyProperMotion(obj, maxLazyMu)) {
+            std::pair<double, double> pos = correctProperMotion(obj, epoch);
+            double const ra = radians(pos.first);
+            double const dec = radians(pos.second);
+            double const cosDec = std::cos(dec);
+            double const dx = std::cos(ra)*cosDec - r->_first->_x;
+            double const dy = std::sin(ra)*cosDec - r->_first->_y;
+            double const dz = std::sin(dec) - r->_first->_z;
+            r->_distance = 2.0*std::asin(0.5*std::sqrt(dx*dx + dy*dy + dz*dz));
+            ++numCorrected;
+        }
+        if (r->_distance < radius) {
+            *out = *r;
+            ++out;
+        }
+    }
+    records.erase(out, records.end());
+    return numCorrected;
+}
+
+
+// -- Index creation ----------------
+
+double buildZoneIndex(
+    ObjectIndex & index,
+    ObjectChunkVector const & chunks,
+    double const epoch,
+    double const maxLazyMu
+);
+
+void tuneZoneIndex(
+    ObjectIndex & index,
+    ObjectChunkVector const & chunks,
+    ZoneStripeChunkDecomposition const & zsc,
+    double const radius
+);
+
+
+/**
+ * @brief  An object zone index that is maintained incrementally across visits.
+ *
+ * Consecutive visits usually overlap heavily. Rather than rebuilding the object index
+ * from scratch for every visit, entries for chunks that remain in the FOV are kept, entries
+ * for chunks that left the FOV are removed, and only entries for newly loaded chunks and for
+ * objects appended to retained chunks (e.g. by NewObjectCreator) are inserted and merged into
+ * the already sorted zones.
+ *
+ * Retained entries keep the proper motion corrected positions computed for an earlier visit.
+ * The index is therefore rebuilt from scratch once the visit epoch drifts too far from the
+ * epoch of the last full rebuild. Entries indexed at their catalog positions (see
+ * isLazyProperMotion()) are not affected by epoch drift. A chunk is also re-indexed in its
+ * entirety if its generation number changed (because it was evicted and re-read, or rolled
+ * back) or if it shrank.
+ *
+ * If zone height tuning is enabled, the zone height is chosen (with tuneZoneIndex()) on every
+ * full rebuild, for the match radius of the visit triggering it. Changing the zone height
+ * empties the index, so it is kept between rebuilds, even if later visits use other match
+ * radii.
+ *
+ * Note that a single instance is shared by the visit processing contexts of successive visits,
+ * so the object index of a visit is only valid until the next visit builds its object index.
+ */
+class IncrementalObjectIndex : private boost::noncopyable {
+
+public :
+
+    IncrementalObjectIndex(
+        ZoneStripeChunkDecomposition const & zsc,
+        double const maxEpochDrift,
+        double const maxLazyMu,
+        bool const autoTuneZoneHeight,
+        std::string const & runId
+    );
+
+    ObjectIndex & getIndex() {
+        return _index;
+    }
+
+    /// Returns the largest total proper motion (mas/year) of an entry indexed at its catalog position.
+    double getLazyProperMotion() const {
+        return _lazyMu;
+    }
+
+    std::string const & getRunId() const {
+        return _runId;
+    }
+
+    void update(ObjectChunkVector const & chunks, double const epoch, double const radius);
+
+private :
+
+    /// Records the state of a chunk at the time its entries were last indexed.
+    struct IndexedChunk {
+        ObjectChunk     _chunk;      ///< index entries point to this (stable) chunk instance
+        boost::uint64_t _generation; ///< chunk generation number
+        int             _size;       ///< number of chunk entries indexed
+
+        IndexedChunk(ObjectChunk const & chunk) :
+            _chunk(chunk),
+            _generation(chunk.getGeneration()),
+            _size(0)
+        {}
+    };
+
+    typedef std::map<int, IndexedChunk> IndexedChunkMap;
+
+    /// Filter which discards index entries belonging to a sorted list of chunks.
+    struct DiscardChunkFilter {
+        std::vector<ObjectChunk const *> const & _discard;
+
+        explicit DiscardChunkFilter(std::vector<ObjectChunk const *> const & discard) :
+            _discard(discard) {}
+
+        bool operator()(ObjectEntry const & entry) {
+            return !std::binary_search(_discard.begin(), _discard.end(), entry._chunk);
+        }
+    };
+
+    ObjectIndex     _index;
+    IndexedChunkMap _chunks;
+    ZoneStripeChunkDecomposition _zsc; ///< decomposition to tune zone heights for
+    std::string     _runId;
+    double          _epoch;         ///< epoch of the last full index rebuild
+    double          _maxEpochDrift; ///< maximum visit epoch drift (days) before a full rebuild
+    double          _maxLazyMu;     ///< see isLazyProperMotion()
+    double          _lazyMu;        ///< upper bound on proper motions of entries at catalog positions
+    bool            _autoTuneZoneHeight;
+
+    void clear();
+};
+
+}}} // end of namespace lsst::ap::detail
+
+#endif // LSST_AP_OBJECT_INDEX_H
@@ -39,7 +39,13 @@
 
 namespace lsst { namespace ap {
 
-/** @brief  A rectangular region (in right ascension and declination) of the unit sphere. */
+/**
+ * @brief  A rectangular region (in right ascension and declination) of the unit sphere.
+ *
+ * Regions with a minimum right ascension greater than their maximum right ascension wrap
+ * around ra = 0. Regions covering all right ascensions (e.g. those bounding a circle that
+ * contains a pole) have a minimum right ascension of 0 and a maximum of 360 degrees.
+ */
 class RectangularRegion {
 
 public :
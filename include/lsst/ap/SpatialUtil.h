@@ -196,6 +196,8 @@ public :
         return stripeId*_zonesPerStripe + _zonesPerStripe - 1;
     }
 
+    int getZonesPerDegree() const { return static_cast<int>(_zonesPerDegree); }
+
     int getZonesPerStripe() const { return _zonesPerStripe; }
 
     /**
@@ -65,6 +65,13 @@ struct DiaSourceChunk {
 #endif
 
 
+#ifndef SWIG
+namespace detail {
+class IncrementalObjectIndex;
+}
+#endif
+
+
 /** @brief  Container for inter-stage association pipeline state. */
 class VisitProcessingContext :
     public  lsst::daf::base::Citizen,
@@ -105,17 +112,20 @@ public :
         return _chunks;
     }
 
-    ObjectIndex & getObjectIndex() {
-        return _objectIndex;
-    }
+    ObjectIndex & getObjectIndex();
     DiaSourceIndex & getDiaSourceIndex() {
         return _diaSourceIndex;
     }
 
     void buildObjectIndex();
 
+    /**
+     * Returns the zone/stripe/chunk decomposition specified by the pipeline policy, which
+     * determines object chunk boundaries. The zone height of the object index may differ
+     * (see the @c autoTuneZoneHeight policy parameter), but its stripes never do.
+     */
     ZoneStripeChunkDecomposition const & getDecomposition() const {
-        return _objectIndex.getDecomposition();
+        return _zsc;
     }
     CircularRegion const & getFov() const {
         return _fov;
@@ -138,6 +148,18 @@ public :
     double getMatchRadius() const {
         return _matchRadius;
     }
+    double getVisitTime() const {
+        return _visitTime;
+    }
+    /**
+     * Returns the largest total proper motion (mas/year) of objects that are indexed at
+     * their catalog positions and proper motion corrected only when they become match
+     * candidates, or -1 if lazy proper motion correction is disabled.
+     */
+    double getMaxLazyProperMotion() const {
+        return _maxLazyProperMotion;
+    }
+    double getLazyProperMotionPadding() const;
     double getEllipseScalingFactor() const {
         return _ellipseScalingFactor;
     }
@@ -162,8 +184,13 @@ private :
     lsst::pex::policy::Policy::Ptr _policy;
     std::vector<int> _chunkIds;
     std::vector<ObjectChunk> _chunks;
+    ZoneStripeChunkDecomposition _zsc;
     ObjectIndex _objectIndex;
     DiaSourceIndex _diaSourceIndex;
+#ifndef SWIG
+    /// Set if the object index is maintained incrementally across visits
+    boost::shared_ptr<detail::IncrementalObjectIndex> _incrementalObjectIndex;
+#endif
     std::vector<lsst::afw::detection::DiaSource::Ptr> _diaSources;
 
     TimeSpec _deadline;
@@ -173,17 +200,22 @@ private :
     double _matchRadius;
     double _ellipseScalingFactor;
     double _visitTime;
+    double _maxLazyProperMotion; ///< see getMaxLazyProperMotion()
+    double _lazyProperMotion;    ///< largest proper motion of an object at its catalog position
     lsst::afw::image::Filter _filter;
     int _workerId;
     int _numWorkers;
+    bool _autoTuneZoneHeight;
     bool _debugSharedMemory;
 };
 
 
-void initialize(std::string const & runId);
+void initialize(lsst::pex::policy::Policy::Ptr const policy, std::string const & runId);
 
 void registerVisit(VisitProcessingContext & context);
 
+void prefetchVisit(VisitProcessingContext & context, double const ra, double const dec);
+
 void loadSliceObjects(VisitProcessingContext & context);
 
 void buildObjectIndex(VisitProcessingContext & context);
@@ -0,0 +1,83 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   A minimal wrapper for POSIX threads, used to run work in the background.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_THREAD_H
+#define LSST_AP_THREAD_H
+
+#include <pthread.h>
+
+#include <string>
+
+#include "boost/function.hpp"
+#include "boost/noncopyable.hpp"
+
+#include "Common.h"
+
+
+namespace lsst { namespace ap {
+
+/**
+ * @brief   Runs a function in a newly created POSIX thread.
+ *
+ * The thread is started on construction. Exceptions thrown by the function are caught in
+ * the thread and reported by join(), which rethrows them as a RuntimeError. A thread that
+ * was never joined is joined on destruction, in which case failures are silently dropped.
+ */
+class Thread : private boost::noncopyable {
+
+public :
+
+    explicit Thread(boost::function<void ()> const & function);
+
+    ~Thread();
+
+    void join();
+
+    /// Returns @c true if the thread has not yet been joined.
+    bool isJoinable() const { return _joinable; }
+
+private :
+
+    boost::function<void ()> _function;
+    std::string _failure;
+    ::pthread_t _thread;
+    bool _joinable;
+    bool _failed;
+
+    static void * run(void * thread);
+};
+
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_THREAD_H
@@ -0,0 +1,108 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   A cost balancing, work stealing scheduler for ranges of adjacent work items.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_WORK_SCHEDULER_H
+#define LSST_AP_WORK_SCHEDULER_H
+
+#include <vector>
+
+#include "boost/noncopyable.hpp"
+#include "boost/scoped_array.hpp"
+
+#include "Common.h"
+#include "Mutex.h"
+
+
+namespace lsst { namespace ap {
+
+/**
+ * @brief   Hands out batches of adjacent work items (e.g. zones) to a fixed number of threads.
+ *
+ * Work items are cut into batches of consecutive items with roughly equal estimated cost,
+ * and each thread is initially assigned a contiguous run of batches with roughly equal total
+ * cost. A thread consumes its own batches from the front, so that it visits adjacent items
+ * in order. Once a thread runs out of work, it steals batches from the back of the runs
+ * assigned to other threads.
+ *
+ * The time each thread spends processing batches can be recorded via addBusyTime(), which
+ * allows load imbalance to be measured.
+ */
+class WorkScheduler : private boost::noncopyable {
+
+public :
+
+    WorkScheduler(
+        std::vector<double> const & costs,
+        int const numThreads,
+        int const batchesPerThread = 8
+    );
+
+    ~WorkScheduler();
+
+    bool next(int const thread, int & begin, int & end);
+
+    /// Adds @a seconds to the time spent by thread @a thread processing batches.
+    void addBusyTime(int const thread, double const seconds) {
+        _queues[thread]._busyTime += seconds;
+    }
+
+    void getBusyTimes(std::vector<double> & busyTimes) const;
+
+    /// Returns the number of threads work is scheduled for.
+    int getNumThreads() const { return _numThreads; }
+
+    /// Returns the number of batches work items were split into.
+    int getNumBatches() const { return static_cast<int>(_batches.size()) - 1; }
+
+private :
+
+    /// Batches assigned to a single thread, padded to avoid false sharing.
+    struct Queue {
+        Mutex  _mutex;
+        int    _head;
+        int    _tail;
+        double _busyTime;
+        char   _pad[64];
+
+        Queue() : _mutex(), _head(0), _tail(0), _busyTime(0.0) {}
+    };
+
+    std::vector<int>          _batches; ///< batch i covers items [_batches[i], _batches[i + 1])
+    boost::scoped_array<Queue> _queues;
+    int                        _numThreads;
+};
+
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_WORK_SCHEDULER_H
@@ -0,0 +1,74 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Selection of zone heights for zone indexes, based on entry density and match radius.
+ *
+ * @ingroup ap
+ */
+
+#ifndef LSST_AP_ZONE_TUNING_H
+#define LSST_AP_ZONE_TUNING_H
+
+#include <cstddef>
+#include <vector>
+
+#include "Common.h"
+#include "Point.h"
+
+
+namespace lsst { namespace ap {
+
+/** @brief  A zone configuration chosen by tuneZoneHeight(). */
+struct ZoneHeightTuning {
+    int _zonesPerDegree;
+    int _zonesPerStripe;
+    int _maxEntriesPerZoneEstimate;
+    double _density;      ///< estimated entry density (per square degree) seen by a probe
+    double _costPerProbe; ///< estimated relative cost of a single distance match probe
+};
+
+double estimateProbeCost(double const zoneHeight, double const density, double const radius);
+
+double estimateDensity(
+    std::vector<Point> const & sample,
+    std::size_t const numEntries,
+    double const cellSize
+);
+
+ZoneHeightTuning tuneZoneHeight(
+    std::vector<Point> const & sample,
+    std::size_t const numEntries,
+    double const radius,
+    int const zonesPerDegree,
+    int const zonesPerStripe,
+    int const maxEntriesPerZoneEstimate
+);
+
+}} // end of namespace lsst::ap
+
+#endif // LSST_AP_ZONE_TUNING_H
@@ -33,6 +33,10 @@
 #ifndef LSST_AP_ZONE_TYPES_CC
 #define LSST_AP_ZONE_TYPES_CC
 
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
 #include <cstdlib>
 #include <cmath>
 
@@ -40,27 +44,40 @@
 #   include <omp.h>
 #endif
 
+#include <cstdio>
+#include <cstring>
 #include <new>
 #include <stdexcept>
 #include <algorithm>
 
+#include "boost/bind.hpp"
+#include "boost/format.hpp"
 #include "boost/scoped_array.hpp"
+#include "boost/static_assert.hpp"
 
 #include "lsst/pex/exceptions.h"
 
+#include "ScopeGuard.h"
 #include "SpatialUtil.h"
 #include "ZoneTypes.h"
+#include "io/FileIo.h"
 
 
 // -- lsst::ap::ZoneEntry<C> ----------------
 
+/**
+ * Creates a zone entry for a data object. The chunk slot and zone reference point
+ * are only used by compact entries.
+ */
 template <typename ChunkT>
 inline lsst::ap::ZoneEntry<ChunkT>::ZoneEntry(
     double const ra,
     double const dec,
     Data * const data,
     Chunk * const chunk,
-    int const index
+    boost::uint32_t const,
+    int const index,
+    double const
 ) :
     _data(data),
     _flags(0),
@@ -78,19 +95,289 @@ inline lsst::ap::ZoneEntry<ChunkT>::ZoneEntry(
 }
 
 
+// -- lsst::ap::CompactZoneEntry<C> ----------------
+
+template <typename ChunkT>
+inline lsst::ap::CompactZoneEntry<ChunkT>::CompactZoneEntry(
+    double const ra,
+    double const dec,
+    Data * const,
+    Chunk * const,
+    boost::uint32_t const chunkSlot,
+    int const index,
+    double const refZ
+) :
+    _flags(0),
+    _chunkSlot(chunkSlot),
+    _index(index)
+{
+    _ra  = raToScaledInteger(ra);
+    _dec = decToScaledInteger(dec);
+    double raRad  = radians(ra);
+    double decRad = radians(dec);
+    double cosDec = std::cos(decRad);
+    _dx = static_cast<float>(std::cos(raRad)*cosDec);
+    _dy = static_cast<float>(std::sin(raRad)*cosDec);
+    _dz = static_cast<float>(std::sin(decRad) - refZ);
+}
+
+
+/**
+ * Stores the unit vector position of this entry in (@a x, @a y, @a z), recomputed in double
+ * precision from its scaled integer right ascension and declination.
+ */
+template <typename ChunkT>
+inline void lsst::ap::CompactZoneEntry<ChunkT>::getUnitVector(
+    double & x,
+    double & y,
+    double & z
+) const {
+    // use the centers of the scaled integer ra/dec bins
+    double const raRad  = radians((static_cast<double>(_ra) + 0.5)/RA_DEC_SCALE);
+    double const decRad = radians((static_cast<double>(_dec) + 0.5)/RA_DEC_SCALE);
+    double const cosDec = std::cos(decRad);
+    x = std::cos(raRad)*cosDec;
+    y = std::sin(raRad)*cosDec;
+    z = std::sin(decRad);
+}
+
+
+/**
+ * Returns the squared chord length between the given unit vector and the position of this
+ * entry, recomputed in double precision (see getUnitVector()).
+ */
+template <typename ChunkT>
+inline double lsst::ap::CompactZoneEntry<ChunkT>::exactDistance2(
+    double const x,
+    double const y,
+    double const z
+) const {
+    double ex, ey, ez;
+    getUnitVector(ex, ey, ez);
+    double const dx = x - ex;
+    double const dy = y - ey;
+    double const dz = z - ez;
+    return dx*dx + dy*dy + dz*dz;
+}
+
+
+// -- lsst::ap::detail::RegionQuery ----------------
+
+/** Sets up a query for the entries within @a radius degrees of (@a ra, @a dec). */
+inline void lsst::ap::detail::RegionQuery::setCircle(
+    double const ra,
+    double const dec,
+    double const radius
+) {
+    double alpha = 180.0;
+    if (radius <= 0.0) {
+        alpha = 0.0;
+    } else if (radius < 10.0) {
+        alpha = maxAlpha(radius, dec);
+    }
+    double const raRad  = radians(ra);
+    double const decRad = radians(dec);
+    double const cosDec = std::cos(decRad);
+    double const shr    = std::sin(radians(radius*0.5));
+    _minDec  = clampDec(dec - radius);
+    _maxDec  = clampDec(dec + radius);
+    _x       = std::cos(raRad)*cosDec;
+    _y       = std::sin(raRad)*cosDec;
+    _z       = std::sin(decRad);
+    _d2      = 4.0*shr*shr;
+    _ra      = raToScaledInteger(ra);
+    _deltaRa = (alpha >= 180.0) ? 0x80000000u : deltaRaToScaledInteger(alpha);
+    _minRa   = 0;
+    _width   = 0;
+    _minDecScaled = 0;
+    _maxDecScaled = 0;
+    _box     = false;
+}
+
+
+/**
+ * Sets up a query for the entries inside @a box. Boxes with a minimum right ascension greater
+ * than their maximum right ascension wrap around ra = 0, and boxes at least 360 degrees wide
+ * (see RectangularRegion) cover all right ascensions. Box boundaries are tested using scaled
+ * integer coordinates.
+ */
+inline void lsst::ap::detail::RegionQuery::setBox(RectangularRegion const & box) {
+    _minDec  = box.getMinDec();
+    _maxDec  = box.getMaxDec();
+    _x       = 0.0;
+    _y       = 0.0;
+    _z       = 0.0;
+    _d2      = 0.0;
+    if (box.getMaxRa() - box.getMinRa() >= 360.0) {
+        _minRa   = 0;
+        _width   = 0xffffffffu;
+        _ra      = 0x80000000u;
+        _deltaRa = 0x80000000u;
+    } else {
+        boost::uint32_t const maxRa = (box.getMaxRa() >= 360.0) ?
+            0xffffffffu : raToScaledInteger(box.getMaxRa());
+        _minRa   = raToScaledInteger(box.getMinRa());
+        _width   = maxRa - _minRa; // modulo 2^32, handles wrap-around
+        _ra      = _minRa + (_width >> 1);
+        _deltaRa = _width - (_width >> 1);
+    }
+    _minDecScaled = decToScaledInteger(_minDec);
+    _maxDecScaled = decToScaledInteger(_maxDec);
+    _box     = true;
+}
+
+
+// -- lsst::ap::detail::radixSortIndexes ----------------
+
+namespace lsst { namespace ap { namespace detail {
+
+/**
+ * Computes the permutation that sorts @a n 32 bit keys in ascending order, using a stable
+ * LSD radix sort with 11 bit digits. Digit passes in which all keys share the same digit
+ * value are skipped.
+ *
+ * @param[in, out] keys     The keys to sort -- clobbered on output.
+ * @param[in, out] keyTmp   Scratch space for @a n keys.
+ * @param[in, out] idx      Must contain 0, 1, ..., n - 1 on input.
+ * @param[in, out] idxTmp   Scratch space for @a n indexes.
+ * @param[in] n             The number of keys to sort.
+ * @return                  Either @a idx or @a idxTmp, whichever contains the sorted
+ *                          permutation: element @c i is the index of the key with rank @c i.
+ */
+inline int * radixSortIndexes(
+    boost::uint32_t * keys,
+    boost::uint32_t * keyTmp,
+    int * idx,
+    int * idxTmp,
+    int const n
+) {
+    static int const NUM_PASSES = 3;
+    static int const DIGIT_BITS = 11;
+    static int const NUM_BUCKETS = 1 << DIGIT_BITS;
+    static boost::uint32_t const MASK = NUM_BUCKETS - 1;
+
+    // histogram all digits in a single pass over the keys
+    boost::scoped_array<int> counts(new int[NUM_PASSES*NUM_BUCKETS]);
+    std::fill(counts.get(), counts.get() + NUM_PASSES*NUM_BUCKETS, 0);
+    int * const __restrict c0 = counts.get();
+    int * const __restrict c1 = c0 + NUM_BUCKETS;
+    int * const __restrict c2 = c1 + NUM_BUCKETS;
+    for (int i = 0; i < n; ++i) {
+        boost::uint32_t const k = keys[i];
+        ++c0[k & MASK];
+        ++c1[(k >> DIGIT_BITS) & MASK];
+        ++c2[k >> 2*DIGIT_BITS];
+    }
+
+    for (int p = 0; p < NUM_PASSES; ++p) {
+        int * const __restrict c = c0 + p*NUM_BUCKETS;
+        int const shift = p*DIGIT_BITS;
+        if (c[(keys[0] >> shift) & MASK] == n) {
+            continue; // every key has the same digit value
+        }
+        // convert counts to starting offsets
+        int sum = 0;
+        for (int b = 0; b < NUM_BUCKETS; ++b) {
+            int const cnt = c[b];
+            c[b] = sum;
+            sum += cnt;
+        }
+        boost::uint32_t const * const __restrict ks = keys;
+        int const * const __restrict is = idx;
+        boost::uint32_t * const __restrict kd = keyTmp;
+        int * const __restrict id = idxTmp;
+        for (int i = 0; i < n; ++i) {
+            boost::uint32_t const k = ks[i];
+            int const d = c[(k >> shift) & MASK]++;
+            kd[d] = k;
+            id[d] = is[i];
+        }
+        std::swap(keys, keyTmp);
+        std::swap(idx, idxTmp);
+    }
+    return idx;
+}
+
+
+/** Rounds @a offset up to the alignment of ZoneIndex snapshot sections. */
+inline boost::uint64_t alignSnapshotSection(boost::uint64_t const offset) {
+    boost::uint64_t const a = ZoneIndexSnapshotHeader::SECTION_ALIGNMENT;
+    return (offset + a - 1) & ~(a - 1);
+}
+
+/**
+ * Writes @a len bytes from @a data to a ZoneIndex snapshot, after padding the snapshot with
+ * zeros up to @a offset. The current size of the snapshot is tracked by @a pos.
+ */
+inline void writeSnapshotBytes(
+    io::SequentialWriter & writer,
+    boost::uint64_t & pos,
+    boost::uint64_t const offset,
+    void const * const data,
+    std::size_t const len
+) {
+    static unsigned char const zeros[ZoneIndexSnapshotHeader::SECTION_ALIGNMENT] = { 0 };
+    assert(offset >= pos && offset - pos <= sizeof(zeros));
+    writer.write(zeros, static_cast<std::size_t>(offset - pos));
+    writer.write(static_cast<unsigned char const *>(data), len);
+    pos = offset + len;
+}
+
+/**
+ * Returns @c true if a ZoneIndex snapshot section of @a count elements of @a elementSize bytes
+ * each, starting at byte @a offset, is aligned and lies entirely within a snapshot of
+ * @a size bytes.
+ */
+inline bool isValidSnapshotSection(
+    boost::uint64_t const offset,
+    boost::uint64_t const count,
+    std::size_t const elementSize,
+    boost::uint64_t const size
+) {
+    if (offset % ZoneIndexSnapshotHeader::SECTION_ALIGNMENT != 0 ||
+        offset < sizeof(ZoneIndexSnapshotHeader) || offset > size) {
+        return false;
+    }
+    return count <= (size - offset)/elementSize;
+}
+
+}}} // end of namespace lsst::ap::detail
+
+
 // -- lsst::ap::ZoneEntryArray<EntryT> ----------------
 
 template <typename EntryT>
-lsst::ap::ZoneEntryArray<EntryT>::ZoneEntryArray()
-    : _entries(0), _size(0), _capacity(0), _zone(0), _deltaRa(0) {}
+lsst::ap::ZoneEntryArray<EntryT>::ZoneEntryArray() :
+    _entries(0),
+    _ra(0),
+    _x(0),
+    _y(0),
+    _z(0),
+    _size(0),
+    _numSorted(0),
+    _capacity(0),
+    _columnCapacity(0),
+    _zone(0),
+    _refZ(0.0),
+    _deltaRa(0),
+    _borrowed(false)
+{}
 
 
 template <typename EntryT>
 lsst::ap::ZoneEntryArray<EntryT>::~ZoneEntryArray() {
-    if (_entries != 0) {
+    if (!_borrowed) {
         std::free(_entries);
-        _entries = 0;
+        std::free(_ra);
+        std::free(_x);
+        std::free(_y);
+        std::free(_z);
     }
+    _entries = 0;
+    _ra = 0;
+    _x  = 0;
+    _y  = 0;
+    _z  = 0;
 }
 
 
@@ -110,16 +397,131 @@ void lsst::ap::ZoneEntryArray<EntryT>::init(int const capacity) {
 }
 
 
-/** Sorts the zone entries on ra. */
+/**
+ * Sorts the zone entries on ra, then rebuilds the zone columns. Small zones are sorted
+ * in place. For larger zones, the permutation that sorts the entries is computed with a
+ * radix sort on the ra keys alone, so that each (comparatively large) entry is moved
+ * exactly once.
+ */
 template <typename EntryT>
 void lsst::ap::ZoneEntryArray<EntryT>::sort() {
-    std::sort(_entries, _entries + _size);
+    int const sz = _size;
+    if (sz < MIN_RADIX_SORT_SIZE) {
+        std::sort(_entries, _entries + sz);
+    } else {
+        boost::scoped_array<boost::uint32_t> keys(new boost::uint32_t[2*sz]);
+        boost::scoped_array<int> indexes(new int[2*sz]);
+        EntryT const * const __restrict entries = _entries;
+        for (int i = 0; i < sz; ++i) {
+            keys[i] = entries[i]._ra;
+            indexes[i] = i;
+        }
+        int const * const __restrict perm = detail::radixSortIndexes(
+            keys.get(), keys.get() + sz, indexes.get(), indexes.get() + sz, sz);
+        EntryT * const __restrict sorted = static_cast<EntryT *>(std::malloc(sizeof(EntryT)*_capacity));
+        if (sorted == 0) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
+                              "failed to allocate space for sorting zone");
+        }
+        for (int i = 0; i < sz; ++i) {
+            sorted[i] = entries[perm[i]];
+        }
+        std::free(_entries);
+        _entries = sorted;
+    }
+    _numSorted = sz;
+    buildColumns();
+}
+
+
+/**
+ * Merges entries inserted since the last call to sort() or merge() into the (sorted) entries
+ * preceding them, then rebuilds the zone columns. The newly inserted entries are sorted first,
+ * and each entry is then moved exactly once while merging the two sorted runs.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneEntryArray<EntryT>::merge() {
+    int const ns = _numSorted;
+    int const sz = _size;
+    if (ns == sz) {
+        return;
+    } else if (ns == 0) {
+        sort();
+        return;
+    }
+    int const n = sz - ns;
+    EntryT * const __restrict tail = _entries + ns;
+    boost::scoped_array<int> indexes(new int[2*n]);
+    int const * __restrict perm = indexes.get();
+    if (n < MIN_RADIX_SORT_SIZE) {
+        std::sort(tail, tail + n);
+        for (int i = 0; i < n; ++i) {
+            indexes[i] = i;
+        }
+    } else {
+        boost::scoped_array<boost::uint32_t> keys(new boost::uint32_t[2*n]);
+        for (int i = 0; i < n; ++i) {
+            keys[i] = tail[i]._ra;
+            indexes[i] = i;
+        }
+        perm = detail::radixSortIndexes(keys.get(), keys.get() + n, indexes.get(), indexes.get() + n, n);
+    }
+    EntryT * const __restrict merged = static_cast<EntryT *>(std::malloc(sizeof(EntryT)*_capacity));
+    if (merged == 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
+                          "failed to allocate space for merging zone");
+    }
+    EntryT const * const __restrict head = _entries;
+    int h = 0;
+    int t = 0;
+    int d = 0;
+    while (h < ns && t < n) {
+        if (tail[perm[t]]._ra < head[h]._ra) {
+            merged[d++] = tail[perm[t++]];
+        } else {
+            merged[d++] = head[h++];
+        }
+    }
+    for ( ; h < ns; ++h) {
+        merged[d++] = head[h];
+    }
+    for ( ; t < n; ++t) {
+        merged[d++] = tail[perm[t]];
+    }
+    std::free(_entries);
+    _entries = merged;
+    _numSorted = sz;
+    buildColumns();
+}
+
+
+/** Exchanges the contents (and ownership of the underlying memory) of two zones. */
+template <typename EntryT>
+void lsst::ap::ZoneEntryArray<EntryT>::swap(ZoneEntryArray & zone) {
+    using std::swap;
+    swap(_entries, zone._entries);
+    swap(_ra, zone._ra);
+    swap(_x, zone._x);
+    swap(_y, zone._y);
+    swap(_z, zone._z);
+    swap(_size, zone._size);
+    swap(_numSorted, zone._numSorted);
+    swap(_capacity, zone._capacity);
+    swap(_columnCapacity, zone._columnCapacity);
+    swap(_zone, zone._zone);
+    swap(_refZ, zone._refZ);
+    swap(_deltaRa, zone._deltaRa);
+    swap(_borrowed, zone._borrowed);
 }
 
 
 /** Increases the size of the underlying array of entries by roughly 25% (and by at least 1). */
 template <typename EntryT>
 void lsst::ap::ZoneEntryArray<EntryT>::grow() {
+    if (_borrowed) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LogicError,
+                          "cannot insert entries into a mapped zone index snapshot");
+    }
     int cap = _capacity >> 2;
     cap = _capacity + (64 > cap ? 64 : cap);
     EntryT * entries  = static_cast<EntryT *>(std::realloc(_entries, sizeof(EntryT)*cap));
@@ -132,6 +534,52 @@ void lsst::ap::ZoneEntryArray<EntryT>::grow() {
 }
 
 
+/**
+ * Copies the right ascension and unit vector coordinates of every entry into the
+ * corresponding zone column, growing the columns if necessary.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneEntryArray<EntryT>::buildColumns() {
+    int const sz = _size;
+    if (sz > _columnCapacity) {
+        int const cap = _capacity > sz ? _capacity : sz;
+        boost::uint32_t * ra = static_cast<boost::uint32_t *>(
+            std::realloc(_ra, sizeof(boost::uint32_t)*cap));
+        if (ra != 0) {
+            _ra = ra;
+        }
+        Coordinate * x = static_cast<Coordinate *>(std::realloc(_x, sizeof(Coordinate)*cap));
+        if (x != 0) {
+            _x = x;
+        }
+        Coordinate * y = static_cast<Coordinate *>(std::realloc(_y, sizeof(Coordinate)*cap));
+        if (y != 0) {
+            _y = y;
+        }
+        Coordinate * z = static_cast<Coordinate *>(std::realloc(_z, sizeof(Coordinate)*cap));
+        if (z != 0) {
+            _z = z;
+        }
+        if (ra == 0 || x == 0 || y == 0 || z == 0) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::MemoryError,
+                              "failed to allocate zone columns");
+        }
+        _columnCapacity = cap;
+    }
+    EntryT const * const __restrict entries = _entries;
+    boost::uint32_t * const __restrict raCol = _ra;
+    Coordinate * const __restrict xCol = _x;
+    Coordinate * const __restrict yCol = _y;
+    Coordinate * const __restrict zCol = _z;
+    for (int i = 0; i < sz; ++i) {
+        raCol[i] = entries[i]._ra;
+        xCol[i]  = entries[i].getColumnX();
+        yCol[i]  = entries[i].getColumnY();
+        zCol[i]  = entries[i].getColumnZ();
+    }
+}
+
+
 /** Prepares for a distance based match with the given radius */
 template <typename EntryT>
 void lsst::ap::ZoneEntryArray<EntryT>::computeMatchParams(
@@ -155,6 +603,7 @@ template <typename EntryT>
 int lsst::ap::ZoneEntryArray<EntryT>::pack(FilterT & filter) {
     int src = 0;
     int dst = 0;
+    int numSorted = 0;
 
     for ( ; src < _size; ++src) {
         if (!filter(_entries[src])) {
@@ -164,8 +613,16 @@ int lsst::ap::ZoneEntryArray<EntryT>::pack(FilterT & filter) {
             _entries[dst] = _entries[src];
         }
         ++dst;
+        if (src < _numSorted) {
+            // packing preserves the order of the sorted entries
+            numSorted = dst;
+        }
     }
     _size = dst;
+    _numSorted = numSorted;
+    if (src != dst) {
+        buildColumns();
+    }
     return src - dst;
 }
 
@@ -183,6 +640,47 @@ void lsst::ap::ZoneEntryArray<EntryT>::apply(FunctionT & function) {
 }
 
 
+/**
+ * Appends pointers to the entries of this zone that are inside the given region to
+ * @a results. The zone must have been sorted.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneEntryArray<EntryT>::query(
+    detail::RegionQuery const & query,
+    std::vector<EntryT *> & results
+) {
+    int const sz = _size;
+    if (sz == 0) {
+        return;
+    }
+    EntryT * const entries = _entries;
+    int i = findGte(query._ra - query._deltaRa);
+    int const n = countInRaRange(i, query._ra, query._deltaRa);
+    if (query._box) {
+        for (int j = 0; j < n; ++j, ++i) {
+            if (i == sz) {
+                i = 0; // ra wrap around
+            }
+            EntryT & e = entries[i];
+            if (e._ra - query._minRa <= query._width &&
+                e._dec >= query._minDecScaled && e._dec <= query._maxDecScaled) {
+                results.push_back(&e);
+            }
+        }
+    } else {
+        for (int j = 0; j < n; ++j, ++i) {
+            if (i == sz) {
+                i = 0; // ra wrap around
+            }
+            EntryT & e = entries[i];
+            if (e.exactDistance2(query._x, query._y, query._z) < query._d2) {
+                results.push_back(&e);
+            }
+        }
+    }
+}
+
+
 // -- ZoneIndex<EntryT> ----------------
 
 template <typename EntryT>
@@ -194,18 +692,114 @@ lsst::ap::ZoneIndex<EntryT>::ZoneIndex(
     lsst::daf::base::Citizen(typeid(*this)),
     _zsc(zonesPerDegree, zonesPerStripe, maxEntriesPerZoneEstimate),
     _zones(),
+    _chunks(),
+    _chunkSlots(),
+    _freeChunkSlots(),
+    _lastChunk(0),
+    _lastChunkSlot(0),
     _capacity(0),
     _minZone(0),
-    _maxZone(-1)
+    _maxZone(-1),
+    _snapshot()
 {}
 
 
-/// Removes all entries from every zone in the index.
+/**
+ * Removes all entries from every zone in the index. A mapped index is detached from its
+ * snapshot, leaving it without zones: setDecBounds() must be called before new entries
+ * are inserted.
+ */
 template <typename EntryT>
 void lsst::ap::ZoneIndex<EntryT>::clear() {
+    if (_snapshot) {
+        detach();
+        return;
+    }
     for (int i = 0; i < _capacity; ++i) {
         _zones[i].clear();
     }
+    clearChunkSlots();
+}
+
+
+/// Returns the slot of the given chunk, assigning a new (or released) slot if necessary.
+template <typename EntryT>
+boost::uint32_t lsst::ap::ZoneIndex<EntryT>::getChunkSlot(Chunk * const chunk) {
+    typename std::map<Chunk *, boost::uint32_t>::const_iterator i = _chunkSlots.find(chunk);
+    if (i != _chunkSlots.end()) {
+        return i->second;
+    }
+    boost::uint32_t slot;
+    if (_freeChunkSlots.empty()) {
+        slot = static_cast<boost::uint32_t>(_chunks.size());
+        _chunks.push_back(chunk);
+    } else {
+        slot = _freeChunkSlots.back();
+        _freeChunkSlots.pop_back();
+        _chunks[slot] = chunk;
+    }
+    _chunkSlots.insert(std::make_pair(chunk, slot));
+    return slot;
+}
+
+
+/**
+ * Forgets the slot of a chunk that no longer has entries in the index (e.g. because they were
+ * all removed with pack()), so that the slot can be reused and the chunk can be destroyed.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::releaseChunk(Chunk * const chunk) {
+    typename std::map<Chunk *, boost::uint32_t>::iterator i = _chunkSlots.find(chunk);
+    if (i == _chunkSlots.end()) {
+        return;
+    }
+    _chunks[i->second] = 0;
+    _freeChunkSlots.push_back(i->second);
+    _chunkSlots.erase(i);
+    if (chunk == _lastChunk) {
+        _lastChunk = 0;
+    }
+}
+
+
+/// Forgets all chunk slot assignments -- only valid when the index is empty.
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::clearChunkSlots() {
+    _chunks.clear();
+    _chunkSlots.clear();
+    _freeChunkSlots.clear();
+    _lastChunk = 0;
+    _lastChunkSlot = 0;
+}
+
+
+/// Releases the zones of a mapped index, along with the snapshot they borrow entries from.
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::detach() {
+    _zones.reset();
+    _capacity = 0;
+    _minZone  = 0;
+    _maxZone  = -1;
+    clearChunkSlots();
+    _snapshot.reset();
+}
+
+
+/// Throws if the index is mapped, since the entries of a snapshot are read-only.
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::checkWritable() const {
+    if (_snapshot) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LogicError,
+                          "cannot modify the entries of a mapped zone index snapshot");
+    }
+}
+
+
+/// Assigns the given id (and the corresponding reference point) to a zone.
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::setZone(Zone & zone, int const zoneId) const {
+    zone._zone = zoneId;
+    zone._refZ = EntryT::getReferenceZ(0.5*(_zsc.getZoneDecMin(zoneId) + _zsc.getZoneDecMax(zoneId)));
 }
 
 
@@ -220,9 +814,31 @@ int lsst::ap::ZoneIndex<EntryT>::size() const {
 }
 
 
+/**
+ * Changes the zone height (and zone/stripe decomposition) of the index, e.g. to one chosen by
+ * tuneZoneHeight(). All entries are removed, and setDecBounds() must be called before new
+ * entries are inserted.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::setDecomposition(
+    int const zonesPerDegree,
+    int const zonesPerStripe,
+    int const maxEntriesPerZoneEstimate
+) {
+    ZoneStripeChunkDecomposition zsc(zonesPerDegree, zonesPerStripe, maxEntriesPerZoneEstimate);
+    clear();
+    _zsc.swap(zsc);
+    _minZone = 0;
+    _maxZone = -1;
+}
+
+
 /// Sets the range of declination values the index will accept data for.
 template <typename EntryT>
 void lsst::ap::ZoneIndex<EntryT>::setDecBounds(double const minDec, double const maxDec) {
+    if (_snapshot) {
+        detach();
+    }
     int minZone = _zsc.decToZone(minDec);
     int maxZone = _zsc.decToZone(maxDec);
     if (maxZone < minZone) {
@@ -243,8 +859,14 @@ void lsst::ap::ZoneIndex<EntryT>::setDecBounds(double const minDec, double const
         // transfer zone ownership from old zone array to new array
         for (i = 0; i < _capacity; ++i) {
             _zones[i]._entries  = 0;
+            _zones[i]._ra       = 0;
+            _zones[i]._x        = 0;
+            _zones[i]._y        = 0;
+            _zones[i]._z        = 0;
             _zones[i]._size     = 0;
+            _zones[i]._numSorted = 0;
             _zones[i]._capacity = 0;
+            _zones[i]._columnCapacity = 0;
         }
         using std::swap;
         swap(_zones, zones);
@@ -254,16 +876,78 @@ void lsst::ap::ZoneIndex<EntryT>::setDecBounds(double const minDec, double const
     int i = 0;
     for ( ; i <= maxZone - minZone; ++i) {
         _zones[i].clear();
-        _zones[i]._zone = i + minZone;
+        setZone(_zones[i], i + minZone);
     }
     for ( ; i < _capacity; ++i) {
         _zones[i].clear();
     }
+    clearChunkSlots();
     _minZone = minZone;
     _maxZone = maxZone;
 }
 
 
+/**
+ * Sets the range of declination values the index will accept data for. Unlike setDecBounds(),
+ * entries in zones belonging to both the current and the new range are kept -- only entries
+ * in zones that fall outside of the new range are discarded.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::changeDecBounds(double const minDec, double const maxDec) {
+    checkWritable();
+    if (_maxZone < _minZone) {
+        setDecBounds(minDec, maxDec);
+        return;
+    }
+    int const minZone = _zsc.decToZone(minDec);
+    int const maxZone = _zsc.decToZone(maxDec);
+    if (maxZone < minZone) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "min/max zone ids inverted");
+    }
+    int const numZones = maxZone - minZone + 1;
+    int const cap = (numZones > _capacity) ? numZones : _capacity;
+    boost::scoped_array<Zone> zones(new Zone[cap]);
+    boost::scoped_array<bool> taken(new bool[_capacity]);
+    std::fill(taken.get(), taken.get() + _capacity, false);
+
+    // keep zones in both the old and new range
+    int const overlapMin = (minZone > _minZone) ? minZone : _minZone;
+    int const overlapMax = (maxZone < _maxZone) ? maxZone : _maxZone;
+    for (int z = overlapMin; z <= overlapMax; ++z) {
+        zones[z - minZone].swap(_zones[z - _minZone]);
+        taken[z - _minZone] = true;
+    }
+    // recycle the remaining zones (emptying them), allocating new ones as necessary
+    int const worst = _zsc.getMaxEntriesPerZoneEstimate();
+    int spare = 0;
+    for (int i = 0; i < cap; ++i) {
+        int const z = minZone + i;
+        if (z >= overlapMin && z <= overlapMax) {
+            continue;
+        }
+        while (spare < _capacity && taken[spare]) {
+            ++spare;
+        }
+        if (spare < _capacity) {
+            zones[i].swap(_zones[spare]);
+            taken[spare] = true;
+            zones[i].clear();
+        } else {
+            zones[i].init(worst);
+        }
+    }
+    for (int i = 0; i < numZones; ++i) {
+        setZone(zones[i], minZone + i);
+    }
+    using std::swap;
+    swap(_zones, zones);
+    _capacity = cap;
+    _minZone  = minZone;
+    _maxZone  = maxZone;
+}
+
+
 /// Prepares for distance based matches of the given maximum radius
 template <typename EntryT>
 void lsst::ap::ZoneIndex<EntryT>::computeMatchParams(double const radius) {
@@ -274,13 +958,17 @@ void lsst::ap::ZoneIndex<EntryT>::computeMatchParams(double const radius) {
 }
 
 
-/// Sorts each zone in the index (on right ascension)
+/**
+ * Sorts each zone in the index (on right ascension). Zones are sorted in parallel and are
+ * scheduled dynamically, since entry counts can vary widely from zone to zone.
+ */
 template <typename EntryT>
 void lsst::ap::ZoneIndex<EntryT>::sort() {
+    checkWritable();
     int const numZones = _maxZone - _minZone + 1;
 #if LSST_AP_HAVE_OPEN_MP
 #   pragma omp parallel for default(shared) \
-               schedule(static,8)
+               schedule(dynamic,4)
 #endif
     for (int t = 0; t < numZones; ++t) {
         _zones[t].sort();
@@ -288,6 +976,25 @@ void lsst::ap::ZoneIndex<EntryT>::sort() {
 }
 
 
+/**
+ * Merges entries inserted since the last call to sort() or merge() into the sorted
+ * entries of each zone. This is much cheaper than a full sort() when most of the
+ * entries in the index were already sorted.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::merge() {
+    checkWritable();
+    int const numZones = _maxZone - _minZone + 1;
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               schedule(dynamic,4)
+#endif
+    for (int t = 0; t < numZones; ++t) {
+        _zones[t].merge();
+    } // end of parallel for
+}
+
+
 /**
  * Given a functor that implements @code bool operator()(EntryT const &) @endcode ,
  * removes any entry @a e where @c filter(e) returns @c false from the index.
@@ -297,6 +1004,7 @@ void lsst::ap::ZoneIndex<EntryT>::sort() {
 template <typename EntryT>
     template <typename FilterT>
 int lsst::ap::ZoneIndex<EntryT>::pack(FilterT & filter) {
+    checkWritable();
     int const numZones = _maxZone - _minZone + 1;
     int numPacked = 0;
 #if LSST_AP_HAVE_OPEN_MP
@@ -326,4 +1034,387 @@ void lsst::ap::ZoneIndex<EntryT>::apply(FunctionT & function) {
 }
 
 
+/**
+ * Writes a snapshot of the index to the file at @a path. Snapshots contain no pointers: zones
+ * are located by entry offsets and chunks by id, so a snapshot can be mapped (read-only, and by
+ * any number of processes) with mapSnapshot(). Writing the snapshot to a memory backed file
+ * system (e.g. /dev/shm) shares a single copy of the index between processes. The snapshot is
+ * first written to a temporary file that is then renamed to @a path, so that readers never
+ * observe a partially written snapshot.
+ *
+ * The index must have been sorted, and its entries must be position independent (e.g.
+ * CompactZoneEntry). Chunks are identified using a functor implementing
+ * @code boost::int64_t operator()(Chunk const &) @endcode .
+ */
+template <typename EntryT>
+    template <typename ChunkIdT>
+void lsst::ap::ZoneIndex<EntryT>::writeSnapshot(std::string const & path, ChunkIdT & chunkId) const {
+    BOOST_STATIC_ASSERT(EntryT::POSITION_INDEPENDENT);
+    typedef detail::ZoneIndexSnapshotHeader Header;
+    typedef typename EntryT::Coordinate Coordinate;
+
+    int const numZones = _maxZone - _minZone + 1;
+    std::vector<boost::uint64_t> offsets(numZones + 1, 0);
+    boost::uint64_t numEntries = 0;
+    for (int i = 0; i < numZones; ++i) {
+        if (_zones[i]._numSorted != _zones[i]._size) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LogicError,
+                              "zone index must be sorted before writing a snapshot of it");
+        }
+        offsets[i] = numEntries;
+        numEntries += _zones[i]._size;
+    }
+    offsets[numZones] = numEntries;
+    // released slots are written with an id of -1
+    std::vector<boost::int64_t> ids(_chunks.size(), -1);
+    for (std::size_t i = 0; i < _chunks.size(); ++i) {
+        if (_chunks[i] != 0) {
+            ids[i] = chunkId(*_chunks[i]);
+        }
+    }
+
+    Header h;
+    std::memset(&h, 0, sizeof(Header));
+    h._magic          = Header::MAGIC;
+    h._version        = Header::VERSION;
+    h._entrySize      = sizeof(EntryT);
+    h._coordinateSize = sizeof(Coordinate);
+    h._zonesPerDegree = _zsc.getZonesPerDegree();
+    h._zonesPerStripe = _zsc.getZonesPerStripe();
+    h._maxEntriesPerZoneEstimate = _zsc.getMaxEntriesPerZoneEstimate();
+    h._minZone    = _minZone;
+    h._maxZone    = _maxZone;
+    h._numChunks  = static_cast<boost::uint32_t>(ids.size());
+    h._numEntries = numEntries;
+    h._zoneOffset  = detail::alignSnapshotSection(sizeof(Header));
+    h._chunkOffset = detail::alignSnapshotSection(h._zoneOffset + sizeof(boost::uint64_t)*offsets.size());
+    h._entryOffset = detail::alignSnapshotSection(h._chunkOffset + sizeof(boost::int64_t)*ids.size());
+    h._raOffset    = detail::alignSnapshotSection(h._entryOffset + sizeof(EntryT)*numEntries);
+    h._xOffset     = detail::alignSnapshotSection(h._raOffset + sizeof(boost::uint32_t)*numEntries);
+    h._yOffset     = detail::alignSnapshotSection(h._xOffset + sizeof(Coordinate)*numEntries);
+    h._zOffset     = detail::alignSnapshotSection(h._yOffset + sizeof(Coordinate)*numEntries);
+    h._size        = h._zOffset + sizeof(Coordinate)*numEntries;
+
+    std::string const tmpPath = path + ".tmp";
+    ScopeGuard guard(boost::bind(::unlink, tmpPath.c_str()));
+    {
+        io::SequentialFileWriter writer(tmpPath, true);
+        boost::uint64_t pos = 0;
+        detail::writeSnapshotBytes(writer, pos, 0, &h, sizeof(Header));
+        detail::writeSnapshotBytes(writer, pos, h._zoneOffset, &offsets[0],
+                                   sizeof(boost::uint64_t)*offsets.size());
+        detail::writeSnapshotBytes(writer, pos, h._chunkOffset, ids.empty() ? 0 : &ids[0],
+                                   sizeof(boost::int64_t)*ids.size());
+        boost::uint64_t offset = h._entryOffset;
+        for (int i = 0; i < numZones; ++i) {
+            detail::writeSnapshotBytes(writer, pos, offset, _zones[i]._entries, sizeof(EntryT)*_zones[i]._size);
+            offset = pos;
+        }
+        offset = h._raOffset;
+        for (int i = 0; i < numZones; ++i) {
+            detail::writeSnapshotBytes(writer, pos, offset, _zones[i]._ra, sizeof(boost::uint32_t)*_zones[i]._size);
+            offset = pos;
+        }
+        offset = h._xOffset;
+        for (int i = 0; i < numZones; ++i) {
+            detail::writeSnapshotBytes(writer, pos, offset, _zones[i]._x, sizeof(Coordinate)*_zones[i]._size);
+            offset = pos;
+        }
+        offset = h._yOffset;
+        for (int i = 0; i < numZones; ++i) {
+            detail::writeSnapshotBytes(writer, pos, offset, _zones[i]._y, sizeof(Coordinate)*_zones[i]._size);
+            offset = pos;
+        }
+        offset = h._zOffset;
+        for (int i = 0; i < numZones; ++i) {
+            detail::writeSnapshotBytes(writer, pos, offset, _zones[i]._z, sizeof(Coordinate)*_zones[i]._size);
+            offset = pos;
+        }
+        assert(pos == h._size);
+        writer.finish();
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::IoError,
+            (boost::format("rename() of %1% to %2% failed, errno: %3%") % tmpPath % path % errno).str());
+    }
+    guard.dismiss();
+}
+
+
+/**
+ * Replaces the contents of the index with a snapshot written by writeSnapshot(). The snapshot
+ * is mapped read-only and shared: zones refer to entries and columns in the mapping rather than
+ * copying them, so mapping a snapshot is cheap regardless of its size. The chunk ids stored in
+ * the snapshot are turned back into chunks using a functor implementing
+ * @code Chunk * operator()(boost::int64_t) @endcode .
+ *
+ * A mapped index can be matched against (with distanceMatch() for instance, once
+ * computeMatchParams() has been called) and queried, but its entries must not be modified:
+ * sort(), merge(), pack(), changeDecBounds() and insertion throw. Calling clear() or
+ * setDecBounds() detaches the index from the snapshot.
+ */
+template <typename EntryT>
+    template <typename ChunkResolverT>
+void lsst::ap::ZoneIndex<EntryT>::mapSnapshot(std::string const & path, ChunkResolverT & resolver) {
+    BOOST_STATIC_ASSERT(EntryT::POSITION_INDEPENDENT);
+    typedef detail::ZoneIndexSnapshotHeader Header;
+    typedef typename EntryT::Coordinate Coordinate;
+    namespace ex = lsst::pex::exceptions;
+
+    boost::shared_ptr<MappedFile> file(new MappedFile(path));
+    unsigned char const * const base = file->getData();
+    if (file->size() < sizeof(Header)) {
+        throw LSST_EXCEPT(ex::IoError, path + " is not a zone index snapshot");
+    }
+    Header const * const h = reinterpret_cast<Header const *>(base);
+    if (h->_magic != Header::MAGIC) {
+        throw LSST_EXCEPT(ex::IoError, path + " is not a zone index snapshot");
+    }
+    if (h->_version != Header::VERSION) {
+        throw LSST_EXCEPT(ex::IoError, (boost::format(
+            "zone index snapshot %1% has unsupported version %2%") % path % h->_version).str());
+    }
+    if (h->_entrySize != sizeof(EntryT) || h->_coordinateSize != sizeof(Coordinate)) {
+        throw LSST_EXCEPT(ex::IoError, (boost::format(
+            "zone index snapshot %1% contains entries of a different type") % path).str());
+    }
+    if (h->_zonesPerDegree < 1 || h->_zonesPerDegree > 3600 || h->_zonesPerStripe < 1 ||
+        h->_maxEntriesPerZoneEstimate < 1) {
+        throw LSST_EXCEPT(ex::IoError, (boost::format(
+            "zone index snapshot %1% has an invalid zone decomposition") % path).str());
+    }
+    ZoneStripeChunkDecomposition zsc(h->_zonesPerDegree, h->_zonesPerStripe,
+                                     h->_maxEntriesPerZoneEstimate);
+
+    // check that every section lies within the mapped file before touching it
+    boost::uint64_t const size = file->size();
+    bool valid = h->_size == size &&
+                 h->_minZone >= zsc.decToZone(-90.0) && h->_maxZone <= zsc.decToZone(90.0) &&
+                 h->_maxZone >= h->_minZone - 1;
+    if (valid) {
+        boost::uint64_t const n = h->_numEntries;
+        valid = detail::isValidSnapshotSection(h->_zoneOffset,
+                    static_cast<boost::uint64_t>(h->_maxZone - h->_minZone + 2),
+                    sizeof(boost::uint64_t), size) &&
+                detail::isValidSnapshotSection(h->_chunkOffset, h->_numChunks,
+                                               sizeof(boost::int64_t), size) &&
+                detail::isValidSnapshotSection(h->_entryOffset, n, sizeof(EntryT), size) &&
+                detail::isValidSnapshotSection(h->_raOffset, n, sizeof(boost::uint32_t), size) &&
+                detail::isValidSnapshotSection(h->_xOffset, n, sizeof(Coordinate), size) &&
+                detail::isValidSnapshotSection(h->_yOffset, n, sizeof(Coordinate), size) &&
+                detail::isValidSnapshotSection(h->_zOffset, n, sizeof(Coordinate), size);
+    }
+    if (!valid) {
+        throw LSST_EXCEPT(ex::IoError, (boost::format(
+            "zone index snapshot %1% is truncated or corrupt") % path).str());
+    }
+
+    // map chunk ids back to chunks
+    boost::int64_t const * const ids = reinterpret_cast<boost::int64_t const *>(base + h->_chunkOffset);
+    std::vector<Chunk *> chunks(h->_numChunks, 0);
+    std::map<Chunk *, boost::uint32_t> chunkSlots;
+    std::vector<boost::uint32_t> freeChunkSlots;
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (ids[i] == -1) {
+            freeChunkSlots.push_back(static_cast<boost::uint32_t>(i));
+            continue;
+        }
+        chunks[i] = resolver(ids[i]);
+        if (chunks[i] == 0) {
+            throw LSST_EXCEPT(ex::NotFoundError, (boost::format(
+                "chunk %1% of zone index snapshot %2% is not available") % ids[i] % path).str());
+        }
+        chunkSlots.insert(std::make_pair(chunks[i], static_cast<boost::uint32_t>(i)));
+    }
+
+    // point zones at their entries and columns
+    int const numZones = h->_maxZone - h->_minZone + 1;
+    boost::uint64_t const * const offsets = reinterpret_cast<boost::uint64_t const *>(base + h->_zoneOffset);
+    unsigned char * const data = const_cast<unsigned char *>(base);
+    EntryT * const entries = reinterpret_cast<EntryT *>(data + h->_entryOffset);
+    boost::uint32_t * const ra = reinterpret_cast<boost::uint32_t *>(data + h->_raOffset);
+    Coordinate * const x = reinterpret_cast<Coordinate *>(data + h->_xOffset);
+    Coordinate * const y = reinterpret_cast<Coordinate *>(data + h->_yOffset);
+    Coordinate * const z = reinterpret_cast<Coordinate *>(data + h->_zOffset);
+    boost::scoped_array<Zone> zones(new Zone[numZones]);
+    for (int i = 0; i < numZones; ++i) {
+        boost::uint64_t const begin = offsets[i];
+        boost::uint64_t const end = offsets[i + 1];
+        if (end < begin || end > h->_numEntries) {
+            throw LSST_EXCEPT(ex::IoError, (boost::format(
+                "zone index snapshot %1% is truncated or corrupt") % path).str());
+        }
+        Zone & zone = zones[i];
+        zone._entries  = entries + begin;
+        zone._ra       = ra + begin;
+        zone._x        = x + begin;
+        zone._y        = y + begin;
+        zone._z        = z + begin;
+        zone._size     = static_cast<int>(end - begin);
+        zone._numSorted = zone._size;
+        zone._capacity = zone._size;
+        zone._columnCapacity = zone._size;
+        zone._borrowed = true;
+    }
+
+    using std::swap;
+    _zsc.swap(zsc);
+    swap(_zones, zones);
+    _chunks.swap(chunks);
+    _chunkSlots.swap(chunkSlots);
+    _freeChunkSlots.swap(freeChunkSlots);
+    _lastChunk     = 0;
+    _lastChunkSlot = 0;
+    _capacity = numZones;
+    _minZone  = h->_minZone;
+    _maxZone  = h->_maxZone;
+    _snapshot.swap(file);
+    for (int i = 0; i < numZones; ++i) {
+        setZone(_zones[i], i + _minZone);
+    }
+}
+
+
+/**
+ * Finds the entries within @a radius degrees of each of the given positions.
+ *
+ * @pre The index has been sorted.
+ *
+ * @param[in] centers   Cone centers.
+ * @param[in] radius    Cone radius (in degrees), in range [0, 90].
+ * @param[out] results  Set to the entries inside each cone, in the order of @a centers.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::coneQuery(
+    std::vector<Point> const & centers,
+    double const radius,
+    RegionQueryResults<EntryT> & results
+) {
+    if (radius < 0.0 || radius > 90.0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RangeError,
+                          "cone radius must be in range [0, 90] degrees");
+    }
+    std::vector<detail::RegionQuery> queries(centers.size());
+    for (std::size_t i = 0; i < centers.size(); ++i) {
+        queries[i].setCircle(centers[i]._ra, centers[i]._dec, radius);
+        queries[i]._query = static_cast<int>(i);
+    }
+    query(queries, results);
+}
+
+
+/**
+ * Finds the entries inside each of the given circles.
+ *
+ * @pre The index has been sorted.
+ *
+ * @param[in] circles   Circles to search.
+ * @param[out] results  Set to the entries inside each circle, in the order of @a circles.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::circleQuery(
+    std::vector<CircularRegion> const & circles,
+    RegionQueryResults<EntryT> & results
+) {
+    std::vector<detail::RegionQuery> queries(circles.size());
+    for (std::size_t i = 0; i < circles.size(); ++i) {
+        queries[i].setCircle(circles[i].getCenterRa(), circles[i].getCenterDec(),
+                             circles[i].getRadius());
+        queries[i]._query = static_cast<int>(i);
+    }
+    query(queries, results);
+}
+
+
+/**
+ * Finds the entries inside each of the given boxes.
+ *
+ * @pre The index has been sorted.
+ *
+ * @param[in] boxes     Boxes to search.
+ * @param[out] results  Set to the entries inside each box, in the order of @a boxes.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::boxQuery(
+    std::vector<RectangularRegion> const & boxes,
+    RegionQueryResults<EntryT> & results
+) {
+    std::vector<detail::RegionQuery> queries(boxes.size());
+    for (std::size_t i = 0; i < boxes.size(); ++i) {
+        queries[i].setBox(boxes[i]);
+        queries[i]._query = static_cast<int>(i);
+    }
+    query(queries, results);
+}
+
+
+/**
+ * Evaluates a batch of region queries. Queries are sorted by zone (and then right ascension)
+ * so that threads working on adjacent queries touch the same zones, and are then scheduled
+ * dynamically. Each thread appends results to a private buffer; once all queries have been
+ * evaluated, results are copied to @a results in the original query order.
+ */
+template <typename EntryT>
+void lsst::ap::ZoneIndex<EntryT>::query(
+    std::vector<detail::RegionQuery> & queries,
+    RegionQueryResults<EntryT> & results
+) {
+    int const numQueries = static_cast<int>(queries.size());
+    for (int i = 0; i < numQueries; ++i) {
+        queries[i]._minZone = _zsc.decToZone(queries[i]._minDec);
+    }
+    std::sort(queries.begin(), queries.end());
+
+    int numThreads = 1;
+#if LSST_AP_HAVE_OPEN_MP
+    numThreads = ::omp_get_max_threads();
+#endif
+    std::vector<std::vector<EntryT *> > buffers(numThreads);
+    std::vector<std::size_t> begins(numQueries);
+    std::vector<int> threads(numQueries);
+    results._offsets.assign(numQueries + 1, 0);
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared)
+#endif
+    {
+        int thread = 0;
+#if LSST_AP_HAVE_OPEN_MP
+        thread = ::omp_get_thread_num();
+#endif
+        std::vector<EntryT *> & buffer = buffers[thread];
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp for schedule(dynamic,64)
+#endif
+        for (int i = 0; i < numQueries; ++i) {
+            detail::RegionQuery const & q = queries[i];
+            std::size_t const begin = buffer.size();
+            int const maxZone = _zsc.decToZone(q._maxDec);
+            Zone * const end = endZone(q._minZone, maxZone);
+            for (Zone * z = firstZone(q._minZone, maxZone); z < end; ++z) {
+                z->query(q, buffer);
+            }
+            begins[q._query] = begin;
+            threads[q._query] = thread;
+            results._offsets[q._query + 1] = buffer.size() - begin;
+        }
+    }
+
+    for (int i = 0; i < numQueries; ++i) {
+        results._offsets[i + 1] += results._offsets[i];
+    }
+    results._entries.resize(results._offsets[numQueries]);
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               schedule(static,256)
+#endif
+    for (int i = 0; i < numQueries; ++i) {
+        typename std::vector<EntryT *>::const_iterator b = buffers[threads[i]].begin() + begins[i];
+        std::copy(b, b + (results._offsets[i + 1] - results._offsets[i]),
+                  results._entries.begin() + results._offsets[i]);
+    } // end of parallel for
+}
+
+
 #endif // LSST_AP_ZONE_TYPES_CC
@@ -33,12 +33,21 @@
 #ifndef LSST_AP_ZONE_TYPES_H
 #define LSST_AP_ZONE_TYPES_H
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "boost/noncopyable.hpp"
 #include "boost/scoped_array.hpp"
+#include "boost/shared_ptr.hpp"
 
 #include "lsst/daf/base/Citizen.h"
 
 #include "Common.h"
+#include "CircularRegion.h"
+#include "MappedFile.h"
+#include "Point.h"
+#include "RectangularRegion.h"
 #include "SpatialUtil.h"
 
 
@@ -54,6 +63,7 @@ template <typename ChunkT>
 struct ZoneEntry {
     typedef ChunkT Chunk;
     typedef typename ChunkT::Entry Data;
+    typedef double Coordinate; ///< type of zone coordinate columns
 
     Data * _data;   ///< Pointer to the corresponding data object
     boost::uint32_t _ra;    ///< scaled right ascension of entity position
@@ -70,8 +80,38 @@ struct ZoneEntry {
         double const dec,
         Data * const data,
         Chunk * const chunk,
-        int const index
+        boost::uint32_t const chunkSlot,
+        int const index,
+        double const refZ
     );
+
+    /// Full entries point to their chunk and data object, so they cannot be written to snapshots
+    static bool const POSITION_INDEPENDENT = false;
+
+    /** Full entries store absolute coordinates, so zone reference points are at the origin. */
+    static double getReferenceZ(double const) { return 0.0; }
+
+    /** Returns an upper bound on the chord length error of distances computed from zone columns. */
+    static double getCoordinateError() { return 0.0; }
+
+    Coordinate getColumnX() const { return _x; }
+    Coordinate getColumnY() const { return _y; }
+    Coordinate getColumnZ() const { return _z; }
+
+    /** Stores the unit vector position of this entry in (@a x, @a y, @a z). */
+    void getUnitVector(double & x, double & y, double & z) const {
+        x = _x;
+        y = _y;
+        z = _z;
+    }
+
+    /** Returns the squared chord length between this entry and the given unit vector. */
+    double exactDistance2(double const x, double const y, double const z) const {
+        double const dx = x - _x;
+        double const dy = y - _y;
+        double const dz = z - _z;
+        return dx*dx + dy*dy + dz*dz;
+    }
 };
 
 template <typename ChunkT>
@@ -105,20 +145,235 @@ inline bool operator== (ZoneEntry<ChunkT> const & a, boost::uint32_t const b) {
 }
 
 
+/**
+ * @brief   A 32 byte alternative to ZoneEntry for large indexes.
+ *
+ * Rather than pointers to the chunk and data object, a compact entry stores the slot of its
+ * chunk in the owning ZoneIndex (see ZoneIndex::getChunk()) along with the index of the data
+ * object in that chunk. Unit vector coordinates are stored in single precision, as offsets from
+ * the reference point of the zone containing the entry, and the zone coordinate columns are
+ * single precision as well. This roughly halves the memory traffic of index construction and
+ * of the distanceMatch() inner loop. Candidates that are within coordinate rounding error of
+ * the match radius are re-tested in double precision, using positions recomputed from the
+ * scaled integer right ascension and declination of the entry (accurate to about 0.2
+ * milliarcseconds).
+ *
+ * Compact entries can be used for either set of distanceMatch(), variableDistanceMatch() and
+ * nearestMatch(), and with distanceSelfMatch().
+ */
+template <typename ChunkT>
+struct CompactZoneEntry {
+    typedef ChunkT Chunk;
+    typedef typename ChunkT::Entry Data;
+    typedef float Coordinate; ///< type of zone coordinate columns
+
+    boost::uint32_t _ra;        ///< scaled right ascension of entity position
+    boost::int32_t  _dec;       ///< scaled declination of entity position
+    boost::uint32_t _flags;     ///< Reserved
+    boost::uint32_t _chunkSlot; ///< Slot of the chunk containing the data object
+    boost::int32_t  _index;     ///< Index of the data object in the chunk
+    float _dx;      ///< x offset of entity position from the zone reference point
+    float _dy;      ///< y offset of entity position from the zone reference point
+    float _dz;      ///< z offset of entity position from the zone reference point
+
+    inline CompactZoneEntry(
+        double const ra,
+        double const dec,
+        Data * const data,
+        Chunk * const chunk,
+        boost::uint32_t const chunkSlot,
+        int const index,
+        double const refZ
+    );
+
+    /// Compact entries contain no pointers, so indexes of them can be written to snapshots
+    static bool const POSITION_INDEPENDENT = true;
+
+    /** Returns the z coordinate of the reference point (0, 0, z) for a zone centered at @a dec. */
+    static double getReferenceZ(double const dec) { return std::sin(radians(dec)); }
+
+    /**
+     * Returns an upper bound on the chord length error of distances computed from zone columns.
+     *
+     * Column values and query coordinates are offsets of magnitude at most 1 that are rounded
+     * to single precision, with an absolute error of at most 2^-24 (6e-8) each. Subtracting a
+     * column value from a query coordinate in single precision adds the same error again, so
+     * each coordinate difference is off by at most 1.8e-7, and the chord length by at most
+     * sqrt(3) times that, or 3.1e-7. Rounding the squares and their sum adds a relative error of
+     * about 3*2^-24 to the squared chord length, which is at most 4, i.e. less than 2e-7 to
+     * the chord length. Finally, exactDistance2() uses the centers of the scaled integer
+     * position bins, which are within 1e-9 radians of the original position. The returned
+     * value bounds the sum of these (about 5e-7) with a safety factor of 2.
+     */
+    static double getCoordinateError() { return 1.0e-6; }
+
+    Coordinate getColumnX() const { return _dx; }
+    Coordinate getColumnY() const { return _dy; }
+    Coordinate getColumnZ() const { return _dz; }
+
+    inline void getUnitVector(double & x, double & y, double & z) const;
+
+    inline double exactDistance2(double const x, double const y, double const z) const;
+
+    /** Returns a pointer to the data object of this entry, given the chunk containing it. */
+    Data * getData(Chunk & chunk) const {
+        return &chunk.getBlock(_index >> Chunk::ENTRIES_PER_BLOCK_LOG2)[
+            _index & ((1 << Chunk::ENTRIES_PER_BLOCK_LOG2) - 1)];
+    }
+};
+
+template <typename ChunkT>
+inline bool operator< (CompactZoneEntry<ChunkT> const & a, CompactZoneEntry<ChunkT> const & b) {
+    return a._ra < b._ra;
+}
+
+template <typename ChunkT>
+inline bool operator< (boost::uint32_t const a, CompactZoneEntry<ChunkT> const & b) {
+    return a < b._ra;
+}
+
+template <typename ChunkT>
+inline bool operator< (CompactZoneEntry<ChunkT> const & a, boost::uint32_t const b) {
+    return a._ra < b;
+}
+
+
+namespace detail {
+
+/**
+ * @brief  A circular or rectangular region query, in the form evaluated against zones
+ *         by ZoneIndex::coneQuery(), ZoneIndex::circleQuery() and ZoneIndex::boxQuery().
+ */
+struct RegionQuery {
+    double _minDec;
+    double _maxDec;
+    double _x;  ///< unit vector x coordinate of circle center
+    double _y;  ///< unit vector y coordinate of circle center
+    double _z;  ///< unit vector z coordinate of circle center
+    double _d2; ///< squared chord length corresponding to the circle radius
+    boost::uint32_t _ra;      ///< scaled right ascension of the region center
+    boost::uint32_t _deltaRa; ///< scaled right ascension half-width of the region
+    boost::uint32_t _minRa;   ///< scaled minimum right ascension of a box
+    boost::uint32_t _width;   ///< scaled right ascension width of a box
+    boost::int32_t _minDecScaled; ///< scaled minimum declination of a box
+    boost::int32_t _maxDecScaled; ///< scaled maximum declination of a box
+    int _minZone;
+    int _query;  ///< index of the query in the input batch
+    bool _box;
+
+    inline void setCircle(double const ra, double const dec, double const radius);
+    inline void setBox(RectangularRegion const & box);
+
+    bool operator<(RegionQuery const & q) const {
+        return _minZone < q._minZone || (_minZone == q._minZone && _ra < q._ra);
+    }
+};
+
+
+/**
+ * @brief  Header of a ZoneIndex snapshot (see ZoneIndex::writeSnapshot()).
+ *
+ * All other sections of a snapshot are located by their byte offset from the start of the
+ * snapshot, and begin on a SECTION_ALIGNMENT byte boundary. Values are in native byte order.
+ */
+struct ZoneIndexSnapshotHeader {
+    static boost::uint64_t const MAGIC = 0x5a4f4e4549445831ULL; // "ZONEIDX1"
+    static boost::uint32_t const VERSION = 1;
+    static std::size_t const SECTION_ALIGNMENT = 64;
+
+    boost::uint64_t _magic;
+    boost::uint32_t _version;
+    boost::uint32_t _entrySize;      ///< size of a zone entry in bytes
+    boost::uint32_t _coordinateSize; ///< size of a zone column coordinate in bytes
+    boost::int32_t  _zonesPerDegree;
+    boost::int32_t  _zonesPerStripe;
+    boost::int32_t  _maxEntriesPerZoneEstimate;
+    boost::int32_t  _minZone;
+    boost::int32_t  _maxZone;
+    boost::uint32_t _numChunks;
+    boost::uint32_t _reserved;
+    boost::uint64_t _numEntries;
+    boost::uint64_t _zoneOffset;  ///< offset of the zone table: index of the first entry of each zone,
+                                  ///  followed by the total number of entries
+    boost::uint64_t _chunkOffset; ///< offset of the chunk id table, ordered by chunk slot (-1 for free slots)
+    boost::uint64_t _entryOffset; ///< offset of the entries of all zones, in zone order
+    boost::uint64_t _raOffset;    ///< offset of the ra column of all zones
+    boost::uint64_t _xOffset;     ///< offset of the x column of all zones
+    boost::uint64_t _yOffset;     ///< offset of the y column of all zones
+    boost::uint64_t _zOffset;     ///< offset of the z column of all zones
+    boost::uint64_t _size;        ///< total size of the snapshot in bytes
+};
+
+} // end of namespace detail
+
+
+/**
+ * @brief  Results of a batch of region queries against a ZoneIndex, stored in compressed
+ *         sparse row form.
+ *
+ * The entries inside query @c i are <tt>_entries[_offsets[i]]</tt> through (but not including)
+ * <tt>_entries[_offsets[i + 1]]</tt>, grouped by zone. Entry pointers are only valid until the
+ * queried index is next modified.
+ *
+ * Entries are referred to by pointer rather than by index: entries live in per-zone arrays, so
+ * an index would be a (zone, position) pair, which is no smaller than a pointer, is invalidated
+ * by the same index modifications, and costs an extra lookup per result. Offsets are 64 bit,
+ * since a large batch of queries can return more than 2^31 entries in total.
+ */
+template <typename EntryT>
+struct RegionQueryResults {
+    std::vector<std::size_t> _offsets;
+    std::vector<EntryT *> _entries;
+
+    /** Returns the number of queries results are available for. */
+    int getNumQueries() const {
+        return _offsets.empty() ? 0 : static_cast<int>(_offsets.size()) - 1;
+    }
+
+    /** Returns the number of entries inside query @a i. */
+    std::size_t size(int const i) const {
+        return _offsets[i + 1] - _offsets[i];
+    }
+};
+
+
 /**
  * @brief  Stores entries inside a single zone (a narrow declination stripe)
  *         in a sorted array.
+ *
+ * In addition to the array of entries, a zone maintains a structure-of-arrays copy of
+ * the fields read by the inner loop of distance based matching: the scaled right ascension
+ * and the unit vector coordinates of each entry are stored in separate contiguous columns.
+ * Scanning a run of match candidates then only touches memory that is actually used, and
+ * distance tests over a run can be vectorized. The entries themselves (data/chunk pointers,
+ * index, flags) are only accessed for candidates that pass the distance test. The columns
+ * are (re)built by sort(), merge() and pack(), and are only valid after one of these has
+ * been called. Coordinate columns have the precision of @c EntryT::Coordinate, and are
+ * relative to the zone reference point (0, 0, _refZ), which is at the origin for full
+ * precision entries.
  */
 template <typename EntryT>
 struct ZoneEntryArray {
     typedef typename EntryT::Chunk Chunk;
     typedef typename EntryT::Data  Data;
+    typedef typename EntryT::Coordinate Coordinate;
+
+    /// Zones with fewer entries are sorted with std::sort rather than a radix sort
+    static int const MIN_RADIX_SORT_SIZE = 256;
 
     EntryT * _entries;
+    boost::uint32_t * _ra; ///< column of entry scaled right ascensions
+    Coordinate * _x;       ///< column of entry unit vector x coordinates
+    Coordinate * _y;       ///< column of entry unit vector y coordinates
+    Coordinate * _z;       ///< column of entry unit vector z coordinates
     int _size;
+    int _numSorted; ///< number of leading entries known to be sorted on ra
     int _capacity;
+    int _columnCapacity;
     int _zone;
+    double _refZ;          ///< z coordinate of the zone reference point
     boost::uint32_t _deltaRa;
+    bool _borrowed;        ///< entries and columns point into a mapped ZoneIndex snapshot
 
     ZoneEntryArray();
     ~ZoneEntryArray();
@@ -126,24 +381,40 @@ struct ZoneEntryArray {
     void init(int const capacity);
 
     /** Inserts the given data item into the zone. */
-    void insert(double const ra, double const dec, Data * const data, Chunk * const chunk, int const index) {
+    void insert(
+        double const ra,
+        double const dec,
+        Data * const data,
+        Chunk * const chunk,
+        boost::uint32_t const chunkSlot,
+        int const index
+    ) {
         int const sz = _size;
         if (sz == _capacity) {
             grow();
         }
-        new(&_entries[sz]) EntryT(ra, dec, data, chunk, index);
+        new(&_entries[sz]) EntryT(ra, dec, data, chunk, chunkSlot, index, _refZ);
         _size = sz + 1;
     }
 
     void sort();
 
+    void merge();
+
     void grow();
 
+    void buildColumns();
+
+    void swap(ZoneEntryArray & zone);
+
     /** Returns the number of entries in the zone. */
     int size() const { return _size; }
 
     /** Empties the zone (without deallocating/shrinking memory). */
-    void clear() { _size = 0; }
+    void clear() {
+        _size = 0;
+        _numSorted = 0;
+    }
 
     /** Finds the last entry with ra less than or equal to the specified value. */
     int findLte(boost::uint32_t const ra) {
@@ -187,10 +458,34 @@ struct ZoneEntryArray {
         return (i == end) ? 0 : i;
     }
 
+    /**
+     * Returns the length of the run of consecutive entries (with ra wrap-around) starting
+     * at entry @a i that have right ascension within @a deltaRa of @a ra. Uses the zone
+     * ra column, so the zone must have been sorted.
+     */
+    int countInRaRange(int const i, boost::uint32_t const ra, boost::uint32_t const deltaRa) const {
+        boost::uint32_t const * const raCol = _ra;
+        boost::uint32_t const deltaRaWrap = -deltaRa;
+        int const sz = _size;
+        int n = 0;
+        for (int e = i; n < sz; ++n) {
+            boost::uint32_t const dra = ra - raCol[e];
+            if (dra > deltaRa && dra < deltaRaWrap) {
+                break;
+            }
+            if (++e == sz) {
+                e = 0; // ra wrap around
+            }
+        }
+        return n;
+    }
+
     void computeMatchParams(ZoneStripeChunkDecomposition const & zsc, double const radius);
 
     template <typename FilterT> int pack (FilterT & filter);
     template <typename FunctionT> void apply(FunctionT & function);
+
+    void query(detail::RegionQuery const & query, std::vector<EntryT *> & results);
 };
 
 
@@ -216,23 +511,69 @@ public :
 
     int size() const;
 
+    void setDecomposition(
+        int const zonesPerDegree,
+        int const zonesPerStripe,
+        int const maxEntriesPerZoneEstimate
+    );
+
     void setDecBounds(double const minDec, double const maxDec);
 
+    void changeDecBounds(double const minDec, double const maxDec);
+
     void computeMatchParams(double const radius);
 
     void sort();
 
+    void merge();
+
     template <typename FilterT> int pack(FilterT & filter);
     template <typename FunctionT> void apply(FunctionT & function);
 
-    /** Inserts the given data item from the given chunk into the index. */
+    template <typename ChunkIdT>
+    void writeSnapshot(std::string const & path, ChunkIdT & chunkId) const;
+    template <typename ChunkResolverT>
+    void mapSnapshot(std::string const & path, ChunkResolverT & resolver);
+
+    /** Returns @c true if the entries of the index belong to a mapped snapshot. */
+    bool isMapped() const { return _snapshot.get() != 0; }
+
+    void coneQuery(
+        std::vector<Point> const & centers,
+        double const radius,
+        RegionQueryResults<EntryT> & results
+    );
+    void circleQuery(
+        std::vector<CircularRegion> const & circles,
+        RegionQueryResults<EntryT> & results
+    );
+    void boxQuery(
+        std::vector<RectangularRegion> const & boxes,
+        RegionQueryResults<EntryT> & results
+    );
+
+    /**
+     * Inserts the given data item from the given chunk into the index, at the given position
+     * (which may differ from that of the data item, e.g. after proper motion correction).
+     */
     void insert(double const ra, double const dec, Data * const data, Chunk * const chunk, int const index) {
-        int const zone = _zsc.decToZone(data->getDec());
+        int const zone = _zsc.decToZone(dec);
         if (zone >= _minZone && zone <= _maxZone) {
-            _zones[zone - _minZone].insert(ra, dec, data, chunk, index);
+            if (chunk != _lastChunk || _chunks.empty()) {
+                _lastChunkSlot = getChunkSlot(chunk);
+                _lastChunk = chunk;
+            }
+            _zones[zone - _minZone].insert(ra, dec, data, chunk, _lastChunkSlot, index);
         }
     }
 
+    void releaseChunk(Chunk * const chunk);
+
+    /** Returns the chunk with the given slot (see CompactZoneEntry). */
+    Chunk * getChunk(boost::uint32_t const slot) const {
+        return _chunks[slot];
+    }
+
     /** Returns the smallest zone id in the index. */
     int getMinZone() const { return _minZone; }
 
@@ -286,9 +627,22 @@ private :
 
     ZoneStripeChunkDecomposition _zsc;
     boost::scoped_array<Zone> _zones;
+    std::vector<Chunk *> _chunks; ///< chunks of index entries, by slot (0 for free slots)
+    std::map<Chunk *, boost::uint32_t> _chunkSlots; ///< slots of chunks in @a _chunks
+    std::vector<boost::uint32_t> _freeChunkSlots;   ///< slots released by releaseChunk()
+    Chunk * _lastChunk;
+    boost::uint32_t _lastChunkSlot;
     int _capacity;
     int _minZone;
     int _maxZone;
+    boost::shared_ptr<MappedFile> _snapshot; ///< snapshot the zones borrow their entries from
+
+    boost::uint32_t getChunkSlot(Chunk * const chunk);
+    void clearChunkSlots();
+    void detach();
+    void checkWritable() const;
+    void setZone(Zone & zone, int const zoneId) const;
+    void query(std::vector<detail::RegionQuery> & queries, RegionQueryResults<EntryT> & results);
 };
 
 
@@ -37,9 +37,12 @@
 #include <zlib.h>
 
 #include <string>
+#include <vector>
 
+#include "boost/cstdint.hpp"
 #include "boost/noncopyable.hpp"
 #include "boost/scoped_array.hpp"
+#include "boost/scoped_ptr.hpp"
 
 #include "../Common.h"
 
@@ -156,11 +159,16 @@ private :
 };
 
 
+class BlockedCompressedFileReader;
+
+
 /**
  * @brief   A sequential reader for compressed files that uses asynchronous IO
  *          to overlap IO with decompression.
  *
  * Gzip compatible files, or files written with zlib compression can be read by this class.
+ * Files written by BlockedCompressedFileWriter are detected, and are decompressed in
+ * parallel by a BlockedCompressedFileReader.
  */
 class CompressedFileReader : public SequentialReader {
 
@@ -186,6 +194,7 @@ private :
     std::size_t       _fileSize;  ///< Size of the file being read
     std::size_t       _remaining; ///< Bytes that haven't yet been read
     int               _fd;        ///< file descriptor
+    boost::scoped_ptr<BlockedCompressedFileReader> _blocked; ///< reader for blocked files
 
     void cleanup();
     void cleanup(State const state) {
@@ -236,6 +245,124 @@ private :
 };
 
 
+/**
+ * @brief   A writer for blocked gzip files, which compresses blocks of data in parallel.
+ *
+ * Data is split into blocks of a fixed uncompressed size, each of which is written as an
+ * independent gzip member whose header records its compressed size. The compressed size of
+ * every block is also written to an index following the last block, which is in turn
+ * followed by a fixed size footer locating the index. The index and footer are stored in
+ * the extra fields of empty gzip members, so files remain readable by gzip. Batches of
+ * blocks are compressed in parallel when OpenMP is available.
+ */
+class BlockedCompressedFileWriter :
+    public  SequentialWriter,
+    private boost::noncopyable
+{
+
+public :
+
+    explicit BlockedCompressedFileWriter(
+        std::string const & fileName,
+        bool        const   overwrite  = false,
+        std::size_t const   blockSize  = 262144,
+        int         const   numThreads = 0
+    );
+
+    virtual ~BlockedCompressedFileWriter();
+
+    virtual void write(unsigned char const * const buf, std::size_t const len);
+    virtual void finish();
+
+    std::size_t getBlockSize() const { return _blockSize; }
+
+private :
+
+    std::vector<unsigned char>   _input;       ///< uncompressed data of the current batch
+    std::vector<unsigned char>   _output;      ///< one compressed member slot per batch block
+    std::vector<std::size_t>     _memberSizes; ///< size of each member in the current batch
+    std::vector<boost::uint32_t> _index;       ///< size of each member written so far
+    std::size_t const _blockSize;     ///< uncompressed bytes per block
+    std::size_t       _batchBlocks;   ///< blocks compressed per batch
+    std::size_t       _maxMemberSize; ///< upper bound on the size of a member
+    std::size_t       _fill;          ///< uncompressed bytes in the current batch
+    boost::uint64_t   _offset;        ///< compressed bytes written
+    boost::uint64_t   _size;          ///< uncompressed bytes written
+    int               _fd;
+
+    void flushBatch();
+    void writeFully(unsigned char const * buf, std::size_t len);
+    void cleanup();
+    void cleanup(State const state) {
+        cleanup();
+        _state = state;
+    }
+};
+
+
+/**
+ * @brief   A reader for files written by BlockedCompressedFileWriter, which decompresses
+ *          blocks of data in parallel.
+ *
+ * Besides sequential reads, any block can be decompressed on its own, since the file
+ * offset of every block is known from the index.
+ */
+class BlockedCompressedFileReader :
+    public  SequentialReader,
+    private boost::noncopyable
+{
+
+public :
+
+    explicit BlockedCompressedFileReader(
+        std::string const & fileName,
+        int         const   numThreads = 0
+    );
+    BlockedCompressedFileReader(
+        int         const   fd,
+        std::string const & fileName,
+        int         const   numThreads = 0
+    );
+
+    virtual ~BlockedCompressedFileReader();
+    virtual std::size_t read(unsigned char * const buf, std::size_t const len);
+
+    std::size_t readBlock(std::size_t const block, unsigned char * const buf) const;
+    void seekBlock(std::size_t const block);
+
+    /// Returns the number of uncompressed bytes in each block (except perhaps the last).
+    std::size_t getBlockSize() const { return _blockSize; }
+    /// Returns the number of blocks in the file.
+    std::size_t getNumBlocks() const { return _offsets.empty() ? 0 : _offsets.size() - 1; }
+    /// Returns the number of uncompressed bytes in the file.
+    boost::uint64_t getSize() const { return _size; }
+
+private :
+
+    std::vector<boost::uint64_t> _offsets;    ///< file offset of each block, then of the index
+    std::vector<unsigned char>   _batch;      ///< decompressed data of the current batch
+    std::vector<unsigned char>   _compressed; ///< one compressed member slot per batch block
+    std::size_t     _blockSize;
+    std::size_t     _batchBlocks; ///< blocks decompressed per batch
+    std::size_t     _maxMemberSize;
+    std::size_t     _nextBlock;   ///< index of the first block not yet decompressed
+    std::size_t     _pos;         ///< offset of the next byte to return from the current batch
+    std::size_t     _end;         ///< number of bytes in the current batch
+    boost::uint64_t _size;
+    int             _fd;
+
+    void init(int const fd, std::string const & fileName);
+    std::size_t blockBytes(std::size_t const block, std::size_t const n) const;
+    char const * decodeBlock(std::size_t const block, unsigned char * dst, unsigned char * scratch) const;
+    void decodeBlocks(std::size_t const block, std::size_t const n, unsigned char * dst);
+    void cleanup();
+    void cleanup(State const state) {
+        cleanup();
+        _state = state;
+    }
+};
+
+
 }}}  // end of namespace lsst::ap::io
 
 #endif // LSST_AP_IO_FILE_IO_H
@@ -80,6 +80,9 @@ class LoadStage(harness.Stage.Stage):
           precision value in MJD (TAI)
         - [optionally] a match radius given by the 'matchRadius' key (with a double
           precision value in units of arc-seconds).
+        - [optionally] the position of the next scheduled visit center, given by keys
+          'nextRa' and 'nextDecl' (both with double precision values in units of degrees).
+        The event is returned.
         """
         clipboard = self.inputQueue.getNextDataset()
         event = clipboard.get('triggerAssociationEvent')
@@ -88,19 +91,25 @@ class LoadStage(harness.Stage.Stage):
         )
         clipboard.put('vpContext', self.vpContext)
         self.outputQueue.addDataset(clipboard)
+        return event
 
     def preprocess(self):
         """
-        Registers the incoming visit with the shared memory chunk manager.
+        Registers the incoming visit with the shared memory chunk manager. If the
+        position of the next scheduled visit is known, chunks for it are prefetched
+        in the background.
         """
         assert self.inputQueue.size() == 1
         assert self.outputQueue.size() == 0
         if self._firstVisit:
             self._massagePolicy()
-            ap.initialize(str(self.getRun()))
+            ap.initialize(self._policy, str(self.getRun()))
             self._firstVisit = False
-        self.makeVpContext()
+        event = self.makeVpContext()
         ap.registerVisit(self.vpContext)
+        if event.exists('nextRa') and event.exists('nextDecl'):
+            ap.prefetchVisit(self.vpContext, event.getAsDouble('nextRa'),
+                             event.getAsDouble('nextDecl'))
 
     def process(self):
         """
@@ -110,7 +119,7 @@ class LoadStage(harness.Stage.Stage):
         assert self.outputQueue.size() == 0
         if self._firstVisit:
             self._massagePolicy()
-            ap.initialize(str(self.getRun()))
+            ap.initialize(self._policy, str(self.getRun()))
             self._firstVisit = False
         self.makeVpContext()
         ap.loadSliceObjects(self.vpContext)
@@ -0,0 +1,590 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Implementation of the columnar binary chunk file format.
+ *
+ * @ingroup ap
+ */
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "boost/format.hpp"
+#include "boost/scoped_array.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/ChunkFormat.h"
+
+namespace ex = lsst::pex::exceptions;
+
+
+namespace lsst { namespace ap { namespace detail {
+
+namespace {
+
+boost::uint64_t const SIGN_BIT = UINT64_C(0x8000000000000000);
+
+inline boost::uint64_t zigzag(boost::uint64_t const d) {
+    return (d << 1) ^ static_cast<boost::uint64_t>(static_cast<boost::int64_t>(d) >> 63);
+}
+
+inline boost::uint64_t unzigzag(boost::uint64_t const u) {
+    return (u >> 1) ^ (~(u & 1) + 1);
+}
+
+/// Maps the bits of a double to an unsigned integer with the same ordering as the double.
+inline boost::uint64_t toOrdered(double const v) {
+    boost::uint64_t u;
+    std::memcpy(&u, &v, sizeof(double));
+    return (u & SIGN_BIT) != 0 ? ~u : (u | SIGN_BIT);
+}
+
+inline double fromOrdered(boost::uint64_t u) {
+    u = (u & SIGN_BIT) != 0 ? (u & ~SIGN_BIT) : ~u;
+    double v;
+    std::memcpy(&v, &u, sizeof(double));
+    return v;
+}
+
+inline boost::uint64_t bitsOf(boost::int64_t const v) {
+    return static_cast<boost::uint64_t>(v);
+}
+
+inline boost::uint64_t bitsOf(double const v) {
+    return toOrdered(v);
+}
+
+void appendVarint(std::vector<unsigned char> & out, boost::uint64_t u) {
+    while (u >= 0x80) {
+        out.push_back(static_cast<unsigned char>(u | 0x80));
+        u >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(u));
+}
+
+template <typename T>
+void appendRaw(std::vector<unsigned char> & out, T const * values, int const n) {
+    unsigned char const * const p = reinterpret_cast<unsigned char const *>(values);
+    out.insert(out.end(), p, p + sizeof(T)*n);
+}
+
+/// Appends zig-zag varints of the differences between successive (ordered) values.
+template <typename T>
+void appendDeltas(std::vector<unsigned char> & out, T const * values, int const n) {
+    boost::uint64_t prev = 0;
+    for (int i = 0; i < n; ++i) {
+        boost::uint64_t const u = bitsOf(values[i]);
+        appendVarint(out, zigzag(u - prev));
+        prev = u;
+    }
+}
+
+/// Appends the number of non-zero values, then the index gap and raw value of each one.
+template <typename T>
+void appendSparse(std::vector<unsigned char> & out, T const * values, int const n) {
+    int numNonZero = 0;
+    for (int i = 0; i < n; ++i) {
+        boost::uint64_t u;
+        std::memcpy(&u, &values[i], sizeof(u));
+        numNonZero += (u != 0);
+    }
+    appendVarint(out, static_cast<boost::uint64_t>(numNonZero));
+    int next = 0;
+    for (int i = 0; i < n; ++i) {
+        boost::uint64_t u;
+        std::memcpy(&u, &values[i], sizeof(u));
+        if (u != 0) {
+            appendVarint(out, static_cast<boost::uint64_t>(i - next));
+            appendRaw(out, &values[i], 1);
+            next = i + 1;
+        }
+    }
+}
+
+/// Appends @a data to @a out, recording its encoding, size and checksum in @a header.
+void finishColumn(
+    ColumnHeader & header,
+    std::vector<unsigned char> & out,
+    std::vector<unsigned char> const & data,
+    ColumnHeader::Encoding const encoding
+) {
+    header._encoding = static_cast<boost::uint8_t>(encoding);
+    header._size = data.size();
+    header._checksum = static_cast<boost::uint32_t>(::crc32(0L, data.empty() ? 0 : &data[0],
+                                                            static_cast<uInt>(data.size())));
+    out.insert(out.end(), data.begin(), data.end());
+}
+
+} // end of anonymous namespace
+
+
+// -- Column encoding ----------------
+
+/**
+ * Appends the encoding of the given 64 bit integers to @a out: raw or delta encoded,
+ * whichever is smaller.
+ */
+void encodeColumn(
+    ColumnHeader & header,
+    std::vector<unsigned char> & out,
+    boost::int64_t const * values,
+    int const n
+) {
+    std::vector<unsigned char> delta;
+    delta.reserve(sizeof(boost::int64_t)*n);
+    appendDeltas(delta, values, n);
+    header._width = 0;
+    if (delta.size() < sizeof(boost::int64_t)*n) {
+        finishColumn(header, out, delta, ColumnHeader::DELTA);
+    } else {
+        delta.clear();
+        appendRaw(delta, values, n);
+        finishColumn(header, out, delta, ColumnHeader::RAW);
+    }
+}
+
+
+/**
+ * Appends the encoding of the given doubles to @a out: raw, delta or sparse encoded,
+ * whichever is smallest. Values are reproduced bit for bit when decoded.
+ */
+void encodeColumn(
+    ColumnHeader & header,
+    std::vector<unsigned char> & out,
+    double const * values,
+    int const n
+) {
+    std::vector<unsigned char> best;
+    std::vector<unsigned char> candidate;
+    ColumnHeader::Encoding encoding = ColumnHeader::SPARSE;
+    appendSparse(best, values, n);
+    appendDeltas(candidate, values, n);
+    if (candidate.size() < best.size()) {
+        best.swap(candidate);
+        encoding = ColumnHeader::DELTA;
+    }
+    if (sizeof(double)*n < best.size()) {
+        best.clear();
+        appendRaw(best, values, n);
+        encoding = ColumnHeader::RAW;
+    }
+    header._width = 0;
+    finishColumn(header, out, best, encoding);
+}
+
+
+/**
+ * Appends the encoding of the given 16 bit integers to @a out: the minimum value, followed
+ * by the difference between each value and the minimum in as few bits as possible.
+ */
+void encodeColumn(
+    ColumnHeader & header,
+    std::vector<unsigned char> & out,
+    boost::int16_t const * values,
+    int const n
+) {
+    boost::int16_t minValue = 0;
+    boost::int16_t maxValue = 0;
+    if (n > 0) {
+        minValue = *std::min_element(values, values + n);
+        maxValue = *std::max_element(values, values + n);
+    }
+    boost::uint32_t const range = static_cast<boost::uint32_t>(static_cast<int>(maxValue) - minValue);
+    int width = 0;
+    while ((range >> width) != 0) {
+        ++width;
+    }
+    std::vector<unsigned char> data;
+    data.reserve(sizeof(boost::int16_t) + (static_cast<std::size_t>(n)*width + 7)/8);
+    appendRaw(data, &minValue, 1);
+    boost::uint32_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < n && width > 0; ++i) {
+        acc |= static_cast<boost::uint32_t>(static_cast<int>(values[i]) - minValue) << bits;
+        bits += width;
+        while (bits >= 8) {
+            data.push_back(static_cast<unsigned char>(acc));
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0) {
+        data.push_back(static_cast<unsigned char>(acc));
+    }
+    header._width = static_cast<boost::uint8_t>(width);
+    finishColumn(header, out, data, ColumnHeader::BIT_PACKED);
+}
+
+
+// -- ColumnDecoder ----------------
+
+ColumnDecoder::ColumnDecoder(ColumnHeader const & header, unsigned char const * const data) :
+    _cur(data),
+    _end(data + header._size),
+    _encoding(header._encoding),
+    _width(header._width),
+    _index(0),
+    _nextNonZero(-1),
+    _numNonZero(0),
+    _prev(0),
+    _bit(0)
+{
+    if (_encoding == ColumnHeader::SPARSE) {
+        boost::uint64_t const numNonZero = decodeVarint();
+        if (numNonZero > 0x7fffffff) {
+            throw LSST_EXCEPT(ex::IoError, "malformed sparse chunk file column");
+        }
+        _numNonZero = static_cast<int>(numNonZero);
+        decodeNextNonZero(0);
+    } else if (_encoding == ColumnHeader::BIT_PACKED) {
+        if (_width > 16 || _end - _cur < static_cast<std::ptrdiff_t>(sizeof(boost::int16_t))) {
+            throw LSST_EXCEPT(ex::IoError, "malformed bit-packed chunk file column");
+        }
+    } else if (_encoding != ColumnHeader::RAW && _encoding != ColumnHeader::DELTA) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("unknown chunk file column encoding %1%") % _encoding).str());
+    }
+}
+
+
+boost::uint64_t ColumnDecoder::decodeVarint() {
+    boost::uint64_t u = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (_cur == _end) {
+            break;
+        }
+        unsigned char const c = *_cur++;
+        u |= static_cast<boost::uint64_t>(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return u;
+        }
+    }
+    throw LSST_EXCEPT(ex::IoError, "malformed varint in chunk file column");
+}
+
+
+/// Decodes the index of the next non-zero value of a sparse column, given the index following the last one.
+void ColumnDecoder::decodeNextNonZero(int const base) {
+    if (_numNonZero == 0) {
+        _nextNonZero = -1;
+        return;
+    }
+    boost::uint64_t const gap = decodeVarint();
+    if (gap > 0x7fffffff || static_cast<boost::uint64_t>(base) + gap > 0x7fffffff) {
+        throw LSST_EXCEPT(ex::IoError, "malformed sparse chunk file column");
+    }
+    _nextNonZero = base + static_cast<int>(gap);
+    --_numNonZero;
+}
+
+
+/** Decodes the next @a n values of a 64 bit integer column, storing them @a stride bytes apart. */
+void ColumnDecoder::decode(boost::int64_t * dst, std::size_t const stride, int const n) {
+    unsigned char * d = reinterpret_cast<unsigned char *>(dst);
+    if (_encoding == ColumnHeader::DELTA) {
+        for (int i = 0; i < n; ++i, d += stride) {
+            _prev += unzigzag(decodeVarint());
+            boost::int64_t const v = static_cast<boost::int64_t>(_prev);
+            std::memcpy(d, &v, sizeof(v));
+        }
+    } else if (_encoding == ColumnHeader::RAW) {
+        if (_end - _cur < static_cast<std::ptrdiff_t>(sizeof(boost::int64_t))*n) {
+            throw LSST_EXCEPT(ex::IoError, "truncated chunk file column");
+        }
+        for (int i = 0; i < n; ++i, d += stride, _cur += sizeof(boost::int64_t)) {
+            std::memcpy(d, _cur, sizeof(boost::int64_t));
+        }
+    } else {
+        throw LSST_EXCEPT(ex::IoError, "invalid encoding for an integer chunk file column");
+    }
+    _index += n;
+}
+
+
+/** Decodes the next @a n values of a double column, storing them @a stride bytes apart. */
+void ColumnDecoder::decode(double * dst, std::size_t const stride, int const n) {
+    unsigned char * d = reinterpret_cast<unsigned char *>(dst);
+    if (_encoding == ColumnHeader::DELTA) {
+        for (int i = 0; i < n; ++i, d += stride) {
+            _prev += unzigzag(decodeVarint());
+            double const v = fromOrdered(_prev);
+            std::memcpy(d, &v, sizeof(v));
+        }
+    } else if (_encoding == ColumnHeader::SPARSE) {
+        int const end = _index + n;
+        for (int i = _index; i < end; ++i, d += stride) {
+            if (i != _nextNonZero) {
+                std::memset(d, 0, sizeof(double));
+                continue;
+            }
+            if (_end - _cur < static_cast<std::ptrdiff_t>(sizeof(double))) {
+                throw LSST_EXCEPT(ex::IoError, "truncated chunk file column");
+            }
+            std::memcpy(d, _cur, sizeof(double));
+            _cur += sizeof(double);
+            decodeNextNonZero(i + 1);
+        }
+    } else if (_encoding == ColumnHeader::RAW) {
+        if (_end - _cur < static_cast<std::ptrdiff_t>(sizeof(double))*n) {
+            throw LSST_EXCEPT(ex::IoError, "truncated chunk file column");
+        }
+        for (int i = 0; i < n; ++i, d += stride, _cur += sizeof(double)) {
+            std::memcpy(d, _cur, sizeof(double));
+        }
+    } else {
+        throw LSST_EXCEPT(ex::IoError, "invalid encoding for a floating point chunk file column");
+    }
+    _index += n;
+}
+
+
+/** Decodes the next @a n values of a 16 bit integer column, storing them @a stride bytes apart. */
+void ColumnDecoder::decode(boost::int16_t * dst, std::size_t const stride, int const n) {
+    unsigned char * d = reinterpret_cast<unsigned char *>(dst);
+    if (_encoding != ColumnHeader::BIT_PACKED) {
+        throw LSST_EXCEPT(ex::IoError, "invalid encoding for a 16 bit integer chunk file column");
+    }
+    boost::int16_t minValue;
+    std::memcpy(&minValue, _cur, sizeof(minValue));
+    unsigned char const * const packed = _cur + sizeof(boost::int16_t);
+    std::size_t const numBytes = static_cast<std::size_t>(_end - packed);
+    if ((static_cast<std::size_t>(_index + n)*_width + 7)/8 > numBytes) {
+        throw LSST_EXCEPT(ex::IoError, "truncated chunk file column");
+    }
+    boost::uint32_t const mask = (1u << _width) - 1;
+    for (int i = 0; i < n; ++i, d += stride) {
+        boost::uint32_t v = 0;
+        if (_width > 0) {
+            // a value spans at most 3 bytes
+            int const byte = _bit >> 3;
+            boost::uint32_t w = packed[byte];
+            if (byte + 1 < static_cast<int>(numBytes)) {
+                w |= static_cast<boost::uint32_t>(packed[byte + 1]) << 8;
+            }
+            if (byte + 2 < static_cast<int>(numBytes)) {
+                w |= static_cast<boost::uint32_t>(packed[byte + 2]) << 16;
+            }
+            v = (w >> (_bit & 7)) & mask;
+            _bit += _width;
+        }
+        boost::int16_t const value = static_cast<boost::int16_t>(minValue + static_cast<int>(v));
+        std::memcpy(d, &value, sizeof(value));
+    }
+    _index += n;
+}
+
+
+/**
+ * Checks that all the data of a column has been decoded.
+ *
+ * @throw lsst::pex::exceptions::IoError
+ *      Thrown if the column contains more values than were decoded.
+ */
+void ColumnDecoder::finish() const {
+    bool complete;
+    if (_encoding == ColumnHeader::BIT_PACKED) {
+        complete = static_cast<std::size_t>(_end - _cur) ==
+                   sizeof(boost::int16_t) + (static_cast<std::size_t>(_bit) + 7)/8;
+    } else if (_encoding == ColumnHeader::SPARSE) {
+        complete = _cur == _end && _nextNonZero < 0;
+    } else {
+        complete = _cur == _end;
+    }
+    if (!complete) {
+        throw LSST_EXCEPT(ex::IoError, "chunk file column contains more values than the chunk");
+    }
+}
+
+} // end of namespace detail
+
+
+// -- ColumnarFormat<Object> ----------------
+
+namespace {
+
+void readFully(io::SequentialReader & reader, unsigned char * dst, std::size_t len) {
+    while (len > 0) {
+        std::size_t const nb = reader.read(dst, len);
+        if (nb == 0) {
+            throw LSST_EXCEPT(ex::IoError, "Unexpected end of file");
+        }
+        dst += nb;
+        len -= nb;
+    }
+}
+
+template <typename T>
+void gather(
+    std::vector<T> & values,
+    Object const * const * blocks,
+    int const entriesPerBlockLog2,
+    int const numRecords,
+    T Object::* field
+) {
+    int const mask = (1 << entriesPerBlockLog2) - 1;
+    values.resize(numRecords);
+    for (int i = 0; i < numRecords; ++i) {
+        values[i] = blocks[i >> entriesPerBlockLog2][i & mask].*field;
+    }
+}
+
+} // end of anonymous namespace
+
+
+/**
+ * Writes the given chunk entries to a columnar chunk file.
+ *
+ * @param[in] writer                The sequential writer for the file.
+ * @param[in] blocks                Pointers to the blocks of entries to write.
+ * @param[in] entriesPerBlockLog2   The base 2 logarithm of the number of entries per block.
+ * @param[in] numRecords            The number of entries to write.
+ */
+void ColumnarFormat<Object>::write(
+    io::SequentialWriter & writer,
+    Object const * const * blocks,
+    int const entriesPerBlockLog2,
+    int const numRecords
+) {
+    ColumnarChunkHeader header;
+    header._numColumns = NUM_COLUMNS;
+    header._numRecords = numRecords;
+    header._recordSize = sizeof(Object);
+
+    ColumnHeader columns[NUM_COLUMNS];
+    std::memset(columns, 0, sizeof(columns));
+    std::vector<unsigned char> data;
+    data.reserve(static_cast<std::size_t>(numRecords)*24);
+    {
+        std::vector<boost::int64_t> ids;
+        gather(ids, blocks, entriesPerBlockLog2, numRecords, &Object::_objectId);
+        detail::encodeColumn(columns[0], data, ids.empty() ? 0 : &ids[0], numRecords);
+    }
+    double Object::* const doubles[6] = {
+        &Object::_ra, &Object::_decl, &Object::_muRa, &Object::_muDecl,
+        &Object::_parallax, &Object::_radialVelocity
+    };
+    std::vector<double> values;
+    for (int c = 0; c < 6; ++c) {
+        gather(values, blocks, entriesPerBlockLog2, numRecords, doubles[c]);
+        detail::encodeColumn(columns[1 + c], data, values.empty() ? 0 : &values[0], numRecords);
+    }
+    std::vector<boost::int16_t> probs(numRecords);
+    int const mask = (1 << entriesPerBlockLog2) - 1;
+    for (int f = 0; f < Object::NUM_FILTERS; ++f) {
+        for (int i = 0; i < numRecords; ++i) {
+            probs[i] = blocks[i >> entriesPerBlockLog2][i & mask]._varProb[f];
+        }
+        detail::encodeColumn(columns[7 + f], data, probs.empty() ? 0 : &probs[0], numRecords);
+    }
+
+    writer.write(reinterpret_cast<unsigned char const *>(&header), sizeof(ColumnarChunkHeader));
+    writer.write(reinterpret_cast<unsigned char const *>(columns), sizeof(columns));
+    if (!data.empty()) {
+        writer.write(&data[0], data.size());
+    }
+}
+
+
+/**
+ * Reads the entries of a columnar chunk file, the header of which has already been read.
+ * The blocks must have space for the number of entries in the header.
+ *
+ * @param[in] reader                The sequential reader for the file.
+ * @param[in] header                The header of the file.
+ * @param[in] blocks                Pointers to the blocks to store entries in.
+ * @param[in] entriesPerBlockLog2   The base 2 logarithm of the number of entries per block.
+ *
+ * @throw lsst::pex::exceptions::IoError
+ *      Thrown if the file is truncated, malformed or fails a checksum test.
+ */
+void ColumnarFormat<Object>::read(
+    io::SequentialReader & reader,
+    ColumnarChunkHeader const & header,
+    Object * const * blocks,
+    int const entriesPerBlockLog2
+) {
+    int const numRecords = header._numRecords;
+    if (header._numColumns != NUM_COLUMNS || header._recordSize != sizeof(Object) || numRecords < 0) {
+        throw LSST_EXCEPT(ex::IoError, "columnar chunk file does not contain Object records");
+    }
+    ColumnHeader columns[NUM_COLUMNS];
+    readFully(reader, reinterpret_cast<unsigned char *>(columns), sizeof(columns));
+
+    // no encoding takes more than a varint and a value per entry, plus a varint per column
+    std::size_t const maxColumnSize = static_cast<std::size_t>(numRecords)*18 + 10;
+    std::size_t size = 0;
+    std::size_t offsets[NUM_COLUMNS];
+    for (int c = 0; c < NUM_COLUMNS; ++c) {
+        if (columns[c]._size > maxColumnSize) {
+            throw LSST_EXCEPT(ex::IoError, "chunk file column is too large");
+        }
+        offsets[c] = size;
+        size += static_cast<std::size_t>(columns[c]._size);
+    }
+    boost::scoped_array<unsigned char> data(new unsigned char[size + 1]);
+    readFully(reader, data.get(), size);
+    for (int c = 0; c < NUM_COLUMNS; ++c) {
+        boost::uint32_t const checksum = static_cast<boost::uint32_t>(
+            ::crc32(0L, data.get() + offsets[c], static_cast<uInt>(columns[c]._size)));
+        if (checksum != columns[c]._checksum) {
+            throw LSST_EXCEPT(ex::IoError,
+                (boost::format("checksum mismatch in column %1% of chunk file") % c).str());
+        }
+    }
+
+    std::vector<detail::ColumnDecoder> decoders;
+    decoders.reserve(NUM_COLUMNS);
+    for (int c = 0; c < NUM_COLUMNS; ++c) {
+        decoders.push_back(detail::ColumnDecoder(columns[c], data.get() + offsets[c]));
+    }
+    // decode a block at a time, so that the entries being filled in stay in cache
+    std::size_t const stride = sizeof(Object);
+    for (int i = 0, b = 0; i < numRecords; ++b) {
+        int const n = std::min(1 << entriesPerBlockLog2, numRecords - i);
+        Object * const o = blocks[b];
+        std::memset(o, 0, n*sizeof(Object));
+        decoders[0].decode(&o->_objectId, stride, n);
+        decoders[1].decode(&o->_ra, stride, n);
+        decoders[2].decode(&o->_decl, stride, n);
+        decoders[3].decode(&o->_muRa, stride, n);
+        decoders[4].decode(&o->_muDecl, stride, n);
+        decoders[5].decode(&o->_parallax, stride, n);
+        decoders[6].decode(&o->_radialVelocity, stride, n);
+        for (int f = 0; f < Object::NUM_FILTERS; ++f) {
+            decoders[7 + f].decode(&o->_varProb[f], stride, n);
+        }
+        i += n;
+    }
+    for (int c = 0; c < NUM_COLUMNS; ++c) {
+        decoders[c].finish();
+    }
+}
+
+}} // end of namespace lsst::ap
@@ -0,0 +1,238 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   ChunkLoader class implementation.
+ *
+ * @ingroup ap
+ */
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "boost/bind.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/ChunkLoader.h"
+#include "lsst/ap/Time.h"
+
+namespace ex = lsst::pex::exceptions;
+
+
+namespace lsst { namespace ap {
+
+namespace {
+
+/**
+ * Returns the size of the file with the given name, or 0 if it does not exist. Missing chunk
+ * and chunk delta files are treated as empty by ChunkRef::read() and ChunkRef::readDelta().
+ */
+unsigned long long fileSize(std::string const & name) {
+    struct ::stat buf;
+    if (::stat(name.c_str(), &buf) != 0) {
+        return 0;
+    }
+    return static_cast<unsigned long long>(buf.st_size);
+}
+
+} // end of anonymous namespace
+
+
+/**
+ * Creates a pool of @a numThreads threads (including the thread calling load()). The number
+ * of threads is clamped to [1, MAX_THREADS].
+ */
+ChunkLoader::ChunkLoader(int const numThreads) :
+    _loadMutex(),
+    _mutex(),
+    _workAvailable(),
+    _workDone(),
+    _threads(),
+    _chunks(0),
+    _refNames(0),
+    _deltaNames(0),
+    _stats(0),
+    _next(0),
+    _numBusy(0),
+    _failure(),
+    _stop(false)
+{
+    int const n = std::min(std::max(numThreads, 1), static_cast<int>(MAX_THREADS));
+    _threads.reserve(n - 1);
+    try {
+        for (int t = 1; t < n; ++t) {
+            _threads.push_back(boost::shared_ptr<Thread>(
+                new Thread(boost::bind(&ChunkLoader::work, this))));
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+
+ChunkLoader::~ChunkLoader() {
+    stop();
+}
+
+
+/**
+ * Reads the chunk and chunk delta files for the given chunks, marking each chunk usable as
+ * soon as it has been read. Returns once every chunk has been read, or once reading a chunk
+ * has failed and the chunks already claimed have been dealt with.
+ *
+ * @param[in, out] chunks   The (distinct) chunks to read.
+ * @param[in] refNames      The names of the chunk files, by chunk.
+ * @param[in] deltaNames    The names of the chunk delta files, by chunk.
+ * @param[out] stats        Set to the read statistics of each chunk.
+ *
+ * @throw lsst::pex::exceptions::IoError    Thrown if reading any chunk failed.
+ */
+void ChunkLoader::load(
+    std::vector<ObjectChunk> & chunks,
+    std::vector<std::string> const & refNames,
+    std::vector<std::string> const & deltaNames,
+    std::vector<ChunkLoadStats> & stats
+) {
+    if (chunks.empty()) {
+        return;
+    }
+    if (refNames.size() != chunks.size() || deltaNames.size() != chunks.size()) {
+        throw LSST_EXCEPT(ex::InvalidParameterError,
+                          "the number of chunk file names does not match the number of chunks");
+    }
+    stats.assign(chunks.size(), ChunkLoadStats());
+
+    ScopedLock<Mutex> loadLock(_loadMutex);
+    ScopedLock<Mutex> lock(_mutex);
+    _chunks = &chunks;
+    _refNames = &refNames;
+    _deltaNames = &deltaNames;
+    _stats = &stats;
+    _next = 0;
+    _failure.clear();
+    _workAvailable.notifyAll();
+    readChunks(lock);
+    while (!isIdle()) {
+        _workDone.wait(lock);
+    }
+    _chunks = 0;
+    _refNames = 0;
+    _deltaNames = 0;
+    _stats = 0;
+    if (!_failure.empty()) {
+        throw LSST_EXCEPT(ex::IoError, "failed to read chunks: " + _failure);
+    }
+}
+
+
+/// Main loop of worker threads.
+void ChunkLoader::work() {
+    ScopedLock<Mutex> lock(_mutex);
+    while (true) {
+        while (!_stop && !hasWork()) {
+            _workAvailable.wait(lock);
+        }
+        if (_stop) {
+            return;
+        }
+        readChunks(lock);
+    }
+}
+
+
+/**
+ * Claims and reads chunks until none remain. Must be called with @a lock held on @a _mutex;
+ * the lock is released while chunk files are being read.
+ */
+void ChunkLoader::readChunks(ScopedLock<Mutex> & lock) {
+    while (hasWork()) {
+        std::size_t const i = _next++;
+        ++_numBusy;
+        ObjectChunk & c = (*_chunks)[i];
+        std::string const & refName = (*_refNames)[i];
+        std::string const & deltaName = (*_deltaNames)[i];
+        ChunkLoadStats & stats = (*_stats)[i];
+        lock.release();
+
+        std::string failure;
+        try {
+            Stopwatch watch(true);
+            c.read(refName, false);
+            c.readDelta(deltaName, false);
+            c.setUsable();
+            watch.stop();
+            stats._seconds = watch.seconds();
+            stats._bytes = fileSize(refName) + fileSize(deltaName);
+        } catch (std::exception & except) {
+            failure = except.what();
+        } catch (...) {
+            failure = "unknown exception";
+        }
+
+        lock.acquire(_mutex);
+        --_numBusy;
+        if (!failure.empty() && _failure.empty()) {
+            _failure = failure;
+        }
+        if (isIdle()) {
+            _workDone.notifyAll();
+        }
+    }
+}
+
+
+/// Returns @c true if there are unclaimed chunks and no chunk read has failed.
+bool ChunkLoader::hasWork() const {
+    return _chunks != 0 && _failure.empty() && _next < _chunks->size();
+}
+
+
+/// Returns @c true if no chunk is being read and no more chunks will be claimed.
+bool ChunkLoader::isIdle() const {
+    return _numBusy == 0 && !hasWork();
+}
+
+
+/// Stops and joins all worker threads.
+void ChunkLoader::stop() {
+    {
+        ScopedLock<Mutex> lock(_mutex);
+        _stop = true;
+        _workAvailable.notifyAll();
+    }
+    for (std::size_t t = 0; t < _threads.size(); ++t) {
+        try {
+            _threads[t]->join();
+        } catch (...) {}
+    }
+    _threads.clear();
+}
+
+}} // end of namespace lsst::ap
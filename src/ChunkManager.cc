@@ -30,24 +30,40 @@
  * @ingroup ap
  */
 
-#include <sys/mman.h>   // for mmap, munmap, shm_open, shm_unlink
+#include <sys/mman.h>   // for mmap, munmap, shm_open, shm_unlink, madvise
+#include <sys/stat.h>
+#if LSST_AP_HAVE_HUGE_PAGES
+#   include <sys/vfs.h>     // for fstatfs
+#   include <linux/magic.h> // for HUGETLBFS_MAGIC
+#endif
 #include <time.h>       // for nanosleep
 #include <unistd.h>     // for ftruncate
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>      // for SCHED_IDLE
 
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <string>
 
 #include "boost/bind.hpp"
 #include "boost/format.hpp"
+#include "boost/function.hpp"
+#include "boost/scoped_ptr.hpp"
 
 #include "lsst/pex/exceptions.h"
 
 #include "lsst/ap/Chunk.cc"
 #include "lsst/ap/ChunkManagerImpl.cc"
 #include "lsst/ap/ChunkManager.h"
+#include "lsst/ap/Condition.h"
+#include "lsst/ap/Mutex.h"
 #include "lsst/ap/ScopeGuard.h"
 #include "lsst/ap/SpatialUtil.h"
+#include "lsst/ap/Thread.h"
 
 namespace ex = lsst::pex::exceptions;
 
@@ -56,10 +72,13 @@ namespace lsst { namespace ap { namespace detail {
 
 // -- Explicit instantiations ----------------
 
-typedef BlockAllocator<SharedMutex, Object> ObjAllocator;
+typedef SubManager<SharedMutex, Object>::Allocator ObjAllocator;
 
 /// @cond
 template class BlockAllocator<SharedMutex, Object>;
+#if LSST_AP_HAVE_SYNC_BUILTINS
+template class LockFreeBlockAllocator<Object>;
+#endif
 template class SubManager<SharedMutex, Object>;
 template class ChunkManagerImpl<SharedMutex, Object>;
 /// @endcond
@@ -125,8 +144,203 @@ BootstrapLock::~BootstrapLock() {
 }
 
 
+/** @brief  Pages requested for, and pages backing, the shared memory object of a process. */
+struct PageConfig {
+    SharedObjectChunkManager::PageMode _requested;
+    std::string _hugetlbfsDir;
+    SharedObjectChunkManager::PageMode _mode;
+    std::size_t _pageSize;
+};
+
+PageConfig sPageConfig = {
+    SharedObjectChunkManager::NORMAL_PAGES, std::string(), SharedObjectChunkManager::NORMAL_PAGES, 0
+};
+
+
+/** @brief  Capacities of the shared memory object of a process. */
+struct LayoutConfig {
+    ChunkStoreLayout _layout;
+    bool _explicit; ///< Was the layout set explicitly, i.e. must an existing object match it?
+};
+
+LayoutConfig sLayoutConfig = { ChunkStoreLayout::fromTraits<DataTraits<Object> >(), false };
+
+
+/// Returns the size of the given open shared memory object.
+std::size_t getObjectSize(int const fd, std::string const & name) {
+    struct ::stat st;
+    if (::fstat(fd, &st) != 0) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("fstat(): failed to obtain size of shared memory object %1%, errno: %2%")
+                % name % errno).str());
+    }
+    return static_cast<std::size_t>(st.st_size);
+}
+
+
+/**
+ * @brief  Contents of the POSIX shared memory object standing in for a shared memory object
+ *         on hugetlbfs.
+ *
+ * The POSIX shared memory object name is the one place every process looks for the chunk
+ * store, whatever pages it requests and whether or not it knows of a hugetlbfs directory.
+ * When the store is created on hugetlbfs, a POSIX shared memory object holding the path of
+ * the hugetlbfs file is created along with it. Such an object is much smaller than a page,
+ * whereas a chunk store spans many pages, so the two are told apart by size.
+ */
+struct HugetlbfsRecord {
+    static boost::uint64_t const MAGIC = 0x68756765746c6266ULL;
+
+    boost::uint64_t _magic;
+    char _path[1016];   ///< Null terminated path of the file on hugetlbfs
+};
+
+
+/**
+ * Returns @c true if the given open shared memory object is a HugetlbfsRecord, in which case
+ * @a path is set to the path of the hugetlbfs file holding the chunk store.
+ */
+bool readHugetlbfsRecord(int const fd, std::string const & name, std::string & path) {
+    if (getObjectSize(fd, name) != sizeof(HugetlbfsRecord)) {
+        return false;
+    }
+    void * mem = ::mmap(0, sizeof(HugetlbfsRecord), PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("mmap(): failed to map shared memory object %1%, errno: %2%")
+                % name % errno).str());
+    }
+    HugetlbfsRecord const * const r = static_cast<HugetlbfsRecord const *>(mem);
+    bool const isRecord = (r->_magic == HugetlbfsRecord::MAGIC &&
+                           std::memchr(r->_path, 0, sizeof(r->_path)) != 0);
+    if (isRecord) {
+        path = r->_path;
+    }
+    ::munmap(mem, sizeof(HugetlbfsRecord));
+    return isRecord;
+}
+
+
+/// Stores the path of the hugetlbfs file holding the chunk store in a newly created object.
+void writeHugetlbfsRecord(int const fd, std::string const & name, std::string const & path) {
+    void * mem = MAP_FAILED;
+    if (::ftruncate(fd, sizeof(HugetlbfsRecord)) == 0) {
+        mem = ::mmap(0, sizeof(HugetlbfsRecord), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("failed to record hugetlbfs shared memory object in %1%, errno: %2%")
+                % name % errno).str());
+    }
+    HugetlbfsRecord * const r = static_cast<HugetlbfsRecord *>(mem);
+    std::memset(r, 0, sizeof(HugetlbfsRecord));
+    r->_magic = HugetlbfsRecord::MAGIC;
+    path.copy(r->_path, sizeof(r->_path) - 1);
+    ::munmap(mem, sizeof(HugetlbfsRecord));
+}
+
+
+/// Unlinks a shared memory object on hugetlbfs along with the object recording it.
+void unlinkHugetlbfsObject(std::string const & name, std::string const & path) {
+    ::unlink(path.c_str());
+    ::shm_unlink(name.c_str());
+}
+
+
+/**
+ * Returns the huge page size of the hugetlbfs file system containing the given
+ * open file, or 0 if the file is not on a hugetlbfs file system.
+ */
+std::size_t getHugetlbfsPageSize(int const fd) {
+#if LSST_AP_HAVE_HUGE_PAGES
+    struct ::statfs fs;
+    if (::fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+        return static_cast<std::size_t>(fs.f_bsize);
+    }
+#endif
+    return 0;
+}
+
+
+/**
+ * Returns the size of transparent huge pages if the kernel will use them for shared memory
+ * regions advised with MADV_HUGEPAGE, and 0 otherwise.
+ */
+std::size_t getShmemTransparentHugePageSize() {
+#if LSST_AP_HAVE_HUGE_PAGES
+    std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+    std::string setting;
+    std::getline(enabled, setting);
+    if (setting.find("[advise]") == std::string::npos &&
+        setting.find("[always]") == std::string::npos &&
+        setting.find("[within_size]") == std::string::npos &&
+        setting.find("[force]") == std::string::npos) {
+        return 0;
+    }
+    std::ifstream size("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+    std::size_t pageSize = 0;
+    if (size >> pageSize) {
+        return pageSize;
+    }
+#endif
+    return 0;
+}
+
+
+/**
+ * Maps @a numBytes of the given file at an address that is a multiple of @a alignment
+ * (a power of 2 no smaller than the system page size). Returns MAP_FAILED on failure.
+ */
+void * mapAligned(int const fd, std::size_t const numBytes, std::size_t const alignment) {
+    std::size_t const len = numBytes + alignment;
+    void * r = ::mmap(0, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) {
+        return r;
+    }
+    char * const reserved = static_cast<char *>(r);
+    char * const aligned = reinterpret_cast<char *>(
+        (reinterpret_cast<std::size_t>(reserved) + alignment - 1) & ~(alignment - 1));
+    void * mem = ::mmap(aligned, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (mem == MAP_FAILED) {
+        ::munmap(reserved, len);
+        return mem;
+    }
+    // release the unused parts of the reservation
+    if (aligned != reserved) {
+        ::munmap(reserved, aligned - reserved);
+    }
+    if (aligned + numBytes != reserved + len) {
+        ::munmap(aligned + numBytes, (reserved + len) - (aligned + numBytes));
+    }
+    return mem;
+}
+
+
+/**
+ * Returns the chunk manager living in the named shared memory object, creating and
+ * initializing the object if it does not yet exist.
+ *
+ * The chunk manager is always found via the POSIX shared memory object of the given name,
+ * so that processes agree on the object in use even when huge pages are requested by some
+ * of them but not by others (or could not be obtained). An existing object either holds the
+ * chunk manager, or records the hugetlbfs file that does (see HugetlbfsRecord). New objects
+ * are created on hugetlbfs when explicit huge pages are requested (and recorded), and via
+ * shm_open() otherwise or if there are too few free huge pages. The pages actually backing
+ * the object mapped by the process are recorded in @a config.
+ *
+ * A newly created object is sized for, and initialized with, the capacities in @a layout. An
+ * existing object is mapped in its entirety and validated; if the layout was set explicitly,
+ * its capacities must match those of the object.
+ */
 template <typename ManagerT>
-ManagerT * getSingleton(char const * const shmObjName, char const * const shmLockName) {
+ManagerT * getSingleton(
+    char const * const shmObjName,
+    char const * const shmLockName,
+    PageConfig & config,
+    LayoutConfig const & layout
+) {
+
+    typedef SharedObjectChunkManager Mgr;
 
     static Mutex mutex;
     static ManagerT * singleton = 0;
@@ -139,74 +353,164 @@ ManagerT * getSingleton(char const * const shmObjName, char const * const shmLoc
     // Block interference from other processes
     BootstrapLock blck(shmLockName);
 
-    std::size_t const pageSize  = static_cast<std::size_t>(::getpagesize());
-    std::size_t const numBytes  = (ManagerT::size() + pageSize - 1) & ~(pageSize - 1);
-
-    // 1. try to create shared memory object
-    int fd = ::shm_open(shmObjName, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-    if (fd == -1) {
-
-        // failed ...
-        if (errno != EEXIST) {
-            throw LSST_EXCEPT(ex::RuntimeError,
-                (boost::format("shm_open(): failed to create shared memory object %1%, errno: %2%")
-                    % shmObjName % errno).str());
-        }
-        // because the shared memory object already exists -- so try to open existing object instead
-        fd = ::shm_open(shmObjName, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (fd == -1) {
-            throw LSST_EXCEPT(ex::RuntimeError,
-                (boost::format("shm_open(): failed to open existing shared memory object %1%, errno: %2%")
-                    % shmObjName % errno).str());
-        }
-        ScopeGuard g(boost::bind(::close, fd));
+    ::mode_t const perms = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    std::size_t pageSize = static_cast<std::size_t>(::getpagesize());
+    std::size_t const requiredBytes = ManagerT::size(layout._layout);
+    std::size_t numBytes = (requiredBytes + pageSize - 1) & ~(pageSize - 1);
+    Mgr::PageMode mode   = Mgr::NORMAL_PAGES;
+    void * mem           = MAP_FAILED;
+    bool created         = false;
+    boost::function<void ()> undo; // removes a newly created object
+    std::size_t const thpSize = (config._requested == Mgr::TRANSPARENT_HUGE_PAGES) ?
+                                getShmemTransparentHugePageSize() : 0;
+
+    int fd = ::shm_open(shmObjName, O_RDWR, perms);
+    if (fd == -1 && errno != ENOENT) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("shm_open(): failed to open existing shared memory object %1%, errno: %2%")
+                % shmObjName % errno).str());
+    }
 
-        void * mem = ::mmap(0, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (mem == 0) {
-            throw LSST_EXCEPT(ex::RuntimeError,
-                (boost::format("mmap(): failed to map %1% bytes of shared memory object %2%, errno: %3%")
-                    % numBytes % shmObjName % errno).str());
+    if (fd != -1) {
+        // 1. map the existing object, or the hugetlbfs file it records
+        ScopeGuard g1(boost::bind(::close, fd));
+        std::string hugePath;
+        if (readHugetlbfsRecord(fd, shmObjName, hugePath)) {
+            int const hfd = ::open(hugePath.c_str(), O_RDWR);
+            if (hfd == -1) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format("failed to open hugetlbfs shared memory object %1%, errno: %2%")
+                        % hugePath % errno).str());
+            }
+            ScopeGuard g2(boost::bind(::close, hfd));
+            std::size_t const hugePageSize = getHugetlbfsPageSize(hfd);
+            numBytes = getObjectSize(hfd, hugePath);
+            if (hugePageSize != 0) {
+                mem = ::mmap(0, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, hfd, 0);
+            }
+            if (mem == MAP_FAILED) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format("failed to map existing hugetlbfs shared memory object %1%, errno: %2%")
+                        % hugePath % errno).str());
+            }
+            mode     = Mgr::HUGETLBFS_PAGES;
+            pageSize = hugePageSize;
+        } else {
+            numBytes = getObjectSize(fd, shmObjName);
+            // transparent huge pages are only used for huge page aligned memory
+            mem = (thpSize != 0) ? mapAligned(fd, numBytes, thpSize) :
+                  ::mmap(0, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem == MAP_FAILED) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format("mmap(): failed to map %1% bytes of shared memory object %2%, errno: %3%")
+                        % numBytes % shmObjName % errno).str());
+            }
         }
-        singleton = static_cast<ManagerT *>(mem);
-        g.dismiss();
-
     } else {
-
-        // shared memory object was created (initially of zero size)
-        ScopeGuard g1(boost::bind(::shm_unlink, shmObjName));
-        ScopeGuard g2(boost::bind(::close, fd));
-
-        // set size of shared memory object
-        if (::ftruncate(fd, numBytes) != 0) {
-            throw LSST_EXCEPT(ex::RuntimeError,
-                (boost::format(
-                    "ftruncate(): failed to set size of shared memory object %1% to %2% bytes, errno: %3%")
-                    % shmObjName % numBytes % errno).str());
+        created = true;
+
+        // 2. try to create the object on hugetlbfs if explicit huge pages are requested
+        std::string const hugePath(config._hugetlbfsDir.empty() ? std::string() :
+                                   config._hugetlbfsDir + shmObjName);
+        if (config._requested == Mgr::HUGETLBFS_PAGES && !hugePath.empty() &&
+            hugePath.size() < sizeof(HugetlbfsRecord()._path)) {
+            int hfd = ::open(hugePath.c_str(), O_RDWR | O_CREAT | O_EXCL, perms);
+            if (hfd == -1 && errno == EEXIST) {
+                // no object records the file, so it was left behind by a failed creation
+                ::unlink(hugePath.c_str());
+                hfd = ::open(hugePath.c_str(), O_RDWR | O_CREAT | O_EXCL, perms);
+            }
+            if (hfd != -1) {
+                ScopeGuard g1(boost::bind(::close, hfd));
+                ScopeGuard g2(boost::bind(::unlink, hugePath.c_str()));
+                std::size_t const hugePageSize = getHugetlbfsPageSize(hfd);
+                if (hugePageSize != 0) {
+                    std::size_t const n = (requiredBytes + hugePageSize - 1) & ~(hugePageSize - 1);
+                    // mapping reserves huge pages for the object, and fails if too few are free
+                    if (::ftruncate(hfd, n) == 0) {
+                        mem = ::mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, hfd, 0);
+                    }
+                    if (mem != MAP_FAILED) {
+                        ScopeGuard g3(boost::bind(::munmap, mem, n));
+                        fd = ::shm_open(shmObjName, O_RDWR | O_CREAT | O_EXCL, perms);
+                        if (fd == -1) {
+                            throw LSST_EXCEPT(ex::RuntimeError,
+                                (boost::format("shm_open(): failed to create shared memory object %1%, errno: %2%")
+                                    % shmObjName % errno).str());
+                        }
+                        ScopeGuard g4(boost::bind(::close, fd));
+                        ScopeGuard g5(boost::bind(::shm_unlink, shmObjName));
+                        writeHugetlbfsRecord(fd, shmObjName, hugePath);
+                        mode     = Mgr::HUGETLBFS_PAGES;
+                        pageSize = hugePageSize;
+                        numBytes = n;
+                        undo = boost::bind(&unlinkHugetlbfsObject, std::string(shmObjName), hugePath);
+                        g5.dismiss();
+                        g3.dismiss();
+                        g2.dismiss();
+                    }
+                }
+            }
         }
 
-        // map shared memory object
-        void * mem = ::mmap(0, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (mem == 0) {
-            throw LSST_EXCEPT(ex::RuntimeError,
-                (boost::format("mmap(): failed to map %1% bytes of shared memory object %2%, errno: %3%")
-                    % numBytes % shmObjName % errno).str());
+        // 3. otherwise, create a POSIX shared memory object
+        if (mem == MAP_FAILED) {
+            fd = ::shm_open(shmObjName, O_RDWR | O_CREAT | O_EXCL, perms);
+            if (fd == -1) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format("shm_open(): failed to create shared memory object %1%, errno: %2%")
+                        % shmObjName % errno).str());
+            }
+            ScopeGuard g1(boost::bind(::shm_unlink, shmObjName));
+            ScopeGuard g2(boost::bind(::close, fd));
+
+            // set size of shared memory object (initially of zero size)
+            if (::ftruncate(fd, numBytes) != 0) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format(
+                        "ftruncate(): failed to set size of shared memory object %1% to %2% bytes, errno: %3%")
+                        % shmObjName % numBytes % errno).str());
+            }
+
+            // map shared memory object - transparent huge pages are only used for huge page aligned memory
+            mem = (thpSize != 0) ? mapAligned(fd, numBytes, thpSize) :
+                  ::mmap(0, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem == MAP_FAILED) {
+                throw LSST_EXCEPT(ex::RuntimeError,
+                    (boost::format("mmap(): failed to map %1% bytes of shared memory object %2%, errno: %3%")
+                        % numBytes % shmObjName % errno).str());
+            }
+            undo = boost::bind(::shm_unlink, shmObjName);
+            g1.dismiss();
         }
-        ScopeGuard g3(boost::bind(::munmap, mem, numBytes));
-
-        new (mem) ManagerT();
-        singleton = static_cast<ManagerT *>(mem);
-        g3.dismiss();
+    }
+#if LSST_AP_HAVE_HUGE_PAGES
+    if (thpSize != 0 && mode == Mgr::NORMAL_PAGES && ::madvise(mem, numBytes, MADV_HUGEPAGE) == 0) {
+        mode     = Mgr::TRANSPARENT_HUGE_PAGES;
+        pageSize = thpSize;
+    }
+#endif
+    if (created) {
+        ScopeGuard g1(undo);
+        ScopeGuard g2(boost::bind(::munmap, mem, numBytes));
+        new (mem) ManagerT(layout._layout);
         g2.dismiss();
         g1.dismiss();
+    } else {
+        ScopeGuard g(boost::bind(::munmap, mem, numBytes));
+        ManagerT::validate(mem, numBytes, layout._explicit ? &layout._layout : 0);
+        g.dismiss();
     }
+    singleton     = static_cast<ManagerT *>(mem);
+    config._mode     = mode;
+    config._pageSize = pageSize;
 
     // Try to lock chunk pages into memory to avoid swapping, but ignore failure to do so
     // - Solaris      : process must be run as root
     // - Linux/Darwin : process must be run as root or RLIMIT_MEMLOCK should be set to a large value
     ::mlock(static_cast<void *>(singleton), numBytes);
 
-    // Note: we rely on the system to munmap and close the file descriptor above at process exit.
+    // Note: we rely on the system to munmap the shared memory object at process exit.
 
     return singleton;
 }
@@ -218,12 +522,176 @@ ManagerT * getSingleton(char const * const shmObjName, char const * const shmLoc
 #   pragma GCC visibility push(hidden)
 #endif
 /// @cond
-template ObjChunkMgr * getSingleton<ObjChunkMgr>(char const * const, char const * const);
+template ObjChunkMgr * getSingleton<ObjChunkMgr>(
+    char const * const, char const * const, PageConfig &, LayoutConfig const &);
 /// @endcond
 #if defined(__GNUC__) && __GNUC__ > 3
 #   pragma GCC visibility pop
 #endif
 
+
+// -- Background chunk prefetching ----------------
+
+/**
+ * @brief   Reads chunks ahead of the visits that need them on a background thread.
+ *
+ * There is a single instance per process. Its thread is started when prefetch requests arrive
+ * and exits once all pending requests have been served, so that an idle process has no
+ * lingering threads. Requests still pending at process exit are abandoned.
+ *
+ * A read is only started once a CPU is idle, but is then performed at normal priority: a
+ * visit that needs a chunk while it is being read waits for it, and must not wait on a thread
+ * that only runs when nothing else wants to. A visit that needs a chunk whose read has not yet
+ * started takes the read over instead (see ChunkManagerImpl::beginPrefetch()).
+ */
+class ChunkPrefetcher : private boost::noncopyable {
+public :
+    typedef ObjChunkMgr::Chunk Chunk;
+
+    /// A chunk to prefetch, along with its generation and the names of its chunk and chunk delta files.
+    struct Request {
+        ObjChunkMgr * _manager;
+        Chunk _chunk;
+        boost::uint64_t _generation;
+        std::string _refName;
+        std::string _deltaName;
+    };
+
+    ChunkPrefetcher() : _running(false), _cancelled(false) {}
+    ~ChunkPrefetcher();
+
+    static ChunkPrefetcher & instance();
+
+    void enqueue(std::vector<Request> const & requests);
+    void wait();
+
+private :
+    Mutex _mutex;
+    Condition<Mutex> _idle;
+    std::deque<Request> _requests;
+    boost::scoped_ptr<Thread> _thread;
+    bool _running;
+    bool _cancelled;
+
+    void run();
+    void abandon();
+};
+
+
+/**
+ * Returns once the calling thread has been scheduled at idle priority, i.e. once a CPU
+ * would otherwise have been idle. Returns immediately if idle priority is unavailable.
+ */
+void waitForIdleCpu() {
+#if defined(SCHED_IDLE)
+    ::sched_param param;
+    param.sched_priority = 0;
+    if (::pthread_setschedparam(::pthread_self(), SCHED_IDLE, &param) == 0) {
+        ::sched_yield();
+    }
+#endif
+}
+
+
+ChunkPrefetcher::~ChunkPrefetcher() {
+    {
+        ScopedLock<Mutex> lock(_mutex);
+        _cancelled = true;
+    }
+    if (_thread) {
+        try {
+            _thread->join();
+        } catch (...) {}
+    }
+}
+
+
+ChunkPrefetcher & ChunkPrefetcher::instance() {
+    static ChunkPrefetcher prefetcher;
+    return prefetcher;
+}
+
+
+/**
+ * Queues chunks for prefetching, starting the background thread if necessary. If the thread
+ * cannot be started, all pending requests are abandoned before the failure is reported.
+ */
+void ChunkPrefetcher::enqueue(std::vector<Request> const & requests) {
+    ScopedLock<Mutex> lock(_mutex);
+    _requests.insert(_requests.end(), requests.begin(), requests.end());
+    if (_running || _requests.empty()) {
+        return;
+    }
+    try {
+        if (_thread) {
+            // the previous thread has served all its requests and is exiting
+            try {
+                _thread->join();
+            } catch (...) {}
+        }
+        _thread.reset(new Thread(boost::bind(&ChunkPrefetcher::run, this)));
+    } catch (...) {
+        abandon();
+        throw;
+    }
+    _running = true;
+}
+
+
+/// Blocks until all pending prefetch requests have been served.
+void ChunkPrefetcher::wait() {
+    ScopedLock<Mutex> lock(_mutex);
+    while (_running) {
+        _idle.wait(lock);
+    }
+}
+
+
+/// Ends every pending prefetch unsuccessfully. Assumes the prefetcher mutex is held.
+void ChunkPrefetcher::abandon() {
+    for (std::deque<Request>::const_iterator i = _requests.begin(); i != _requests.end(); ++i) {
+        i->_manager->endPrefetch(i->_chunk, i->_generation, false);
+    }
+    _requests.clear();
+}
+
+
+void ChunkPrefetcher::run() {
+    ScopedLock<Mutex> lock(_mutex);
+    while (!_requests.empty()) {
+        Request r(_requests.front());
+        _requests.pop_front();
+        bool cancelled = _cancelled;
+        lock.release();
+        if (!cancelled) {
+            // only start reading when a CPU is idle - the thread at idle priority cannot
+            // raise its priority again, so it is a separate thread from the reader
+            try {
+                Thread idle(&waitForIdleCpu);
+                idle.join();
+            } catch (...) {}
+            lock.acquire(_mutex);
+            cancelled = _cancelled;
+            lock.release();
+        }
+        bool success = false;
+        if (!cancelled && r._manager->beginPrefetch(r._chunk, r._generation)) {
+            try {
+                r._chunk.read(r._refName, false);
+                r._chunk.readDelta(r._deltaName, false);
+                success = true;
+            } catch (...) {
+                // a visit waiting for the chunk will re-read it
+            }
+        }
+        // a no-op for chunks taken over by a visit
+        r._manager->endPrefetch(r._chunk, r._generation, success);
+        lock.acquire(_mutex);
+    }
+    _running = false;
+    _idle.notifyAll();
+}
+
 } // end of namespace detail
 
 
@@ -240,17 +708,85 @@ SharedObjectChunkManager::SharedObjectChunkManager(std::string const & name) : _
 detail::ObjChunkMgr * SharedObjectChunkManager::instance(std::string const & name) {
     std::string actualName(sSharedPrefix);
     actualName += name;
-    return detail::getSingleton<detail::ObjChunkMgr>(actualName.c_str(), sSharedObjLock);
+    return detail::getSingleton<detail::ObjChunkMgr>(actualName.c_str(), sSharedObjLock,
+                                                     detail::sPageConfig, detail::sLayoutConfig);
+}
+
+
+/**
+ * Sets the kind of pages the calling process should back the shared memory object with, should
+ * it be the one to create it. Must be called before the first manager instance is created by the
+ * process. If the requested pages are unavailable, normal pages are used instead - call
+ * getPageMode() to find out which pages are in use.
+ *
+ * @param[in] mode          The kind of pages to use.
+ * @param[in] hugetlbfsDir  The directory (on a hugetlbfs mount) in which shared memory objects
+ *                          backed by explicit huge pages are created. Only needed to create
+ *                          such objects: processes find existing ones via the POSIX shared
+ *                          memory object recording them.
+ *
+ * @throw lsst::pex::exceptions::InvalidParameterError
+ *      Thrown if explicit huge pages are requested, but no hugetlbfs directory is given.
+ */
+void SharedObjectChunkManager::setPageMode(PageMode const mode, std::string const & hugetlbfsDir) {
+    if (mode == HUGETLBFS_PAGES && hugetlbfsDir.empty()) {
+        throw LSST_EXCEPT(ex::InvalidParameterError,
+                          "a hugetlbfs directory is required to use explicit huge pages");
+    }
+    detail::sPageConfig._requested = mode;
+    detail::sPageConfig._hugetlbfsDir = hugetlbfsDir;
+    // strip trailing slashes - the object name starts with one
+    std::string::size_type const n = hugetlbfsDir.find_last_not_of('/');
+    detail::sPageConfig._hugetlbfsDir.erase(n == std::string::npos ? 0 : n + 1);
+}
+
+
+/// Returns a human readable name for the given kind of pages.
+char const * SharedObjectChunkManager::getPageModeName(PageMode const mode) {
+    switch (mode) {
+        case NORMAL_PAGES:           return "normal";
+        case TRANSPARENT_HUGE_PAGES: return "transparent huge pages";
+        case HUGETLBFS_PAGES:        return "hugetlbfs";
+    }
+    return "unknown";
+}
+
+
+/// Returns the kind of pages backing the shared memory object in the calling process.
+SharedObjectChunkManager::PageMode SharedObjectChunkManager::getPageMode() const {
+    return detail::sPageConfig._mode;
+}
+
+
+/**
+ * Returns the size of the pages backing the shared memory object in the calling process. For
+ * transparent huge pages, this is the huge page size - the kernel may nevertheless back parts of
+ * the object with normal pages, e.g. when memory is fragmented.
+ */
+std::size_t SharedObjectChunkManager::getPageSize() const {
+    return detail::sPageConfig._pageSize;
 }
 
 
 /**
- * Unlinks the shared memory object underlying all manager instances. The associated memory
- * is not returned to the system until all client processes have relinquished references to it.
+ * Unlinks the shared memory object underlying all manager instances, along with the hugetlbfs
+ * file holding it, if any. The associated memory is not returned to the system until all client
+ * processes have relinquished references to it.
  */
 void SharedObjectChunkManager::destroyInstance(std::string const & name) {
     std::string actualName(sSharedPrefix);
     actualName += name;
+    int const fd = ::shm_open(actualName.c_str(), O_RDONLY, 0);
+    if (fd != -1) {
+        ScopeGuard g(boost::bind(::close, fd));
+        std::string hugePath;
+        if (detail::readHugetlbfsRecord(fd, actualName, hugePath) &&
+            ::unlink(hugePath.c_str()) != 0 && errno != ENOENT) {
+            throw LSST_EXCEPT(ex::RuntimeError,
+                (boost::format("unlink(): failed to unlink hugetlbfs shared memory object %1%, errno: %2%")
+                % hugePath % errno).str());
+        }
+    }
     int res = ::shm_unlink(actualName.c_str());
     // Note: shm_unlink is broken on Mac OSX 10.4 - in violation of the documentation and standard,
     // EINVAL (rather than ENOENT) is returned when trying to shm_unlink a non-existant shared
@@ -263,8 +799,100 @@ void SharedObjectChunkManager::destroyInstance(std::string const & name) {
 }
 
 
-/// Returns the size in bytes of the underlying chunk manager and pool of memory blocks.
-std::size_t SharedObjectChunkManager::size() { return detail::ObjChunkMgr::size(); }
+/**
+ * Starts reading in the chunks covering the FOV of a future visit that are not yet in memory.
+ * Chunks are read on a background thread, one at a time and only while a CPU is idle, and are
+ * retained once read, so that the visit can use them without performing any I/O. A visit that
+ * needs a chunk while it is being read waits for it, just as for a chunk owned by another visit,
+ * and a visit that needs a chunk whose read has not started reads it itself. Chunks being
+ * prefetched by a process that exits before finishing are reclaimed by visits that time out
+ * waiting for them.
+ *
+ * Prefetching requires chunk retention (see setRetentionBudget()), and stops short of
+ * exhausting the retention budget.
+ *
+ * @param[in] fov           The FOV of the future visit.
+ * @param[in] decomposition The chunk decomposition of the sky.
+ * @param[in] namer         Returns the chunk and chunk delta file names for a chunk id.
+ *                          Called on the calling thread only.
+ *
+ * @return  The number of chunks scheduled for reading.
+ */
+int SharedObjectChunkManager::prefetch(
+    CircularRegion const & fov,
+    ZoneStripeChunkDecomposition const & decomposition,
+    ChunkFileNamer const & namer
+) {
+    typedef detail::ChunkPrefetcher::Request Request;
+
+    std::vector<int> chunkIds;
+    computeChunkIds(chunkIds, fov, decomposition, 0, 1);
+    std::vector<ObjectChunk> chunks;
+    std::vector<boost::uint64_t> generations;
+    _manager->startPrefetch(chunks, generations, chunkIds);
+    if (chunks.empty()) {
+        return 0;
+    }
+    std::vector<Request> requests;
+    try {
+        requests.reserve(chunks.size());
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            std::pair<std::string, std::string> names(namer(static_cast<int>(chunks[i].getId())));
+            Request r = { _manager, chunks[i], generations[i], names.first, names.second };
+            requests.push_back(r);
+        }
+    } catch (...) {
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            _manager->endPrefetch(chunks[i], generations[i], false);
+        }
+        throw;
+    }
+    detail::ChunkPrefetcher::instance().enqueue(requests);
+    return static_cast<int>(requests.size());
+}
+
+
+/// Blocks until all chunk prefetches started by the calling process have completed.
+void SharedObjectChunkManager::waitForPrefetch() {
+    detail::ChunkPrefetcher::instance().wait();
+}
+
+
+/**
+ * Sets the capacities of the shared memory object, should the calling process be the one to
+ * create it. Processes attaching to an existing object after calling this method fail unless
+ * the object has exactly these capacities. Must be called before the first manager instance
+ * is created by the process.
+ *
+ * @throw lsst::pex::exceptions::InvalidParameterError
+ *      Thrown if a capacity is not positive or too large.
+ */
+void SharedObjectChunkManager::setLayout(detail::ChunkStoreLayout const & layout) {
+    layout.validate(DataTraits<Object>::ENTRIES_PER_BLOCK_LOG2);
+    detail::sLayoutConfig._layout = layout;
+    detail::sLayoutConfig._explicit = true;
+}
+
+
+/// Returns the capacities used for a shared memory object unless others are set.
+detail::ChunkStoreLayout SharedObjectChunkManager::getDefaultLayout() {
+    return detail::ChunkStoreLayout::fromTraits<DataTraits<Object> >();
+}
+
+
+/// Returns the capacities of the shared memory object mapped by the calling process.
+detail::ChunkStoreLayout const & SharedObjectChunkManager::getLayout() const {
+    return _manager->getLayout();
+}
+
+
+/**
+ * Returns the size in bytes of the underlying chunk manager and pool of memory blocks
+ * for the capacities the calling process would create the shared memory object with.
+ */
+std::size_t SharedObjectChunkManager::size() {
+    return detail::ObjChunkMgr::size(detail::sLayoutConfig._layout);
+}
 
 
 }} // end of namespace lsst::ap
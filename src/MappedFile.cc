@@ -0,0 +1,90 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Implementation of the MappedFile class.
+ *
+ * @ingroup ap
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "boost/bind.hpp"
+#include "boost/format.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/MappedFile.h"
+#include "lsst/ap/ScopeGuard.h"
+
+namespace ex = lsst::pex::exceptions;
+
+
+/** Maps the file at @a path into memory. Throws an IoError if this fails. */
+lsst::ap::MappedFile::MappedFile(std::string const & path) :
+    _path(path),
+    _data(0),
+    _size(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("open() failed on file %1%, errno: %2%") % path % errno).str());
+    }
+    ScopeGuard g(boost::bind(::close, fd));
+    struct ::stat st;
+    if (::fstat(fd, &st) != 0) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("fstat() failed on file %1%, errno: %2%") % path % errno).str());
+    }
+    if (st.st_size == 0) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("cannot map empty file %1%") % path).str());
+    }
+    std::size_t const numBytes = static_cast<std::size_t>(st.st_size);
+    void * mem = ::mmap(0, numBytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("mmap(): failed to map %1% bytes of file %2%, errno: %3%") %
+                numBytes % path % errno).str());
+    }
+    _data = static_cast<unsigned char const *>(mem);
+    _size = numBytes;
+}
+
+
+lsst::ap::MappedFile::~MappedFile() {
+    if (_data != 0) {
+        ::munmap(const_cast<unsigned char *>(_data), _size);
+        _data = 0;
+    }
+}
@@ -0,0 +1,515 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Implementation of proper motion correction and object zone index construction.
+ *
+ * @ingroup ap
+ */
+
+#include <cmath>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+
+#include "boost/scoped_array.hpp"
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/pex/logging/Log.h"
+#include "lsst/afw/geom/Angle.h"
+
+#include "lsst/ap/ObjectIndex.h"
+#include "lsst/ap/Time.h"
+#include "lsst/ap/ZoneTuning.h"
+
+using lsst::pex::logging::Log;
+using lsst::pex::logging::Rec;
+using lsst::pex::logging::Prop;
+
+namespace ex = lsst::pex::exceptions;
+
+
+namespace lsst { namespace ap { namespace detail {
+
+namespace {
+
+double const RAD_PER_MAS = (RADIANS_PER_DEGREE/3600000.0);
+
+} // end of anonymous namespace
+
+
+// -- Proper motion correction for objects ----------------
+
+/** @return the proper motion corrected position of the given object */
+std::pair<double, double> correctProperMotion(Object const& obj, double const epoch) {
+    // (rad/mas)*(sec/year)/(km/AU)
+    static double const SCALE = RAD_PER_MAS*(365.25*86400/149597870.691);
+
+    double ra   = radians(obj.getRa());   // rad
+    double decl = radians(obj.getDec()); // rad
+
+    // Convert ra, dec to unit vector in cartesian coordinate system
+    double const sinDecl = std::sin(decl);
+    double const cosDecl = std::cos(decl);
+    double const sinRa   = std::sin(ra);
+    double const cosRa   = std::cos(ra);
+    double x = cosRa * cosDecl;
+    double y = sinRa * cosDecl;
+    double z = sinDecl;
+
+    // compute space motion vector (radians per year)
+    double const pmRa   = obj.getMuRa()*RAD_PER_MAS/cosDecl;
+    double const pmDecl = obj.getMuDecl()*RAD_PER_MAS;
+    // divide radial velociy by distance to source
+    double const w = obj.getParallax()*obj.getRadialVelocity()*SCALE;
+
+    double const mx = - pmRa*y - pmDecl*cosRa*sinDecl + x*w;
+    double const my =   pmRa*x - pmDecl*sinRa*sinDecl + y*w;
+    double const mz =            pmDecl*cosDecl       + z*w;
+
+    // Linear interpolation of position
+    double const dt = (epoch - obj.getEpoch()) * (1/365.25); // julian years
+    x += mx*dt;
+    y += my*dt;
+    z += mz*dt;
+
+    // Store unit vector for corrected position, convert back to
+    // spherical coords and store scaled integer ra/dec
+    double d2 = x*x + y*y;
+    ra   = (d2 == 0.0) ? 0 : degrees(std::atan2(y, x));
+    decl = (z  == 0.0) ? 0 : degrees(std::atan2(z, std::sqrt(d2)));
+    if (ra < 0.0) {
+        ra += 360.0;
+    }
+    return std::make_pair(ra, decl);
+}
+
+
+/**
+ * Returns an upper bound on the angular distance (in degrees) an object with the given total
+ * proper motion (mas/year) moves between the object epoch and @a epoch, as computed by
+ * correctProperMotion().
+ */
+double maxProperMotionDisplacement(double const mu, double const epoch) {
+    double const dt = std::fabs(epoch - Object().getEpoch())*(1/365.25); // julian years
+    return degrees(mu*RAD_PER_MAS*dt);
+}
+
+
+// -- Index creation ----------------
+
+namespace {
+
+/** Computes the range of stripes covered by the given (non-empty) list of chunks. */
+template <typename ChunkT>
+void computeStripeBounds(
+    std::vector<ChunkT> const & chunks,
+    int & minStripe,
+    int & maxStripe
+) {
+    typedef typename std::vector<ChunkT>::const_iterator ChunkIterator;
+
+    minStripe = 0x7FFFFFFF;
+    maxStripe = -1 - minStripe;
+    ChunkIterator const end(chunks.end());
+    for (ChunkIterator c(chunks.begin()); c != end; ++c) {
+        int const stripeId = ZoneStripeChunkDecomposition::chunkToStripe(c->getId());
+        if (stripeId > maxStripe) {
+            maxStripe = stripeId;
+        }
+        if (stripeId < minStripe) {
+            minStripe = stripeId;
+        }
+    }
+    assert(maxStripe >= minStripe && "invalid stripe bounds for chunk list");
+}
+
+
+/**
+ * Inserts proper motion corrected positions for the entries of the given chunk, starting
+ * with entry @a first, into a zone index. Deleted entries are skipped. Entries for which
+ * isLazyProperMotion() returns @c true are inserted at their catalog positions instead, and
+ * @a lazyMu is raised to the largest total proper motion of such an entry.
+ */
+template <typename EntryT>
+void insertChunkEntries(
+    ZoneIndex<EntryT> & index,
+    typename EntryT::Chunk & chunk,
+    int const first,
+    double const epoch,
+    double const maxLazyMu,
+    double & lazyMu
+) {
+    typedef typename EntryT::Data Data;
+    typedef typename EntryT::Chunk Chunk;
+
+    int const numBlocks  = chunk.blocks();
+    int const firstBlock = first >> Chunk::ENTRIES_PER_BLOCK_LOG2;
+    int i = first;
+
+    // loop over blocks in chunk
+    for (int b = firstBlock; b < numBlocks; ++b) {
+        int const numEntries = chunk.entries(b);
+        Data * const block = chunk.getBlock(b);
+        ChunkEntryFlag const * const flags = chunk.getFlagBlock(b);
+
+        // loop over entries in block
+        int e = (b == firstBlock) ? first - (firstBlock << Chunk::ENTRIES_PER_BLOCK_LOG2) : 0;
+        for ( ; e < numEntries; ++e, ++i) {
+            if ((flags[e] & Chunk::DELETED) != 0) {
+                continue;
+            }
+            if (isLazyProperMotion(block[e], maxLazyMu)) {
+                double const mu = totalProperMotion(block[e]);
+                if (mu > lazyMu) {
+                    lazyMu = mu;
+                }
+                index.insert(block[e].getRa(), block[e].getDec(), &block[e], &chunk, i);
+            } else {
+                std::pair<double, double> pos = correctProperMotion(block[e], epoch);
+                index.insert(pos.first, pos.second, &block[e], &chunk, i);
+            }
+        }
+    }
+}
+
+
+} // end of anonymous namespace
+
+
+/**
+ * Builds a zone index from scratch for the entries of the given chunks, at the given epoch.
+ * See insertChunkEntries() for the meaning of @a maxLazyMu.
+ *
+ * @return  the largest total proper motion (mas/year) of an entry indexed at its catalog position.
+ */
+double buildZoneIndex(
+    ObjectIndex & index,
+    ObjectChunkVector const & chunks,
+    double const epoch,
+    double const maxLazyMu
+) {
+    typedef ObjectChunkVector ChunkVector;
+    typedef ChunkVector::const_iterator ChunkIterator;
+    typedef ChunkVector::size_type Size;
+
+    index.clear();
+    if (chunks.empty()) {
+        return 0.0;
+    }
+
+    Stopwatch watch(true);
+    double lazyMu = 0.0;
+
+    // determine stripe bounds for the input chunks
+    ZoneStripeChunkDecomposition const & zsc = index.getDecomposition();
+    int minStripe = 0;
+    int maxStripe = 0;
+    computeStripeBounds(chunks, minStripe, maxStripe);
+
+    // Partition input chunks into stripes
+    int const numStripes = maxStripe - minStripe + 1;
+    boost::scoped_array<ChunkVector> stripes(new ChunkVector[numStripes]);
+    ChunkIterator const end(chunks.end());
+    for (ChunkIterator c(chunks.begin()); c != end; ++c) {
+        int const stripeId = ZoneStripeChunkDecomposition::chunkToStripe(c->getId());
+        assert(stripeId >= minStripe && stripeId <= maxStripe && "stripe id out of bounds");
+        stripes[stripeId - minStripe].push_back(*c);
+    }
+
+    double minDec = zsc.getStripeDecMin(minStripe) - 0.001;
+    double maxDec = zsc.getStripeDecMax(maxStripe) + 0.001;
+    index.setDecBounds(std::max(minDec, -90.0), std::min(maxDec, 90.0));
+
+    // Loop over stripes. Note that due to proper motion, objects from
+    // different stripes can end up in the same zone. Objects are never
+    // migrated across chunks/stripes; rather, their J2000 coordinates
+    // determine the chunks that they will belong to. As time goes on,
+    // the spatial extent of a chunk will grow, where the rate of growth
+    // is bounded by Barnard's star with a proper motion of ~10.5 arcsec/year.
+    // When intersecting the bounding circle of a FOV with chunk boundaries
+    // to determine which chunks must be loaded for association, the bounding
+    // circle must be padded to ensure all relevant objects are loaded.
+    try {
+        for (int s = 0; s < numStripes; ++s) {
+            ChunkVector &  vec = stripes[s];
+            Size const numChunks = vec.size();
+
+            // Loop over chunks in stripe
+            for (Size c = 0; c < numChunks; ++c) {
+                insertChunkEntries(index, vec[c], 0, epoch, maxLazyMu, lazyMu);
+            }
+        }
+    } catch(...) {
+       index.clear();
+       throw LSST_EXCEPT(ex::RuntimeError, "Failed to build zone index"); 
+    }
+
+    watch.stop();
+    Log log(Log::getDefaultLog(), "lsst.ap");
+    int numElements = static_cast<int>(index.size());
+    Rec(log, Log::INFO) << "inserted elements into zone index" <<
+        Prop<int>("numElements", numElements) <<
+        Prop<double>("maxLazyProperMotion", lazyMu) <<
+        Prop<double>("time", watch.seconds()) << Rec::endr;
+
+    // zone structure is filled, sort individual zones (on right ascension)
+    watch.start();
+    index.sort();
+    watch.stop();
+    Rec(log, Log::INFO) << "sorted zone index" <<
+        Prop<int>("numElements", numElements) <<
+        Prop<double>("time", watch.seconds()) << Rec::endr;
+    return lazyMu;
+}
+
+
+/**
+ * Samples the positions of the (non-deleted) entries in the given chunks, picks a zone height
+ * for the given match radius (in degrees) with tuneZoneHeight(), and changes the decomposition
+ * of @a index accordingly. The stripes of @a zsc, and therefore chunk boundaries, are preserved.
+ */
+void tuneZoneIndex(
+    ObjectIndex & index,
+    ObjectChunkVector const & chunks,
+    ZoneStripeChunkDecomposition const & zsc,
+    double const radius
+) {
+    typedef ObjectEntry::Data Data;
+    typedef ObjectEntry::Chunk Chunk;
+    typedef ObjectChunkVector::const_iterator ChunkIterator;
+
+    static std::size_t const MAX_SAMPLE_SIZE = 65536;
+
+    Stopwatch watch(true);
+    std::size_t numEntries = 0;
+    for (ChunkIterator c(chunks.begin()), end(chunks.end()); c != end; ++c) {
+        numEntries += c->size();
+    }
+    std::size_t const stride = numEntries/MAX_SAMPLE_SIZE + 1;
+    std::vector<Point> sample;
+    sample.reserve(numEntries/stride + 1);
+    std::size_t numLive = 0;
+    std::size_t i = 0;
+    for (ChunkIterator c(chunks.begin()), end(chunks.end()); c != end; ++c) {
+        int const numBlocks = c->blocks();
+        for (int b = 0; b < numBlocks; ++b) {
+            int const n = c->entries(b);
+            Data const * const block = c->getBlock(b);
+            ChunkEntryFlag const * const flags = c->getFlagBlock(b);
+            for (int e = 0; e < n; ++e, ++i) {
+                if ((flags[e] & Chunk::DELETED) != 0) {
+                    continue;
+                }
+                ++numLive;
+                if (i % stride == 0) {
+                    sample.push_back(Point(block[e].getRa(), block[e].getDec()));
+                }
+            }
+        }
+    }
+
+    ZoneHeightTuning const t = tuneZoneHeight(
+        sample, numLive, radius, zsc.getZonesPerDegree(), zsc.getZonesPerStripe(),
+        zsc.getMaxEntriesPerZoneEstimate());
+    ZoneStripeChunkDecomposition const & current = index.getDecomposition();
+    if (t._zonesPerDegree != current.getZonesPerDegree() ||
+        t._zonesPerStripe != current.getZonesPerStripe()) {
+        index.setDecomposition(t._zonesPerDegree, t._zonesPerStripe,
+                               t._maxEntriesPerZoneEstimate);
+    }
+    watch.stop();
+    Log log(Log::getDefaultLog(), "lsst.ap");
+    Rec(log, Log::INFO) << "tuned zone height of zone index" <<
+        Prop<int>("numElements", static_cast<int>(numLive)) <<
+        Prop<int>("sampleSize", static_cast<int>(sample.size())) <<
+        Prop<double>("density", t._density) <<
+        Prop<double>("matchRadius", radius) <<
+        Prop<int>("zonesPerDegree", t._zonesPerDegree) <<
+        Prop<int>("zonesPerStripe", t._zonesPerStripe) <<
+        Prop<int>("maxEntriesPerZoneEstimate", t._maxEntriesPerZoneEstimate) <<
+        Prop<double>("costPerProbe", t._costPerProbe) <<
+        Prop<double>("time", watch.seconds()) << Rec::endr;
+}
+
+
+// -- IncrementalObjectIndex ----------------
+
+IncrementalObjectIndex::IncrementalObjectIndex(
+    ZoneStripeChunkDecomposition const & zsc,
+    double const maxEpochDrift,
+    double const maxLazyMu,
+    bool const autoTuneZoneHeight,
+    std::string const & runId
+) :
+    _index(zsc.getZonesPerDegree(), zsc.getZonesPerStripe(), zsc.getMaxEntriesPerZoneEstimate()),
+    _chunks(),
+    _zsc(zsc),
+    _runId(runId),
+    _epoch(0.0),
+    _maxEpochDrift(maxEpochDrift),
+    _maxLazyMu(maxLazyMu),
+    _lazyMu(0.0),
+    _autoTuneZoneHeight(autoTuneZoneHeight)
+{}
+
+
+/// Empties the index.
+void IncrementalObjectIndex::clear() {
+    _index.clear();
+    _chunks.clear();
+    _lazyMu = 0.0;
+}
+
+
+/**
+ * Brings the index up to date with the given list of chunks (covering the FOV of a visit
+ * at the given epoch). If zone height tuning is enabled and the index is rebuilt from
+ * scratch, the zone height is chosen for the given match radius (in degrees).
+ */
+void IncrementalObjectIndex::update(
+    ObjectChunkVector const & chunks,
+    double const epoch,
+    double const radius
+) {
+    typedef ObjectChunkVector::const_iterator ChunkIterator;
+    typedef IndexedChunkMap::iterator MapIterator;
+
+    Log log(Log::getDefaultLog(), "lsst.ap");
+    Stopwatch watch(true);
+
+    if (chunks.empty()) {
+        clear();
+        return;
+    }
+    bool const rebuild = _chunks.empty() || std::fabs(epoch - _epoch) > _maxEpochDrift;
+    if (rebuild) {
+        clear();
+        _epoch = epoch;
+        if (_autoTuneZoneHeight) {
+            tuneZoneIndex(_index, chunks, _zsc, radius);
+        }
+    }
+
+    // determine which indexed chunks can be kept, and which chunk entries must be inserted
+    std::vector<ObjectChunk const *> discard;
+    std::vector<int> discardIds;
+    std::vector<std::pair<IndexedChunk *, int> > toInsert;
+    std::vector<ObjectChunk> toAdd;
+    std::set<int> ids;
+    ChunkIterator const end(chunks.end());
+    for (ChunkIterator c(chunks.begin()); c != end; ++c) {
+        int const id = static_cast<int>(c->getId());
+        ids.insert(id);
+        MapIterator i = _chunks.find(id);
+        if (i != _chunks.end() &&
+            i->second._generation == c->getGeneration() &&
+            i->second._size <= c->size()) {
+            // index entries keep pointing to the retained chunk instance, but its state
+            // must be that of the chunk the visit acquired
+            i->second._chunk = *c;
+            // append entries added since the chunk was last indexed
+            if (i->second._size < c->size()) {
+                toInsert.push_back(std::make_pair(&i->second, i->second._size));
+            }
+        } else {
+            if (i != _chunks.end()) {
+                discard.push_back(&i->second._chunk);
+                discardIds.push_back(id);
+            }
+            toAdd.push_back(*c);
+        }
+    }
+    for (MapIterator i = _chunks.begin(); i != _chunks.end(); ++i) {
+        if (ids.find(i->first) == ids.end()) {
+            discard.push_back(&i->second._chunk);
+            discardIds.push_back(i->first);
+        }
+    }
+    int const numRetained = static_cast<int>(chunks.size() - toAdd.size());
+
+    try {
+        // adjust index to the new dec range, then remove entries for discarded chunks
+        ZoneStripeChunkDecomposition const & zsc = _index.getDecomposition();
+        int minStripe = 0;
+        int maxStripe = 0;
+        computeStripeBounds(chunks, minStripe, maxStripe);
+        double minDec = zsc.getStripeDecMin(minStripe) - 0.001;
+        double maxDec = zsc.getStripeDecMax(maxStripe) + 0.001;
+        _index.changeDecBounds(std::max(minDec, -90.0), std::min(maxDec, 90.0));
+        int numRemoved = 0;
+        if (!discard.empty()) {
+            std::sort(discard.begin(), discard.end());
+            DiscardChunkFilter filter(discard);
+            numRemoved = _index.pack(filter);
+            // the chunks no longer have entries in the index: free their slots
+            for (std::vector<int>::const_iterator d = discardIds.begin(); d != discardIds.end(); ++d) {
+                MapIterator i = _chunks.find(*d);
+                _index.releaseChunk(&i->second._chunk);
+                _chunks.erase(i);
+            }
+        }
+
+        // insert entries for new chunks and for entries appended to retained chunks
+        for (ChunkIterator c(toAdd.begin()); c != toAdd.end(); ++c) {
+            MapIterator i = _chunks.insert(
+                IndexedChunkMap::value_type(static_cast<int>(c->getId()), IndexedChunk(*c))).first;
+            toInsert.push_back(std::make_pair(&i->second, 0));
+        }
+        int const numBefore = _index.size();
+        for (std::vector<std::pair<IndexedChunk *, int> >::iterator i = toInsert.begin();
+             i != toInsert.end(); ++i) {
+            IndexedChunk * const ic = i->first;
+            insertChunkEntries(_index, ic->_chunk, i->second, epoch, _maxLazyMu, _lazyMu);
+            ic->_size = ic->_chunk.size();
+        }
+        int const numInserted = _index.size() - numBefore;
+        watch.stop();
+        Rec(log, Log::INFO) << "updated incremental zone index" <<
+            Prop<int>("rebuild", rebuild ? 1 : 0) <<
+            Prop<int>("numChunks", static_cast<int>(chunks.size())) <<
+            Prop<int>("numRetainedChunks", numRetained) <<
+            Prop<int>("numDiscardedChunks", static_cast<int>(discard.size())) <<
+            Prop<int>("numRemoved", numRemoved) <<
+            Prop<int>("numInserted", numInserted) <<
+            Prop<double>("maxLazyProperMotion", _lazyMu) <<
+            Prop<double>("time", watch.seconds()) << Rec::endr;
+
+        // merge newly inserted entries into the sorted zones
+        watch.start();
+        _index.merge();
+        watch.stop();
+        Rec(log, Log::INFO) << "merged zone index" <<
+            Prop<int>("numElements", _index.size()) <<
+            Prop<double>("time", watch.seconds()) << Rec::endr;
+    } catch (...) {
+        clear();
+        throw LSST_EXCEPT(ex::RuntimeError, "Failed to update zone index");
+    }
+}
+
+}}} // end of namespace lsst::ap::detail
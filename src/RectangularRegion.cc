@@ -50,9 +50,9 @@ lsst::ap::RectangularRegion::RectangularRegion(
     _minDec(minDec),
     _maxDec(maxDec)
 {
-    if (minRa < 0.0 || minRa >= 360.0 || maxRa < 0.0 || maxRa >= 360.0) {
+    if (minRa < 0.0 || minRa >= 360.0 || maxRa < 0.0 || maxRa > 360.0) {
         throw LSST_EXCEPT(ex::RangeError,
-                          "right ascension must be in range [0, 360) degrees");
+                          "minimum (maximum) right ascension must be in range [0, 360) ([0, 360]) degrees");
     }
     if (minDec < -90.0 || minDec > 90.0 || maxDec < -90.0 || maxDec > 90.0) {
         throw LSST_EXCEPT(ex::RangeError,
@@ -97,13 +97,19 @@ void lsst::ap::RectangularRegion::fromCircle(
                           "circle radius must be in range  [0, 90] degrees");
     }
     double alpha = maxAlpha(radius, dec);
-    _minRa = ra - alpha;
-    if (_minRa < 0.0) {
-        _minRa += 360.0;
-    }
-    _maxRa = ra + alpha;
-    if (_maxRa >= 360.0) {
-        _maxRa -= 360.0;
+    if (alpha >= 180.0) {
+        // the circle contains a pole
+        _minRa = 0.0;
+        _maxRa = 360.0;
+    } else {
+        _minRa = ra - alpha;
+        if (_minRa < 0.0) {
+            _minRa += 360.0;
+        }
+        _maxRa = ra + alpha;
+        if (_maxRa >= 360.0) {
+            _maxRa -= 360.0;
+        }
     }
     _minDec = dec - radius;
     if (_minDec < -90.0) {
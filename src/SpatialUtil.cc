@@ -426,7 +426,12 @@ void lsst::ap::computeChunkIds(
         int maxChunk = fc + static_cast<int>(std::floor((raMax*nc)/360.0)) % nc;
         int chunk    = fc + static_cast<int>(std::floor((raMin*nc)/360.0)) % nc;
 
-        if (raMax < raMin) {
+        if (raMax - raMin >= 360.0) {
+            // region covers all right ascensions
+            for (chunk = fc; chunk < fc + nc; ++chunk) {
+                chunkIds.push_back(chunk);
+            }
+        } else if (raMax < raMin) {
             if (chunk == maxChunk) {
                 --maxChunk; // avoid adding the same chunk twice
             }
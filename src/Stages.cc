@@ -52,11 +52,12 @@
 #endif
 
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <utility>
 
 #include "boost/format.hpp"
-#include "boost/scoped_array.hpp"
+#include "boost/shared_ptr.hpp"
 
 #include "lsst/daf/persistence/LogicalLocation.h"
 #include "lsst/pex/exceptions.h"
@@ -66,8 +67,10 @@
 #include "lsst/afw/image/Filter.h"
 #include "lsst/mops/MovingObjectPrediction.h"
 
+#include "lsst/ap/ChunkLoader.h"
 #include "lsst/ap/ChunkManager.h"
 #include "lsst/ap/Match.h"
+#include "lsst/ap/ObjectIndex.h"
 #include "lsst/ap/Point.h"
 #include "lsst/ap/Stages.h"
 #include "lsst/ap/Time.h"
@@ -108,13 +111,10 @@ static char const * const VAR_PROB_THRESH_KEY[6] = {
 
 namespace detail {
 
-typedef SharedObjectChunkManager::ObjectChunk ObjectChunk;
-
-typedef std::vector<ObjectChunk> ObjectChunkVector;
-
-typedef ZoneEntry<ObjectChunk> ObjectEntry;
 typedef ZoneEntry<DiaSourceChunk> DiaSourceEntry;
 
+typedef MatchCollector<DiaSourceEntry, ObjectEntry> ObjectMatchCollector;
+
 typedef Ellipse<MovingObjectPrediction> MovingObjectEllipse;
 
 } // end of namespace detail
@@ -145,63 +145,22 @@ namespace detail {
 
 // -- Proper motion correction for objects ----------------
 
-/** @return the proper motion corrected position of the given object */
-std::pair<double, double> correctProperMotion(Object const& obj, double const epoch) {
-    static double const RAD_PER_MAS = (RADIANS_PER_DEGREE/360000.0);
-    // (rad/mas)*(sec/year)/(km/AU)
-    static double const SCALE = RAD_PER_MAS*(365.25*86400/149597870.691);
-
-    double ra   = radians(obj.getRa());   // rad
-    double decl = radians(obj.getDec()); // rad
-
-    // Convert ra, dec to unit vector in cartesian coordinate system
-    double const sinDecl = std::sin(decl);
-    double const cosDecl = std::cos(decl);
-    double const sinRa   = std::sin(ra);
-    double const cosRa   = std::cos(ra);
-    double x = cosRa * cosDecl;
-    double y = sinRa * cosDecl;
-    double z = sinDecl;
-
-    // compute space motion vector (radians per year)
-    double const pmRa   = obj.getMuRa()*RAD_PER_MAS/cosDecl;
-    double const pmDecl = obj.getMuDecl()*RAD_PER_MAS;
-    // divide radial velociy by distance to source
-    double const w = obj.getParallax()*obj.getRadialVelocity()*SCALE;
-
-    double const mx = - pmRa*y - pmDecl*cosRa   + x*w;
-    double const my =   pmRa*x - pmDecl*sinRa   + y*w;
-    double const mz =            pmDecl*cosDecl + z*w;
-
-    // Linear interpolation of position
-    double const dt = (epoch - obj.getEpoch()) * (1/365.25); // julian years
-    x += mx*dt;
-    y += my*dt;
-    z += mz*dt;
-
-    // Store unit vector for corrected position, convert back to
-    // spherical coords and store scaled integer ra/dec
-    double d2 = x*x + y*y;
-    ra   = (d2 == 0.0) ? 0 : degrees(std::atan2(y, x));
-    decl = (z  == 0.0) ? 0 : degrees(std::atan2(z, std::sqrt(d2)));
-    if (ra < 0.0) {
-        ra += 360.0;
-    }
-    return std::make_pair(ra, decl);
+/**
+ * Returns the maximum total proper motion (mas/year) of objects that are indexed at their
+ * catalog positions, or -1 if lazy proper motion correction is disabled by the given policy.
+ */
+double getMaxLazyProperMotion(Policy::Ptr const policy) {
+    return policy->getBool("lazyProperMotion") ? policy->getDouble("maxLazyProperMotion") : -1.0;
 }
 
 
 // -- Match processors ----------------
 
-/** @brief  Processor for lists of objects matching a difference source */
-template <typename ZoneEntryT>
+/** @brief  Processor for collected difference source to object matches */
 class ObjectMatchProcessor {
 
 public :
 
-    typedef MatchWithDistance<ZoneEntryT> Match;
-    typedef typename std::vector<Match>::iterator MatchIterator;
-
     MatchPairVector & _matches;
     Filter const _filter;
     int const _threshold;
@@ -216,20 +175,16 @@ public :
         _threshold(context.getPipelinePolicy()->getInt(VAR_PROB_THRESH_KEY[filter.getId()]))
     {}
 
-    void operator()(DiaSourceEntry & ds, MatchIterator begin, MatchIterator end) {
-        boost::uint32_t flags = HAS_MATCH;
-        do {
-            ZoneEntryT * const obj  = begin->_match;
-            double const dist = degrees(begin->_distance);
-            ++begin;
-            // record match results (to be persisted later)
-            _matches.push_back(MatchPair(ds._data->getId(), obj->_data->getId(), dist));
-            if (obj->_data->getVarProb(_filter) >= _threshold) {
-                // flag ds as matching a known variable
-                flags |= HAS_KNOWN_VARIABLE_MATCH;
-            }
-        } while (begin != end);
-        ds._flags = flags;
+    void operator()(ObjectMatchCollector::Record const & r) {
+        DiaSourceEntry * const ds  = r._first;
+        ObjectEntry    * const obj = r._second;
+        // record match results (to be persisted later)
+        _matches.push_back(MatchPair(ds->_data->getId(), obj->_data->getId(), degrees(r._distance)));
+        ds->_flags |= HAS_MATCH;
+        if (obj->_data->getVarProb(_filter) >= _threshold) {
+            // flag ds as matching a known variable
+            ds->_flags |= HAS_KNOWN_VARIABLE_MATCH;
+        }
     }
 };
 
@@ -377,111 +332,136 @@ struct NewObjectCreator {
 };
 
 
-// -- Index creation ----------------
-
-template <typename EntryT>
-void buildZoneIndex(
-    ZoneIndex<EntryT> & index,
-    std::vector<typename EntryT::Chunk> const & chunks,
-    double const epoch
+/**
+ * Returns the incremental object index for the given run, creating it if necessary.
+ */
+boost::shared_ptr<IncrementalObjectIndex> getIncrementalObjectIndex(
+    Policy::Ptr const policy,
+    std::string const & runId
 ) {
-    typedef typename EntryT::Data Data;
-    typedef typename EntryT::Chunk Chunk;
-    typedef std::vector<Chunk> ChunkVector;
-    typedef typename ChunkVector::const_iterator ChunkIterator;
-    typedef typename ChunkVector::size_type Size;
-
-    index.clear();
-    if (chunks.empty()) {
-        return;
+    static boost::shared_ptr<IncrementalObjectIndex> index;
+    if (!index || index->getRunId() != runId) {
+        ZoneStripeChunkDecomposition const zsc(
+            policy->getInt("zonesPerDegree"),
+            policy->getInt("zonesPerStripe"),
+            policy->getInt("maxEntriesPerZoneEstimate")
+        );
+        index.reset(new IncrementalObjectIndex(
+            zsc,
+            policy->getDouble("maxObjectIndexEpochDrift"),
+            getMaxLazyProperMotion(policy),
+            policy->getBool("autoTuneZoneHeight"),
+            runId
+        ));
     }
+    return index;
+}
 
-    Stopwatch watch(true);
 
-    // determine stripe bounds for the input chunks
-    ZoneStripeChunkDecomposition const & zsc = index.getDecomposition();
-    int minStripe = 0x7FFFFFFF;
-    int maxStripe = -1 - minStripe;
-    ChunkIterator const end(chunks.end());
-    for (ChunkIterator c(chunks.begin()); c != end; ++c) {
-        int const stripeId = ZoneStripeChunkDecomposition::chunkToStripe(c->getId());
-        if (stripeId > maxStripe) {
-            maxStripe = stripeId;
-        }
-        if (stripeId < minStripe) {
-            minStripe = stripeId;
-        }
+// -- Parallel chunk loading ----------------
+
+/**
+ * @brief   Maps chunk ids to the names of chunk and chunk delta files, as given by the
+ *          file name patterns in a pipeline policy. Not thread-safe.
+ */
+class ChunkFileNamer {
+public :
+    ChunkFileNamer(Policy::Ptr const policy, std::string const & runId) :
+        _refNamePattern(policy->getString("objectChunkFileNamePattern")),
+        _deltaNamePattern(policy->getString("objectDeltaChunkFileNamePattern")),
+        _ps(new PropertySet)
+    {
+        _ps->set<std::string>("runId", runId);
     }
-    assert(maxStripe >= minStripe && "invalid stripe bounds for chunk list");
-
-    // Partition input chunks into stripes
-    int const numStripes = maxStripe - minStripe + 1;
-    boost::scoped_array<ChunkVector> stripes(new ChunkVector[numStripes]);
-    for (ChunkIterator c(chunks.begin()); c != end; ++c) {
-        int const stripeId = ZoneStripeChunkDecomposition::chunkToStripe(c->getId());
-        assert(stripeId >= minStripe && stripeId <= maxStripe && "stripe id out of bounds");
-        stripes[stripeId - minStripe].push_back(*c);
+
+    std::pair<std::string, std::string> operator()(int const chunkId) const {
+        _ps->set<int>("chunkId", chunkId);
+        _ps->set<int>("stripeId", ZoneStripeChunkDecomposition::chunkToStripe(chunkId));
+        _ps->set<int>("chunkSeqNum", ZoneStripeChunkDecomposition::chunkToSequence(chunkId));
+        return std::make_pair(LogicalLocation(_refNamePattern, _ps).locString(),
+                              LogicalLocation(_deltaNamePattern, _ps).locString());
     }
 
-    double minDec = zsc.getStripeDecMin(minStripe) - 0.001;
-    double maxDec = zsc.getStripeDecMax(maxStripe) + 0.001;
-    index.setDecBounds(std::max(minDec, -90.0), std::min(maxDec, 90.0));
-
-    // Loop over stripes. Note that due to proper motion, objects from
-    // different stripes can end up in the same zone. Objects are never
-    // migrated across chunks/stripes; rather, their J2000 coordinates
-    // determine the chunks that they will belong to. As time goes on,
-    // the spatial extent of a chunk will grow, where the rate of growth
-    // is bounded by Barnard's star with a proper motion of ~10.5 arcsec/year.
-    // When intersecting the bounding circle of a FOV with chunk boundaries
-    // to determine which chunks must be loaded for association, the bounding
-    // circle must be padded to ensure all relevant objects are loaded.
-    try {
-        for (int s = 0; s < numStripes; ++s) {
-            ChunkVector &  vec = stripes[s];
-            Size const numChunks = vec.size();
-
-            // Loop over chunks in stripe
-            for (Size c = 0; c < numChunks; ++c) {
-                Chunk * const ch = &vec[c];
-                int const numBlocks  = ch->blocks();
-                int i = 0;
-
-                // loop over blocks in chunk
-                for (int b = 0; b < numBlocks; ++b) {
-                    int const numEntries = ch->entries(b);
-                    Data * const block = ch->getBlock(b);
-                    ChunkEntryFlag const * const flags = ch->getFlagBlock(b);
-
-                    // loop over entries in block
-                    for (int e = 0; e < numEntries; ++e, ++i) {
-                        if ((flags[e] & Chunk::DELETED) == 0) {
-                            std::pair<double, double> pos = correctProperMotion(block[e], epoch);
-                            index.insert(pos.first, pos.second, &block[e], ch, i);
-                        }
-                    }
-                }
-            }
-        }
-    } catch(...) {
-       index.clear();
-       throw LSST_EXCEPT(ex::RuntimeError, "Failed to build zone index"); 
+private :
+    std::string _refNamePattern;
+    std::string _deltaNamePattern;
+    PropertySet::Ptr _ps;
+};
+
+
+/**
+ * Returns the chunk loader of the calling process, replacing it if it does not have
+ * @a numThreads threads (clamped to [1, ChunkLoader::MAX_THREADS]). Loader threads are
+ * therefore created once per process rather than once per visit.
+ */
+ChunkLoader & getChunkLoader(int const numThreads) {
+    static boost::shared_ptr<ChunkLoader> loader;
+    int const n = std::min(std::max(numThreads, 1), static_cast<int>(ChunkLoader::MAX_THREADS));
+    if (!loader || loader->getNumThreads() != n) {
+        loader.reset();
+        loader.reset(new ChunkLoader(n));
     }
+    return *loader;
+}
 
-    watch.stop();
-    Log log(Log::getDefaultLog(), "lsst.ap");
-    int numElements = static_cast<int>(index.size());
-    Rec(log, Log::INFO) << "inserted elements into zone index" <<
-        Prop<int>("numElements", numElements) <<
-        Prop<double>("time", watch.seconds()) << Rec::endr;
 
-    // zone structure is filled, sort individual zones (on right ascension)
-    watch.start();
-    index.sort();
+/**
+ * Reads the chunk and chunk delta files for the given chunks with the chunk loader of the
+ * calling process, marking each chunk usable as soon as it has been read. Per chunk read
+ * times and the aggregate read throughput are logged.
+ *
+ * @param[in, out] chunks           The chunks to read.
+ * @param[in] namer                 Maps chunk ids to file names.
+ * @param[in] numThreads            The number of threads in the chunk loader of the process.
+ *                                  Values less than 2 cause chunks to be read serially
+ *                                  by the calling thread.
+ * @param[in] log                   Log to report statistics to.
+ */
+void loadChunks(
+    std::vector<VisitProcessingContext::ObjectChunk> & chunks,
+    ChunkFileNamer const & namer,
+    int const numThreads,
+    Log & log
+) {
+    if (chunks.empty()) {
+        return;
+    }
+    // PropertySet and LogicalLocation are not thread-safe: compute file names up front
+    std::vector<std::string> refNames;
+    std::vector<std::string> deltaNames;
+    refNames.reserve(chunks.size());
+    deltaNames.reserve(chunks.size());
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        std::pair<std::string, std::string> names(namer(chunks[i].getId()));
+        refNames.push_back(names.first);
+        deltaNames.push_back(names.second);
+    }
+
+    std::vector<ChunkLoadStats> stats;
+    ChunkLoader & loader = getChunkLoader(numThreads);
+    int const nt = static_cast<int>(std::min(
+        static_cast<std::size_t>(loader.getNumThreads()), chunks.size()));
+    Stopwatch watch(true);
+    loader.load(chunks, refNames, deltaNames, stats);
     watch.stop();
-    Rec(log, Log::INFO) << "sorted zone index" <<
-        Prop<int>("numElements", numElements) <<
-        Prop<double>("time", watch.seconds()) << Rec::endr;
+
+    unsigned long long totalBytes = 0;
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        totalBytes += stats[i]._bytes;
+        Rec(log, Log::DEBUG) << "read chunk" <<
+            Prop<int>("chunkId", chunks[i].getId()) <<
+            Prop<int>("numEntries", chunks[i].size()) <<
+            Prop<double>("bytes", static_cast<double>(stats[i]._bytes)) <<
+            Prop<double>("time", stats[i]._seconds) << Rec::endr;
+    }
+    double const seconds = watch.seconds();
+    Rec(log, Log::INFO) << "chunk read throughput" <<
+        Prop<int>("numChunks", static_cast<int>(chunks.size())) <<
+        Prop<int>("numThreads", nt) <<
+        Prop<double>("bytes", static_cast<double>(totalBytes)) <<
+        Prop<double>("time", seconds) <<
+        Prop<double>("MiBPerSecond", seconds > 0.0 ?
+            static_cast<double>(totalBytes)/(seconds*1048576.0) : 0.0) << Rec::endr;
 }
 
 } // end of namespace detail
@@ -493,21 +473,22 @@ void buildZoneIndex(
 #   pragma GCC visibility push(hidden)
 #endif
 /// @cond
-template class detail::ObjectMatchProcessor<detail::ObjectEntry>;
+template class MatchCollector<detail::DiaSourceEntry, detail::ObjectEntry>;
 
 template std::size_t distanceMatch<
     detail::DiaSourceEntry,
     detail::ObjectEntry,
     PassthroughFilter<detail::DiaSourceEntry>,
     PassthroughFilter<detail::ObjectEntry>,
-    detail::ObjectMatchProcessor<detail::ObjectEntry>
+    detail::ObjectMatchCollector
 >(
     ZoneIndex<detail::DiaSourceEntry> &,
     ZoneIndex<detail::ObjectEntry> &,
     double const,
     PassthroughFilter<detail::DiaSourceEntry> &,
     PassthroughFilter<detail::ObjectEntry> &,
-    detail::ObjectMatchProcessor<detail::ObjectEntry> &
+    detail::ObjectMatchCollector &,
+    std::vector<double> &
 );
 
 template std::size_t ellipseMatch<
@@ -542,21 +523,28 @@ VisitProcessingContext::VisitProcessingContext(
     _policy(policy),
     _chunkIds(),
     _chunks(),
+    _zsc(policy->getInt("zonesPerDegree"),
+         policy->getInt("zonesPerStripe"),
+         policy->getInt("maxEntriesPerZoneEstimate")),
     _objectIndex(policy->getInt("zonesPerDegree"),
                  policy->getInt("zonesPerStripe"),
                  policy->getInt("maxEntriesPerZoneEstimate")),
     _diaSourceIndex(policy->getInt("zonesPerDegree"),
                     policy->getInt("zonesPerStripe"),
                     policy->getInt("maxEntriesPerZoneEstimate")),
+    _incrementalObjectIndex(),
     _deadline(),
     _fov(),
     _runId(runId),
     _visitId(-1),
     _matchRadius(policy->getDouble("matchRadius")),
     _ellipseScalingFactor(policy->getDouble("ellipseScalingFactor")),
+    _maxLazyProperMotion(detail::getMaxLazyProperMotion(policy)),
+    _lazyProperMotion(0.0),
     _filter(),
     _workerId(workerId),
     _numWorkers(numWorkers),
+    _autoTuneZoneHeight(policy->getBool("autoTuneZoneHeight")),
     _debugSharedMemory(policy->getBool("debugSharedMemory"))
 {
     double ra = event->getAsDouble("ra");
@@ -567,6 +555,9 @@ VisitProcessingContext::VisitProcessingContext(
         _matchRadius = event->getAsDouble("matchRadius");
     }
     _visitTime = event->getAsDouble("dateObs");
+    if (policy->getBool("incrementalObjectIndex")) {
+        _incrementalObjectIndex = detail::getIncrementalObjectIndex(policy, runId);
+    }
 
     // DC3a: set association pipeline deadline to 10 minutes
     // after creation of a visit processing context.
@@ -630,8 +621,36 @@ void VisitProcessingContext::setDiaSources(boost::shared_ptr<PersistableDiaSourc
 }
 
 
+VisitProcessingContext::ObjectIndex & VisitProcessingContext::getObjectIndex() {
+    if (_incrementalObjectIndex) {
+        return _incrementalObjectIndex->getIndex();
+    }
+    return _objectIndex;
+}
+
+
 void VisitProcessingContext::buildObjectIndex() {
-    detail::buildZoneIndex(_objectIndex, _chunks, _visitTime);
+    if (_incrementalObjectIndex) {
+        _incrementalObjectIndex->update(_chunks, _visitTime, _matchRadius/3600.0);
+    } else {
+        if (_autoTuneZoneHeight) {
+            detail::tuneZoneIndex(_objectIndex, _chunks, _zsc, _matchRadius/3600.0);
+        }
+        _lazyProperMotion = detail::buildZoneIndex(_objectIndex, _chunks, _visitTime,
+                                                   _maxLazyProperMotion);
+    }
+}
+
+
+/**
+ * Returns an upper bound on the distance (in degrees) between the catalog and visit epoch
+ * positions of objects that were indexed at their catalog positions. Matches against the
+ * object index must use a match radius padded by this amount.
+ */
+double VisitProcessingContext::getLazyProperMotionPadding() const {
+    double const mu = _incrementalObjectIndex ?
+        _incrementalObjectIndex->getLazyProperMotion() : _lazyProperMotion;
+    return detail::maxProperMotionDisplacement(mu, _visitTime);
 }
 
 
@@ -640,25 +659,86 @@ void VisitProcessingContext::buildObjectIndex() {
 /**
  * Sets up all fundamental visit processing parameters using a policy and ensure
  * that a reference to the shared memory object used for chunk storage exists.
+ * The kind of pages backing the shared memory object and its capacities are taken
+ * from the policy, and the kind of pages actually in use is logged.
  */
-void initialize(std::string const & runId) {
+void initialize(Policy::Ptr const policy, std::string const & runId) {
+    Log log(Log::getDefaultLog(), "lsst.ap");
+    std::string const pageMode(policy->getString("chunkPageMode"));
+    SharedObjectChunkManager::PageMode mode = SharedObjectChunkManager::NORMAL_PAGES;
+    if (pageMode == "transparent") {
+        mode = SharedObjectChunkManager::TRANSPARENT_HUGE_PAGES;
+    } else if (pageMode == "hugetlbfs") {
+        mode = SharedObjectChunkManager::HUGETLBFS_PAGES;
+    } else if (pageMode != "normal") {
+        throw LSST_EXCEPT(ex::InvalidParameterError,
+            "chunkPageMode must be one of \"normal\", \"transparent\" or \"hugetlbfs\"");
+    }
+    SharedObjectChunkManager::setPageMode(mode, policy->getString("hugetlbfsDir"));
+    detail::ChunkStoreLayout layout;
+    layout._numBlocks         = policy->getInt("numChunkBlocks");
+    layout._maxBlocksPerChunk = policy->getInt("maxBlocksPerChunk");
+    layout._maxChunksPerFov   = policy->getInt("maxChunksPerFov");
+    layout._maxVisitsInFlight = policy->getInt("maxVisitsInFlight");
+    SharedObjectChunkManager::setLayout(layout);
+
     // create shared memory object if it doesn't already exist
-    volatile SharedObjectChunkManager manager(runId);
+    SharedObjectChunkManager manager(runId);
+    if (manager.getPageMode() != mode) {
+        Rec(log, Log::WARN) << "requested pages unavailable for shared memory chunk storage" <<
+            Prop<std::string>("requested", SharedObjectChunkManager::getPageModeName(mode)) << Rec::endr;
+    }
+    Rec(log, Log::INFO) << "mapped shared memory chunk storage" <<
+        Prop<std::string>("pageMode", SharedObjectChunkManager::getPageModeName(manager.getPageMode())) <<
+        Prop<double>("pageSize", static_cast<double>(manager.getPageSize())) <<
+        Prop<int>("numChunkBlocks", layout._numBlocks) <<
+        Prop<int>("maxBlocksPerChunk", layout._maxBlocksPerChunk) <<
+        Prop<int>("maxChunksPerFov", layout._maxChunksPerFov) <<
+        Prop<int>("maxVisitsInFlight", layout._maxVisitsInFlight) <<
+        Prop<double>("size", static_cast<double>(SharedObjectChunkManager::size())) << Rec::endr;
 }
 
 
 /**
  * Computes ids for all object chunks covering the visit FOV and
- * registers the visit with the shared memory chunk manager.
+ * registers the visit with the shared memory chunk manager. The budget for
+ * chunks retained in memory across visits is also (re)set from the pipeline policy.
  */
 void registerVisit(VisitProcessingContext & context) {
     context.getChunkIds().clear();
     computeChunkIds(context.getChunkIds(), context.getFov(), context.getDecomposition(), 0, 1);
     SharedObjectChunkManager manager(context.getRunId());
+    int const budget = context.getPipelinePolicy()->getInt("chunkRetentionBudget");
+    manager.setRetentionBudget(static_cast<std::size_t>(std::max(budget, 0))*1024*1024);
     manager.registerVisit(context.getVisitId());
 }
 
 
+/**
+ * Starts reading in the object chunks covering the FOV of an upcoming visit, centered at the
+ * given position, on a low priority background thread of the calling process. Chunks read in
+ * this way are handed to the visit when it starts, so that it performs no I/O for them.
+ * Requires a non-zero chunk retention budget.
+ *
+ * @param[in] context   State for the visit currently being processed.
+ * @param[in] ra        Right ascension of the upcoming visit center (degrees).
+ * @param[in] dec       Declination of the upcoming visit center (degrees).
+ */
+void prefetchVisit(VisitProcessingContext & context, double const ra, double const dec) {
+    Log log(Log::getDefaultLog(), "lsst.ap");
+    Policy::Ptr policy(context.getPipelinePolicy());
+    CircularRegion fov(ra, dec, policy->getDouble("fovRadius"));
+    SharedObjectChunkManager manager(context.getRunId());
+    Stopwatch watch(true);
+    int const numChunks = manager.prefetch(
+        fov, context.getDecomposition(), detail::ChunkFileNamer(policy, context.getRunId()));
+    watch.stop();
+    Rec(log, Log::INFO) << "started prefetching chunks for upcoming visit" <<
+        Prop<int>("numChunks", numChunks) <<
+        Prop<double>("time", watch.seconds()) << Rec::endr;
+}
+
+
 /**
  * Ensures that object data for the chunks assigned to the calling slice has been read in or is
  * owned by the given visit.
@@ -667,7 +747,6 @@ void loadSliceObjects(VisitProcessingContext & context) {
 
     typedef VisitProcessingContext::ObjectChunk Chunk;
     typedef std::vector<Chunk>                        ChunkVector;
-    typedef std::vector<Chunk>::iterator              ChunkIterator;
 
     SharedObjectChunkManager manager(context.getRunId());
     Log log(Log::getDefaultLog(), "lsst.ap");
@@ -696,6 +775,14 @@ void loadSliceObjects(VisitProcessingContext & context) {
         watch.stop();
         Rec(log, Log::INFO) << "started processing visit" <<
             Prop<double>("time", watch.seconds()) << Rec::endr;
+        detail::ChunkRetentionStats stats = manager.getRetentionStats();
+        Rec(log, Log::INFO) << "chunk retention statistics" <<
+            Prop<double>("hits", static_cast<double>(stats._hits)) <<
+            Prop<double>("misses", static_cast<double>(stats._misses)) <<
+            Prop<double>("evictions", static_cast<double>(stats._evictions)) <<
+            Prop<double>("prefetches", static_cast<double>(stats._prefetches)) <<
+            Prop<int>("numRetained", stats._numRetained) <<
+            Prop<double>("retainedBytes", static_cast<double>(stats._retainedBytes)) << Rec::endr;
 
         // record pointers to all chunks being handled by the slice
         ChunkVector & chunks = context.getChunks();
@@ -705,20 +792,11 @@ void loadSliceObjects(VisitProcessingContext & context) {
 
         // Read data files
         watch.start();
-        std::string refNamePattern(context.getPipelinePolicy()->getString("objectChunkFileNamePattern"));
-        std::string deltaNamePattern(context.getPipelinePolicy()->getString("objectDeltaChunkFileNamePattern"));
-        PropertySet::Ptr ps(new PropertySet);
-        ps->set<std::string>("runId", context.getRunId());
+        Policy::Ptr policy(context.getPipelinePolicy());
+        detail::ChunkFileNamer namer(policy, context.getRunId());
+        int const numLoaderThreads = policy->getInt("numChunkLoaderThreads");
         ChunkVector::size_type numToRead(toRead.size());
-        for (ChunkIterator i(toRead.begin()), end(toRead.end()); i != end; ++i) {
-            Chunk & c = *i;
-            ps->set<int>("chunkId", c.getId());
-            ps->set<int>("stripeId", ZoneStripeChunkDecomposition::chunkToStripe(c.getId()));
-            ps->set<int>("chunkSeqNum", ZoneStripeChunkDecomposition::chunkToSequence(c.getId()));
-            c.read(LogicalLocation(refNamePattern, ps).locString(), false);
-            c.readDelta(LogicalLocation(deltaNamePattern, ps).locString(), false);
-            c.setUsable();
-        }
+        detail::loadChunks(toRead, namer, numLoaderThreads, log);
         watch.stop();
         Rec(log, Log::INFO) << "read chunk files" <<
             Prop<int>("numChunks", static_cast<int>(numToRead)) <<
@@ -738,21 +816,20 @@ void loadSliceObjects(VisitProcessingContext & context) {
             // Read in chunks that were not successfully read by the previous owner
             watch.start();
             numToRead = toRead.size();
-            for (ChunkIterator i(toRead.begin()), end(toRead.end()); i != end; ++i) {
-                Chunk & c = *i;
-                ps->set<int>("chunkId", c.getId());
-                ps->set<int>("stripeId", ZoneStripeChunkDecomposition::chunkToStripe(c.getId()));
-                ps->set<int>("chunkSeqNum", ZoneStripeChunkDecomposition::chunkToSequence(c.getId()));
-                c.read(LogicalLocation(refNamePattern, ps).locString(), false);
-                c.readDelta(LogicalLocation(deltaNamePattern, ps).locString(), false);
-                c.setUsable();
-            }
+            detail::loadChunks(toRead, namer, numLoaderThreads, log);
             watch.stop();
             Rec(log, Log::INFO) << "read straggling chunks" <<
                 Prop<int>("numChunks", static_cast<int>(numToRead)) <<
                 Prop<double>("time", watch.seconds()) << Rec::endr;
         }
 
+        // totals over all workers of the visit that have loaded their chunks so far
+        detail::VisitWaitStats waits = manager.getVisitWaitStats(context.getVisitId());
+        Rec(log, Log::INFO) << "chunk manager wait times for visit" <<
+            Prop<double>("lockWait", waits._lockWait) <<
+            Prop<double>("ownershipWait", waits._ownershipWait) <<
+            Prop<int>("numWakeups", waits._numWakeups) << Rec::endr;
+
     } catch (ex::Exception & except) {
         Rec(log, Log::FATAL) << except.what() << Rec::endr;
         manager.failVisit(context.getVisitId());
@@ -816,31 +893,56 @@ void matchDiaSources(
         matches.clear();
         matches.reserve(65536);
 
-        detail::ObjectMatchProcessor<detail::ObjectEntry> mlp(context, matches, context.getFilter());
+        detail::ObjectMatchCollector collector;
         PassthroughFilter<detail::DiaSourceEntry> pdf;
         PassthroughFilter<detail::ObjectEntry> pof;
 
+        // objects indexed at their catalog positions can be up to padding degrees away
+        // from their positions at the visit epoch
+        double const radius  = context.getMatchRadius()/3600.0; // match routine expects degrees
+        double const padding = context.getLazyProperMotionPadding();
+        std::vector<double> busyTimes;
         Stopwatch watch(true);
         std::size_t nm = distanceMatch<
             detail::DiaSourceEntry,
             detail::ObjectEntry,
             PassthroughFilter<detail::DiaSourceEntry>,
             PassthroughFilter<detail::ObjectEntry>,
-            detail::ObjectMatchProcessor<detail::ObjectEntry>
+            detail::ObjectMatchCollector
         >(
             context.getDiaSourceIndex(),
             context.getObjectIndex(),
-            context.getMatchRadius()/3600.0,    // match routine expects degrees, not arc-seconds
+            radius + padding,
             pdf,
             pof,
-            mlp
+            collector,
+            busyTimes
         );
+        // gather matches from all threads in a reproducible order, then record them
+        // and flag difference sources with matches
+        std::vector<detail::ObjectMatchCollector::Record> records;
+        collector.collect(records, true);
+        int numCorrected = 0;
+        if (padding > 0.0) {
+            numCorrected = detail::retestLazyProperMotionMatches(
+                records, radians(radius), context.getVisitTime(), context.getMaxLazyProperMotion());
+            nm = records.size();
+        }
+        detail::ObjectMatchProcessor mp(context, matches, context.getFilter());
+        std::for_each(records.begin(), records.end(), mp);
         watch.stop();
+        double minBusyTime = busyTimes.empty() ? 0.0 : *std::min_element(busyTimes.begin(), busyTimes.end());
+        double maxBusyTime = busyTimes.empty() ? 0.0 : *std::max_element(busyTimes.begin(), busyTimes.end());
         Log log(Log::getDefaultLog(), "lsst.ap");
         Rec(log, Log::INFO) << "matched difference sources to objects" <<
             Prop<int>("numDiaSources", context.getDiaSourceIndex().size()) <<
             Prop<int>("numObjects", context.getObjectIndex().size()) <<
             Prop<int>("numMatches", static_cast<int>(nm)) <<
+            Prop<double>("lazyProperMotionPadding", padding) <<
+            Prop<int>("numProperMotionCorrected", numCorrected) <<
+            Prop<int>("numThreads", static_cast<int>(busyTimes.size())) <<
+            Prop<double>("minThreadBusyTime", minBusyTime) <<
+            Prop<double>("maxThreadBusyTime", maxBusyTime) <<
             Prop<double>("time", watch.seconds()) << Rec::endr;
 
     } catch (...) {
@@ -0,0 +1,103 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Implementation of the Thread class.
+ *
+ * @ingroup ap
+ */
+
+#include <cassert>
+#include <exception>
+
+#include "boost/format.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/Thread.h"
+
+namespace ex = lsst::pex::exceptions;
+
+
+/** Creates a new thread that runs @a function. */
+lsst::ap::Thread::Thread(boost::function<void ()> const & function) :
+    _function(function),
+    _failure(),
+    _joinable(false),
+    _failed(false)
+{
+    int err = ::pthread_create(&_thread, 0, &Thread::run, this);
+    if (err != 0) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("pthread_create() failed, return code: %1%") % err).str());
+    }
+    _joinable = true;
+}
+
+
+lsst::ap::Thread::~Thread() {
+    if (_joinable) {
+        int result = ::pthread_join(_thread, 0);
+        assert(result == 0);
+    }
+}
+
+
+/**
+ * Waits for the thread to finish. If the thread function threw an exception, a RuntimeError
+ * describing it is thrown. Calling join() on a thread that has already been joined is a no-op.
+ */
+void lsst::ap::Thread::join() {
+    if (!_joinable) {
+        return;
+    }
+    int err = ::pthread_join(_thread, 0);
+    if (err != 0) {
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("pthread_join() failed, return code: %1%") % err).str());
+    }
+    _joinable = false;
+    if (_failed) {
+        _failed = false;
+        throw LSST_EXCEPT(ex::RuntimeError, "background thread failed: " + _failure);
+    }
+}
+
+
+void * lsst::ap::Thread::run(void * thread) {
+    Thread * t = static_cast<Thread *>(thread);
+    try {
+        t->_function();
+    } catch (std::exception & e) {
+        t->_failure = e.what();
+        t->_failed = true;
+    } catch (...) {
+        t->_failure = "unknown exception";
+        t->_failed = true;
+    }
+    return 0;
+}
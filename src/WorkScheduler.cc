@@ -0,0 +1,175 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   WorkScheduler class implementation.
+ *
+ * @ingroup ap
+ */
+
+#include <cassert>
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/WorkScheduler.h"
+
+
+namespace lsst { namespace ap {
+
+/**
+ * Creates a scheduler for work items with the given estimated costs.
+ *
+ * @param[in] costs             Estimated (relative) cost of each work item. Negative
+ *                              costs are treated as zero.
+ * @param[in] numThreads        The number of threads work will be scheduled for.
+ * @param[in] batchesPerThread  The approximate number of batches to create per thread.
+ *                              Larger values improve load balance, smaller values improve
+ *                              cache coherency and reduce scheduling overhead.
+ */
+WorkScheduler::WorkScheduler(
+    std::vector<double> const & costs,
+    int const numThreads,
+    int const batchesPerThread
+) :
+    _batches(),
+    _queues(),
+    _numThreads(numThreads)
+{
+    if (numThreads <= 0 || batchesPerThread <= 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "number of threads and batches per thread must be positive");
+    }
+    _queues.reset(new Queue[numThreads]);
+
+    int const n = static_cast<int>(costs.size());
+    double total = 0.0;
+    for (int i = 0; i < n; ++i) {
+        if (costs[i] > 0.0) {
+            total += costs[i];
+        }
+    }
+    // fall back to uniform costs if no estimates are available
+    bool const uniform = (total <= 0.0);
+    if (uniform) {
+        total = static_cast<double>(n);
+    }
+
+    // greedily cut items into batches of consecutive items with roughly equal cost
+    double const target = total/(static_cast<double>(numThreads)*batchesPerThread);
+    std::vector<double> batchCost;
+    _batches.push_back(0);
+    double acc = 0.0;
+    for (int i = 0; i < n; ++i) {
+        acc += uniform ? 1.0 : (costs[i] > 0.0 ? costs[i] : 0.0);
+        if (acc >= target || i == n - 1) {
+            _batches.push_back(i + 1);
+            batchCost.push_back(acc);
+            acc = 0.0;
+        }
+    }
+
+    // assign contiguous runs of batches with roughly equal total cost to threads --
+    // the owner of a batch is determined by the cumulative cost at its midpoint
+    int const nb = static_cast<int>(batchCost.size());
+    double cum = 0.0;
+    int t = 0;
+    _queues[0]._head = 0;
+    for (int b = 0; b < nb; ++b) {
+        double const mid = cum + 0.5*batchCost[b];
+        cum += batchCost[b];
+        int owner = static_cast<int>(mid*numThreads/total);
+        if (owner >= numThreads) {
+            owner = numThreads - 1;
+        }
+        while (t < owner) {
+            _queues[t]._tail = b;
+            ++t;
+            _queues[t]._head = b;
+        }
+    }
+    while (t < numThreads) {
+        _queues[t]._tail = nb;
+        ++t;
+        if (t < numThreads) {
+            _queues[t]._head = nb;
+        }
+    }
+}
+
+
+WorkScheduler::~WorkScheduler() {}
+
+
+/**
+ * Obtains the next batch of work items for the calling thread, stealing work from
+ * other threads if necessary.
+ *
+ * @param[in]  thread   The index of the calling thread (in range [0, getNumThreads())).
+ * @param[out] begin    Set to the index of the first work item in the batch.
+ * @param[out] end      Set to one past the index of the last work item in the batch.
+ * @return              @c false if no work is left, @c true otherwise.
+ */
+bool WorkScheduler::next(int const thread, int & begin, int & end) {
+    assert(thread >= 0 && thread < _numThreads);
+    int b = -1;
+    {
+        Queue & q = _queues[thread];
+        ScopedLock<Mutex> lock(q._mutex);
+        if (q._head < q._tail) {
+            b = q._head++;
+        }
+    }
+    // steal from the back of the other threads' queues, starting with the next thread
+    for (int i = 1; b < 0 && i < _numThreads; ++i) {
+        Queue & q = _queues[(thread + i) % _numThreads];
+        ScopedLock<Mutex> lock(q._mutex);
+        if (q._head < q._tail) {
+            b = --q._tail;
+        }
+    }
+    if (b < 0) {
+        return false;
+    }
+    begin = _batches[b];
+    end   = _batches[b + 1];
+    return true;
+}
+
+
+/**
+ * Stores the time (in seconds) each thread spent processing batches in @a busyTimes,
+ * which is resized to getNumThreads().
+ */
+void WorkScheduler::getBusyTimes(std::vector<double> & busyTimes) const {
+    busyTimes.resize(_numThreads);
+    for (int t = 0; t < _numThreads; ++t) {
+        busyTimes[t] = _queues[t]._busyTime;
+    }
+}
+
+
+}} // end of namespace lsst::ap
@@ -0,0 +1,185 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Implementation of zone height tuning.
+ *
+ * The cost of probing a zone index for the matches of a single entity (see distanceMatch())
+ * is modeled as the sum of a fixed cost per zone touched (setup and a binary search for the
+ * start of the right ascension range) and a cost per candidate distance test. For zones of
+ * height h, a match radius r and a local entry density s, a probe touches 2r/h + 1 zones on
+ * average, and tests about s*2r*(2r + h) candidates. Tall zones therefore waste time on
+ * candidates outside of the search circle, while short zones waste time on per-zone overhead.
+ *
+ * @ingroup ap
+ */
+
+#include <cmath>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/SpatialUtil.h"
+#include "lsst/ap/ZoneTuning.h"
+
+namespace ex = lsst::pex::exceptions;
+
+
+namespace {
+
+/// Relative cost of touching a zone during a probe (measured in candidate distance tests)
+double const ZONE_COST = 32.0;
+
+/// Relative cost of a single candidate distance test
+double const CANDIDATE_COST = 1.0;
+
+int gcd(int a, int b) {
+    while (b != 0) {
+        int const t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+} // end of anonymous namespace
+
+
+/**
+ * Returns the estimated relative cost of finding the matches for a single entity in a zone
+ * index with the given zone height (in degrees), entry density (per square degree) and match
+ * radius (in degrees).
+ */
+double lsst::ap::estimateProbeCost(
+    double const zoneHeight,
+    double const density,
+    double const radius
+) {
+    if (zoneHeight <= 0.0) {
+        throw LSST_EXCEPT(ex::InvalidParameterError, "zone height must be positive");
+    }
+    double const numZones = 2.0*radius/zoneHeight + 1.0;
+    double const numCandidates = density*2.0*radius*(2.0*radius + zoneHeight);
+    return numZones*ZONE_COST + numCandidates*CANDIDATE_COST;
+}
+
+
+/**
+ * Estimates the density of entries (per square degree) in the neighbourhood of a typical entry,
+ * given a uniform random sample of entry positions. Sample positions are binned into cells
+ * of roughly @a cellSize by @a cellSize degrees, and cell densities are averaged with weights
+ * proportional to cell populations. Unlike the mean density over some bounding region, this
+ * is not diluted by empty sky, e.g. in the gaps between the chunks covering an FOV.
+ *
+ * @param[in] sample        Positions sampled uniformly at random from a set of entries.
+ * @param[in] numEntries    The total number of entries in the set.
+ * @param[in] cellSize      Side length (in degrees) of the cells used for density estimation.
+ */
+double lsst::ap::estimateDensity(
+    std::vector<Point> const & sample,
+    std::size_t const numEntries,
+    double const cellSize
+) {
+    if (cellSize <= 0.0 || cellSize > 10.0) {
+        throw LSST_EXCEPT(ex::RangeError, "cell size must be in range (0, 10] degrees");
+    }
+    if (sample.empty()) {
+        return 0.0;
+    }
+    std::map<std::pair<int, int>, int> cells;
+    for (std::vector<Point>::const_iterator i = sample.begin(); i != sample.end(); ++i) {
+        int const row = static_cast<int>(std::floor((i->_dec + 90.0)/cellSize));
+        double const rowDec = clampDec(row*cellSize - 90.0 + 0.5*cellSize);
+        double const cosDec = std::max(std::cos(radians(rowDec)), 1.0e-3);
+        int const col = static_cast<int>(std::floor(i->_ra*cosDec/cellSize));
+        ++cells[std::make_pair(row, col)];
+    }
+    double sum = 0.0;
+    for (std::map<std::pair<int, int>, int>::const_iterator c = cells.begin(); c != cells.end(); ++c) {
+        sum += static_cast<double>(c->second)*static_cast<double>(c->second);
+    }
+    double const n = static_cast<double>(sample.size());
+    return (sum/n)/(cellSize*cellSize)*(static_cast<double>(numEntries)/n);
+}
+
+
+/**
+ * Chooses a zone height for a zone index that will be searched for the matches of entities
+ * within @a radius degrees, given a sample of the positions of the entries in the index.
+ * Candidate zone heights evenly divide the stripe height of the given (policy) decomposition,
+ * so that stripes -- and therefore the chunks covering a region -- do not change. The estimate
+ * of the maximum number of entries per zone is scaled along with the zone height.
+ *
+ * @param[in] sample                    Positions sampled uniformly at random from the index entries.
+ * @param[in] numEntries                The total number of index entries.
+ * @param[in] radius                    The match radius (in degrees).
+ * @param[in] zonesPerDegree            The number of zones per degree of the default decomposition.
+ * @param[in] zonesPerStripe            The number of zones per stripe of the default decomposition.
+ * @param[in] maxEntriesPerZoneEstimate The max entries per zone estimate of the default decomposition.
+ */
+lsst::ap::ZoneHeightTuning lsst::ap::tuneZoneHeight(
+    std::vector<Point> const & sample,
+    std::size_t const numEntries,
+    double const radius,
+    int const zonesPerDegree,
+    int const zonesPerStripe,
+    int const maxEntriesPerZoneEstimate
+) {
+    if (radius < 0.0 || radius > 10.0) {
+        throw LSST_EXCEPT(ex::RangeError, "match radius must be in range [0, 10] degrees");
+    }
+    if (zonesPerDegree < 1 || zonesPerDegree > 3600 || zonesPerStripe < 1) {
+        throw LSST_EXCEPT(ex::RangeError, "invalid zone/stripe decomposition");
+    }
+    ZoneHeightTuning best;
+    best._zonesPerDegree = zonesPerDegree;
+    best._zonesPerStripe = zonesPerStripe;
+    best._maxEntriesPerZoneEstimate = maxEntriesPerZoneEstimate;
+    best._density = estimateDensity(sample, numEntries,
+                                     std::min(10.0, std::max(0.05, 8.0*radius)));
+    best._costPerProbe = estimateProbeCost(1.0/zonesPerDegree, best._density, radius);
+
+    // the stripe height is zonesPerStripe/zonesPerDegree; a zone height of 1/zpd evenly divides
+    // it iff zpd*zonesPerStripe/zonesPerDegree is an integer, i.e. iff zpd is a multiple of step
+    int const step = zonesPerDegree/gcd(zonesPerDegree, zonesPerStripe);
+    for (int zpd = step; zpd <= 3600; zpd += step) {
+        double const cost = estimateProbeCost(1.0/zpd, best._density, radius);
+        if (cost < best._costPerProbe) {
+            best._zonesPerDegree = zpd;
+            best._costPerProbe = cost;
+        }
+    }
+    best._zonesPerStripe = static_cast<int>(
+        (static_cast<long>(best._zonesPerDegree)*zonesPerStripe)/zonesPerDegree);
+    double const scale = static_cast<double>(zonesPerDegree)/best._zonesPerDegree;
+    best._maxEntriesPerZoneEstimate = std::max(
+        1, static_cast<int>(std::ceil(maxEntriesPerZoneEstimate*scale)));
+    return best;
+}
@@ -41,6 +41,10 @@
 #    warning Older version of zlib detected, upgrading to version 1.2.3 or later is recommended
 #endif
 
+#if LSST_AP_HAVE_OPEN_MP
+#   include <omp.h>
+#endif
+
 #include <cstring>
 #include <algorithm>
 
@@ -75,6 +79,130 @@ int openFile(
     return fd;
 }
 
+
+// -- Blocked gzip layout ----------------
+//
+// Every block is a gzip member with an extra field (subfield id "AP") holding the
+// size of the member. The index is a sequence of empty members whose extra fields
+// (subfield id "AI") hold the member sizes of consecutive blocks, and the footer is
+// an empty member whose extra field (subfield id "AF") holds the index offset, the
+// uncompressed file size, the number of blocks and the block size. Multi-byte values
+// are little endian, as required by RFC 1952.
+
+std::size_t const MEMBER_HEADER_SIZE  = 20; ///< gzip header with an 8 byte extra field
+std::size_t const MEMBER_TRAILER_SIZE = 8;  ///< CRC-32 and uncompressed size
+std::size_t const EMPTY_MEMBER_SIZE   = 12 + 2 + MEMBER_TRAILER_SIZE; ///< excluding the extra field
+std::size_t const FOOTER_DATA_SIZE    = 24;
+std::size_t const FOOTER_SIZE         = EMPTY_MEMBER_SIZE + 4 + FOOTER_DATA_SIZE;
+std::size_t const MAX_INDEX_ENTRIES   = (65535 - 4)/4;
+
+inline void putLe(unsigned char * dst, boost::uint64_t v, int const n) {
+    for (int i = 0; i < n; ++i, v >>= 8) {
+        dst[i] = static_cast<unsigned char>(v);
+    }
+}
+
+inline boost::uint64_t getLe(unsigned char const * src, int const n) {
+    boost::uint64_t v = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        v = (v << 8) | src[i];
+    }
+    return v;
+}
+
+/// Writes a gzip member header with a single extra subfield of @a len bytes to @a dst.
+void putMemberHeader(unsigned char * dst, char const id, std::size_t const len) {
+    static unsigned char const header[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff };
+    std::memcpy(dst, header, sizeof(header));
+    putLe(dst + 10, len + 4, 2);
+    dst[12] = 'A';
+    dst[13] = static_cast<unsigned char>(id);
+    putLe(dst + 14, len, 2);
+}
+
+/**
+ * Returns the length of the extra subfield of the gzip member header at @a src,
+ * or -1 if the header is not one written by BlockedCompressedFileWriter.
+ */
+long getMemberHeader(unsigned char const * src, char const id) {
+    static unsigned char const magic[4] = { 0x1f, 0x8b, 8, 4 };
+    if (std::memcmp(src, magic, 4) != 0 || src[12] != 'A' || src[13] != static_cast<unsigned char>(id)) {
+        return -1;
+    }
+    long const len = static_cast<long>(getLe(src + 14, 2));
+    return static_cast<long>(getLe(src + 10, 2)) == len + 4 ? len : -1;
+}
+
+/// Writes the empty deflate stream and trailer of an empty gzip member to @a dst.
+void putEmptyMemberTrailer(unsigned char * dst) {
+    static unsigned char const trailer[2 + MEMBER_TRAILER_SIZE] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    std::memcpy(dst, trailer, sizeof(trailer));
+}
+
+bool isEmptyMemberTrailer(unsigned char const * src) {
+    static unsigned char const trailer[2 + MEMBER_TRAILER_SIZE] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    return std::memcmp(src, trailer, sizeof(trailer)) == 0;
+}
+
+struct BlockedFooter {
+    boost::uint64_t _indexOffset;
+    boost::uint64_t _size;
+    std::size_t _numBlocks;
+    std::size_t _blockSize;
+};
+
+void preadFully(int const fd, unsigned char * buf, std::size_t len, ::off_t off) {
+    while (len > 0) {
+        ::ssize_t const n = ::pread(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            throw LSST_EXCEPT(ex::IoError,
+                (boost::format("pread() failed, errno: %1%") % errno).str());
+        } else if (n == 0) {
+            throw LSST_EXCEPT(ex::IoError, "pread(): unexpected end of file reached");
+        }
+        buf += n;
+        len -= static_cast<std::size_t>(n);
+        off += n;
+    }
+}
+
+/**
+ * Reads the footer of a blocked gzip file. Returns @c false if the file does not
+ * end with one.
+ */
+bool readFooter(int const fd, std::size_t const fileSize, BlockedFooter & footer) {
+    if (fileSize < FOOTER_SIZE) {
+        return false;
+    }
+    unsigned char buf[FOOTER_SIZE];
+    preadFully(fd, buf, FOOTER_SIZE, static_cast< ::off_t>(fileSize - FOOTER_SIZE));
+    if (getMemberHeader(buf, 'F') != static_cast<long>(FOOTER_DATA_SIZE) ||
+        !isEmptyMemberTrailer(buf + FOOTER_SIZE - 2 - MEMBER_TRAILER_SIZE)) {
+        return false;
+    }
+    unsigned char const * data = buf + 16;
+    footer._indexOffset = getLe(data, 8);
+    footer._size        = getLe(data + 8, 8);
+    footer._numBlocks   = static_cast<std::size_t>(getLe(data + 16, 4));
+    footer._blockSize   = static_cast<std::size_t>(getLe(data + 20, 4));
+    return true;
+}
+
+int getNumThreads(int const numThreads) {
+    if (numThreads > 0) {
+        return numThreads;
+    }
+#if LSST_AP_HAVE_OPEN_MP
+    return ::omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
 }}}} // end of anonymous namespace
 
 
@@ -242,11 +370,6 @@ lsst::ap::io::CompressedFileReader::CompressedFileReader(
     std::memset(&_request, 0, sizeof(::aiocb));
     _request.aio_fildes = -1;
 
-    // allocate IO buffers, store pointer to 8k aligned location inside buffer
-    boost::scoped_array<unsigned char> mem(new unsigned char[2*blockSize + 8192]);
-    std::size_t buf = reinterpret_cast<std::size_t>(mem.get());
-    _buffers = reinterpret_cast<unsigned char *>((buf + 8191) & ~static_cast<std::size_t>(8191));
-
     // open file
     int const fd = openFile(fileName, O_RDONLY);
     if (fd == -1) {
@@ -268,6 +391,20 @@ lsst::ap::io::CompressedFileReader::CompressedFileReader(
     }
     _remaining = _fileSize;
 
+    // blocked files are decompressed in parallel, and need no IO buffers
+    BlockedFooter footer;
+    if (readFooter(fd, _fileSize, footer)) {
+        _blocked.reset(new BlockedCompressedFileReader(fd, fileName));
+        fdGuard.dismiss();
+        _state = _blocked->getState();
+        return;
+    }
+
+    // allocate IO buffers, store pointer to 8k aligned location inside buffer
+    boost::scoped_array<unsigned char> mem(new unsigned char[2*blockSize + 8192]);
+    std::size_t buf = reinterpret_cast<std::size_t>(mem.get());
+    _buffers = reinterpret_cast<unsigned char *>((buf + 8191) & ~static_cast<std::size_t>(8191));
+
     // setup zlib (specify auto-detection of zlib/gzip header)
     if (inflateInit2(&_stream, MAX_WBITS + 32) != Z_OK) {
         throw LSST_EXCEPT(ex::RuntimeError,
@@ -325,6 +462,11 @@ std::size_t lsst::ap::io::CompressedFileReader::read(
     } else if (_state == FINISHED) {
         return 0;
     }
+    if (_blocked) {
+        std::size_t const nb = _blocked->read(buf, len);
+        _state = _blocked->getState();
+        return nb;
+    }
 
     // if the current block has not been fully transferred to the user,
     // decompress as much as possible of what remains
@@ -694,3 +836,514 @@ void lsst::ap::io::CompressedFileWriter::finish() {
     cleanup(FINISHED);
 }
 
+
+// -- BlockedCompressedFileWriter ----------------
+
+lsst::ap::io::BlockedCompressedFileWriter::BlockedCompressedFileWriter(
+    std::string const & fileName,
+    bool        const   overwrite,
+    std::size_t const   blockSize,
+    int         const   numThreads
+) :
+    _input(),
+    _output(),
+    _memberSizes(),
+    _index(),
+    _blockSize(blockSize),
+    _batchBlocks(static_cast<std::size_t>(getNumThreads(numThreads))),
+    _maxMemberSize(0),
+    _fill(0),
+    _offset(0),
+    _size(0),
+    _fd(-1)
+{
+    if (blockSize < 1024 || blockSize > 16777216 || (blockSize & (blockSize - 1)) != 0) {
+        throw LSST_EXCEPT(ex::InvalidParameterError,
+                          "I/O block size must be a power of 2 between 2^10 and 2^24 bytes");
+    }
+    _maxMemberSize = MEMBER_HEADER_SIZE + ::compressBound(blockSize) + MEMBER_TRAILER_SIZE;
+    _input.resize(_batchBlocks*_blockSize);
+    _output.resize(_batchBlocks*_maxMemberSize);
+    _memberSizes.resize(_batchBlocks);
+
+    int const fd = openFile(
+        fileName,
+        O_WRONLY | O_CREAT | O_APPEND | (overwrite ? O_TRUNC : O_EXCL),
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH
+    );
+    assert(fd != -1);
+    _fd = fd;
+}
+
+
+lsst::ap::io::BlockedCompressedFileWriter::~BlockedCompressedFileWriter() { cleanup(); }
+
+
+void lsst::ap::io::BlockedCompressedFileWriter::cleanup() {
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+
+void lsst::ap::io::BlockedCompressedFileWriter::writeFully(
+    unsigned char const * buf,
+    std::size_t len
+) {
+    while (len > 0) {
+        ::ssize_t const n = ::write(_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            cleanup(FAILED);
+            throw LSST_EXCEPT(ex::IoError,
+                              (boost::format("write() failed, errno: %1%") % errno).str());
+        }
+        buf += n;
+        len -= static_cast<std::size_t>(n);
+        _offset += static_cast<boost::uint64_t>(n);
+    }
+}
+
+
+/**
+ * Compresses the blocks of the current batch in parallel, then writes them out in order.
+ */
+void lsst::ap::io::BlockedCompressedFileWriter::flushBatch() {
+    if (_fill == 0) {
+        return;
+    }
+    int const numBlocks = static_cast<int>((_fill + _blockSize - 1)/_blockSize);
+    int failure = Z_OK;
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               schedule(dynamic,1)
+#endif
+    for (int b = 0; b < numBlocks; ++b) {
+        unsigned char * const in  = &_input[b*_blockSize];
+        unsigned char * const out = &_output[b*_maxMemberSize];
+        std::size_t const len = std::min(_blockSize, _fill - b*_blockSize);
+        ::z_stream stream;
+        std::memset(&stream, 0, sizeof(::z_stream));
+        // raw deflate stream (negative window bits), since the gzip wrapper is written here
+        int zret = ::deflateInit2(&stream, 1, Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+        if (zret == Z_OK) {
+            stream.next_in   = in;
+            stream.avail_in  = static_cast<uInt>(len);
+            stream.next_out  = out + MEMBER_HEADER_SIZE;
+            stream.avail_out = static_cast<uInt>(_maxMemberSize - MEMBER_HEADER_SIZE - MEMBER_TRAILER_SIZE);
+            zret = ::deflate(&stream, Z_FINISH);
+            ::deflateEnd(&stream);
+        }
+        if (zret != Z_STREAM_END) {
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp critical (BlockedCompressedFileWriter)
+#endif
+            failure = (zret == Z_OK ? Z_BUF_ERROR : zret);
+            _memberSizes[b] = 0;
+            continue;
+        }
+        std::size_t const size = MEMBER_HEADER_SIZE + stream.total_out + MEMBER_TRAILER_SIZE;
+        putMemberHeader(out, 'P', 4);
+        putLe(out + 16, size, 4);
+        unsigned char * const trailer = out + MEMBER_HEADER_SIZE + stream.total_out;
+        putLe(trailer, ::crc32(0L, in, static_cast<uInt>(len)), 4);
+        putLe(trailer + 4, len, 4);
+        _memberSizes[b] = size;
+    } // end of parallel for
+
+    if (failure != Z_OK) {
+        cleanup(FAILED);
+        throw LSST_EXCEPT(ex::RuntimeError,
+            (boost::format("[zlib] deflate() failed, return code: %1%") % failure).str());
+    }
+    for (int b = 0; b < numBlocks; ++b) {
+        writeFully(&_output[b*_maxMemberSize], _memberSizes[b]);
+        _index.push_back(static_cast<boost::uint32_t>(_memberSizes[b]));
+    }
+    _size += _fill;
+    _fill = 0;
+}
+
+
+void lsst::ap::io::BlockedCompressedFileWriter::write(
+    unsigned char const * const buf,
+    std::size_t const len
+) {
+    if (len == 0) {
+        return;
+    }
+    if (buf == 0) {
+        throw LSST_EXCEPT(ex::InvalidParameterError,
+                          "null pointer to bytes to write");
+    }
+    if (_state != IN_PROGRESS) {
+        throw LSST_EXCEPT(ex::IoError,
+                          "write() called on a finished or failed BlockedCompressedFileWriter");
+    }
+    unsigned char const * src = buf;
+    std::size_t remaining = len;
+    while (remaining > 0) {
+        std::size_t const nb = std::min(remaining, _input.size() - _fill);
+        std::memcpy(&_input[_fill], src, nb);
+        _fill += nb;
+        src += nb;
+        remaining -= nb;
+        if (_fill == _input.size()) {
+            flushBatch();
+        }
+    }
+}
+
+
+void lsst::ap::io::BlockedCompressedFileWriter::finish() {
+    if (_state != IN_PROGRESS) {
+        throw LSST_EXCEPT(ex::IoError,
+            "finish() called on a finished or failed BlockedCompressedFileWriter");
+    }
+    flushBatch();
+
+    // write the index, then the footer
+    boost::uint64_t const indexOffset = _offset;
+    std::vector<unsigned char> buf;
+    for (std::size_t i = 0; i < _index.size(); i += MAX_INDEX_ENTRIES) {
+        std::size_t const n = std::min(MAX_INDEX_ENTRIES, _index.size() - i);
+        buf.resize(EMPTY_MEMBER_SIZE + 4 + 4*n);
+        putMemberHeader(&buf[0], 'I', 4*n);
+        for (std::size_t j = 0; j < n; ++j) {
+            putLe(&buf[16 + 4*j], _index[i + j], 4);
+        }
+        putEmptyMemberTrailer(&buf[16 + 4*n]);
+        writeFully(&buf[0], buf.size());
+    }
+    unsigned char footer[FOOTER_SIZE];
+    putMemberHeader(footer, 'F', FOOTER_DATA_SIZE);
+    putLe(footer + 16, indexOffset, 8);
+    putLe(footer + 24, _size, 8);
+    putLe(footer + 32, _index.size(), 4);
+    putLe(footer + 36, _blockSize, 4);
+    putEmptyMemberTrailer(footer + 16 + FOOTER_DATA_SIZE);
+    writeFully(footer, FOOTER_SIZE);
+
+    // flush both userland and kernel buffers
+    while (::fsync(_fd) != 0) {
+        if (errno != EINTR) {
+            cleanup(FAILED);
+            throw LSST_EXCEPT(ex::IoError,
+                              (boost::format("fsync() failed, errno: %1%") % errno).str());
+        }
+        errno = 0;
+    }
+    cleanup(FINISHED);
+}
+
+
+// -- BlockedCompressedFileReader ----------------
+
+lsst::ap::io::BlockedCompressedFileReader::BlockedCompressedFileReader(
+    std::string const & fileName,
+    int         const   numThreads
+) :
+    _offsets(),
+    _batch(),
+    _compressed(),
+    _blockSize(0),
+    _batchBlocks(static_cast<std::size_t>(getNumThreads(numThreads))),
+    _maxMemberSize(0),
+    _nextBlock(0),
+    _pos(0),
+    _end(0),
+    _size(0),
+    _fd(-1)
+{
+    int const fd = openFile(fileName, O_RDONLY);
+    if (fd == -1) {
+        _state = FINISHED;
+        return;
+    }
+    ScopeGuard fdGuard(boost::bind(::close, fd));
+    init(fd, fileName);
+    fdGuard.dismiss();
+}
+
+
+/**
+ * Creates a reader for the blocked file open for reading via the descriptor @a fd. The reader
+ * takes ownership of @a fd, unless construction fails; @a fileName is only used in messages.
+ */
+lsst::ap::io::BlockedCompressedFileReader::BlockedCompressedFileReader(
+    int         const   fd,
+    std::string const & fileName,
+    int         const   numThreads
+) :
+    _offsets(),
+    _batch(),
+    _compressed(),
+    _blockSize(0),
+    _batchBlocks(static_cast<std::size_t>(getNumThreads(numThreads))),
+    _maxMemberSize(0),
+    _nextBlock(0),
+    _pos(0),
+    _end(0),
+    _size(0),
+    _fd(-1)
+{
+    init(fd, fileName);
+}
+
+
+/// Reads the footer and index of the blocked file open via @a fd, and takes ownership of @a fd.
+void lsst::ap::io::BlockedCompressedFileReader::init(int const fd, std::string const & fileName) {
+    struct stat sb;
+    if (::fstat(fd, &sb) != 0) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("fstat() failed on file %1%, errno: %2%") % fileName % errno).str());
+    }
+    std::size_t const fileSize = static_cast<std::size_t>(sb.st_size);
+    BlockedFooter footer;
+    if (!readFooter(fd, fileSize, footer)) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("%1% is not a blocked gzip file") % fileName).str());
+    }
+    if (footer._blockSize < 1024 || footer._blockSize > 16777216 ||
+        footer._indexOffset > fileSize - FOOTER_SIZE ||
+        footer._size > static_cast<boost::uint64_t>(footer._numBlocks)*footer._blockSize ||
+        (footer._numBlocks > 0 &&
+         footer._size <= static_cast<boost::uint64_t>(footer._numBlocks - 1)*footer._blockSize)) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("blocked gzip file %1% has an invalid footer") % fileName).str());
+    }
+    _blockSize = footer._blockSize;
+    _size = footer._size;
+    _maxMemberSize = MEMBER_HEADER_SIZE + ::compressBound(_blockSize) + MEMBER_TRAILER_SIZE;
+
+    // read the index, and convert member sizes to offsets
+    std::size_t const indexSize = fileSize - FOOTER_SIZE - static_cast<std::size_t>(footer._indexOffset);
+    std::vector<unsigned char> index(indexSize + 1);
+    preadFully(fd, &index[0], indexSize, static_cast< ::off_t>(footer._indexOffset));
+    _offsets.reserve(footer._numBlocks + 1);
+    _offsets.push_back(0);
+    for (std::size_t i = 0; i < indexSize; ) {
+        long const len = (indexSize - i < EMPTY_MEMBER_SIZE + 4) ? -1 : getMemberHeader(&index[i], 'I');
+        if (len < 0 || len % 4 != 0 || indexSize - i < EMPTY_MEMBER_SIZE + 4 + len ||
+            !isEmptyMemberTrailer(&index[i + 16 + len])) {
+            throw LSST_EXCEPT(ex::IoError,
+                (boost::format("blocked gzip file %1% has an invalid index") % fileName).str());
+        }
+        for (long j = 0; j < len; j += 4) {
+            boost::uint64_t const memberSize = getLe(&index[i + 16 + j], 4);
+            if (memberSize <= MEMBER_HEADER_SIZE + MEMBER_TRAILER_SIZE || memberSize > _maxMemberSize) {
+                throw LSST_EXCEPT(ex::IoError,
+                    (boost::format("blocked gzip file %1% has an invalid index") % fileName).str());
+            }
+            _offsets.push_back(_offsets.back() + memberSize);
+        }
+        i += EMPTY_MEMBER_SIZE + 4 + len;
+    }
+    if (_offsets.size() != footer._numBlocks + 1 || _offsets.back() != footer._indexOffset) {
+        throw LSST_EXCEPT(ex::IoError,
+            (boost::format("blocked gzip file %1% has an invalid index") % fileName).str());
+    }
+    if (footer._numBlocks == 0) {
+        _state = FINISHED;
+    }
+    _batchBlocks = std::min(_batchBlocks, std::max(footer._numBlocks, static_cast<std::size_t>(1)));
+    _batch.resize(_batchBlocks*_blockSize);
+    _compressed.resize(_batchBlocks*_maxMemberSize);
+    _fd = fd;
+}
+
+
+lsst::ap::io::BlockedCompressedFileReader::~BlockedCompressedFileReader() { cleanup(); }
+
+
+void lsst::ap::io::BlockedCompressedFileReader::cleanup() {
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+
+/// Returns the number of uncompressed bytes in the @a n blocks starting at @a block.
+std::size_t lsst::ap::io::BlockedCompressedFileReader::blockBytes(
+    std::size_t const block,
+    std::size_t const n
+) const {
+    if (block + n < getNumBlocks()) {
+        return n*_blockSize;
+    }
+    return static_cast<std::size_t>(_size - static_cast<boost::uint64_t>(block)*_blockSize);
+}
+
+
+/**
+ * Decompresses a single block into @a dst, using @a scratch (which must be able to hold a
+ * compressed member) to hold its compressed data. Never throws, so that it can be called
+ * from within a parallel region.
+ *
+ * @return  A description of the problem if the block could not be decompressed, 0 otherwise.
+ */
+char const * lsst::ap::io::BlockedCompressedFileReader::decodeBlock(
+    std::size_t const block,
+    unsigned char *   dst,
+    unsigned char *   scratch
+) const {
+    std::size_t const memberSize = static_cast<std::size_t>(_offsets[block + 1] - _offsets[block]);
+    std::size_t const len = blockBytes(block, 1);
+    try {
+        preadFully(_fd, scratch, memberSize, static_cast< ::off_t>(_offsets[block]));
+    } catch (...) {
+        return "pread() failed to read block";
+    }
+    if (getMemberHeader(scratch, 'P') != 4 || getLe(scratch + 16, 4) != memberSize) {
+        return "invalid block header";
+    }
+    ::z_stream stream;
+    std::memset(&stream, 0, sizeof(::z_stream));
+    if (::inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        return "[zlib] inflateInit2() failed to initialize decompression stream";
+    }
+    stream.next_in   = scratch + MEMBER_HEADER_SIZE;
+    stream.avail_in  = static_cast<uInt>(memberSize - MEMBER_HEADER_SIZE - MEMBER_TRAILER_SIZE);
+    stream.next_out  = dst;
+    stream.avail_out = static_cast<uInt>(len);
+    int const zret = ::inflate(&stream, Z_FINISH);
+    ::inflateEnd(&stream);
+    if (zret != Z_STREAM_END || stream.avail_in != 0 || stream.avail_out != 0) {
+        return "[zlib] inflate() failed to decompress block";
+    }
+    unsigned char const * const trailer = scratch + memberSize - MEMBER_TRAILER_SIZE;
+    if (getLe(trailer, 4) != ::crc32(0L, dst, static_cast<uInt>(len)) || getLe(trailer + 4, 4) != len) {
+        return "block failed CRC-32 check";
+    }
+    return 0;
+}
+
+
+/**
+ * Decompresses @a n consecutive blocks starting at @a block into @a dst in parallel.
+ * At most one batch worth of blocks may be decompressed per call.
+ */
+void lsst::ap::io::BlockedCompressedFileReader::decodeBlocks(
+    std::size_t const block,
+    std::size_t const n,
+    unsigned char *   dst
+) {
+    assert(n <= _batchBlocks);
+    char const * failure = 0;
+    int const numBlocks = static_cast<int>(n);
+
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               schedule(dynamic,1)
+#endif
+    for (int b = 0; b < numBlocks; ++b) {
+        char const * msg = decodeBlock(block + b, dst + b*_blockSize, &_compressed[b*_maxMemberSize]);
+        if (msg != 0) {
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp critical (BlockedCompressedFileReader)
+#endif
+            failure = msg;
+        }
+    } // end of parallel for
+
+    if (failure != 0) {
+        cleanup(FAILED);
+        throw LSST_EXCEPT(ex::IoError, failure);
+    }
+}
+
+
+std::size_t lsst::ap::io::BlockedCompressedFileReader::read(
+    unsigned char * const buf,
+    std::size_t const len
+) {
+    if (len == 0) {
+        return 0;
+    }
+    if (buf == 0) {
+        throw LSST_EXCEPT(ex::InvalidParameterError, "null pointer to read destination");
+    }
+    if (_state == FAILED) {
+        throw LSST_EXCEPT(ex::IoError, "read() called on a failed BlockedCompressedFileReader");
+    } else if (_state == FINISHED) {
+        return 0;
+    }
+
+    std::size_t nb = 0;
+    while (nb < len) {
+        if (_pos == _end) {
+            std::size_t const numBlocks = getNumBlocks();
+            if (_nextBlock == numBlocks) {
+                _state = FINISHED;
+                break;
+            }
+            std::size_t const n = std::min(_batchBlocks, numBlocks - _nextBlock);
+            std::size_t const bytes = blockBytes(_nextBlock, n);
+            if (len - nb >= bytes) {
+                // decompress straight into the caller's buffer
+                decodeBlocks(_nextBlock, n, buf + nb);
+                _nextBlock += n;
+                nb += bytes;
+                continue;
+            }
+            decodeBlocks(_nextBlock, n, &_batch[0]);
+            _nextBlock += n;
+            _pos = 0;
+            _end = bytes;
+        }
+        std::size_t const n = std::min(len - nb, _end - _pos);
+        std::memcpy(buf + nb, &_batch[_pos], n);
+        _pos += n;
+        nb += n;
+    }
+    return nb;
+}
+
+
+/**
+ * Decompresses the given block into @a buf, which must have space for getBlockSize() bytes.
+ * Does not affect the position of sequential reads.
+ *
+ * @return  The number of bytes in the block.
+ */
+std::size_t lsst::ap::io::BlockedCompressedFileReader::readBlock(
+    std::size_t const block,
+    unsigned char * const buf
+) const {
+    if (buf == 0) {
+        throw LSST_EXCEPT(ex::InvalidParameterError, "null pointer to read destination");
+    }
+    if (block >= getNumBlocks()) {
+        throw LSST_EXCEPT(ex::InvalidParameterError, "block index out of range");
+    }
+    if (_fd == -1) {
+        throw LSST_EXCEPT(ex::IoError, "readBlock() called on a failed BlockedCompressedFileReader");
+    }
+    boost::scoped_array<unsigned char> scratch(new unsigned char[_maxMemberSize]);
+    char const * msg = decodeBlock(block, buf, scratch.get());
+    if (msg != 0) {
+        throw LSST_EXCEPT(ex::IoError, msg);
+    }
+    return blockBytes(block, 1);
+}
+
+
+/// Positions sequential reads at the beginning of the given block.
+void lsst::ap::io::BlockedCompressedFileReader::seekBlock(std::size_t const block) {
+    if (block > getNumBlocks()) {
+        throw LSST_EXCEPT(ex::InvalidParameterError, "block index out of range");
+    }
+    if (_state == FAILED) {
+        throw LSST_EXCEPT(ex::IoError, "seekBlock() called on a failed BlockedCompressedFileReader");
+    }
+    _nextBlock = block;
+    _pos = 0;
+    _end = 0;
+    _state = (block == getNumBlocks() || _fd == -1) ? FINISHED : IN_PROGRESS;
+}
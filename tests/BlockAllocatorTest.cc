@@ -0,0 +1,290 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Tests for the shared memory chunk store block allocators, including a stress
+ *          test in which several processes allocate and free blocks concurrently.
+ *
+ * @ingroup associate
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE BlockAllocatorTest
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/ChunkManagerImpl.cc"
+
+
+using namespace lsst::ap;
+namespace ex = lsst::pex::exceptions;
+
+
+namespace {
+
+struct TestDatum {
+    boost::uint64_t _tag;
+    boost::uint64_t _pad;
+};
+
+// deliberately not a multiple of 64 blocks
+struct TestTraits {
+    enum {
+        ENTRIES_PER_BLOCK_LOG2 = 9,
+        MAX_BLOCKS_PER_CHUNK   = 64,
+        MAX_CHUNKS_PER_FOV     = 16,
+        NUM_BLOCKS             = 1000
+    };
+};
+
+std::size_t const BLOCK_SIZE = (sizeof(TestDatum) + sizeof(ChunkEntryFlag)) <<
+                               TestTraits::ENTRIES_PER_BLOCK_LOG2;
+
+
+/** @brief  An allocator and its pool of blocks, in memory shared with child processes. */
+template <typename AllocatorT>
+class Arena {
+public :
+    Arena() : _mem(0), _size(0), _blocks(0) {
+        std::size_t const bitmap = (sizeof(AllocatorT) + 63) & ~static_cast<std::size_t>(63);
+        _blocks = (bitmap + AllocatorT::bitmapSize(TestTraits::NUM_BLOCKS) + 511) &
+                  ~static_cast<std::size_t>(511);
+        _size = _blocks + BLOCK_SIZE*TestTraits::NUM_BLOCKS;
+        _mem = ::mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        BOOST_REQUIRE(_mem != MAP_FAILED);
+        new (_mem) AllocatorT(static_cast<unsigned char *>(_mem), bitmap, _blocks,
+                              detail::ChunkStoreLayout::fromTraits<TestTraits>());
+    }
+
+    ~Arena() {
+        getAllocator().~AllocatorT();
+        ::munmap(_mem, _size);
+    }
+
+    AllocatorT & getAllocator() {
+        return *static_cast<AllocatorT *>(_mem);
+    }
+
+    /// Returns a reference to the tag stored at the beginning of the block with the given offset.
+    boost::uint64_t volatile & tag(std::size_t const offset) {
+        return *reinterpret_cast<boost::uint64_t volatile *>(static_cast<unsigned char *>(_mem) + offset);
+    }
+
+    bool isValid(std::size_t const offset) const {
+        return offset >= _blocks && offset < _size && (offset - _blocks) % BLOCK_SIZE == 0;
+    }
+
+private :
+    void * _mem;
+    std::size_t _size;
+    std::size_t _blocks;
+};
+
+
+template <typename AllocatorT>
+void testExhaustion() {
+    Arena<AllocatorT> arena;
+    AllocatorT & a = arena.getAllocator();
+    BOOST_CHECK_EQUAL(a.getNumFree(), static_cast<int>(TestTraits::NUM_BLOCKS));
+
+    // every block can be allocated exactly once
+    std::vector<std::size_t> offsets;
+    for (int i = 0; i < TestTraits::NUM_BLOCKS; ++i) {
+        std::size_t const off = a.allocate();
+        BOOST_CHECK(arena.isValid(off));
+        offsets.push_back(off);
+    }
+    std::vector<std::size_t> sorted(offsets);
+    std::sort(sorted.begin(), sorted.end());
+    BOOST_CHECK(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+    BOOST_CHECK_EQUAL(a.getNumFree(), 0);
+    BOOST_CHECK_THROW(a.allocate(), ex::MemoryError);
+    std::size_t batch[TestTraits::MAX_BLOCKS_PER_CHUNK];
+    BOOST_CHECK_THROW(a.allocate(batch, 2), ex::MemoryError);
+
+    // batch requests are all or nothing
+    a.free(&offsets[0], 3);
+    BOOST_CHECK_THROW(a.allocate(batch, 4), ex::MemoryError);
+    BOOST_CHECK_EQUAL(a.getNumFree(), 3);
+    a.allocate(batch, 3);
+    std::sort(batch, batch + 3);
+    BOOST_CHECK(std::includes(sorted.begin(), sorted.end(), batch, batch + 3));
+    BOOST_CHECK_EQUAL(a.getNumFree(), 0);
+
+    for (std::size_t i = 3; i < offsets.size(); i += TestTraits::MAX_BLOCKS_PER_CHUNK) {
+        int const n = static_cast<int>(std::min(offsets.size() - i,
+            static_cast<std::size_t>(TestTraits::MAX_BLOCKS_PER_CHUNK)));
+        a.free(&offsets[i], n);
+    }
+    a.free(batch, 3);
+    BOOST_CHECK_EQUAL(a.getNumFree(), static_cast<int>(TestTraits::NUM_BLOCKS));
+
+    BOOST_CHECK_THROW(a.allocate(batch, -1), ex::RangeError);
+    BOOST_CHECK_THROW(a.allocate(batch, TestTraits::MAX_BLOCKS_PER_CHUNK + 1), ex::RangeError);
+    a.allocate(batch, TestTraits::MAX_BLOCKS_PER_CHUNK);
+    std::sort(batch, batch + TestTraits::MAX_BLOCKS_PER_CHUNK);
+    BOOST_CHECK(std::adjacent_find(batch, batch + TestTraits::MAX_BLOCKS_PER_CHUNK) ==
+                batch + TestTraits::MAX_BLOCKS_PER_CHUNK);
+    a.free(batch, TestTraits::MAX_BLOCKS_PER_CHUNK);
+    BOOST_CHECK_EQUAL(a.getNumFree(), static_cast<int>(TestTraits::NUM_BLOCKS));
+}
+
+
+/**
+ * Randomly allocates and frees blocks, tagging each allocated block and checking that the tag
+ * is intact when the block is freed. Returns @c false if a tag was overwritten (i.e. a block
+ * was handed out twice) or if allocation failed unexpectedly.
+ */
+template <typename AllocatorT>
+bool stress(Arena<AllocatorT> & arena, unsigned int seed, int const iterations) {
+    static int const MAX_LIVE = 16;
+    static int const MAX_BATCH = 8;
+
+    AllocatorT & a = arena.getAllocator();
+    std::vector<std::vector<std::size_t> > live;
+    boost::uint64_t const pid = static_cast<boost::uint64_t>(::getpid());
+    boost::uint64_t counter = 0;
+    bool ok = true;
+
+    try {
+        for (int i = 0; i < iterations; ++i) {
+            bool const alloc = live.empty() ||
+                (static_cast<int>(live.size()) < MAX_LIVE && (::rand_r(&seed) & 1) == 0);
+            if (alloc) {
+                int const n = 1 + ::rand_r(&seed) % MAX_BATCH;
+                std::vector<std::size_t> offsets(n);
+                if (n == 1) {
+                    offsets[0] = a.allocate();
+                } else {
+                    a.allocate(&offsets[0], n);
+                }
+                for (int j = 0; j < n; ++j) {
+                    ok = ok && arena.isValid(offsets[j]);
+                    arena.tag(offsets[j]) = (pid << 32) | ++counter;
+                }
+                live.push_back(offsets);
+            } else {
+                std::size_t const k = ::rand_r(&seed) % live.size();
+                std::vector<std::size_t> & offsets = live[k];
+                boost::uint64_t const first = (arena.tag(offsets[0]) & 0xffffffff);
+                for (std::size_t j = 0; j < offsets.size(); ++j) {
+                    boost::uint64_t const t = arena.tag(offsets[j]);
+                    ok = ok && (t >> 32) == pid && (t & 0xffffffff) == first + j;
+                }
+                a.free(&offsets[0], static_cast<int>(offsets.size()));
+                live[k].swap(live.back());
+                live.pop_back();
+            }
+        }
+        for (std::size_t k = 0; k < live.size(); ++k) {
+            a.free(&live[k][0], static_cast<int>(live[k].size()));
+        }
+    } catch (...) {
+        ok = false;
+    }
+    return ok;
+}
+
+
+template <typename AllocatorT>
+void testConcurrency() {
+    static int const NUM_PROCESSES = 6;
+    static int const ITERATIONS = 1000000;
+
+    Arena<AllocatorT> arena;
+    std::vector<pid_t> children;
+    // children block reading from a pipe until all of them have been started
+    int fds[2];
+    BOOST_REQUIRE(::pipe(fds) == 0);
+    for (int p = 0; p < NUM_PROCESSES; ++p) {
+        pid_t const pid = ::fork();
+        BOOST_REQUIRE(pid >= 0);
+        if (pid == 0) {
+            char c;
+            ::close(fds[1]);
+            if (::read(fds[0], &c, 1) != 0) {
+                ::_exit(EXIT_FAILURE);
+            }
+            ::_exit(stress(arena, 12345u + p, ITERATIONS) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        children.push_back(pid);
+    }
+    ::close(fds[0]);
+    ::close(fds[1]);
+    for (std::size_t p = 0; p < children.size(); ++p) {
+        int status = 0;
+        BOOST_REQUIRE(::waitpid(children[p], &status, 0) == children[p]);
+        BOOST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    // all blocks must have been returned
+    AllocatorT & a = arena.getAllocator();
+    BOOST_CHECK_EQUAL(a.getNumFree(), static_cast<int>(TestTraits::NUM_BLOCKS));
+    for (int i = 0; i < TestTraits::NUM_BLOCKS; ++i) {
+        a.allocate();
+    }
+    BOOST_CHECK_THROW(a.allocate(), ex::MemoryError);
+}
+
+typedef detail::BlockAllocator<SharedMutex, TestDatum, TestTraits> LockingAllocator;
+#if LSST_AP_HAVE_SYNC_BUILTINS
+typedef detail::LockFreeBlockAllocator<TestDatum, TestTraits> LockFreeAllocator;
+#endif
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(blockAllocatorTest) {
+    BOOST_TEST_MESSAGE("    - BlockAllocator: exhaustion and batch allocation");
+    testExhaustion<LockingAllocator>();
+    BOOST_TEST_MESSAGE("    - BlockAllocator: multi-process stress test");
+    testConcurrency<LockingAllocator>();
+}
+
+
+#if LSST_AP_HAVE_SYNC_BUILTINS
+
+BOOST_AUTO_TEST_CASE(lockFreeBlockAllocatorTest) {
+    BOOST_TEST_MESSAGE("    - LockFreeBlockAllocator: exhaustion and batch allocation");
+    testExhaustion<LockFreeAllocator>();
+    BOOST_TEST_MESSAGE("    - LockFreeBlockAllocator: multi-process stress test");
+    testConcurrency<LockFreeAllocator>();
+}
+
+#endif
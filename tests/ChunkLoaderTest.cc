@@ -0,0 +1,232 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Tests whether chunks read in parallel by a ChunkLoader are identical to
+ *          chunks read serially.
+ *
+ * @ingroup associate
+ */
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE ChunkLoaderTest
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/afw/math/Random.h"
+#include "lsst/pex/exceptions.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/Chunk.h"
+#include "lsst/ap/ChunkLoader.h"
+#include "lsst/ap/ChunkManager.h"
+#include "lsst/ap/Object.h"
+
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+typedef SharedObjectChunkManager::ObjectChunk ObjChunk;
+
+
+namespace {
+
+int const NUM_CHUNKS = 48;
+
+
+/** @brief  Chunk and chunk delta files for NUM_CHUNKS chunks, removed on destruction. */
+class ChunkFiles {
+public :
+    ChunkFiles(SharedObjectChunkManager & mgr) : _refNames(), _deltaNames() {
+        Random rng(Random::MT19937, 1);
+        std::vector<ObjChunk> chunks = startVisit(mgr, 1, 1);
+        for (int i = 0; i < NUM_CHUNKS; ++i) {
+            std::ostringstream ref;
+            std::ostringstream delta;
+            ref << "/tmp/ChunkLoaderTest_" << ::getpid() << '_' << i << ".chunk";
+            delta << "/tmp/ChunkLoaderTest_" << ::getpid() << '_' << i << ".delta";
+            _refNames.push_back(ref.str());
+            _deltaNames.push_back(delta.str());
+            ObjChunk & c = chunks[i];
+            appendObjects(rng, c, static_cast<int>(rng.uniformInt(5000)));
+            c.write(_refNames[i], true, false);
+            c.commit(true);
+            // every third chunk has no delta file (missing files are read as empty)
+            if (i % 3 != 0) {
+                appendObjects(rng, c, static_cast<int>(rng.uniformInt(2000)));
+                c.writeDelta(_deltaNames[i], true, false);
+            }
+        }
+        mgr.endVisit(1, true);
+    }
+
+    ~ChunkFiles() {
+        for (int i = 0; i < NUM_CHUNKS; ++i) {
+            ::unlink(_refNames[i].c_str());
+            ::unlink(_deltaNames[i].c_str());
+        }
+    }
+
+    std::vector<std::string> const & getRefNames() const {
+        return _refNames;
+    }
+
+    std::vector<std::string> const & getDeltaNames() const {
+        return _deltaNames;
+    }
+
+    /// Starts a visit to NUM_CHUNKS new chunks with consecutive ids and returns them.
+    static std::vector<ObjChunk> startVisit(
+        SharedObjectChunkManager & mgr,
+        int const visitId,
+        int const firstChunkId
+    ) {
+        std::vector<int> chunkIds;
+        for (int i = 0; i < NUM_CHUNKS; ++i) {
+            chunkIds.push_back(firstChunkId + i);
+        }
+        std::vector<ObjChunk> toRead;
+        std::vector<ObjChunk> toWaitFor;
+        mgr.registerVisit(visitId);
+        mgr.startVisit(toRead, toWaitFor, visitId, chunkIds);
+        BOOST_REQUIRE_EQUAL(toRead.size(), static_cast<std::size_t>(NUM_CHUNKS));
+        return toRead;
+    }
+
+private :
+    std::vector<std::string> _refNames;
+    std::vector<std::string> _deltaNames;
+
+    static void appendObjects(Random & rng, ObjChunk & chunk, int const num) {
+        Object obj;
+        std::memset(&obj, 0, sizeof(Object));
+        for (int i = 0; i < num; ++i) {
+            obj._objectId = chunk.size();
+            obj._ra = rng.flat(0.0, 360.0);
+            obj._decl = rng.flat(-90.0, 90.0);
+            obj._muRa = rng.gaussian()*10.0;
+            obj._muDecl = rng.gaussian()*10.0;
+            for (int f = 0; f < Object::NUM_FILTERS; ++f) {
+                obj._varProb[f] = static_cast<boost::int16_t>(rng.uniformInt(100));
+            }
+            chunk.insert(obj);
+        }
+    }
+};
+
+
+/// Checks that two lists of chunks have identical contents.
+void checkChunks(std::vector<ObjChunk> const & chunks, std::vector<ObjChunk> const & expected) {
+    BOOST_REQUIRE_EQUAL(chunks.size(), expected.size());
+    for (std::size_t c = 0; c < chunks.size(); ++c) {
+        BOOST_CHECK(chunks[c].isUsable());
+        BOOST_REQUIRE_EQUAL(chunks[c].size(), expected[c].size());
+        BOOST_CHECK_EQUAL(chunks[c].delta(), expected[c].delta());
+        for (int i = 0; i < chunks[c].size(); ++i) {
+            if (chunks[c].get(i) != expected[c].get(i) ||
+                chunks[c].getFlag(i) != expected[c].getFlag(i)) {
+                BOOST_ERROR("chunk read in parallel differs from chunk read serially");
+                break;
+            }
+        }
+    }
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(parallelLoadTest) {
+    BOOST_TEST_MESSAGE("    - Chunk loader test: parallel vs. serial chunk loading");
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+    ChunkFiles files(mgr);
+
+    std::vector<ObjChunk> serial = ChunkFiles::startVisit(mgr, 2, 1001);
+    std::vector<ChunkLoadStats> serialStats;
+    ChunkLoader serialLoader(1);
+    BOOST_CHECK_EQUAL(serialLoader.getNumThreads(), 1);
+    serialLoader.load(serial, files.getRefNames(), files.getDeltaNames(), serialStats);
+
+    // the same pool of threads loads the chunks of several visits
+    ChunkLoader loader(8);
+    BOOST_CHECK_EQUAL(loader.getNumThreads(), 8);
+    for (int v = 0; v < 3; ++v) {
+        std::vector<ObjChunk> parallel = ChunkFiles::startVisit(mgr, 3 + v, 2001 + 1000*v);
+        std::vector<ChunkLoadStats> stats;
+        loader.load(parallel, files.getRefNames(), files.getDeltaNames(), stats);
+        checkChunks(parallel, serial);
+        BOOST_REQUIRE_EQUAL(stats.size(), serialStats.size());
+        for (std::size_t i = 0; i < stats.size(); ++i) {
+            BOOST_CHECK_EQUAL(stats[i]._bytes, serialStats[i]._bytes);
+        }
+        mgr.endVisit(3 + v, true);
+    }
+    mgr.endVisit(2, true);
+    BOOST_CHECK_EQUAL(ChunkLoader(1000).getNumThreads(), static_cast<int>(ChunkLoader::MAX_THREADS));
+}
+
+
+BOOST_AUTO_TEST_CASE(failedLoadTest) {
+    BOOST_TEST_MESSAGE("    - Chunk loader test: failure to read a chunk");
+    SharedObjectChunkManager mgr("test");
+    SharedObjectChunkManager::destroyInstance("test");
+    ChunkFiles files(mgr);
+
+    // replace one chunk file with garbage
+    std::vector<std::string> refNames(files.getRefNames());
+    std::ostringstream bad;
+    bad << "/tmp/ChunkLoaderTest_" << ::getpid() << "_bad.chunk";
+    refNames[NUM_CHUNKS/2] = bad.str();
+    std::FILE * f = std::fopen(bad.str().c_str(), "wb");
+    BOOST_REQUIRE(f != 0);
+    std::fputs("this is not a chunk file, but it is long enough to hold a chunk file header", f);
+    std::fclose(f);
+
+    ChunkLoader loader(4);
+    std::vector<ObjChunk> chunks = ChunkFiles::startVisit(mgr, 10, 5001);
+    std::vector<ChunkLoadStats> stats;
+    BOOST_CHECK_THROW(loader.load(chunks, refNames, files.getDeltaNames(), stats),
+                      lsst::pex::exceptions::IoError);
+    ::unlink(bad.str().c_str());
+    mgr.endVisit(10, true);
+
+    // the pool remains usable after a failure
+    chunks = ChunkFiles::startVisit(mgr, 11, 6001);
+    loader.load(chunks, files.getRefNames(), files.getDeltaNames(), stats);
+    std::vector<ObjChunk> serial = ChunkFiles::startVisit(mgr, 12, 7001);
+    ChunkLoader(1).load(serial, files.getRefNames(), files.getDeltaNames(), stats);
+    checkChunks(chunks, serial);
+    mgr.endVisit(11, true);
+    mgr.endVisit(12, true);
+}
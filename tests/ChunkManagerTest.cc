@@ -31,6 +31,16 @@
  * @ingroup associate
  */
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/bind.hpp"
@@ -44,6 +54,8 @@
 #include "lsst/ap/Chunk.h"
 #include "lsst/ap/ChunkManager.h"
 #include "lsst/ap/ScopeGuard.h"
+#include "lsst/ap/SpatialUtil.h"
+#include "lsst/ap/Thread.h"
 #include "lsst/ap/Time.h"
 
 
@@ -52,6 +64,200 @@ using namespace lsst::ap;
 typedef SharedObjectChunkManager::ObjectChunk ObjChunk;
 
 
+namespace {
+
+detail::ChunkStoreLayout smallLayout() {
+    detail::ChunkStoreLayout layout = { 8, 4, 2, 2 };
+    return layout;
+}
+
+/// Creates a small chunk store and checks that its capacities are enforced.
+bool checkCapacities() {
+    SharedObjectChunkManager::setLayout(smallLayout());
+    SharedObjectChunkManager mgr("layout");
+    if (mgr.getLayout() != smallLayout()) {
+        return false;
+    }
+    // visits in flight
+    mgr.registerVisit(1);
+    mgr.registerVisit(2);
+    try {
+        mgr.registerVisit(3);
+        return false;
+    } catch (lsst::pex::exceptions::LengthError &) {}
+
+    // chunks tracked at once
+    std::vector<ObjChunk> toRead;
+    std::vector<ObjChunk> toWaitFor;
+    std::vector<int> chunkIds;
+    for (int i = 1; i <= 5; ++i) {
+        chunkIds.push_back(i);
+    }
+    try {
+        mgr.startVisit(toRead, toWaitFor, 1, chunkIds);
+        return false;
+    } catch (lsst::pex::exceptions::LengthError &) {}
+    chunkIds.resize(2);
+    mgr.startVisit(toRead, toWaitFor, 1, chunkIds);
+    if (toRead.size() != 2) {
+        return false;
+    }
+
+    // blocks per chunk and blocks in the store
+    int const entriesPerBlock = 1 << ObjChunk::ENTRIES_PER_BLOCK_LOG2;
+    try {
+        toRead[0].reserve(5*entriesPerBlock);
+        return false;
+    } catch (lsst::pex::exceptions::LengthError &) {}
+    toRead[0].reserve(4*entriesPerBlock);
+    toRead[1].reserve(4*entriesPerBlock);
+    std::vector<ObjChunk> toRead2;
+    chunkIds[0] = 3;
+    chunkIds[1] = 4;
+    mgr.startVisit(toRead2, toWaitFor, 2, chunkIds);
+    try {
+        toRead2[0].reserve(1);
+        return false;
+    } catch (lsst::pex::exceptions::MemoryError &) {}
+    mgr.endVisit(1, true);
+    toRead2[0].reserve(1);
+    mgr.endVisit(2, true);
+    return true;
+}
+
+/// Attaches to the chunk store created by checkCapacities().
+bool checkAttach() {
+    detail::ChunkStoreLayout layout(smallLayout());
+    layout._maxVisitsInFlight = 3;
+    SharedObjectChunkManager::setLayout(layout);
+    try {
+        SharedObjectChunkManager mgr("layout");
+        return false;
+    } catch (lsst::pex::exceptions::RuntimeError &) {}
+    SharedObjectChunkManager::setLayout(smallLayout());
+    SharedObjectChunkManager mgr("layout");
+    return mgr.getLayout() == smallLayout();
+}
+
+/**
+ * Returns a hugetlbfs directory to create chunk stores in: the directory named by the
+ * AP_HUGETLBFS_DIR environment variable, or /dev/hugepages. Chunk stores fall back to
+ * normal pages if it is not on a hugetlbfs mount.
+ */
+std::string hugetlbfsDir() {
+    char const * const dir = std::getenv("AP_HUGETLBFS_DIR");
+    return (dir != 0 && dir[0] != 0) ? std::string(dir) : std::string("/dev/hugepages");
+}
+
+/// The retention budget of a chunk store records the pages its creator backed it with.
+std::size_t pageModeBudget(SharedObjectChunkManager const & mgr) {
+    return (1 + static_cast<std::size_t>(mgr.getPageMode()))*ObjChunk::BLOCK_SIZE;
+}
+
+/// Creates a chunk store with the given kind of pages.
+bool createWithPages(SharedObjectChunkManager::PageMode const mode) {
+    SharedObjectChunkManager::setPageMode(mode, hugetlbfsDir());
+    SharedObjectChunkManager mgr("pagemix");
+    mgr.setRetentionBudget(pageModeBudget(mgr));
+    return mgr.getRetentionStats()._budget == pageModeBudget(mgr);
+}
+
+/**
+ * Attaches to the chunk store created by createWithPages(), requesting the given kind of pages,
+ * and checks that the creator's store is found, backed by the pages it was created with.
+ */
+bool attachWithPages(SharedObjectChunkManager::PageMode const mode) {
+    if (mode == SharedObjectChunkManager::HUGETLBFS_PAGES) {
+        SharedObjectChunkManager::setPageMode(mode, hugetlbfsDir());
+    } else {
+        // processes that do not know of the hugetlbfs directory must find the store too
+        SharedObjectChunkManager::setPageMode(mode);
+    }
+    SharedObjectChunkManager mgr("pagemix");
+    return mgr.getRetentionStats()._budget == pageModeBudget(mgr);
+}
+
+bool createWithNormalPages()    { return createWithPages(SharedObjectChunkManager::NORMAL_PAGES); }
+bool createWithHugetlbfsPages() { return createWithPages(SharedObjectChunkManager::HUGETLBFS_PAGES); }
+bool attachWithNormalPages()    { return attachWithPages(SharedObjectChunkManager::NORMAL_PAGES); }
+bool attachWithHugetlbfsPages() { return attachWithPages(SharedObjectChunkManager::HUGETLBFS_PAGES); }
+
+/// Runs the given check in a child process, since a process maps at most one chunk store.
+bool runInChild(bool (*check)()) {
+    pid_t const pid = ::fork();
+    if (pid == 0) {
+        bool ok = false;
+        try {
+            ok = check();
+        } catch (...) {}
+        ::_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status = 0;
+    return pid > 0 && ::waitpid(pid, &status, 0) == pid &&
+           WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+} // end of anonymous namespace
+
+
+// must run before the test process maps a chunk store, which its children would inherit
+BOOST_AUTO_TEST_CASE(layoutTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: chunk store capacities");
+    detail::ChunkStoreLayout layout(SharedObjectChunkManager::getDefaultLayout());
+    layout._maxVisitsInFlight = MAX_VISITS_IN_FLIGHT + 1;
+    BOOST_CHECK_THROW(SharedObjectChunkManager::setLayout(layout),
+                      lsst::pex::exceptions::InvalidParameterError);
+    layout._maxVisitsInFlight = 1;
+    layout._numBlocks = 0;
+    BOOST_CHECK_THROW(SharedObjectChunkManager::setLayout(layout),
+                      lsst::pex::exceptions::InvalidParameterError);
+
+    SharedObjectChunkManager::destroyInstance("layout");
+    BOOST_CHECK_MESSAGE(runInChild(&checkCapacities), "chunk store capacities were not enforced");
+    BOOST_CHECK_MESSAGE(runInChild(&checkAttach), "attaching to an existing chunk store failed");
+    SharedObjectChunkManager::destroyInstance("layout");
+}
+
+
+// must run before the test process maps a chunk store, which its children would inherit
+BOOST_AUTO_TEST_CASE(mixedPageModeTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: attaching to a chunk store with different page modes");
+    SharedObjectChunkManager::destroyInstance("pagemix");
+    BOOST_CHECK_MESSAGE(runInChild(&createWithNormalPages), "creating a chunk store failed");
+    BOOST_CHECK_MESSAGE(runInChild(&attachWithHugetlbfsPages),
+                        "requesting huge pages did not find the existing chunk store");
+    SharedObjectChunkManager::destroyInstance("pagemix");
+
+    BOOST_CHECK_MESSAGE(runInChild(&createWithHugetlbfsPages), "creating a chunk store failed");
+    BOOST_CHECK_MESSAGE(runInChild(&attachWithNormalPages),
+                        "requesting normal pages did not find the existing chunk store");
+    BOOST_CHECK_MESSAGE(runInChild(&attachWithHugetlbfsPages),
+                        "requesting huge pages did not find the existing chunk store");
+    SharedObjectChunkManager::destroyInstance("pagemix");
+    BOOST_CHECK(::access((hugetlbfsDir() + "/ap_pagemix").c_str(), F_OK) != 0);
+}
+
+
+// must run before any other test creates a manager: the page mode only applies to the
+// first manager created by a process
+BOOST_AUTO_TEST_CASE(pageModeTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: falling back to normal pages");
+    BOOST_CHECK_THROW(SharedObjectChunkManager::setPageMode(SharedObjectChunkManager::HUGETLBFS_PAGES),
+                      lsst::pex::exceptions::InvalidParameterError);
+    // /tmp is not a hugetlbfs mount
+    SharedObjectChunkManager::setPageMode(SharedObjectChunkManager::HUGETLBFS_PAGES, "/tmp/");
+    SharedObjectChunkManager mgr("test");
+    SharedObjectChunkManager::destroyInstance("test");
+    BOOST_CHECK_EQUAL(mgr.getPageMode(), SharedObjectChunkManager::NORMAL_PAGES);
+    BOOST_CHECK_EQUAL(mgr.getPageSize(), static_cast<std::size_t>(::getpagesize()));
+    BOOST_CHECK(::access("/tmp/ap_test", F_OK) != 0);
+    SharedObjectChunkManager::setPageMode(SharedObjectChunkManager::NORMAL_PAGES);
+}
+
+
 BOOST_AUTO_TEST_CASE(disjointVisitsTest) {
 
     BOOST_TEST_MESSAGE("    - ChunkManager test: sequence of disjoint visits");
@@ -137,3 +343,279 @@ BOOST_AUTO_TEST_CASE(overlappingVisitsTest) {
     mgr.endVisit(numVisits - 1, false);
 }
 
+
+
+namespace {
+
+void startVisit(
+    SharedObjectChunkManager & mgr,
+    std::vector<ObjChunk> & toRead,
+    std::vector<ObjChunk> & toWaitFor,
+    int const visitId,
+    int const firstChunkId,
+    int const numChunks
+) {
+    std::vector<int> chunkIds;
+    for (int i = 0; i < numChunks; ++i) {
+        chunkIds.push_back(firstChunkId + i);
+    }
+    mgr.registerVisit(visitId);
+    mgr.startVisit(toRead, toWaitFor, visitId, chunkIds);
+    // "read" chunks that are not in memory
+    for (std::vector<ObjChunk>::iterator i = toRead.begin(); i != toRead.end(); ++i) {
+        i->insert(Object());
+        i->setUsable();
+    }
+}
+
+void waitForOwnership(
+    SharedObjectChunkManager * mgr,
+    std::vector<ObjChunk> * toWaitFor,
+    int const visitId
+) {
+    std::vector<ObjChunk> toRead;
+    TimeSpec deadline;
+    deadline.systemTime();
+    deadline += 5.0;
+    mgr->waitForOwnership(toRead, *toWaitFor, visitId, deadline);
+}
+
+// Missing chunk files are read in as empty chunks
+std::pair<std::string, std::string> missingChunkFiles(int) {
+    return std::make_pair(std::string("/nonexistent/ref.chunk"),
+                          std::string("/nonexistent/delta.chunk"));
+}
+
+std::string sFifoName;
+
+// Chunk files are FIFOs, so reading a chunk blocks until the FIFO is written to
+std::pair<std::string, std::string> fifoChunkFiles(int) {
+    return std::make_pair(sFifoName, sFifoName);
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(retentionTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: retention of chunks across visits");
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+    ScopeGuard g(boost::bind(&SharedObjectChunkManager::setRetentionBudget, &mgr, 0));
+
+    // every chunk occupies a single block - retain up to 4 of them
+    mgr.setRetentionBudget(4*ObjChunk::BLOCK_SIZE);
+    detail::ChunkRetentionStats s0 = mgr.getRetentionStats();
+    BOOST_CHECK(s0._numRetained == 0 && s0._retainedBytes == 0);
+    BOOST_CHECK(s0._budget == 4*ObjChunk::BLOCK_SIZE);
+
+    std::vector<ObjChunk> toRead;
+    std::vector<ObjChunk> toWaitFor;
+    TimeSpec deadline;
+    deadline.systemTime();
+    deadline += 1.0;
+
+    // chunks 1000-1003 are read in and retained after the visit commits
+    startVisit(mgr, toRead, toWaitFor, 1000, 1000, 4);
+    BOOST_CHECK(toRead.size() == 4 && toWaitFor.empty());
+    BOOST_CHECK(mgr.endVisit(1000, false));
+    detail::ChunkRetentionStats s = mgr.getRetentionStats();
+    BOOST_CHECK(s._misses - s0._misses == 4 && s._hits == s0._hits);
+    BOOST_CHECK(s._numRetained == 4 && s._retainedBytes == 4*ObjChunk::BLOCK_SIZE);
+
+    // chunks 1002 and 1003 are handed over without being re-read
+    startVisit(mgr, toRead, toWaitFor, 1001, 1002, 4);
+    BOOST_CHECK(toRead.size() == 2 && toWaitFor.size() == 2);
+    mgr.waitForOwnership(toRead, toWaitFor, 1001, deadline);
+    BOOST_CHECK(toRead.empty() && toWaitFor.empty());
+    s = mgr.getRetentionStats();
+    BOOST_CHECK(s._hits - s0._hits == 2 && s._misses - s0._misses == 6);
+    BOOST_CHECK(s._numRetained == 2);
+
+    // retaining chunks 1002-1005 evicts the least recently used chunks 1000 and 1001
+    BOOST_CHECK(mgr.endVisit(1001, false));
+    s = mgr.getRetentionStats();
+    BOOST_CHECK(s._numRetained == 4 && s._evictions - s0._evictions == 2);
+
+    startVisit(mgr, toRead, toWaitFor, 1002, 1000, 1);
+    BOOST_CHECK(toRead.size() == 1 && toWaitFor.empty());
+    BOOST_CHECK(!mgr.endVisit(1002, true));
+    startVisit(mgr, toRead, toWaitFor, 1003, 1005, 1);
+    BOOST_CHECK(toRead.empty() && toWaitFor.size() == 1);
+    // rolled back chunks are not retained
+    BOOST_CHECK(!mgr.endVisit(1003, true));
+    s = mgr.getRetentionStats();
+    BOOST_CHECK(s._numRetained == 3);
+
+    // disabling retention evicts everything
+    g.dismiss();
+    mgr.setRetentionBudget(0);
+    s = mgr.getRetentionStats();
+    BOOST_CHECK(s._numRetained == 0 && s._retainedBytes == 0);
+}
+
+
+// must run before the test process starts prefetching, since a forked child cannot use the
+// prefetching thread of its parent
+BOOST_AUTO_TEST_CASE(abandonedPrefetchTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: reclaiming chunks from a process that dies while prefetching");
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+    ScopeGuard g(boost::bind(&SharedObjectChunkManager::setRetentionBudget, &mgr, 0));
+    mgr.setRetentionBudget(64*ObjChunk::BLOCK_SIZE);
+
+    ZoneStripeChunkDecomposition zsc(180, 63, 4096);
+    CircularRegion fov(225.0, -30.0, 0.75);
+    std::vector<int> chunkIds;
+    computeChunkIds(chunkIds, fov, zsc, 0, 1);
+    BOOST_REQUIRE(chunkIds.size() > 1);
+
+    char fifoName[] = "/tmp/ChunkManagerTest_XXXXXX";
+    BOOST_REQUIRE(::mkdtemp(fifoName) != 0);
+    std::string const dir(fifoName);
+    sFifoName = dir + "/chunk";
+    BOOST_REQUIRE(::mkfifo(sFifoName.c_str(), 0600) == 0);
+
+    // the child shares the chunk store, and blocks reading its first chunk
+    pid_t const pid = ::fork();
+    if (pid == 0) {
+        try {
+            mgr.prefetch(fov, zsc, &fifoChunkFiles);
+            SharedObjectChunkManager::waitForPrefetch();
+        } catch (...) {}
+        ::_exit(EXIT_FAILURE);
+    }
+    BOOST_REQUIRE(pid > 0);
+    // opening the FIFO for writing succeeds once the child has opened it for reading
+    int fd = -1;
+    for (int i = 0; i < 500 && fd == -1; ++i) {
+        fd = ::open(sFifoName.c_str(), O_WRONLY | O_NONBLOCK);
+        if (fd == -1) {
+            ::usleep(10000);
+        }
+    }
+    BOOST_CHECK(fd != -1);
+    int status = 0;
+    ::kill(pid, SIGKILL);
+    BOOST_CHECK(::waitpid(pid, &status, 0) == pid && WIFSIGNALED(status));
+    if (fd != -1) {
+        ::close(fd);
+    }
+    ::unlink(sFifoName.c_str());
+    ::rmdir(dir.c_str());
+    BOOST_CHECK_EQUAL(static_cast<int>(mgr.getRetentionStats()._numPrefetching),
+                      static_cast<int>(chunkIds.size()));
+
+    // chunks queued for prefetching are handed over to the visit, which waits for the chunk
+    // being read until timing out, and then reclaims it
+    std::vector<ObjChunk> toRead;
+    std::vector<ObjChunk> toWaitFor;
+    mgr.registerVisit(1500);
+    mgr.startVisit(toRead, toWaitFor, 1500, chunkIds);
+    BOOST_CHECK(toRead.size() == chunkIds.size() - 1 && toWaitFor.size() == 1);
+    int const chunkId = toWaitFor.empty() ? -1 : static_cast<int>(toWaitFor[0].getId());
+    TimeSpec deadline;
+    deadline.systemTime();
+    deadline += 0.25;
+    mgr.waitForOwnership(toRead, toWaitFor, 1500, deadline);
+    BOOST_CHECK(toRead.size() == 1 && toWaitFor.empty());
+    BOOST_CHECK(!toRead.empty() && static_cast<int>(toRead[0].getId()) == chunkId);
+    BOOST_CHECK(!toRead.empty() && !toRead[0].isUsable());
+    detail::ChunkRetentionStats s = mgr.getRetentionStats();
+    BOOST_CHECK_EQUAL(static_cast<int>(s._numPrefetching), 0);
+    BOOST_CHECK(!mgr.endVisit(1500, true));
+}
+
+
+BOOST_AUTO_TEST_CASE(prefetchTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: prefetching chunks for an upcoming visit");
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+    ScopeGuard g(boost::bind(&SharedObjectChunkManager::setRetentionBudget, &mgr, 0));
+
+    ZoneStripeChunkDecomposition zsc(180, 63, 4096);
+    CircularRegion fov(45.0, 30.0, 0.75);
+    std::vector<int> chunkIds;
+    computeChunkIds(chunkIds, fov, zsc, 0, 1);
+    BOOST_REQUIRE(!chunkIds.empty());
+
+    // prefetching requires chunk retention
+    BOOST_CHECK_EQUAL(mgr.prefetch(fov, zsc, &missingChunkFiles), 0);
+
+    mgr.setRetentionBudget(64*ObjChunk::BLOCK_SIZE);
+    detail::ChunkRetentionStats s0 = mgr.getRetentionStats();
+    int const n = mgr.prefetch(fov, zsc, &missingChunkFiles);
+    BOOST_CHECK_EQUAL(n, static_cast<int>(chunkIds.size()));
+    SharedObjectChunkManager::waitForPrefetch();
+    detail::ChunkRetentionStats s = mgr.getRetentionStats();
+    BOOST_CHECK(s._prefetches - s0._prefetches == static_cast<boost::uint64_t>(n));
+    BOOST_CHECK(s._numPrefetching == 0 && s._numRetained - s0._numRetained == n);
+
+    // chunks already in memory are not prefetched again
+    BOOST_CHECK_EQUAL(mgr.prefetch(fov, zsc, &missingChunkFiles), 0);
+
+    // the visit is handed every chunk without reading any of them
+    std::vector<ObjChunk> toRead;
+    std::vector<ObjChunk> toWaitFor;
+    TimeSpec deadline;
+    deadline.systemTime();
+    deadline += 1.0;
+    mgr.registerVisit(2000);
+    mgr.startVisit(toRead, toWaitFor, 2000, chunkIds);
+    BOOST_CHECK(toRead.empty() && toWaitFor.size() == chunkIds.size());
+    mgr.waitForOwnership(toRead, toWaitFor, 2000, deadline);
+    BOOST_CHECK(toRead.empty() && toWaitFor.empty());
+    s = mgr.getRetentionStats();
+    BOOST_CHECK(s._hits - s0._hits == static_cast<boost::uint64_t>(n));
+    BOOST_CHECK(s._misses == s0._misses);
+    mgr.endVisit(2000, true);
+}
+
+
+BOOST_AUTO_TEST_CASE(ownershipWakeupTest) {
+
+    BOOST_TEST_MESSAGE("    - ChunkManager test: waking only visits that acquire chunks");
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+
+    // visits 3002 and 3003 wait for chunks owned by visits 3000 and 3001 respectively
+    std::vector<ObjChunk> toRead;
+    std::vector<ObjChunk> toWaitFor[4];
+    for (int i = 0; i < 4; ++i) {
+        startVisit(mgr, toRead, toWaitFor[i], 3000 + i, 3000 + (i & 1), 1);
+    }
+    BOOST_CHECK(toWaitFor[0].empty() && toWaitFor[1].empty());
+    BOOST_CHECK(toWaitFor[2].size() == 1 && toWaitFor[3].size() == 1);
+    {
+        Thread t2(boost::bind(&waitForOwnership, &mgr, &toWaitFor[2], 3002));
+        Thread t3(boost::bind(&waitForOwnership, &mgr, &toWaitFor[3], 3003));
+        // give both threads time to start waiting
+        ::usleep(100000);
+
+        // handing chunk 3000 to visit 3002 must not wake up visit 3003
+        BOOST_CHECK(mgr.endVisit(3000, false));
+        t2.join();
+        BOOST_CHECK(toWaitFor[2].empty());
+        BOOST_CHECK(mgr.getVisitWaitStats(3002)._numWakeups >= 1);
+        BOOST_CHECK_EQUAL(mgr.getVisitWaitStats(3003)._numWakeups, 0);
+
+        BOOST_CHECK(mgr.endVisit(3001, false));
+        t3.join();
+        BOOST_CHECK(toWaitFor[3].empty());
+    }
+    detail::VisitWaitStats s = mgr.getVisitWaitStats(3003);
+    BOOST_CHECK(s._numWakeups >= 1);
+    BOOST_CHECK(s._ownershipWait >= 0.1 && s._lockWait >= 0.0);
+    BOOST_CHECK(mgr.endVisit(3002, false));
+    BOOST_CHECK(mgr.endVisit(3003, false));
+
+    // visits that are not in flight have no wait times
+    s = mgr.getVisitWaitStats(3003);
+    BOOST_CHECK(s._numWakeups == 0 && s._ownershipWait == 0.0 && s._lockWait == 0.0);
+}
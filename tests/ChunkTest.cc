@@ -32,6 +32,7 @@
 
 #include <unistd.h>
 
+#include <cstdio>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
@@ -149,6 +150,28 @@ void appendObjects(ObjChunk & chunk, int const num) {
 }
 
 
+// Appends objects sorted by right ascension with mostly zero proper motions, parallaxes
+// and radial velocities, as is typical of objects in chunk files generated from a catalog.
+void appendSparseObjects(ObjChunk & chunk, int const num) {
+    Object obj;
+    std::memset(&obj, 0, sizeof(Object));
+    int id = chunk.size();
+    for (int i = 0; i < num; ++i, ++id) {
+        obj._objectId = id;
+        obj._ra   = 10.0 + (i + rng().uniform())/num;
+        obj._decl = rng().flat(-1.0, 0.0);
+        obj._muRa = coinToss(0.01) ? rng().gaussian() : 0.0;
+        obj._muDecl = coinToss(0.01) ? rng().gaussian() : 0.0;
+        obj._parallax = coinToss(0.01) ? rng().flat(0.0, 10000.0) : 0.0;
+        obj._radialVelocity = 0.0;
+        for (int i = 0; i < Object::NUM_FILTERS; ++i) {
+            obj._varProb[i] = static_cast<boost::int16_t>(rng().uniformInt(100));
+        }
+        chunk.insert(obj);
+    }
+}
+
+
 boost::shared_array<Object> const copyData(ObjChunk & chunk) {
     int sz = chunk.size();
     boost::shared_array<Object> copy(new Object[sz]);
@@ -265,6 +288,21 @@ void verifyData(ObjChunk const & chunk, boost::shared_array<Object> const & data
 }
 
 
+// Columnar chunk files do not preserve structure padding, so compare entries field by field.
+void verifyFields(ObjChunk const & chunk, boost::shared_array<Object> const & data) {
+    int size = chunk.size();
+    for (int i = 0; i < size; ++i) {
+        Object const & o = chunk.get(i);
+        bool same = o == data[i] && o._muRa == data[i]._muRa && o._muDecl == data[i]._muDecl &&
+                    o._parallax == data[i]._parallax && o._radialVelocity == data[i]._radialVelocity;
+        BOOST_CHECK_MESSAGE(same, "columnar chunk IO resulted in data corruption at entry " << i);
+        if (!same) {
+            break;
+        }
+    }
+}
+
+
 void verifyPackedData(
     ObjChunk                    const & chunk,
     boost::shared_array<Object> const & data,
@@ -340,6 +378,29 @@ void wrdCycle(
     verifyChunk(c, d, packed, true);
 }
 
+
+void wrColumnarCycle(ObjChunk & c, std::vector<int> & d, std::string const & name) {
+    int const size = c.size();
+
+    c.writeColumnar(name, true);
+    c.commit(true);
+    c.clear();
+    c.read(name, false);
+    BOOST_CHECK_MESSAGE(c.delta() == size, "chunk delta index must equal chunk size following chunk read");
+    BOOST_CHECK_MESSAGE(c.size() == size, "columnar chunk IO resulted in data corruption");
+    verifyChunk(c, d, false, true);
+}
+
+
+std::size_t fileSize(std::string const & name) {
+    FILE * f = std::fopen(name.c_str(), "rb");
+    BOOST_REQUIRE(f != 0);
+    std::fseek(f, 0, SEEK_END);
+    long const sz = std::ftell(f);
+    std::fclose(f);
+    return static_cast<std::size_t>(sz);
+}
+
 } // end of anonymous namespace
 
 
@@ -467,3 +528,53 @@ BOOST_AUTO_TEST_CASE(emptyChunkTest) {
     verifyData(c, data);
 }
 
+
+BOOST_AUTO_TEST_CASE(columnarChunkIoTest) {
+    BOOST_TEST_MESSAGE("    - Columnar chunk IO test");
+    SharedObjectChunkManager mgr("test");
+    ScopeGuard forMgr(boost::bind(&SharedObjectChunkManager::endVisit, &mgr, 1, true));
+
+    std::vector<int> v;
+    ObjChunk c(createChunk());
+    std::string name(makeTempFile());
+    ScopeGuard  guard(boost::bind(::unlink, name.c_str()));
+
+    // empty chunk
+    wrColumnarCycle(c, v, name);
+    BOOST_CHECK_MESSAGE(c.size() == 0, "empty columnar chunk file produced entries");
+
+    // fields with arbitrary values
+    appendObjects(c, static_cast<int>(rng().flat(1024, 32768)));
+    boost::shared_array<Object> data(copyData(c));
+    wrColumnarCycle(c, v, name);
+    verifyFields(c, data);
+
+    // position sorted objects with mostly zero auxiliary fields
+    c.clear();
+    appendSparseObjects(c, static_cast<int>(rng().flat(1024, 32768)));
+    c.commit(true);
+    int const size = c.size();
+    data = copyData(c);
+    std::string v1Name(makeTempFile());
+    ScopeGuard  v1Guard(boost::bind(::unlink, v1Name.c_str()));
+    c.write(v1Name, true, false);
+    wrColumnarCycle(c, v, name);
+    verifyFields(c, data);
+    BOOST_CHECK_MESSAGE(fileSize(name) < fileSize(v1Name)/2, "columnar chunk file is not much smaller");
+
+    // version 1 files are still read
+    c.read(v1Name, false);
+    BOOST_CHECK(c.size() == size);
+    verifyData(c, data);
+
+    // corrupting a column is detected
+    std::size_t const sz = fileSize(name);
+    FILE * f = std::fopen(name.c_str(), "r+b");
+    BOOST_REQUIRE(f != 0);
+    std::fseek(f, static_cast<long>(sz - sz/3), SEEK_SET);
+    int const ch = std::fgetc(f);
+    std::fseek(f, static_cast<long>(sz - sz/3), SEEK_SET);
+    std::fputc(ch ^ 0x10, f);
+    std::fclose(f);
+    BOOST_CHECK_THROW(c.read(name, false), lsst::pex::exceptions::IoError);
+}
@@ -31,7 +31,9 @@
  */
 
 #include <unistd.h>
+#include <zlib.h>
 
+#include <cstring>
 #include <iostream>
 
 #include "boost/bind.hpp"
@@ -244,3 +246,75 @@ BOOST_AUTO_TEST_CASE(emptyFileTest) {
         doRead(r, 0, 0);
     }
 }
+
+
+BOOST_AUTO_TEST_CASE(blockedIoTest) {
+
+    BOOST_TEST_MESSAGE("    - roundtrip file IO test, blocked gzip");
+    std::string const name(makeTempFile());
+    ScopeGuard  fileGuard(boost::bind(::unlink, name.c_str()));
+
+    size_t const blockSize = 4096;
+    size_t len = static_cast<size_t>(rng().flat(65536, 262144));
+    boost::scoped_array<uint32_t> content(new uint32_t[len]);
+    boost::scoped_array<uint32_t> contentCheck(new uint32_t[len]);
+    for (uint32_t i = 0; i < len; ++i) { content[i] = i*(i & 0xff); }
+    size_t const numBytes = len*sizeof(uint32_t);
+
+    // write out using several threads, read back in with a different number of threads
+    {
+        io::BlockedCompressedFileWriter w(name, true, blockSize, 3);
+        doBlockedWrite(w, reinterpret_cast<uint8_t *>(content.get()), numBytes, 1500);
+    }
+    {
+        io::BlockedCompressedFileReader r(name, 2);
+        BOOST_CHECK_EQUAL(r.getSize(), static_cast<boost::uint64_t>(numBytes));
+        BOOST_CHECK_EQUAL(r.getNumBlocks(), (numBytes + blockSize - 1)/blockSize);
+        doBlockedRead(r, reinterpret_cast<uint8_t *>(contentCheck.get()), numBytes, 3100);
+        BOOST_CHECK_EQUAL(std::memcmp(contentCheck.get(), content.get(), numBytes), 0);
+
+        // random access to blocks
+        boost::scoped_array<uint8_t> block(new uint8_t[blockSize]);
+        for (int i = 0; i < 16; ++i) {
+            size_t const b = static_cast<size_t>(rng().uniformInt(r.getNumBlocks()));
+            size_t const nb = r.readBlock(b, block.get());
+            BOOST_CHECK_EQUAL(nb, std::min(blockSize, numBytes - b*blockSize));
+            BOOST_CHECK_EQUAL(std::memcmp(block.get(),
+                reinterpret_cast<uint8_t *>(content.get()) + b*blockSize, nb), 0);
+        }
+        size_t const b = r.getNumBlocks()/2;
+        r.seekBlock(b);
+        doRead(r, reinterpret_cast<uint8_t *>(contentCheck.get()) + b*blockSize, numBytes - b*blockSize);
+        BOOST_CHECK_EQUAL(std::memcmp(contentCheck.get(), content.get(), numBytes), 0);
+    }
+
+    // blocked files are detected by the generic compressed file reader
+    {
+        std::memset(contentCheck.get(), 0, numBytes);
+        io::CompressedFileReader r(name);
+        doRead(r, reinterpret_cast<uint8_t *>(contentCheck.get()), numBytes);
+        BOOST_CHECK_EQUAL(std::memcmp(contentCheck.get(), content.get(), numBytes), 0);
+    }
+
+    // and remain readable as gzip files
+    {
+        std::memset(contentCheck.get(), 0, numBytes);
+        ::gzFile f = ::gzopen(name.c_str(), "rb");
+        BOOST_REQUIRE(f != 0);
+        int const nb = ::gzread(f, contentCheck.get(), static_cast<unsigned>(numBytes + 1));
+        ::gzclose(f);
+        BOOST_CHECK_EQUAL(nb, static_cast<int>(numBytes));
+        BOOST_CHECK_EQUAL(std::memcmp(contentCheck.get(), content.get(), numBytes), 0);
+    }
+
+    // empty files
+    {
+        io::BlockedCompressedFileWriter w(name, true, blockSize);
+        doWrite(w, 0, 0);
+        io::BlockedCompressedFileReader r(name);
+        BOOST_CHECK_EQUAL(r.getNumBlocks(), 0u);
+        doRead(r, 0, 0);
+        io::CompressedFileReader r2(name);
+        doRead(r2, 0, 0);
+    }
+}
@@ -36,6 +36,7 @@
 #include <set>
 
 #include "boost/bind.hpp"
+#include "boost/scoped_array.hpp"
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE HashedSetTest
 #include "boost/test/unit_test.hpp"
@@ -80,11 +81,28 @@ struct TestEntry {
 
 
 typedef std::vector<int> TestIds;
-typedef detail::HashedSet<TestEntry, 8192> TestEntrySet;
+
+
+struct TestStorage {
+    boost::scoped_array<unsigned char> _storage;
+
+    explicit TestStorage(int const capacity) :
+        _storage(new unsigned char[detail::HashedSet<TestEntry>::storageSize(capacity)]) {}
+};
+
+
+/** A HashedSet of test entries that owns its storage. */
+struct TestEntrySet : private TestStorage, public detail::HashedSet<TestEntry> {
+    enum { CAPACITY = 8192 };
+
+    TestEntrySet() :
+        TestStorage(CAPACITY),
+        detail::HashedSet<TestEntry>(CAPACITY, _storage.get()) {}
+};
 
 }
 
-template class detail::HashedSet<TestEntry, 8192>;
+template class detail::HashedSet<TestEntry>;
 
 
 void initTestIds(TestIds & ids, int const n) {
@@ -30,10 +30,19 @@
  * @ingroup associate
  */
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <vector>
 
+#include "boost/bind.hpp"
+
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE MatchTest
 #include "boost/test/unit_test.hpp"
@@ -42,9 +51,12 @@
 
 #include "lsst/ap/EllipseTypes.h"
 #include "lsst/ap/Match.h"
+#include "lsst/ap/Mutex.h"
 #include "lsst/ap/Object.h"
 #include "lsst/ap/Point.h"
+#include "lsst/ap/ScopeGuard.h"
 #include "lsst/ap/Time.h"
+#include "lsst/ap/ZoneTuning.h"
 #include "lsst/ap/ZoneTypes.h"
 
 using std::size_t;
@@ -155,6 +167,17 @@ struct BogusChunk {
 };
 
 
+// Minimal chunk for compact entries, which locate data objects through their chunk
+struct BlockChunk {
+    typedef TestDatum Entry;
+    static int const ENTRIES_PER_BLOCK_LOG2 = 4;
+
+    std::vector<TestDatum> * _data;
+
+    TestDatum * getBlock(int const b) { return &(*_data)[b << ENTRIES_PER_BLOCK_LOG2]; }
+};
+
+
 typedef ZoneEntry<BogusChunk>  Ze;
 typedef Ellipse<TestDatum>     Ell;
 typedef PassthroughFilter<Ze>  Filt;
@@ -162,6 +185,11 @@ typedef PassthroughFilter<Ell> EllFilt;
 typedef MatchWithDistance<Ze>  Match;
 typedef ZoneIndex<Ze>          Zi;
 typedef EllipseList<TestDatum> EllList;
+typedef MatchCollector<Ze, Ze> Collector;
+typedef CompactZoneEntry<BlockChunk> Cze;
+typedef ZoneIndex<Cze> Czi;
+typedef MatchCollector<Ze, Cze> CompactCollector;
+typedef MatchCollector<Cze, Cze> CompactSelfCollector;
 
 } // end of anonymous namespace
 
@@ -172,6 +200,12 @@ template class Ellipse<TestDatum>;
 template class ZoneEntryArray<Ze>;
 template class ZoneIndex<Ze>;
 template class EllipseList<TestDatum>;
+template class MatchCollector<Ze, Ze>;
+template class CompactZoneEntry<BlockChunk>;
+template class ZoneEntryArray<Cze>;
+template class ZoneIndex<Cze>;
+template class MatchCollector<Ze, Cze>;
+template class MatchCollector<Cze, Cze>;
 
 
 namespace {
@@ -253,6 +287,112 @@ void EmlProcessor::operator()(Ell & e, MatchIterator begin, MatchIterator end) {
     }
 }
 
+
+// Records the nearest neighbour lists passed to it
+struct NnProcessor {
+    typedef MatchWithDistance<Ze> Match;
+    typedef std::vector<Match>::iterator MatchIterator;
+
+    std::vector<std::vector<double> > _distances;
+
+    NnProcessor(std::size_t const n) : _distances(n) {}
+
+    void operator()(Ze & entry, MatchIterator begin, MatchIterator end) {
+        std::vector<double> & d = _distances[entry._data->_id];
+        for ( ; begin != end; ++begin) {
+            d.push_back(degrees(begin->_distance));
+        }
+    }
+};
+
+
+// Returns the match radius of a test point, stored in its semi-major axis length
+struct RadiusFunction {
+    double operator()(Ze const & entry) const { return entry._data->_smaa; }
+};
+
+
+// Records the (unordered) id pairs passed to it
+struct SelfMpProcessor {
+    Mutex _mutex;
+    std::vector<std::pair<int64_t, int64_t> > _pairs;
+
+    void operator()(Ze & a, Ze & b) {
+        int64_t const ia = a._data->_id;
+        int64_t const ib = b._data->_id;
+        ScopedLock<Mutex> lock(_mutex);
+        _pairs.push_back(ia < ib ? std::make_pair(ia, ib) : std::make_pair(ib, ia));
+    }
+};
+
+
+// Records the first/second id pairs of the match lists passed to it
+struct IdMlProcessor {
+    typedef MatchWithDistance<Ze> Match;
+    typedef std::vector<Match>::iterator MatchIterator;
+
+    Mutex _mutex;
+    std::vector<std::pair<int64_t, int64_t> > _pairs;
+
+    void operator()(Ze & entry, MatchIterator begin, MatchIterator end) {
+        ScopedLock<Mutex> lock(_mutex);
+        for ( ; begin < end; ++begin) {
+            _pairs.push_back(std::make_pair(entry._data->_id, begin->_match->_data->_id));
+        }
+    }
+};
+
+
+// Loads test points with declinations in a given range into a zone index, keeping track
+// of the number of points resident in each slot
+struct StripeLoader {
+    std::vector<TestDatum> * _data;
+    size_t _resident[2];
+    size_t _maxResident;
+    double _failDec; ///< loads of stripes starting at or above this declination fail
+    bool _reused;
+
+    explicit StripeLoader(std::vector<TestDatum> & data) :
+        _data(&data), _maxResident(0), _failDec(90.0), _reused(false)
+    {
+        _resident[0] = 0;
+        _resident[1] = 0;
+    }
+
+    void load(Zi & index, int slot, double minDec, double maxDec) {
+        if (minDec >= _failDec) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::IoError, "failed to load stripe");
+        }
+        if (_resident[slot] != 0) {
+            _reused = true; // slot was not released before being reloaded
+        }
+        std::vector<TestDatum> & data = *_data;
+        for (size_t i = 0; i < data.size(); ++i) {
+            double const dec = data[i].getDec();
+            if (dec >= minDec && dec <= maxDec) {
+                index.insert(data[i].getRa(), dec, &data[i], 0, 0);
+                ++_resident[slot];
+            }
+        }
+        _maxResident = std::max(_maxResident, _resident[0] + _resident[1]);
+    }
+
+    void release(int slot) {
+        _resident[slot] = 0;
+    }
+};
+
+
+// Fails once it is passed the match list of a first set entry with positive declination
+struct ThrowingMlProcessor : IdMlProcessor {
+    void operator()(Ze & entry, MatchIterator begin, MatchIterator end) {
+        if (entry._data->getDec() > 0.0) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError, "failed to process match list");
+        }
+        IdMlProcessor::operator()(entry, begin, end);
+    }
+};
+
 } // end of anonymous namespace
 
 
@@ -267,6 +407,68 @@ template size_t distanceMatch<Ze, Ze, Filt, Filt, MlProcessor>(
     MlProcessor &
 );
 
+template size_t nearestMatch<2, Ze, Ze, Filt, Filt, NnProcessor>(
+    Zi &,
+    Zi &,
+    double const,
+    Filt &,
+    Filt &,
+    NnProcessor &
+);
+
+template size_t variableDistanceMatch<Ze, Ze, RadiusFunction, Filt, Filt, NnProcessor>(
+    Zi &,
+    Zi &,
+    RadiusFunction &,
+    Filt &,
+    Filt &,
+    NnProcessor &
+);
+
+template size_t distanceMatch<Ze, Ze, Filt, Filt, Collector>(
+    Zi &,
+    Zi &,
+    double const,
+    Filt &,
+    Filt &,
+    Collector &
+);
+
+template size_t distanceMatch<Ze, Cze, Filt, PassthroughFilter<Cze>, CompactCollector>(
+    Zi &,
+    Czi &,
+    double const,
+    Filt &,
+    PassthroughFilter<Cze> &,
+    CompactCollector &
+);
+
+template size_t stripedDistanceMatch<Ze, Ze, StripeLoader, StripeLoader, Filt, Filt, IdMlProcessor>(
+    ZoneStripeChunkDecomposition const &,
+    double const,
+    double const,
+    double const,
+    StripeLoader &,
+    StripeLoader &,
+    Filt &,
+    Filt &,
+    IdMlProcessor &
+);
+
+template size_t distanceSelfMatch<Ze, Filt, Collector>(
+    Zi &,
+    double const,
+    Filt &,
+    Collector &
+);
+
+template size_t distanceSelfMatch<Ze, Filt, SelfMpProcessor>(
+    Zi &,
+    double const,
+    Filt &,
+    SelfMpProcessor &
+);
+
 template size_t ellipseMatch<TestDatum, Ze, EllFilt, Filt, MpProcessor>(
     EllList &,
     Zi &,
@@ -554,6 +756,952 @@ BOOST_AUTO_TEST_CASE(distanceMatchTest3) {
 }
 
 
+BOOST_AUTO_TEST_CASE(nearestMatchTest) {
+    BOOST_TEST_MESSAGE("    - Nearest neighbour match test");
+    Zi fzi(60, 60, 1024);
+    Zi szi(30, 45, 1024);
+    fzi.setDecBounds(-1.0, 1.0);
+    szi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    first.reserve(2000);
+    second.reserve(20000);
+    double const rad = 0.05;
+    // restrict ra to a narrow band around 0 so that fields are crowded and wrap-around is tested
+    for (int64_t i = 0; i < 2000; ++i) {
+        double ra = rng().flat(-1.0, 1.0);
+        first.push_back(TestDatum(i, Point(ra < 0.0 ? ra + 360.0 : ra, rng().flat(-0.9, 0.9))));
+    }
+    for (int64_t i = 0; i < 20000; ++i) {
+        double ra = rng().flat(-1.0, 1.0);
+        second.push_back(TestDatum(i, Point(ra < 0.0 ? ra + 360.0 : ra, rng().flat(-1.0, 1.0))));
+    }
+    for (size_t i = 0; i < first.size(); ++i) {
+        fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+    }
+    for (size_t i = 0; i < second.size(); ++i) {
+        szi.insert(second[i].getRa(), second[i].getDec(), &second[i], 0, 0);
+    }
+    fzi.sort();
+    szi.sort();
+
+    NnProcessor nnp(first.size());
+    Filt        f;
+    Stopwatch   watch(true);
+    size_t      nm = nearestMatch<2>(fzi, szi, rad, f, f, nnp);
+    watch.stop();
+    BOOST_TEST_MESSAGE("      found " << nm << " nearest neighbours in " << watch);
+
+    // compare against a brute force search
+    size_t total = 0;
+    for (size_t i = 0; i < first.size(); ++i) {
+        std::vector<double> expected;
+        for (size_t j = 0; j < second.size(); ++j) {
+            double const d = first[i]._loc.distance(second[j]._loc);
+            if (d < rad) {
+                expected.push_back(d);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+        if (expected.size() > 2) {
+            expected.resize(2);
+        }
+        std::vector<double> const & got = nnp._distances[i];
+        BOOST_REQUIRE_EQUAL(got.size(), expected.size());
+        for (size_t k = 0; k < got.size(); ++k) {
+            BOOST_CHECK_SMALL(got[k] - expected[k], 1e-6);
+        }
+        total += expected.size();
+    }
+    BOOST_CHECK_EQUAL(nm, total);
+}
+
+
+BOOST_AUTO_TEST_CASE(variableDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Variable radius distance match test");
+    // test a band around the equator (with ra wrap-around), and a polar cap
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi fzi(60, 60, 1024);
+        Zi szi(30, 45, 1024);
+        fzi.setDecBounds(decMin[t], decMax[t]);
+        szi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> first;
+        std::vector<TestDatum> second;
+        first.reserve(2000);
+        second.reserve(20000);
+        for (int64_t i = 0; i < 2000; ++i) {
+            double ra = (t == 0) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 360.0);
+            TestDatum d(i, Point(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin[t], decMax[t])));
+            // mostly small radii, with a few large ones and some zero radii
+            d._smaa = (i % 50 == 0) ? 0.1 : ((i % 7 == 0) ? 0.0 : rng().flat(0.0, 0.02));
+            first.push_back(d);
+        }
+        for (int64_t i = 0; i < 20000; ++i) {
+            double ra = (t == 0) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 360.0);
+            second.push_back(TestDatum(i, Point(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin[t], decMax[t]))));
+        }
+        for (size_t i = 0; i < first.size(); ++i) {
+            fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+        }
+        for (size_t i = 0; i < second.size(); ++i) {
+            szi.insert(second[i].getRa(), second[i].getDec(), &second[i], 0, 0);
+        }
+        fzi.sort();
+        szi.sort();
+
+        NnProcessor    nnp(first.size());
+        RadiusFunction rf;
+        Filt           f;
+        Stopwatch      watch(true);
+        size_t         nm = variableDistanceMatch(fzi, szi, rf, f, f, nnp);
+        watch.stop();
+        BOOST_TEST_MESSAGE("      found " << nm << " match pairs in " << watch);
+
+        // compare against a brute force search
+        size_t total = 0;
+        for (size_t i = 0; i < first.size(); ++i) {
+            std::vector<double> expected;
+            for (size_t j = 0; j < second.size(); ++j) {
+                double const d = first[i]._loc.distance(second[j]._loc);
+                if (d < first[i]._smaa) {
+                    expected.push_back(d);
+                }
+            }
+            std::vector<double> got = nnp._distances[i];
+            std::sort(expected.begin(), expected.end());
+            std::sort(got.begin(), got.end());
+            BOOST_REQUIRE_EQUAL(got.size(), expected.size());
+            for (size_t k = 0; k < got.size(); ++k) {
+                BOOST_CHECK_SMALL(got[k] - expected[k], 1e-6);
+            }
+            total += expected.size();
+        }
+        BOOST_CHECK_EQUAL(nm, total);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(distanceSelfMatchTest) {
+    BOOST_TEST_MESSAGE("    - Distance self-match test");
+    double const rad = 0.05;
+    // test a band around the equator (with ra wrap-around), and a polar cap
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi zi(30, 45, 1024);
+        zi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> data;
+        data.reserve(8000);
+        for (int64_t i = 0; i < 8000; ++i) {
+            double ra = (t == 0) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 360.0);
+            if (i % 10 == 0) {
+                // include duplicate positions
+                ra = 0.5;
+            }
+            Point p(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin[t], decMax[t]));
+            if (i % 10 == 0) {
+                p._dec = 0.5*(decMin[t] + decMax[t]);
+            }
+            data.push_back(TestDatum(i, p));
+        }
+        for (size_t i = 0; i < data.size(); ++i) {
+            zi.insert(data[i].getRa(), data[i].getDec(), &data[i], 0, 0);
+        }
+        zi.sort();
+
+        SelfMpProcessor mpp;
+        Filt            f;
+        Stopwatch       watch(true);
+        size_t          nm = distanceSelfMatch(zi, rad, f, mpp);
+        watch.stop();
+        BOOST_TEST_MESSAGE("      found " << nm << " match pairs amongst " << data.size() <<
+                           " points in " << watch);
+
+        // compare against a brute force search
+        std::vector<std::pair<int64_t, int64_t> > expected;
+        for (size_t i = 0; i < data.size(); ++i) {
+            for (size_t j = i + 1; j < data.size(); ++j) {
+                if (data[i]._loc.distance(data[j]._loc) < rad) {
+                    expected.push_back(std::make_pair(data[i]._id, data[j]._id));
+                }
+            }
+        }
+        std::sort(mpp._pairs.begin(), mpp._pairs.end());
+        BOOST_CHECK_EQUAL(nm, mpp._pairs.size());
+        BOOST_CHECK(std::adjacent_find(mpp._pairs.begin(), mpp._pairs.end()) == mpp._pairs.end());
+        BOOST_CHECK_EQUAL(mpp._pairs.size(), expected.size());
+        BOOST_CHECK(mpp._pairs == expected);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(matchCollectorTest) {
+    BOOST_TEST_MESSAGE("    - Match collector test");
+    Zi fzi(59, 60, 1024);
+    Zi szi(44, 60, 1024);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    double const rad = 0.05;
+    first.reserve(65536);
+    second.reserve(65536);
+    buildPoints(first, second, fzi, szi, -1.0, 1.0, rad);
+    Collector collector(16);
+    Filt      f;
+    Stopwatch watch(true);
+    size_t    nm = distanceMatch(fzi, szi, rad, f, f, collector);
+    BOOST_CHECK_EQUAL(collector.size(), nm);
+    std::vector<Collector::Record> records;
+    collector.collect(records, true);
+    watch.stop();
+    BOOST_TEST_MESSAGE("      found and collected " << nm << " match pairs in " << watch);
+    BOOST_CHECK_EQUAL(records.size(), nm);
+    BOOST_CHECK_EQUAL(collector.size(), 0u);
+    detail::MatchRecordLess<Ze, Ze> less;
+    for (size_t i = 0; i < records.size(); ++i) {
+        TestDatum * p = records[i]._first->_data;
+        TestDatum * s = records[i]._second->_data;
+        BOOST_CHECK(degrees(records[i]._distance) <= rad);
+        BOOST_CHECK_MESSAGE(p->matchWasExpected(s->_id), "unexpected match " << *s << " for " << *p);
+        ++p->_matched;
+        ++s->_matched;
+        if (i > 0) {
+            BOOST_CHECK(!less(records[i], records[i - 1]));
+        }
+    }
+    verifyMatchCount(first);
+    verifyMatchCount(second);
+
+    // pairs reported by a self-match are collected along with their distance
+    size_t ns = distanceSelfMatch(szi, rad, f, collector);
+    collector.collect(records, false);
+    BOOST_CHECK_EQUAL(records.size(), ns);
+    for (size_t i = 0; i < records.size(); ++i) {
+        double const d = records[i]._first->_data->_loc.distance(records[i]._second->_data->_loc);
+        BOOST_CHECK_SMALL(degrees(records[i]._distance) - d, 1e-6);
+        BOOST_CHECK(d < rad);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(matchRecordOrderTest) {
+    BOOST_TEST_MESSAGE("    - Match collector test: ordering of matches between duplicate positions");
+    Zi  fzi(60, 60, 1024);
+    Zi  szi(60, 60, 1024);
+    Czi czi(60, 60, 1024);
+    fzi.setDecBounds(-1.0, 1.0);
+    szi.setDecBounds(-1.0, 1.0);
+    czi.setDecBounds(-1.0, 1.0);
+    // entries at identical positions, inserted in a scrambled id order
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    for (int64_t i = 0; i < 5; ++i) {
+        first.push_back(TestDatum((3*i) % 5, Point(0.5, 0.5)));
+    }
+    for (int64_t i = 0; i < 7; ++i) {
+        second.push_back(TestDatum((4*i) % 7, Point(0.5, 0.5)));
+    }
+    BlockChunk chunk = { &second };
+    for (size_t i = 0; i < first.size(); ++i) {
+        fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+    }
+    for (size_t i = 0; i < second.size(); ++i) {
+        szi.insert(second[i].getRa(), second[i].getDec(), &second[i], 0, 0);
+        czi.insert(second[i].getRa(), second[i].getDec(), &second[i], &chunk, static_cast<int>(i));
+    }
+    fzi.sort();
+    szi.sort();
+    czi.sort();
+
+    Filt f;
+    PassthroughFilter<Cze> cf;
+    Collector collector;
+    CompactCollector compactCollector;
+    BOOST_CHECK_EQUAL(distanceMatch(fzi, szi, 0.01, f, f, collector), 35u);
+    BOOST_CHECK_EQUAL(distanceMatch(fzi, czi, 0.01, f, cf, compactCollector), 35u);
+    std::vector<Collector::Record> records;
+    std::vector<CompactCollector::Record> compactRecords;
+    collector.collect(records, true);
+    compactCollector.collect(compactRecords, true);
+    BOOST_REQUIRE_EQUAL(records.size(), 35u);
+    BOOST_REQUIRE_EQUAL(compactRecords.size(), 35u);
+    for (size_t i = 0; i < records.size(); ++i) {
+        // ordered by first and then second id
+        BOOST_CHECK_EQUAL(records[i]._first->_data->_id, static_cast<int64_t>(i/7));
+        BOOST_CHECK_EQUAL(records[i]._second->_data->_id, static_cast<int64_t>(i%7));
+        // compact entries are ordered by chunk index in the absence of data pointers
+        BOOST_CHECK_EQUAL(compactRecords[i]._first->_data->_id, static_cast<int64_t>(i/7));
+        BOOST_CHECK_EQUAL(compactRecords[i]._second->_index, static_cast<int>(i%7));
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(stripedDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Striped (out-of-core) distance match test");
+    Zi fzi(60, 6, 1024);
+    Zi szi(60, 6, 1024);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    double const rad = 0.05;
+    first.reserve(65536);
+    second.reserve(65536);
+    buildPoints(first, second, fzi, szi, -1.0, 1.0, rad);
+    Filt f;
+    Collector collector(16);
+    std::vector<Collector::Record> records;
+    size_t nm = distanceMatch(fzi, szi, rad, f, f, collector);
+    collector.collect(records, false);
+    std::vector<std::pair<int64_t, int64_t> > expected;
+    for (size_t i = 0; i < records.size(); ++i) {
+        expected.push_back(std::make_pair(records[i]._first->_data->_id,
+                                          records[i]._second->_data->_id));
+    }
+    std::sort(expected.begin(), expected.end());
+
+    // match in stripes of 0.1 degrees, bracketing the test region with empty stripes
+    StripeLoader fl(first);
+    StripeLoader sl(second);
+    IdMlProcessor mlp;
+    Stopwatch watch(true);
+    size_t ns = stripedDistanceMatch<Ze, Ze>(fzi.getDecomposition(), -2.0, 2.0, rad,
+                                             fl, sl, f, f, mlp);
+    watch.stop();
+    BOOST_TEST_MESSAGE("      found " << ns << " match pairs in " << watch);
+    BOOST_CHECK_EQUAL(ns, nm);
+    std::vector<std::pair<int64_t, int64_t> > & actual = mlp._pairs;
+    std::sort(actual.begin(), actual.end());
+    BOOST_CHECK(actual == expected);
+    BOOST_CHECK(!fl._reused && !sl._reused);
+    BOOST_CHECK_EQUAL(fl._resident[0] + fl._resident[1], 0u);
+    // at most two stripes (plus overlap bands) of each input were ever resident
+    BOOST_CHECK(fl._maxResident > 0 && fl._maxResident < first.size()/4);
+    BOOST_CHECK(sl._maxResident > 0 && sl._maxResident < second.size()/4);
+}
+
+
+BOOST_AUTO_TEST_CASE(failedStripedDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Striped (out-of-core) distance match test, failed matches and loads");
+    Zi fzi(60, 6, 1024);
+    Zi szi(60, 6, 1024);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    double const rad = 0.05;
+    first.reserve(65536);
+    second.reserve(65536);
+    buildPoints(first, second, fzi, szi, -1.0, 1.0, rad);
+    Filt f;
+
+#if !LSST_AP_HAVE_OPEN_MP
+    // the match list processor fails halfway through the stripes (exceptions cannot
+    // escape the parallel regions of OpenMP builds)
+    {
+        StripeLoader fl(first);
+        StripeLoader sl(second);
+        ThrowingMlProcessor mlp;
+        BOOST_CHECK_THROW((stripedDistanceMatch<Ze, Ze>(fzi.getDecomposition(), -2.0, 2.0, rad,
+                                                        fl, sl, f, f, mlp)),
+                          lsst::pex::exceptions::RuntimeError);
+        BOOST_CHECK(!mlp._pairs.empty());
+        BOOST_CHECK(fl._maxResident > 0 && sl._maxResident > 0);
+        BOOST_CHECK_EQUAL(fl._resident[0] + fl._resident[1], 0u);
+        BOOST_CHECK_EQUAL(sl._resident[0] + sl._resident[1], 0u);
+    }
+#endif
+
+    // a stripe prefetched by the background thread fails to load
+    {
+        StripeLoader fl(first);
+        StripeLoader sl(second);
+        sl._failDec = 0.5;
+        IdMlProcessor mlp;
+        BOOST_CHECK_THROW((stripedDistanceMatch<Ze, Ze>(fzi.getDecomposition(), -2.0, 2.0, rad,
+                                                        fl, sl, f, f, mlp)),
+                          lsst::pex::exceptions::RuntimeError);
+        BOOST_CHECK(!mlp._pairs.empty());
+        BOOST_CHECK_EQUAL(fl._resident[0] + fl._resident[1], 0u);
+        BOOST_CHECK_EQUAL(sl._resident[0] + sl._resident[1], 0u);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(fineZoneDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Distance match test, search circles covering more than 2048 zones");
+    Zi fzi(3600, 3600, 16);
+    Zi szi(3600, 3600, 16);
+    double const rad = 0.4;
+    fzi.setDecBounds(-1.0, 1.0);
+    szi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    for (int64_t i = 0; i < 200; ++i) {
+        first.push_back(TestDatum(i, Point(rng().flat(0.0, 1.0), rng().flat(-0.5, 0.5))));
+    }
+    for (int64_t i = 0; i < 4000; ++i) {
+        second.push_back(TestDatum(i, Point(rng().flat(0.0, 1.0), rng().flat(-0.5, 0.5))));
+    }
+    for (size_t i = 0; i < first.size(); ++i) {
+        fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+    }
+    for (size_t i = 0; i < second.size(); ++i) {
+        szi.insert(second[i].getRa(), second[i].getDec(), &second[i], 0, 0);
+    }
+    fzi.sort();
+    szi.sort();
+    Collector collector(16);
+    Filt f;
+    size_t nm = distanceMatch(fzi, szi, rad, f, f, collector);
+    size_t expected = 0;
+    for (size_t i = 0; i < first.size(); ++i) {
+        for (size_t j = 0; j < second.size(); ++j) {
+            double const d = first[i]._loc.distance(second[j]._loc);
+            // ignore pairs within rounding error of the match radius
+            BOOST_REQUIRE(std::fabs(d - rad) > 1e-9);
+            if (d <= rad) {
+                ++expected;
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(nm, expected);
+    BOOST_CHECK_EQUAL(collector.size(), expected);
+}
+
+
+BOOST_AUTO_TEST_CASE(zoneTuningTest) {
+    BOOST_TEST_MESSAGE("    - Zone height tuning test");
+    // the estimated probe cost is minimized by zones that are neither too tall nor too short
+    double const rad = 1.0/3600.0;
+    BOOST_CHECK(estimateProbeCost(1.0/180.0, 1.0e6, rad) < estimateProbeCost(1.0, 1.0e6, rad));
+    BOOST_CHECK(estimateProbeCost(1.0/180.0, 1.0e6, rad) < estimateProbeCost(1.0/3600.0, 1.0e6, rad));
+
+    // density estimates are not diluted by empty sky
+    std::vector<Point> sample;
+    for (int i = 0; i < 10000; ++i) {
+        sample.push_back(Point(rng().flat(10.0, 11.0), rng().flat(-0.5, 0.5)));
+    }
+    double const density = estimateDensity(sample, 1000000, 0.1);
+    BOOST_CHECK_CLOSE(density, 1.0e6, 10.0);
+
+    // sparse and dense catalogs lead to tall and short zones respectively,
+    // and tuned zone heights always evenly divide the stripe height
+    ZoneHeightTuning sparse = tuneZoneHeight(sample, 1000, 0.01, 180, 63, 4096);
+    ZoneHeightTuning dense = tuneZoneHeight(sample, 100000000, 0.01, 180, 63, 4096);
+    BOOST_CHECK(sparse._zonesPerDegree < dense._zonesPerDegree);
+    ZoneHeightTuning const * t[2] = { &sparse, &dense };
+    for (int i = 0; i < 2; ++i) {
+        BOOST_CHECK_EQUAL(t[i]->_zonesPerDegree*63, t[i]->_zonesPerStripe*180);
+        BOOST_CHECK(t[i]->_zonesPerDegree >= 1 && t[i]->_zonesPerDegree <= 3600);
+        BOOST_CHECK(t[i]->_maxEntriesPerZoneEstimate >= 1);
+        BOOST_CHECK(t[i]->_costPerProbe <= estimateProbeCost(1.0/180.0, t[i]->_density, 0.01));
+    }
+
+    // large match radii are accepted, even though density estimation cells cannot grow with them
+    ZoneHeightTuning wide;
+    BOOST_CHECK_NO_THROW(wide = tuneZoneHeight(sample, 1000000, 5.0, 180, 63, 4096));
+    BOOST_CHECK_EQUAL(wide._zonesPerDegree*63, wide._zonesPerStripe*180);
+    BOOST_CHECK(wide._density > 0.0);
+
+    // an index with a tuned decomposition matches like any other
+    Zi zi(180, 63, 4096);
+    zi.setDecomposition(dense._zonesPerDegree, dense._zonesPerStripe,
+                        dense._maxEntriesPerZoneEstimate);
+    BOOST_CHECK_EQUAL(zi.getDecomposition().getZonesPerDegree(), dense._zonesPerDegree);
+    BOOST_CHECK_EQUAL(zi.getDecomposition().getStripeDecMin(1),
+                      ZoneStripeChunkDecomposition(180, 63, 4096).getStripeDecMin(1));
+    zi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> data;
+    for (int64_t i = 0; i < 1000; ++i) {
+        data.push_back(TestDatum(i, Point(rng().flat(0.0, 0.1), rng().flat(-0.05, 0.05))));
+    }
+    for (size_t i = 0; i < data.size(); ++i) {
+        zi.insert(data[i].getRa(), data[i].getDec(), &data[i], 0, 0);
+    }
+    zi.sort();
+    BOOST_CHECK_EQUAL(zi.size(), 1000);
+    Filt f;
+    SelfMpProcessor mpp;
+    size_t nm = distanceSelfMatch(zi, 0.01, f, mpp);
+    size_t expected = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        for (size_t j = i + 1; j < data.size(); ++j) {
+            if (data[i]._loc.distance(data[j]._loc) < 0.01) {
+                ++expected;
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(nm, expected);
+}
+
+
+namespace {
+
+// Returns the center of the scaled integer ra/dec bin containing (ra, dec). Compact entries
+// locate points at bin centers, so full precision and compact entries for such points are at
+// identical positions and agree on matches right at the match radius.
+Point binCenter(double const ra, double const dec) {
+    return Point((std::floor(ra*RA_DEC_SCALE) + 0.5)/RA_DEC_SCALE,
+                 (std::floor(dec*RA_DEC_SCALE) + 0.5)/RA_DEC_SCALE);
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(compactDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Distance match test, compact entries");
+    BOOST_CHECK_EQUAL(sizeof(Cze), 32u);
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi  fzi(60, 60, 1024);
+        Zi  szi(30, 45, 1024);
+        Czi czi(30, 45, 1024);
+        fzi.setDecBounds(decMin[t], decMax[t]);
+        szi.setDecBounds(decMin[t], decMax[t]);
+        czi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> first;
+        std::vector<TestDatum> second;
+        for (int64_t i = 0; i < 4000; ++i) {
+            double ra = (t == 0) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 360.0);
+            first.push_back(TestDatum(i, binCenter(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin[t], decMax[t]))));
+        }
+        for (int64_t i = 0; i < 40000; ++i) {
+            double ra = (t == 0) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 360.0);
+            second.push_back(TestDatum(i, binCenter(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin[t], decMax[t]))));
+        }
+        // split the second set into two chunks
+        BlockChunk chunks[2] = { { &second }, { &second } };
+        for (size_t i = 0; i < first.size(); ++i) {
+            fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+        }
+        for (size_t i = 0; i < second.size(); ++i) {
+            szi.insert(second[i].getRa(), second[i].getDec(), &second[i], 0, 0);
+            czi.insert(second[i].getRa(), second[i].getDec(), &second[i],
+                       &chunks[i < second.size()/2 ? 0 : 1], static_cast<int>(i));
+        }
+        fzi.sort();
+        szi.sort();
+        czi.sort();
+
+        double const rad = 0.01;
+        Collector        fc;
+        CompactCollector cc;
+        Filt             f;
+        PassthroughFilter<Cze> cf;
+        size_t const nf = distanceMatch(fzi, szi, rad, f, f, fc);
+        Stopwatch watch(true);
+        size_t const nc = distanceMatch(fzi, czi, rad, f, cf, cc);
+        watch.stop();
+        BOOST_TEST_MESSAGE("      found " << nc << " match pairs in " << watch);
+        BOOST_CHECK_EQUAL(nf, nc);
+
+        std::vector<Collector::Record> fr;
+        std::vector<CompactCollector::Record> cr;
+        fc.collect(fr);
+        cc.collect(cr);
+        std::vector<std::pair<int64_t, int64_t> > fp;
+        std::vector<std::pair<int64_t, int64_t> > cp;
+        for (size_t i = 0; i < fr.size(); ++i) {
+            fp.push_back(std::make_pair(fr[i]._first->_data->_id, fr[i]._second->_data->_id));
+        }
+        for (size_t i = 0; i < cr.size(); ++i) {
+            Cze const & e = *cr[i]._second;
+            BlockChunk * c = czi.getChunk(e._chunkSlot);
+            BOOST_CHECK(c == &chunks[e._index < static_cast<int>(second.size()/2) ? 0 : 1]);
+            TestDatum * d = e.getData(*c);
+            BOOST_CHECK_EQUAL(d->_id, static_cast<int64_t>(e._index));
+            BOOST_CHECK_SMALL(degrees(cr[i]._distance) - cr[i]._first->_data->_loc.distance(d->_loc), 1e-5);
+            cp.push_back(std::make_pair(cr[i]._first->_data->_id, d->_id));
+        }
+        std::sort(fp.begin(), fp.end());
+        std::sort(cp.begin(), cp.end());
+        BOOST_CHECK(fp == cp);
+    }
+}
+
+
+namespace {
+
+typedef std::pair<std::pair<int64_t, int64_t>, double> IdPairDistance;
+
+// Generates test points (at bin centers) in a band around the equator (with ra wrap-around)
+// or a polar cap
+void generatePoints(std::vector<TestDatum> & data, int64_t const n, double const decMin, double const decMax) {
+    bool const cap = (decMax >= 90.0);
+    for (int64_t i = 0; i < n; ++i) {
+        double ra = cap ? rng().flat(0.0, 360.0) : rng().flat(-1.0, 1.0);
+        data.push_back(TestDatum(i, binCenter(ra < 0.0 ? ra + 360.0 : ra, rng().flat(decMin, decMax))));
+    }
+}
+
+// Inserts test points into a full precision and a compact zone index
+void insertPoints(std::vector<TestDatum> & data, BlockChunk & chunk, Zi & zi, Czi & czi) {
+    for (size_t i = 0; i < data.size(); ++i) {
+        zi.insert(data[i].getRa(), data[i].getDec(), &data[i], 0, 0);
+        czi.insert(data[i].getRa(), data[i].getDec(), &data[i], &chunk, static_cast<int>(i));
+    }
+    zi.sort();
+    czi.sort();
+}
+
+int64_t getId(Czi & index, Cze const & e) {
+    return e.getData(*index.getChunk(e._chunkSlot))->_id;
+}
+
+// Returns the sorted (first id, second id, distance) triples of full precision match records
+void getMatches(std::vector<IdPairDistance> & out, std::vector<Collector::Record> const & records) {
+    out.clear();
+    for (size_t i = 0; i < records.size(); ++i) {
+        out.push_back(IdPairDistance(std::make_pair(records[i]._first->_data->_id,
+                                                    records[i]._second->_data->_id),
+                                     records[i]._distance));
+    }
+    std::sort(out.begin(), out.end());
+}
+
+// Returns the sorted (first id, second id, distance) triples of compact match records
+void getMatches(std::vector<IdPairDistance> & out, std::vector<CompactCollector::Record> const & records,
+                Czi & index) {
+    out.clear();
+    for (size_t i = 0; i < records.size(); ++i) {
+        out.push_back(IdPairDistance(std::make_pair(records[i]._first->_data->_id,
+                                                    getId(index, *records[i]._second)),
+                                     records[i]._distance));
+    }
+    std::sort(out.begin(), out.end());
+}
+
+// Checks that full precision and compact matches agree, up to the given distance error (radians)
+void checkMatches(std::vector<IdPairDistance> const & fm, std::vector<IdPairDistance> const & cm,
+                  double const error) {
+    BOOST_REQUIRE_EQUAL(fm.size(), cm.size());
+    for (size_t i = 0; i < fm.size(); ++i) {
+        BOOST_CHECK(fm[i].first == cm[i].first);
+        BOOST_CHECK_SMALL(fm[i].second - cm[i].second, error);
+    }
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(compactVariableDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Variable radius distance match test, compact entries");
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi  fzi(60, 60, 1024);
+        Zi  szi(30, 45, 1024);
+        Czi czi(30, 45, 1024);
+        fzi.setDecBounds(decMin[t], decMax[t]);
+        szi.setDecBounds(decMin[t], decMax[t]);
+        czi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> first;
+        std::vector<TestDatum> second;
+        generatePoints(first, 2000, decMin[t], decMax[t]);
+        generatePoints(second, 20000, decMin[t], decMax[t]);
+        for (size_t i = 0; i < first.size(); ++i) {
+            first[i]._smaa = (i % 50 == 0) ? 0.1 : ((i % 7 == 0) ? 0.0 : rng().flat(0.0, 0.02));
+            fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+        }
+        fzi.sort();
+        BlockChunk chunk = { &second };
+        insertPoints(second, chunk, szi, czi);
+
+        Collector        fc;
+        CompactCollector cc;
+        RadiusFunction   rf;
+        Filt             f;
+        PassthroughFilter<Cze> cf;
+        size_t const nf = variableDistanceMatch(fzi, szi, rf, f, f, fc);
+        size_t const nc = variableDistanceMatch(fzi, czi, rf, f, cf, cc);
+        BOOST_TEST_MESSAGE("      found " << nc << " match pairs");
+        BOOST_CHECK_EQUAL(nf, nc);
+        std::vector<Collector::Record> fr;
+        std::vector<CompactCollector::Record> cr;
+        fc.collect(fr);
+        cc.collect(cr);
+        std::vector<IdPairDistance> fm;
+        std::vector<IdPairDistance> cm;
+        getMatches(fm, fr);
+        getMatches(cm, cr, czi);
+        checkMatches(fm, cm, Cze::getCoordinateError());
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(compactNearestMatchTest) {
+    BOOST_TEST_MESSAGE("    - Nearest neighbour match test, compact entries");
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi  fzi(60, 60, 1024);
+        Zi  szi(30, 45, 1024);
+        Czi czi(30, 45, 1024);
+        fzi.setDecBounds(decMin[t], decMax[t]);
+        szi.setDecBounds(decMin[t], decMax[t]);
+        czi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> first;
+        std::vector<TestDatum> second;
+        generatePoints(first, 2000, decMin[t], decMax[t]);
+        generatePoints(second, 20000, decMin[t], decMax[t]);
+        for (size_t i = 0; i < first.size(); ++i) {
+            fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+        }
+        fzi.sort();
+        BlockChunk chunk = { &second };
+        insertPoints(second, chunk, szi, czi);
+
+        double const rad = 0.05;
+        Collector        fc;
+        CompactCollector cc;
+        Filt             f;
+        PassthroughFilter<Cze> cf;
+        size_t const nf = nearestMatch<2>(fzi, szi, rad, f, f, fc);
+        size_t const nc = nearestMatch<2>(fzi, czi, rad, f, cf, cc);
+        BOOST_TEST_MESSAGE("      found " << nc << " nearest neighbours");
+        BOOST_CHECK_EQUAL(nf, nc);
+        std::vector<Collector::Record> fr;
+        std::vector<CompactCollector::Record> cr;
+        fc.collect(fr);
+        cc.collect(cr);
+        std::vector<IdPairDistance> fm;
+        std::vector<IdPairDistance> cm;
+        getMatches(fm, fr);
+        getMatches(cm, cr, czi);
+        // compact candidates are ranked by exact distances, so neighbours and distances agree
+        checkMatches(fm, cm, 1e-8);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(compactDistanceSelfMatchTest) {
+    BOOST_TEST_MESSAGE("    - Distance self-match test, compact entries");
+    double const decMin[2] = { -1.0, 88.5 };
+    double const decMax[2] = {  1.0, 90.0 };
+    for (int t = 0; t < 2; ++t) {
+        Zi  zi(30, 45, 1024);
+        Czi czi(30, 45, 1024);
+        zi.setDecBounds(decMin[t], decMax[t]);
+        czi.setDecBounds(decMin[t], decMax[t]);
+        std::vector<TestDatum> data;
+        generatePoints(data, 8000, decMin[t], decMax[t]);
+        for (size_t i = 0; i < data.size(); i += 10) {
+            // include duplicate positions
+            data[i]._loc = binCenter(0.5, 0.5*(decMin[t] + decMax[t]));
+        }
+        BlockChunk chunk = { &data };
+        insertPoints(data, chunk, zi, czi);
+
+        double const rad = 0.05;
+        Collector            fc;
+        CompactSelfCollector cc;
+        Filt                 f;
+        PassthroughFilter<Cze> cf;
+        size_t const nf = distanceSelfMatch(zi, rad, f, fc);
+        size_t const nc = distanceSelfMatch(czi, rad, cf, cc);
+        BOOST_TEST_MESSAGE("      found " << nc << " match pairs amongst " << data.size() << " points");
+        BOOST_CHECK_EQUAL(nf, nc);
+        std::vector<Collector::Record> fr;
+        std::vector<CompactSelfCollector::Record> cr;
+        fc.collect(fr);
+        cc.collect(cr);
+        std::vector<std::pair<int64_t, int64_t> > fp;
+        std::vector<std::pair<int64_t, int64_t> > cp;
+        for (size_t i = 0; i < fr.size(); ++i) {
+            int64_t const a = fr[i]._first->_data->_id;
+            int64_t const b = fr[i]._second->_data->_id;
+            fp.push_back(a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+        }
+        for (size_t i = 0; i < cr.size(); ++i) {
+            int64_t const a = getId(czi, *cr[i]._first);
+            int64_t const b = getId(czi, *cr[i]._second);
+            cp.push_back(a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+            BOOST_CHECK_SMALL(degrees(cr[i]._distance) - data[a]._loc.distance(data[b]._loc), 1e-5);
+        }
+        std::sort(fp.begin(), fp.end());
+        std::sort(cp.begin(), cp.end());
+        BOOST_CHECK(fp == cp);
+    }
+}
+
+
+namespace {
+
+// Identifies chunks of a zone index snapshot by their position in an array
+struct ChunkArrayIds {
+    BlockChunk * _chunks;
+    int _numChunks;
+
+    ChunkArrayIds(BlockChunk * chunks, int numChunks) : _chunks(chunks), _numChunks(numChunks) {}
+
+    boost::int64_t operator()(BlockChunk const & chunk) const {
+        return &chunk - _chunks;
+    }
+    BlockChunk * operator()(boost::int64_t const id) const {
+        return (id >= 0 && id < _numChunks) ? &_chunks[id] : 0;
+    }
+};
+
+std::string const makeTempFile() {
+    char name[64];
+    std::strncpy(name, "/tmp/MatchTest.XXXXXX", 63);
+    name[63] = 0;
+    int const fd = ::mkstemp(name);
+    if (fd < 1) {
+        BOOST_FAIL("Failed to create temporary file for testing purposes");
+    }
+    ::close(fd);
+    return std::string(name);
+}
+
+typedef lsst::ap::detail::ZoneIndexSnapshotHeader SnapshotHeader;
+
+std::vector<char> readFile(std::string const & name) {
+    std::ifstream in(name.c_str(), std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFile(std::string const & name, std::vector<char> const & bytes) {
+    std::ofstream out(name.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(snapshotDistanceMatchTest) {
+    BOOST_TEST_MESSAGE("    - Distance match test, mapped zone index snapshot");
+    std::string const name(makeTempFile());
+    ScopeGuard fileGuard(boost::bind(::unlink, name.c_str()));
+
+    Zi  fzi(60, 60, 1024);
+    Czi czi(30, 45, 1024);
+    Czi mzi(60, 60, 16);
+    fzi.setDecBounds(-1.0, 1.0);
+    czi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    for (int64_t i = 0; i < 4000; ++i) {
+        first.push_back(TestDatum(i, Point(rng().flat(0.0, 2.0), rng().flat(-1.0, 1.0))));
+    }
+    for (int64_t i = 0; i < 40000; ++i) {
+        second.push_back(TestDatum(i, Point(rng().flat(0.0, 2.0), rng().flat(-1.0, 1.0))));
+    }
+    BlockChunk chunks[2] = { { &second }, { &second } };
+    for (size_t i = 0; i < first.size(); ++i) {
+        fzi.insert(first[i].getRa(), first[i].getDec(), &first[i], 0, 0);
+    }
+    for (size_t i = 0; i < second.size(); ++i) {
+        czi.insert(second[i].getRa(), second[i].getDec(), &second[i],
+                   &chunks[i < second.size()/2 ? 0 : 1], static_cast<int>(i));
+    }
+    fzi.sort();
+    ChunkArrayIds ids(chunks, 2);
+    BOOST_CHECK_THROW(czi.writeSnapshot(name, ids), lsst::pex::exceptions::LogicError);
+    czi.sort();
+    czi.writeSnapshot(name, ids);
+    mzi.mapSnapshot(name, ids);
+    BOOST_CHECK(mzi.isMapped());
+    BOOST_CHECK_EQUAL(mzi.size(), czi.size());
+    BOOST_CHECK_EQUAL(mzi.getMinZone(), czi.getMinZone());
+    BOOST_CHECK_EQUAL(mzi.getMaxZone(), czi.getMaxZone());
+    BOOST_CHECK_EQUAL(mzi.getDecomposition().getZonesPerDegree(), 30);
+    BOOST_CHECK_EQUAL(mzi.getDecomposition().getZonesPerStripe(), 45);
+
+    double const rad = 0.01;
+    CompactCollector cc;
+    CompactCollector mc;
+    Filt f;
+    PassthroughFilter<Cze> cf;
+    size_t const nc = distanceMatch(fzi, czi, rad, f, cf, cc);
+    size_t const nm = distanceMatch(fzi, mzi, rad, f, cf, mc);
+    BOOST_CHECK_EQUAL(nc, nm);
+    std::vector<CompactCollector::Record> cr;
+    std::vector<CompactCollector::Record> mr;
+    cc.collect(cr);
+    mc.collect(mr);
+    std::vector<std::pair<int64_t, int64_t> > cp;
+    std::vector<std::pair<int64_t, int64_t> > mp;
+    for (size_t i = 0; i < cr.size(); ++i) {
+        Cze const & e = *cr[i]._second;
+        cp.push_back(std::make_pair(cr[i]._first->_data->_id, e.getData(*czi.getChunk(e._chunkSlot))->_id));
+    }
+    for (size_t i = 0; i < mr.size(); ++i) {
+        Cze const & e = *mr[i]._second;
+        mp.push_back(std::make_pair(mr[i]._first->_data->_id, e.getData(*mzi.getChunk(e._chunkSlot))->_id));
+    }
+    std::sort(cp.begin(), cp.end());
+    std::sort(mp.begin(), mp.end());
+    BOOST_CHECK(cp == mp);
+
+    // the entries of a mapped index are read-only
+    BOOST_CHECK_THROW(mzi.sort(), lsst::pex::exceptions::LogicError);
+    BOOST_CHECK_THROW(mzi.insert(second[0].getRa(), second[0].getDec(), &second[0], &chunks[0], 0),
+                      lsst::pex::exceptions::LogicError);
+    mzi.setDecBounds(-1.0, 1.0);
+    BOOST_CHECK(!mzi.isMapped());
+    BOOST_CHECK_EQUAL(mzi.size(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(corruptSnapshotTest) {
+    BOOST_TEST_MESSAGE("    - Mapping truncated or corrupt zone index snapshots");
+    std::string const name(makeTempFile());
+    ScopeGuard fileGuard(boost::bind(::unlink, name.c_str()));
+
+    Czi czi(60, 60, 1024);
+    czi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> data;
+    for (int64_t i = 0; i < 1000; ++i) {
+        data.push_back(TestDatum(i, Point(rng().flat(0.0, 2.0), rng().flat(-1.0, 1.0))));
+    }
+    BlockChunk chunks[1] = { { &data } };
+    for (size_t i = 0; i < data.size(); ++i) {
+        czi.insert(data[i].getRa(), data[i].getDec(), &data[i], &chunks[0], static_cast<int>(i));
+    }
+    czi.sort();
+    ChunkArrayIds ids(chunks, 1);
+    czi.writeSnapshot(name, ids);
+    std::vector<char> const snapshot = readFile(name);
+    BOOST_REQUIRE(snapshot.size() > sizeof(SnapshotHeader));
+    SnapshotHeader const h = *reinterpret_cast<SnapshotHeader const *>(&snapshot[0]);
+
+    // each corruption is applied to a pristine copy of the snapshot
+    std::vector<SnapshotHeader> headers(12, h);
+    headers[0]._zoneOffset  = h._size;
+    headers[1]._chunkOffset = h._size + SnapshotHeader::SECTION_ALIGNMENT;
+    headers[2]._entryOffset = h._entryOffset + 8;   // misaligned
+    headers[3]._raOffset    = 0;                    // overlaps the header
+    headers[4]._xOffset     = ~static_cast<boost::uint64_t>(0) & ~static_cast<boost::uint64_t>(63);
+    headers[5]._zOffset     = h._size - SnapshotHeader::SECTION_ALIGNMENT;
+    headers[6]._numChunks   = 0xffffffffu;
+    headers[7]._numEntries  = h._numEntries*1000;
+    headers[8]._numEntries  = ~static_cast<boost::uint64_t>(0);
+    headers[9]._maxZone     = 0x7fffffff;
+    headers[10]._minZone    = -0x7fffffff - 1;
+    headers[11]._zonesPerDegree = 0;
+    Czi mzi(60, 60, 16);
+    for (size_t i = 0; i < headers.size(); ++i) {
+        std::vector<char> bytes(snapshot);
+        std::memcpy(&bytes[0], &headers[i], sizeof(SnapshotHeader));
+        writeFile(name, bytes);
+        BOOST_CHECK_THROW(mzi.mapSnapshot(name, ids), lsst::pex::exceptions::IoError);
+        BOOST_CHECK(!mzi.isMapped());
+    }
+    // truncated snapshot
+    writeFile(name, std::vector<char>(snapshot.begin(), snapshot.end() - 1));
+    BOOST_CHECK_THROW(mzi.mapSnapshot(name, ids), lsst::pex::exceptions::IoError);
+    // zone table entries beyond the entry count
+    std::vector<char> bytes(snapshot);
+    reinterpret_cast<boost::uint64_t *>(&bytes[0] + h._zoneOffset)[1] = h._numEntries + 1;
+    writeFile(name, bytes);
+    BOOST_CHECK_THROW(mzi.mapSnapshot(name, ids), lsst::pex::exceptions::IoError);
+    // the pristine snapshot maps fine
+    writeFile(name, snapshot);
+    mzi.mapSnapshot(name, ids);
+    BOOST_CHECK_EQUAL(mzi.size(), czi.size());
+}
+
+
 BOOST_AUTO_TEST_CASE(ellipseMatchTest1) {
     BOOST_TEST_MESSAGE("    - Ellipse match test, near north pole");
     Zi                     szi(240, 60, 128);
@@ -685,3 +1833,252 @@ BOOST_AUTO_TEST_CASE(ellipseGroupedMatchTest3) {
     verifyMatchCount(second);
 }
 
+
+
+BOOST_AUTO_TEST_CASE(ellipseGroupedMatchSizeClassTest) {
+    BOOST_TEST_MESSAGE("    - Ellipse grouped match test, small and large ellipses");
+    // with fine zones, ellipses cover between ~10 and ~30 zones, so both size classes are used
+    Zi                     szi(720, 60, 128);
+    std::vector<TestDatum> first;
+    std::vector<TestDatum> second;
+    EllList                ells;
+    first.reserve(65536);
+    second.reserve(65536);
+    buildEllipsesAndPoints(first, second, ells, szi, -0.5, 0.5, 0.01666666667);
+    EmlProcessor        mlp;
+    EllFilt             ef;
+    Filt                f;
+    std::vector<double> busyTimes;
+    EllipseClassTimes   classTimes;
+    size_t nm = ellipseGroupedMatch(ells, szi, ef, f, mlp, busyTimes, classTimes);
+    BOOST_TEST_MESSAGE("      found and validated " << nm << " match pairs: " <<
+        classTimes._numSmall << " small ellipses in " << classTimes._smallTime << " sec, " <<
+        classTimes._numLarge << " large ellipses (" << classTimes._numTasks << " tasks) in " <<
+        classTimes._largeTime << " + " << classTimes._mergeTime << " sec");
+    BOOST_CHECK(classTimes._numSmall > 0);
+    BOOST_CHECK(classTimes._numLarge > 0);
+    BOOST_CHECK(classTimes._numTasks >= classTimes._numLarge*EllipseClassTimes::LARGE_ELLIPSE_ZONES);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(classTimes._numSmall + classTimes._numLarge), ells.size());
+    verifyMatchCount(first);
+    verifyMatchCount(second);
+}
+
+
+BOOST_AUTO_TEST_CASE(zoneSortTest) {
+    BOOST_TEST_MESSAGE("    - Zone index sort test");
+    // few zones, so that both small (std::sort) and large (radix sort) zones are exercised
+    Zi zi(12, 12, 1024);
+    zi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> data;
+    data.reserve(100000);
+    for (int64_t i = 0; i < 100000; ++i) {
+        // zones above dec 0.5 are sparsely populated
+        double dec = (i < 100) ? rng().flat(0.5, 1.0) : rng().flat(-1.0, 0.5);
+        // include many duplicate ra values
+        double ra = (i % 7 == 0) ? 180.0 : rng().flat(0.0, 360.0);
+        data.push_back(TestDatum(i, Point(ra, dec)));
+    }
+    for (std::vector<TestDatum>::iterator i = data.begin(); i != data.end(); ++i) {
+        zi.insert(i->getRa(), i->getDec(), &(*i), 0, 0);
+    }
+    zi.sort();
+    std::vector<int> seen(data.size(), 0);
+    for (int z = zi.getMinZone(); z <= zi.getMaxZone(); ++z) {
+        ZoneEntryArray<Ze> const * zone = zi.getZone(z);
+        for (int e = 0; e < zone->_size; ++e) {
+            Ze const & entry = zone->_entries[e];
+            if (e > 0) {
+                BOOST_CHECK(zone->_entries[e - 1]._ra <= entry._ra);
+            }
+            BOOST_CHECK_EQUAL(entry._ra, raToScaledInteger(entry._data->getRa()));
+            BOOST_CHECK_EQUAL(zone->_ra[e], entry._ra);
+            BOOST_CHECK_EQUAL(zone->_z[e], entry._z);
+            ++seen[entry._data->_id];
+        }
+    }
+    for (std::size_t i = 0; i < seen.size(); ++i) {
+        BOOST_CHECK_EQUAL(seen[i], 1);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(zoneMergeTest) {
+    BOOST_TEST_MESSAGE("    - Zone index merge test");
+    Zi zi(12, 12, 1024);
+    zi.setDecBounds(-1.0, 1.0);
+    std::vector<TestDatum> data;
+    data.reserve(60000);
+    for (int64_t i = 0; i < 60000; ++i) {
+        double dec = (i < 40000) ? rng().flat(-1.0, 1.0) : rng().flat(0.0, 2.0);
+        double ra = (i % 5 == 0) ? 90.0 : rng().flat(0.0, 360.0);
+        data.push_back(TestDatum(i, Point(ra, dec)));
+    }
+    for (int i = 0; i < 40000; ++i) {
+        zi.insert(data[i].getRa(), data[i].getDec(), &data[i], 0, 0);
+    }
+    zi.sort();
+    // shift the index north, keeping entries in overlapping zones, and merge in new entries
+    zi.changeDecBounds(0.0, 2.0);
+    BOOST_CHECK_EQUAL(zi.getMinZone(), zi.getDecomposition().decToZone(0.0));
+    BOOST_CHECK_EQUAL(zi.getMaxZone(), zi.getDecomposition().decToZone(2.0));
+    for (int i = 40000; i < 60000; ++i) {
+        zi.insert(data[i].getRa(), data[i].getDec(), &data[i], 0, 0);
+    }
+    zi.merge();
+    std::vector<int> seen(data.size(), 0);
+    for (int z = zi.getMinZone(); z <= zi.getMaxZone(); ++z) {
+        ZoneEntryArray<Ze> const * zone = zi.getZone(z);
+        BOOST_CHECK_EQUAL(zone->_zone, z);
+        for (int e = 0; e < zone->_size; ++e) {
+            Ze const & entry = zone->_entries[e];
+            if (e > 0) {
+                BOOST_CHECK(zone->_entries[e - 1]._ra <= entry._ra);
+            }
+            BOOST_CHECK_EQUAL(zone->_ra[e], entry._ra);
+            BOOST_CHECK_EQUAL(zone->_x[e], entry._x);
+            ++seen[entry._data->_id];
+        }
+    }
+    for (std::size_t i = 0; i < seen.size(); ++i) {
+        int const z = zi.getDecomposition().decToZone(data[i].getDec());
+        int const expected = (z >= zi.getMinZone() && z <= zi.getMaxZone()) ? 1 : 0;
+        BOOST_CHECK_EQUAL(seen[i], expected);
+    }
+}
+
+
+namespace {
+
+// Checks batch region query results against a brute force scan of the index
+template <typename InsideT>
+void verifyRegionQuery(Zi & zi, RegionQueryResults<Ze> const & results, int q, InsideT inside) {
+    std::vector<int64_t> expected;
+    for (int z = zi.getMinZone(); z <= zi.getMaxZone(); ++z) {
+        ZoneEntryArray<Ze> const * zone = zi.getZone(z);
+        for (int e = 0; e < zone->_size; ++e) {
+            if (inside(zone->_entries[e])) {
+                expected.push_back(zone->_entries[e]._data->_id);
+            }
+        }
+    }
+    std::vector<int64_t> actual;
+    for (size_t i = results._offsets[q]; i < results._offsets[q + 1]; ++i) {
+        actual.push_back(results._entries[i]->_data->_id);
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    BOOST_CHECK_MESSAGE(actual == expected, "query " << q << ": found " << actual.size() <<
+                        " entries, expected " << expected.size());
+}
+
+struct InsideCircle {
+    double _x, _y, _z, _d2;
+
+    InsideCircle(double ra, double dec, double radius) {
+        double const cosDec = std::cos(radians(dec));
+        double const shr = std::sin(radians(radius*0.5));
+        _x = std::cos(radians(ra))*cosDec;
+        _y = std::sin(radians(ra))*cosDec;
+        _z = std::sin(radians(dec));
+        _d2 = 4.0*shr*shr;
+    }
+    bool operator()(Ze const & e) const { return e.exactDistance2(_x, _y, _z) < _d2; }
+};
+
+struct InsideBox {
+    RectangularRegion _box;
+
+    explicit InsideBox(RectangularRegion const & box) : _box(box) {}
+    bool operator()(Ze const & e) const {
+        double const ra = e._data->getRa();
+        double const dec = e._data->getDec();
+        bool const inRa = (_box.getMinRa() <= _box.getMaxRa()) ?
+            (ra >= _box.getMinRa() && ra <= _box.getMaxRa()) :
+            (ra >= _box.getMinRa() || ra <= _box.getMaxRa());
+        return inRa && dec >= _box.getMinDec() && dec <= _box.getMaxDec();
+    }
+};
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(regionQueryTest) {
+    BOOST_TEST_MESSAGE("    - Batch region query test");
+    Zi zi(20, 20, 64);
+    zi.setDecBounds(-90.0, 90.0);
+    std::vector<TestDatum> data;
+    data.reserve(40000);
+    for (int64_t i = 0; i < 40000; ++i) {
+        // a band straddling ra = 0, plus a polar cap
+        double ra = rng().flat(-5.0, 5.0);
+        double dec = rng().flat(-5.0, 5.0);
+        if (i >= 30000) {
+            ra = rng().flat(0.0, 360.0);
+            dec = rng().flat(85.0, 90.0);
+        }
+        data.push_back(TestDatum(i, Point(ra < 0.0 ? ra + 360.0 : ra, dec)));
+    }
+    for (std::vector<TestDatum>::iterator i = data.begin(); i != data.end(); ++i) {
+        zi.insert(i->getRa(), i->getDec(), &(*i), 0, 0);
+    }
+    zi.sort();
+
+    // cones, some containing the pole or straddling ra = 0
+    std::vector<Point> centers;
+    for (int i = 0; i < 1000; ++i) {
+        double ra = rng().flat(-6.0, 6.0);
+        double dec = (i % 4 == 0) ? rng().flat(89.0, 90.0) : rng().flat(-6.0, 6.0);
+        centers.push_back(Point(ra < 0.0 ? ra + 360.0 : ra, dec));
+    }
+    RegionQueryResults<Ze> results;
+    zi.coneQuery(centers, 0.3, results);
+    BOOST_CHECK_EQUAL(results.getNumQueries(), 1000);
+    BOOST_CHECK(results._entries.size() > 0u);
+    for (int q = 0; q < 1000; ++q) {
+        verifyRegionQuery(zi, results, q, InsideCircle(centers[q]._ra, centers[q]._dec, 0.3));
+    }
+
+    // circles with varying radii, including a zero radius and a very large one
+    std::vector<CircularRegion> circles;
+    for (int i = 0; i < 200; ++i) {
+        double radius = (i == 0) ? 0.0 : ((i == 1) ? 20.0 : rng().flat(0.01, 2.0));
+        circles.push_back(CircularRegion(centers[i]._ra, centers[i]._dec, radius));
+    }
+    zi.circleQuery(circles, results);
+    BOOST_CHECK_EQUAL(results.getNumQueries(), 200);
+    for (int q = 0; q < 200; ++q) {
+        verifyRegionQuery(zi, results, q, InsideCircle(circles[q].getCenterRa(),
+                          circles[q].getCenterDec(), circles[q].getRadius()));
+    }
+
+    // boxes, some wrapping around ra = 0, and some covering all right ascensions
+    std::vector<RectangularRegion> boxes;
+    for (int i = 0; i < 200; ++i) {
+        double minRa = rng().flat(-6.0, 6.0);
+        double maxRa = minRa + rng().flat(0.0, 3.0);
+        double minDec = (i % 4 == 0) ? rng().flat(84.0, 90.0) : rng().flat(-6.0, 6.0);
+        double maxDec = clampDec(minDec + rng().flat(0.0, 2.0));
+        if (i % 10 == 1) {
+            boxes.push_back(RectangularRegion(0.0, 360.0, minDec, maxDec));
+        } else {
+            boxes.push_back(RectangularRegion(minRa < 0.0 ? minRa + 360.0 : minRa,
+                                              maxRa < 0.0 ? maxRa + 360.0 : maxRa,
+                                              minDec, maxDec));
+        }
+    }
+    // boxes bounding circles that contain the north pole
+    boxes.push_back(RectangularRegion(123.0, 89.5, 1.0));
+    boxes.push_back(RectangularRegion(CircularRegion(0.0, 88.0, 2.5)));
+    BOOST_CHECK_EQUAL(boxes.back().getMinRa(), 0.0);
+    BOOST_CHECK_EQUAL(boxes.back().getMaxRa(), 360.0);
+    zi.boxQuery(boxes, results);
+    BOOST_CHECK_EQUAL(results.getNumQueries(), 202);
+    for (int q = 0; q < 202; ++q) {
+        verifyRegionQuery(zi, results, q, InsideBox(boxes[q]));
+    }
+    BOOST_CHECK(results._offsets[202] - results._offsets[201] > 1000);
+
+    zi.coneQuery(std::vector<Point>(), 1.0, results);
+    BOOST_CHECK_EQUAL(results.getNumQueries(), 0);
+    BOOST_CHECK(results._entries.empty());
+}
@@ -0,0 +1,511 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+/**
+ * @file
+ * @brief   Tests whether the object zone index maintained incrementally across a sequence
+ *          of overlapping visits matches an index rebuilt from scratch for every visit, and
+ *          whether matching against objects indexed at their catalog positions (lazy proper
+ *          motion correction) produces the same matches as matching against proper motion
+ *          corrected positions.
+ *
+ * @ingroup associate
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "boost/tuple/tuple.hpp"
+#include "boost/tuple/tuple_comparison.hpp"
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE ObjectIndexTest
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/afw/math/Random.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/ChunkManager.h"
+#include "lsst/ap/Match.h"
+#include "lsst/ap/Object.h"
+#include "lsst/ap/ObjectIndex.h"
+#include "lsst/ap/SpatialUtil.h"
+#include "lsst/ap/Time.h"
+
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+typedef SharedObjectChunkManager::ObjectChunk ObjChunk;
+
+
+namespace {
+
+int const ZONES_PER_DEGREE = 60;
+int const ZONES_PER_STRIPE = 21;
+int const MAX_ENTRIES_PER_ZONE = 1024;
+double const EPOCH = 54000.0;        // MJD
+double const MAX_EPOCH_DRIFT = 30.0; // days
+double const RADIUS = 1.0/3600.0;    // degrees
+
+/// (object id, scaled ra, scaled dec, index of the object in its chunk)
+typedef boost::tuple<boost::int64_t, boost::uint32_t, boost::int32_t, int> EntryKey;
+
+
+/** @brief  Simulates the object catalog on disk, and the visits of an association pipeline. */
+class VisitSimulator {
+public :
+    VisitSimulator(SharedObjectChunkManager & mgr) :
+        _mgr(mgr),
+        _zsc(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE),
+        _rng(Random::MT19937, 1),
+        _catalog(),
+        _visitId(0),
+        _nextObjectId(1)
+    {
+        // 2000 objects per square degree in ra [10, 18), dec [0.5, 2.5), some with proper motions
+        for (int i = 0; i < 32000; ++i) {
+            Object obj;
+            std::memset(&obj, 0, sizeof(Object));
+            obj._objectId = _nextObjectId++;
+            obj._ra   = _rng.flat(10.0, 18.0);
+            obj._decl = _rng.flat(0.5, 2.5);
+            if (i % 4 == 0) {
+                obj._muRa   = _rng.flat(-500.0, 500.0);
+                obj._muDecl = _rng.flat(-500.0, 500.0);
+            }
+            _catalog[_zsc.radecToChunk(obj._ra, obj._decl)].push_back(obj);
+        }
+    }
+
+    ~VisitSimulator() {
+        if (_visitId > 0) {
+            _mgr.endVisit(_visitId, false);
+        }
+    }
+
+    ZoneStripeChunkDecomposition const & getDecomposition() const {
+        return _zsc;
+    }
+
+    /**
+     * Starts a visit to the box with the given minimum ra (1 degree wide, covering declinations
+     * [1, 2]), ends the previous visit (rolling back its changes if requested) and returns the
+     * chunks of the new visit.
+     */
+    std::vector<ObjChunk> nextVisit(double const ra, bool const rollback) {
+        std::set<int> ids;
+        for (double r = ra; r <= ra + 1.0; r += 0.05) {
+            for (double d = 1.0; d <= 2.0; d += 0.05) {
+                ids.insert(_zsc.radecToChunk(r, d));
+            }
+        }
+        std::vector<int> chunkIds(ids.begin(), ids.end());
+        std::vector<ObjChunk> toRead;
+        std::vector<ObjChunk> toWaitFor;
+        int const visitId = _visitId + 1;
+        _mgr.registerVisit(visitId);
+        _mgr.startVisit(toRead, toWaitFor, visitId, chunkIds);
+        read(toRead);
+        if (_visitId > 0) {
+            _mgr.endVisit(_visitId, rollback);
+        }
+        _visitId = visitId;
+        TimeSpec deadline;
+        deadline.systemTime();
+        deadline += 5.0;
+        _mgr.waitForOwnership(toRead, toWaitFor, visitId, deadline);
+        read(toRead);
+        std::vector<ObjChunk> chunks;
+        _mgr.getChunks(chunks, chunkIds);
+        BOOST_REQUIRE_EQUAL(chunks.size(), chunkIds.size());
+        return chunks;
+    }
+
+    /// Appends copies (with new ids) of the first @a n objects of a chunk, as NewObjectCreator would.
+    void append(ObjChunk & chunk, int const n) {
+        std::vector<Object> & objects = _catalog[static_cast<int>(chunk.getId())];
+        for (int i = 0; i < n && i < static_cast<int>(objects.size()); ++i) {
+            Object obj(objects[i]);
+            obj._objectId = _nextObjectId++;
+            chunk.insert(obj);
+        }
+    }
+
+    int getVisitId() const {
+        return _visitId;
+    }
+
+private :
+    SharedObjectChunkManager & _mgr;
+    ZoneStripeChunkDecomposition _zsc;
+    Random _rng;
+    std::map<int, std::vector<Object> > _catalog;
+    int _visitId;
+    boost::int64_t _nextObjectId;
+
+    /// "Reads" chunks from the catalog.
+    void read(std::vector<ObjChunk> & chunks) {
+        for (std::vector<ObjChunk>::iterator c = chunks.begin(); c != chunks.end(); ++c) {
+            c->clear();
+            std::vector<Object> const & objects = _catalog[static_cast<int>(c->getId())];
+            for (std::vector<Object>::const_iterator o = objects.begin(); o != objects.end(); ++o) {
+                c->insert(*o);
+            }
+            c->setUsable();
+        }
+    }
+};
+
+
+/**
+ * Checks that the zones of @a index are sorted and returns the sorted list of index entries.
+ * If a visit id is given, also checks that entries point to chunk instances owned by that
+ * visit (buildZoneIndex() leaves entries pointing to temporary chunk instances).
+ */
+std::vector<EntryKey> getEntries(detail::ObjectIndex & index, int const visitId = -1) {
+    std::vector<EntryKey> entries;
+    for (int z = index.getMinZone(); z <= index.getMaxZone(); ++z) {
+        detail::ObjectIndex::Zone const * zone = index.getZone(z);
+        for (int i = 0; i < zone->size(); ++i) {
+            detail::ObjectEntry const & e = zone->_entries[i];
+            if (i > 0) {
+                BOOST_CHECK(zone->_entries[i - 1]._ra <= e._ra);
+            }
+            if (visitId >= 0) {
+                BOOST_CHECK_EQUAL(e._chunk->getVisitId(), visitId);
+                BOOST_CHECK(&e._chunk->get(e._index) == e._data);
+            }
+            entries.push_back(EntryKey(e._data->getId(), e._ra, e._dec, e._index));
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+
+/// Checks that the incremental index matches an index rebuilt from scratch.
+void checkIndex(
+    detail::IncrementalObjectIndex & incremental,
+    std::vector<ObjChunk> const & chunks,
+    int const visitId,
+    double const epoch,
+    double const maxLazyMu
+) {
+    detail::ObjectIndex full(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE);
+    double const lazyMu = detail::buildZoneIndex(full, chunks, epoch, maxLazyMu);
+    std::vector<EntryKey> const expected = getEntries(full);
+    std::vector<EntryKey> const actual = getEntries(incremental.getIndex(), visitId);
+    BOOST_CHECK(!expected.empty());
+    BOOST_CHECK(actual == expected);
+    // the incremental index tracks an upper bound (entries may have been removed since)
+    BOOST_CHECK(incremental.getLazyProperMotion() >= lazyMu);
+}
+
+
+/**
+ * Runs a sequence of overlapping visits through an incremental object index. Chunks enter
+ * and leave the FOV, objects are appended to retained chunks, a visit is rolled back, and
+ * finally the visit epoch drifts far enough to force a full rebuild.
+ */
+void runVisits(double const maxLazyMu, bool const autoTuneZoneHeight) {
+    SharedObjectChunkManager mgr("test");
+    // unlink the shared memory object immediately (it remains available until the test process exits)
+    SharedObjectChunkManager::destroyInstance("test");
+    VisitSimulator sim(mgr);
+    detail::IncrementalObjectIndex incremental(
+        sim.getDecomposition(), MAX_EPOCH_DRIFT, maxLazyMu, autoTuneZoneHeight, "run");
+
+    int zonesPerDegree = 0;
+    for (int v = 0; v < 20; ++v) {
+        // the FOV moves back and forth, so chunks leave it and later re-enter it
+        double const ra = 10.0 + 0.3*(v < 10 ? v : 20 - v);
+        bool const rollback = (v == 7);
+        std::vector<ObjChunk> chunks = sim.nextVisit(ra, rollback);
+        double const epoch = (v < 19) ? EPOCH : EPOCH + 2.0*MAX_EPOCH_DRIFT;
+        incremental.update(chunks, epoch, RADIUS);
+        checkIndex(incremental, chunks, sim.getVisitId(), epoch, maxLazyMu);
+        if (autoTuneZoneHeight) {
+            int const zpd = incremental.getIndex().getDecomposition().getZonesPerDegree();
+            if (v == 0 || v == 19) {
+                detail::ObjectIndex tuned(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE);
+                detail::tuneZoneIndex(tuned, chunks, sim.getDecomposition(), RADIUS);
+                BOOST_CHECK_EQUAL(zpd, tuned.getDecomposition().getZonesPerDegree());
+                zonesPerDegree = zpd;
+            } else {
+                // the zone height only changes on full rebuilds
+                BOOST_CHECK_EQUAL(zpd, zonesPerDegree);
+            }
+        }
+        // append objects to a couple of chunks; they are rolled back at the end of visit 7
+        sim.append(chunks[0], 10);
+        sim.append(chunks[chunks.size()/2], 600);
+    }
+}
+
+// -- Lazy proper motion correction ----------------
+
+/// A stand-in for difference sources: matching only needs an id and a position.
+struct Source {
+    boost::int64_t _id;
+    double _ra;
+    double _dec;
+
+    Source(boost::int64_t const id, double const ra, double const dec) :
+        _id(id), _ra(ra), _dec(dec) {}
+
+    boost::int64_t getId() const { return _id; }
+    double getRa() const { return _ra; }
+    double getDec() const { return _dec; }
+};
+
+struct SourceChunk {
+    typedef Source Entry;
+};
+
+typedef ZoneEntry<SourceChunk> SourceEntry;
+typedef ZoneIndex<SourceEntry> SourceIndex;
+typedef MatchCollector<SourceEntry, detail::ObjectEntry> ObjectMatchCollector;
+
+/// Maps (source id, object id) match pairs to match distances (radians).
+typedef std::map<std::pair<boost::int64_t, boost::int64_t>, double> MatchMap;
+
+/// 10 years after the epoch of object catalog positions
+double const PM_EPOCH = Object().getEpoch() + 3652.5;
+
+
+/// Returns an object with the given id, catalog position and proper motion (mas/year).
+Object makeObject(
+    boost::int64_t const id,
+    double const ra,
+    double const dec,
+    double const muRa,
+    double const muDecl
+) {
+    Object obj;
+    std::memset(&obj, 0, sizeof(Object));
+    obj._objectId = id;
+    obj._ra = ra;
+    obj._decl = dec;
+    obj._muRa = muRa;
+    obj._muDecl = muDecl;
+    return obj;
+}
+
+
+/** @brief  A visit to the chunks containing a list of objects, ended on destruction. */
+class ObjectVisit {
+public :
+    ObjectVisit(SharedObjectChunkManager & mgr, int const visitId, std::vector<Object> const & objects) :
+        _mgr(mgr),
+        _visitId(visitId),
+        _chunks()
+    {
+        ZoneStripeChunkDecomposition zsc(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE);
+        std::map<int, std::vector<Object> > byChunk;
+        for (std::vector<Object>::const_iterator o = objects.begin(); o != objects.end(); ++o) {
+            byChunk[zsc.radecToChunk(o->getRa(), o->getDec())].push_back(*o);
+        }
+        std::vector<int> chunkIds;
+        typedef std::map<int, std::vector<Object> >::const_iterator ChunkIterator;
+        for (ChunkIterator i = byChunk.begin(); i != byChunk.end(); ++i) {
+            chunkIds.push_back(i->first);
+        }
+        std::vector<ObjChunk> toWaitFor;
+        _mgr.registerVisit(visitId);
+        _mgr.startVisit(_chunks, toWaitFor, visitId, chunkIds);
+        BOOST_REQUIRE_EQUAL(_chunks.size(), chunkIds.size());
+        for (std::vector<ObjChunk>::iterator c = _chunks.begin(); c != _chunks.end(); ++c) {
+            std::vector<Object> const & objs = byChunk[static_cast<int>(c->getId())];
+            for (std::vector<Object>::const_iterator o = objs.begin(); o != objs.end(); ++o) {
+                c->insert(*o);
+            }
+            c->setUsable();
+        }
+    }
+
+    ~ObjectVisit() {
+        _mgr.endVisit(_visitId, false);
+    }
+
+    std::vector<ObjChunk> const & getChunks() const {
+        return _chunks;
+    }
+
+private :
+    SharedObjectChunkManager & _mgr;
+    int _visitId;
+    std::vector<ObjChunk> _chunks;
+};
+
+
+/**
+ * Matches sources against objects at PM_EPOCH, as matchDiaSources() does. If @a maxLazyMu
+ * is non-negative, objects with small enough proper motions are indexed at their catalog
+ * positions; the match radius is then padded by their largest displacement (unless
+ * @a pad is @c false) and candidates are re-tested against proper motion corrected
+ * positions (if @a retest is @c true).
+ */
+MatchMap matchObjects(
+    std::vector<ObjChunk> const & chunks,
+    std::vector<Source> & sources,
+    double const maxLazyMu,
+    bool const pad,
+    bool const retest
+) {
+    detail::ObjectIndex objIndex(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE);
+    double const lazyMu = detail::buildZoneIndex(objIndex, chunks, PM_EPOCH, maxLazyMu);
+    SourceIndex srcIndex(ZONES_PER_DEGREE, ZONES_PER_STRIPE, MAX_ENTRIES_PER_ZONE);
+    srcIndex.setDecBounds(-90.0, 90.0);
+    for (std::vector<Source>::iterator s = sources.begin(); s != sources.end(); ++s) {
+        srcIndex.insert(s->getRa(), s->getDec(), &*s, 0, 0);
+    }
+    srcIndex.sort();
+
+    double const padding = pad ? detail::maxProperMotionDisplacement(lazyMu, PM_EPOCH) : 0.0;
+    PassthroughFilter<SourceEntry> sf;
+    PassthroughFilter<detail::ObjectEntry> of;
+    ObjectMatchCollector collector;
+    distanceMatch(srcIndex, objIndex, RADIUS + padding, sf, of, collector);
+    std::vector<ObjectMatchCollector::Record> records;
+    collector.collect(records, true);
+    if (retest && padding > 0.0) {
+        detail::retestLazyProperMotionMatches(records, radians(RADIUS), PM_EPOCH, maxLazyMu);
+    }
+    MatchMap matches;
+    for (std::vector<ObjectMatchCollector::Record>::const_iterator r = records.begin();
+         r != records.end(); ++r) {
+        matches[std::make_pair(r->_first->_data->getId(), r->_second->_data->getId())] = r->_distance;
+    }
+    return matches;
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(incrementalIndexTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: incremental index vs. full rebuilds");
+    runVisits(-1.0, false);
+}
+
+
+BOOST_AUTO_TEST_CASE(lazyProperMotionIncrementalIndexTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: incremental index with lazy proper motion correction");
+    runVisits(400.0, false);
+}
+
+
+BOOST_AUTO_TEST_CASE(tunedIncrementalIndexTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: incremental index with zone height tuning");
+    runVisits(-1.0, true);
+}
+
+
+BOOST_AUTO_TEST_CASE(highProperMotionMatchTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: lazy proper motion correction of a fast moving object");
+    SharedObjectChunkManager mgr("test");
+    SharedObjectChunkManager::destroyInstance("test");
+    // the object moves 100 arcsec in 10 years
+    std::vector<Object> objects;
+    objects.push_back(makeObject(1, 14.0, 1.5, 0.0, 10000.0));
+    ObjectVisit visit(mgr, 1, objects);
+    std::vector<ObjChunk> const & chunks = visit.getChunks();
+    std::pair<double, double> const pos = detail::correctProperMotion(objects[0], PM_EPOCH);
+    std::vector<Source> sources;
+    sources.push_back(Source(1, pos.first, pos.second + 0.3/3600.0));
+
+    // the object matches at its corrected position ...
+    MatchMap const eager = matchObjects(chunks, sources, -1.0, true, true);
+    BOOST_REQUIRE_EQUAL(eager.size(), static_cast<std::size_t>(1));
+    BOOST_CHECK(eager.count(std::make_pair(boost::int64_t(1), boost::int64_t(1))) == 1);
+    BOOST_CHECK_CLOSE(degrees(eager.begin()->second)*3600.0, 0.3, 1e-3);
+    MatchMap const lazy = matchObjects(chunks, sources, 20000.0, true, true);
+    BOOST_REQUIRE_EQUAL(lazy.size(), static_cast<std::size_t>(1));
+    BOOST_CHECK(lazy.begin()->first == eager.begin()->first);
+    BOOST_CHECK(std::fabs(lazy.begin()->second - eager.begin()->second) < 1e-12);
+    // ... but not at its catalog position
+    MatchMap const unpadded = matchObjects(chunks, sources, 20000.0, false, false);
+    BOOST_CHECK(unpadded.empty());
+}
+
+
+BOOST_AUTO_TEST_CASE(lazyProperMotionRetestTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: re-testing of lazy proper motion match candidates");
+    SharedObjectChunkManager mgr("test");
+    SharedObjectChunkManager::destroyInstance("test");
+    std::vector<Object> objects;
+    objects.push_back(makeObject(1, 15.0, 1.5, 0.0, 10000.0));
+    ObjectVisit visit(mgr, 1, objects);
+    std::vector<ObjChunk> const & chunks = visit.getChunks();
+    // the source is at the catalog position of the object, 100 arcsec from its corrected position
+    std::vector<Source> sources;
+    sources.push_back(Source(1, 15.0, 1.5));
+
+    MatchMap const candidates = matchObjects(chunks, sources, 20000.0, true, false);
+    BOOST_REQUIRE_EQUAL(candidates.size(), static_cast<std::size_t>(1));
+    BOOST_CHECK(candidates.begin()->second < radians(RADIUS));
+    BOOST_CHECK(matchObjects(chunks, sources, 20000.0, true, true).empty());
+    BOOST_CHECK(matchObjects(chunks, sources, -1.0, true, true).empty());
+}
+
+
+BOOST_AUTO_TEST_CASE(zeroProperMotionMatchTest) {
+    BOOST_TEST_MESSAGE("    - Object index test: lazy vs. eager proper motion correction");
+    SharedObjectChunkManager mgr("test");
+    SharedObjectChunkManager::destroyInstance("test");
+    Random rng(Random::MT19937, 2);
+    // mostly objects without proper motion, and some slowly moving ones (so that the match
+    // radius is padded and candidates are re-tested)
+    std::vector<Object> objects;
+    std::vector<Source> sources;
+    for (int i = 0; i < 4000; ++i) {
+        double const mu = (i % 8 == 0) ? 50.0 : 0.0;
+        objects.push_back(makeObject(i + 1, rng.flat(12.0, 14.0), rng.flat(1.0, 2.0),
+                                     rng.flat(-mu, mu), rng.flat(-mu, mu)));
+        std::pair<double, double> const pos = detail::correctProperMotion(objects.back(), PM_EPOCH);
+        sources.push_back(Source(i + 1, pos.first + rng.flat(-1.0, 1.0)/3600.0,
+                                 pos.second + rng.flat(-1.0, 1.0)/3600.0));
+    }
+    ObjectVisit visit(mgr, 1, objects);
+    std::vector<ObjChunk> const & chunks = visit.getChunks();
+
+    MatchMap const eager = matchObjects(chunks, sources, -1.0, true, true);
+    MatchMap const lazy = matchObjects(chunks, sources, 100.0, true, true);
+    BOOST_CHECK(!eager.empty());
+    BOOST_REQUIRE_EQUAL(lazy.size(), eager.size());
+    for (MatchMap::const_iterator e = eager.begin(), l = lazy.begin(); e != eager.end(); ++e, ++l) {
+        BOOST_CHECK(e->first == l->first);
+        if (objects[e->first.second - 1].getMuRa() == 0.0 &&
+            objects[e->first.second - 1].getMuDecl() == 0.0) {
+            BOOST_CHECK_EQUAL(e->second, l->second);
+        } else {
+            BOOST_CHECK(std::fabs(e->second - l->second) < 1e-12);
+        }
+    }
+}
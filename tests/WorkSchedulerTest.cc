@@ -0,0 +1,175 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Tests for the WorkScheduler class.
+ *
+ * @ingroup associate
+ */
+
+#if LSST_AP_HAVE_OPEN_MP
+#   include <omp.h>
+#endif
+
+#include <vector>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE WorkSchedulerTest
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/ap/WorkScheduler.h"
+
+using namespace lsst::ap;
+
+
+namespace {
+
+// Drains a scheduler using a single thread per loop iteration (round robin), and checks
+// that every item is handed out exactly once in batches of adjacent items.
+void checkCoverage(WorkScheduler & ws, int const numItems, int const numActive) {
+    std::vector<int> seen(numItems, 0);
+    std::vector<bool> done(numActive, false);
+    int numDone = 0;
+    while (numDone < numActive) {
+        for (int t = 0; t < numActive; ++t) {
+            if (done[t]) {
+                continue;
+            }
+            int begin = -1;
+            int end   = -1;
+            if (!ws.next(t, begin, end)) {
+                done[t] = true;
+                ++numDone;
+                continue;
+            }
+            BOOST_CHECK(begin >= 0 && begin < end && end <= numItems);
+            for (int i = begin; i < end; ++i) {
+                ++seen[i];
+            }
+        }
+    }
+    for (int i = 0; i < numItems; ++i) {
+        BOOST_CHECK_MESSAGE(seen[i] == 1, "item " << i << " handed out " << seen[i] << " times");
+    }
+}
+
+} // end of anonymous namespace
+
+
+BOOST_AUTO_TEST_CASE(wsTest1) {
+    BOOST_TEST_MESSAGE("    - WorkScheduler coverage test");
+    std::vector<double> costs;
+    for (int i = 0; i < 1000; ++i) {
+        // a dense cluster in the middle of an otherwise sparse item range
+        costs.push_back(i >= 450 && i < 550 ? 1000.0 : 1.0);
+    }
+    for (int nt = 1; nt <= 8; ++nt) {
+        WorkScheduler ws(costs, nt);
+        checkCoverage(ws, 1000, nt);
+    }
+    // fewer active threads than scheduled threads forces stealing
+    WorkScheduler ws(costs, 8);
+    checkCoverage(ws, 1000, 3);
+    // zero costs fall back to uniform batches
+    std::vector<double> zeros(100, 0.0);
+    WorkScheduler wz(zeros, 4);
+    BOOST_CHECK(wz.getNumBatches() > 1);
+    checkCoverage(wz, 100, 4);
+    // no work at all
+    std::vector<double> none;
+    WorkScheduler wn(none, 4);
+    checkCoverage(wn, 0, 4);
+}
+
+
+BOOST_AUTO_TEST_CASE(wsTest2) {
+    BOOST_TEST_MESSAGE("    - WorkScheduler balance test");
+    std::vector<double> costs;
+    for (int i = 0; i < 1000; ++i) {
+        costs.push_back(i < 100 ? 100.0 : 1.0);
+    }
+    int const nt = 4;
+    WorkScheduler ws(costs, nt);
+    // a single thread should only receive its own share of the work before stealing,
+    // i.e. the batches from the expensive start of the item range are split between threads
+    double total = 0.0;
+    for (int i = 0; i < 1000; ++i) {
+        total += costs[i];
+    }
+    double own = 0.0;
+    int begin = 0;
+    int end   = 0;
+    int expectedBegin = 0;
+    while (ws.next(0, begin, end) && begin == expectedBegin) {
+        for (int i = begin; i < end; ++i) {
+            own += costs[i];
+        }
+        expectedBegin = end;
+    }
+    BOOST_CHECK(own < 0.5*total);
+    BOOST_CHECK(own > 0.1*total);
+}
+
+
+BOOST_AUTO_TEST_CASE(wsTest3) {
+    BOOST_TEST_MESSAGE("    - WorkScheduler parallel test");
+    std::vector<double> costs(10000, 1.0);
+    int numThreads = 1;
+#if LSST_AP_HAVE_OPEN_MP
+    numThreads = omp_get_max_threads();
+#endif
+    WorkScheduler ws(costs, numThreads);
+    std::vector<int> seen(costs.size(), 0);
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel default(shared)
+#endif
+    {
+        int thread = 0;
+#if LSST_AP_HAVE_OPEN_MP
+        thread = omp_get_thread_num();
+#endif
+        int begin = 0;
+        int end   = 0;
+        while (ws.next(thread, begin, end)) {
+            for (int i = begin; i < end; ++i) {
+                ++seen[i];
+            }
+            ws.addBusyTime(thread, 1.0);
+        }
+    }
+    for (std::size_t i = 0; i < seen.size(); ++i) {
+        BOOST_CHECK_EQUAL(seen[i], 1);
+    }
+    std::vector<double> busyTimes;
+    ws.getBusyTimes(busyTimes);
+    BOOST_CHECK_EQUAL(static_cast<int>(busyTimes.size()), numThreads);
+    double sum = 0.0;
+    for (int t = 0; t < numThreads; ++t) {
+        sum += busyTimes[t];
+    }
+    BOOST_CHECK_EQUAL(static_cast<int>(sum), ws.getNumBatches());
+}
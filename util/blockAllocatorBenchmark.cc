@@ -0,0 +1,223 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Benchmarks the mutex based shared memory block allocator against the lock-free one.
+ *
+ * For each requested number of processes, an allocator is created in an anonymous shared
+ * mapping and that many processes are forked. Each repeatedly allocates a batch of blocks
+ * and frees it again. The aggregate number of allocate/free pairs per second is reported
+ * for both allocators.
+ *
+ * @ingroup associate
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/ChunkManagerImpl.cc"
+#include "lsst/ap/Time.h"
+
+using namespace lsst::ap;
+
+
+namespace {
+
+// the allocators never touch block contents, so a small datum keeps the mapping small
+struct BenchDatum {
+    boost::uint64_t _data;
+};
+
+// same pool geometry as the object chunk store
+struct BenchTraits {
+    enum {
+        ENTRIES_PER_BLOCK_LOG2 = DataTraits<Object>::ENTRIES_PER_BLOCK_LOG2,
+        MAX_BLOCKS_PER_CHUNK   = DataTraits<Object>::MAX_BLOCKS_PER_CHUNK,
+        MAX_CHUNKS_PER_FOV     = DataTraits<Object>::MAX_CHUNKS_PER_FOV,
+        NUM_BLOCKS             = DataTraits<Object>::NUM_BLOCKS
+    };
+};
+
+
+/**
+ * Runs @a numOps allocate/free pairs of @a batchSize blocks in each of @a numProcs forked
+ * processes against an allocator of the given type, and returns the elapsed wall-clock time.
+ */
+template <typename AllocatorT>
+double run(int const numProcs, int const numOps, int const batchSize) {
+    std::size_t const blockSize = (sizeof(BenchDatum) + sizeof(ChunkEntryFlag)) <<
+                                  BenchTraits::ENTRIES_PER_BLOCK_LOG2;
+    std::size_t const bitmap = (sizeof(AllocatorT) + 63) & ~static_cast<std::size_t>(63);
+    std::size_t const header = (bitmap + AllocatorT::bitmapSize(BenchTraits::NUM_BLOCKS) + 4095) &
+                               ~static_cast<std::size_t>(4095);
+    std::size_t const size = header + blockSize*BenchTraits::NUM_BLOCKS;
+    void * mem = ::mmap(0, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("failed to create shared memory mapping");
+    }
+    AllocatorT * allocator = new (mem) AllocatorT(static_cast<unsigned char *>(mem), bitmap, header,
+                                                  detail::ChunkStoreLayout::fromTraits<BenchTraits>());
+
+    // children block on a pipe until the parent closes it
+    int fds[2];
+    if (::pipe(fds) != 0) {
+        throw std::runtime_error("failed to create pipe");
+    }
+    std::vector<pid_t> children;
+    for (int p = 0; p < numProcs; ++p) {
+        pid_t const pid = ::fork();
+        if (pid < 0) {
+            throw std::runtime_error("fork() failed");
+        } else if (pid == 0) {
+            char c;
+            ::close(fds[1]);
+            if (::read(fds[0], &c, 1) != 0) {
+                ::_exit(EXIT_FAILURE);
+            }
+            std::size_t offsets[BenchTraits::MAX_BLOCKS_PER_CHUNK];
+            try {
+                for (int i = 0; i < numOps; ++i) {
+                    allocator->allocate(offsets, batchSize);
+                    allocator->free(offsets, batchSize);
+                }
+            } catch (...) {
+                ::_exit(EXIT_FAILURE);
+            }
+            ::_exit(EXIT_SUCCESS);
+        }
+        children.push_back(pid);
+    }
+    ::close(fds[0]);
+    Stopwatch watch(true);
+    ::close(fds[1]);
+    bool ok = true;
+    for (std::vector<pid_t>::const_iterator i = children.begin(); i != children.end(); ++i) {
+        int status = 0;
+        ok = ::waitpid(*i, &status, 0) == *i && WIFEXITED(status) &&
+             WEXITSTATUS(status) == EXIT_SUCCESS && ok;
+    }
+    watch.stop();
+    ok = ok && allocator->getNumFree() == BenchTraits::NUM_BLOCKS;
+    allocator->~AllocatorT();
+    ::munmap(mem, size);
+    if (!ok) {
+        throw std::runtime_error("benchmark process failed");
+    }
+    return watch.seconds();
+}
+
+typedef detail::BlockAllocator<SharedMutex, BenchDatum, BenchTraits> LockingAllocator;
+#if LSST_AP_HAVE_SYNC_BUILTINS
+typedef detail::LockFreeBlockAllocator<BenchDatum, BenchTraits> LockFreeAllocator;
+#endif
+
+} // end of anonymous namespace
+
+
+int main(int argc, char * argv[]) {
+
+    using namespace boost::program_options;
+
+    try {
+
+        std::vector<int> procs;
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "print usage help")
+            ("ops,o", value<int>()->default_value(200000),
+                "the number of allocate/free pairs per process")
+            ("batch,b", value<int>()->default_value(8),
+                "the number of blocks allocated at once")
+            ("trials,t", value<int>()->default_value(3),
+                "the number of timing trials per process count")
+            ("processes,p", value<std::vector<int> >(&procs)->multitoken(),
+                "process counts to benchmark (default: 1, 2, 4 and 8)");
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        if (procs.empty()) {
+            procs.push_back(1);
+            procs.push_back(2);
+            procs.push_back(4);
+            procs.push_back(8);
+        }
+        int const numOps = vm["ops"].as<int>();
+        int const batchSize = vm["batch"].as<int>();
+        int const numTrials = vm["trials"].as<int>();
+        if (batchSize < 1 || batchSize > BenchTraits::MAX_BLOCKS_PER_CHUNK) {
+            std::cerr << "batch size must be between 1 and " <<
+                         static_cast<int>(BenchTraits::MAX_BLOCKS_PER_CHUNK) << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::cout << "ops per process: " << numOps << ", batch size: " << batchSize <<
+                     ", trials: " << numTrials << std::endl;
+#if LSST_AP_HAVE_SYNC_BUILTINS
+        std::cout << "processes\tmutex (ops/sec)\tlock-free (ops/sec)\tspeedup" << std::endl;
+#else
+        std::cout << "processes\tmutex (ops/sec)" << std::endl;
+#endif
+        for (std::vector<int>::const_iterator i = procs.begin(); i != procs.end(); ++i) {
+            double best[2] = { 1e300, 1e300 };
+            for (int trial = 0; trial < numTrials; ++trial) {
+                best[0] = std::min(best[0], run<LockingAllocator>(*i, numOps, batchSize));
+#if LSST_AP_HAVE_SYNC_BUILTINS
+                best[1] = std::min(best[1], run<LockFreeAllocator>(*i, numOps, batchSize));
+#endif
+            }
+            double const total = static_cast<double>(numOps)*(*i);
+            std::cout << *i << '\t' << total/best[0];
+#if LSST_AP_HAVE_SYNC_BUILTINS
+            std::cout << '\t' << total/best[1] << '\t' << best[0]/best[1];
+#endif
+            std::cout << std::endl;
+        }
+
+    } catch (std::exception & except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
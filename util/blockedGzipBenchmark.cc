@@ -0,0 +1,218 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+
+/**
+ * @file
+ * @brief   Compares single stream gzip compression against blocked gzip compression
+ *          with a varying number of threads.
+ *
+ * A version 1 chunk file worth of randomly positioned objects is compressed with a
+ * CompressedFileWriter, then with a BlockedCompressedFileWriter using 1, 2, 4, ... threads
+ * (up to the requested maximum). For each, the compressed size and the best write and read
+ * times are reported. Files are read from the page cache, so read timings reflect
+ * decompression rather than disk throughput.
+ *
+ * @ingroup associate
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if LSST_AP_HAVE_OPEN_MP
+#   include <omp.h>
+#endif
+
+#include "boost/program_options.hpp"
+
+#include "lsst/afw/math/Random.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/Object.h"
+#include "lsst/ap/Time.h"
+#include "lsst/ap/io/FileIo.h"
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+
+namespace {
+
+void generateObjects(std::vector<Object> & objects, int const numObjects, unsigned long const seed) {
+    Random rng(Random::MT19937, seed);
+    Object obj;
+    std::memset(&obj, 0, sizeof(Object));
+    objects.assign(numObjects, obj);
+    for (int i = 0; i < numObjects; ++i) {
+        objects[i]._objectId = i;
+        objects[i]._ra   = rng.flat(45.0, 46.0);
+        objects[i]._decl = rng.flat(0.0, 0.35);
+    }
+}
+
+
+/// Returns the size of the file written.
+long writeFile(io::SequentialWriter & writer, std::string const & name, std::vector<Object> const & objects) {
+    writer.write(reinterpret_cast<unsigned char const *>(&objects[0]), objects.size()*sizeof(Object));
+    writer.finish();
+    io::SequentialFileReader reader(name);
+    std::vector<unsigned char> buf(1 << 20);
+    long size = 0;
+    std::size_t nb;
+    while ((nb = reader.read(&buf[0], buf.size())) > 0) {
+        size += static_cast<long>(nb);
+    }
+    return size;
+}
+
+
+void readFile(io::SequentialReader & reader, std::vector<Object> & objects) {
+    unsigned char * dst = reinterpret_cast<unsigned char *>(&objects[0]);
+    std::size_t len = objects.size()*sizeof(Object);
+    while (len > 0) {
+        std::size_t const nb = reader.read(dst, len);
+        if (nb == 0) {
+            throw std::runtime_error("unexpected end of file");
+        }
+        dst += nb;
+        len -= nb;
+    }
+}
+
+
+/// Times writing and reading a file with @a numThreads threads, or a single gzip stream if 0.
+void runBenchmark(
+    std::string const & name,
+    int const numThreads,
+    int const numTrials,
+    std::size_t const blockSize,
+    std::vector<Object> const & objects
+) {
+    std::vector<Object> loaded(objects.size());
+    double best[2] = { 1e300, 1e300 };
+    long size = 0;
+    for (int trial = 0; trial < numTrials; ++trial) {
+        Stopwatch watch(true);
+        if (numThreads == 0) {
+            io::CompressedFileWriter writer(name, true, blockSize);
+            size = writeFile(writer, name, objects);
+        } else {
+            io::BlockedCompressedFileWriter writer(name, true, blockSize, numThreads);
+            size = writeFile(writer, name, objects);
+        }
+        watch.stop();
+        best[0] = std::min(best[0], watch.seconds());
+        watch.start();
+        if (numThreads == 0) {
+            io::CompressedFileReader reader(name, blockSize);
+            readFile(reader, loaded);
+        } else {
+            io::BlockedCompressedFileReader reader(name, numThreads);
+            readFile(reader, loaded);
+        }
+        watch.stop();
+        best[1] = std::min(best[1], watch.seconds());
+    }
+    ::unlink(name.c_str());
+    if (std::memcmp(&loaded[0], &objects[0], objects.size()*sizeof(Object)) != 0) {
+        throw std::runtime_error("decompressed data does not match the original");
+    }
+    if (numThreads == 0) {
+        std::cout << "gzip\t-";
+    } else {
+        std::cout << "blocked gzip\t" << numThreads;
+    }
+    std::cout << '\t' << size << '\t' << best[0] << '\t' << best[1] << std::endl;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char * argv[]) {
+
+    using namespace boost::program_options;
+
+    try {
+
+        int maxThreads = 1;
+#if LSST_AP_HAVE_OPEN_MP
+        maxThreads = ::omp_get_max_threads();
+#endif
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "print usage help")
+            ("objects,n", value<int>()->default_value(1000000),
+                "the number of objects to compress")
+            ("trials,t", value<int>()->default_value(3),
+                "the number of timing trials per configuration")
+            ("block-size,b", value<std::size_t>()->default_value(262144),
+                "the uncompressed block size (bytes)")
+            ("max-threads,m", value<int>()->default_value(maxThreads),
+                "the maximum number of threads to compress and decompress with")
+            ("seed,s", value<unsigned long>()->default_value(1),
+                "the random number generator seed")
+            ("directory,d", value<std::string>()->default_value("/tmp"),
+                "the directory to write files to");
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        int const numObjects = vm["objects"].as<int>();
+        int const numTrials  = vm["trials"].as<int>();
+        if (numObjects <= 0 || numTrials <= 0) {
+            std::cerr << "object and trial counts must be positive" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::vector<Object> objects;
+        generateObjects(objects, numObjects, vm["seed"].as<unsigned long>());
+        std::ostringstream name;
+        name << vm["directory"].as<std::string>() << "/blockedGzipBenchmark_" << ::getpid() << ".gz";
+        std::size_t const blockSize = vm["block-size"].as<std::size_t>();
+
+        std::cout << "objects: " << numObjects << ", trials: " << numTrials << std::endl;
+        std::cout << "format\tthreads\tsize (bytes)\twrite (sec)\tread (sec)" << std::endl;
+        runBenchmark(name.str(), 0, numTrials, blockSize, objects);
+        for (int t = 1; t <= vm["max-threads"].as<int>(); t *= 2) {
+            runBenchmark(name.str(), t, numTrials, blockSize, objects);
+        }
+
+    } catch (std::exception & except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+
+/**
+ * @file
+ * @brief   Compares the size and load time of chunk files in each chunk file format.
+ *
+ * A chunk worth of randomly positioned objects is generated and written in the order
+ * dumpObjects produces (1 arcminute declination zones, sorted by right ascension within
+ * each zone), with sequential ids and zero proper motions, parallaxes and radial velocities.
+ * The chunk is then written as a raw version 1 file, a gzipped version 1 file and a
+ * columnar version 2 file. For each, the file size and the best time taken to decode
+ * the file into memory are reported. Files are read from the page cache, so timings
+ * reflect decoding rather than disk throughput.
+ *
+ * @ingroup associate
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "boost/program_options.hpp"
+#include "boost/scoped_ptr.hpp"
+
+#include "lsst/afw/math/Random.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/Chunk.h"
+#include "lsst/ap/ChunkFormat.h"
+#include "lsst/ap/Object.h"
+#include "lsst/ap/Time.h"
+#include "lsst/ap/io/FileIo.h"
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+
+namespace {
+
+enum Format {
+    V1_RAW = 0,
+    V1_GZIP,
+    V2_COLUMNAR
+};
+
+char const * const FORMAT_NAMES[3] = { "v1 raw", "v1 gzip", "v2 columnar" };
+
+
+struct ZoneRaLess {
+    static int zone(Object const & o) {
+        return static_cast<int>(std::floor((o._decl + 90.0) * 60.0));
+    }
+    bool operator()(Object const & o1, Object const & o2) const {
+        int const z1 = zone(o1);
+        int const z2 = zone(o2);
+        return z1 < z2 || (z1 == z2 && o1._ra < o2._ra);
+    }
+};
+
+
+void generateObjects(
+    std::vector<Object> & objects,
+    int const numObjects,
+    double const width,
+    double const height,
+    unsigned long const seed
+) {
+    Random rng(Random::MT19937, seed);
+    Object obj;
+    std::memset(&obj, 0, sizeof(Object));
+    objects.assign(numObjects, obj);
+    for (int i = 0; i < numObjects; ++i) {
+        objects[i]._ra   = rng.flat(45.0, 45.0 + width);
+        objects[i]._decl = rng.flat(0.0, height);
+        for (int f = 0; f < Object::NUM_FILTERS; ++f) {
+            objects[i]._varProb[f] = static_cast<boost::int16_t>(rng.uniformInt(101));
+        }
+    }
+    std::sort(objects.begin(), objects.end(), ZoneRaLess());
+    for (int i = 0; i < numObjects; ++i) {
+        objects[i]._objectId = 1000000000LL + i;
+    }
+}
+
+
+void writeFile(std::string const & name, Format const format, std::vector<Object> const & objects) {
+    int const n = static_cast<int>(objects.size());
+    if (format == V2_COLUMNAR) {
+        io::SequentialFileWriter writer(name, true);
+        Object const * block = &objects[0];
+        ColumnarFormat<Object>::write(writer, &block, 30, n);
+        writer.finish();
+        return;
+    }
+    boost::scoped_ptr<io::SequentialWriter> writer;
+    if (format == V1_GZIP) {
+        writer.reset(new io::CompressedFileWriter(name, true));
+    } else {
+        writer.reset(new io::SequentialFileWriter(name, true));
+    }
+    BinChunkHeader header;
+    header._numRecords = n;
+    header._recordSize = sizeof(Object);
+    writer->write(reinterpret_cast<unsigned char const *>(&header), sizeof(BinChunkHeader));
+    writer->write(reinterpret_cast<unsigned char const *>(&objects[0]), n*sizeof(Object));
+    writer->finish();
+}
+
+
+void readFully(io::SequentialReader & reader, unsigned char * dst, std::size_t len) {
+    while (len > 0) {
+        std::size_t const nb = reader.read(dst, len);
+        if (nb == 0) {
+            throw std::runtime_error("unexpected end of chunk file");
+        }
+        dst += nb;
+        len -= nb;
+    }
+}
+
+
+/** Decodes a chunk file into @a objects, in the same way as ChunkRef::read. */
+void readFile(std::string const & name, Format const format, std::vector<Object> & objects) {
+    boost::scoped_ptr<io::SequentialReader> reader;
+    if (format == V1_GZIP) {
+        reader.reset(new io::CompressedFileReader(name));
+    } else {
+        reader.reset(new io::SequentialFileReader(name));
+    }
+    Object * block = &objects[0];
+    if (format == V2_COLUMNAR) {
+        ColumnarChunkHeader header;
+        readFully(*reader, reinterpret_cast<unsigned char *>(&header), sizeof(ColumnarChunkHeader));
+        ColumnarFormat<Object>::read(*reader, header, &block, 30);
+    } else {
+        BinChunkHeader header;
+        readFully(*reader, reinterpret_cast<unsigned char *>(&header), sizeof(BinChunkHeader));
+        readFully(*reader, reinterpret_cast<unsigned char *>(block),
+                  header._numRecords*sizeof(Object));
+    }
+}
+
+
+long fileSize(std::string const & name) {
+    io::SequentialFileReader reader(name);
+    std::vector<unsigned char> buf(1 << 20);
+    long size = 0;
+    std::size_t nb;
+    while ((nb = reader.read(&buf[0], buf.size())) > 0) {
+        size += static_cast<long>(nb);
+    }
+    return size;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char * argv[]) {
+
+    using namespace boost::program_options;
+
+    try {
+
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "print usage help")
+            ("objects,n", value<int>()->default_value(100000),
+                "the number of objects in the chunk")
+            ("trials,t", value<int>()->default_value(5),
+                "the number of timing trials per format")
+            ("width,w", value<double>()->default_value(1.0),
+                "the right ascension extent (deg) of the chunk")
+            ("height,e", value<double>()->default_value(0.35),
+                "the declination extent (deg) of the chunk")
+            ("seed,s", value<unsigned long>()->default_value(1),
+                "the random number generator seed")
+            ("directory,d", value<std::string>()->default_value("/tmp"),
+                "the directory to write chunk files to");
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        int const numObjects = vm["objects"].as<int>();
+        int const numTrials  = vm["trials"].as<int>();
+        if (numObjects <= 0 || numTrials <= 0) {
+            std::cerr << "object and trial counts must be positive" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::vector<Object> objects;
+        generateObjects(objects, numObjects, vm["width"].as<double>(), vm["height"].as<double>(),
+                        vm["seed"].as<unsigned long>());
+        std::vector<Object> loaded(numObjects);
+
+        std::cout << "objects: " << numObjects << ", trials: " << numTrials << std::endl;
+        std::cout << "format\tsize (bytes)\tbytes per object\tload (sec)" << std::endl;
+        for (int f = V1_RAW; f <= V2_COLUMNAR; ++f) {
+            std::ostringstream name;
+            name << vm["directory"].as<std::string>() << "/chunkFormatBenchmark_" <<
+                    ::getpid() << '_' << f << ".chunk";
+            writeFile(name.str(), static_cast<Format>(f), objects);
+            long const size = fileSize(name.str());
+            double best = 1e300;
+            for (int trial = 0; trial < numTrials; ++trial) {
+                Stopwatch watch(true);
+                readFile(name.str(), static_cast<Format>(f), loaded);
+                watch.stop();
+                best = std::min(best, watch.seconds());
+            }
+            ::unlink(name.str().c_str());
+            std::cout << FORMAT_NAMES[f] << '\t' << size << '\t' <<
+                         static_cast<double>(size)/numObjects << '\t' << best << std::endl;
+        }
+
+    } catch (std::exception & except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
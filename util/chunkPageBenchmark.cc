@@ -0,0 +1,276 @@
+// -*- lsst-c++ -*-
+
+/*
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+
+
+/**
+ * @file
+ * @brief   Benchmarks object zone index construction over shared memory chunks
+ *          backed by each kind of page.
+ *
+ * For every page mode, a child process maps a private shared memory chunk store,
+ * fills the chunks overlapping a square field of view with randomly positioned
+ * objects, and times building a zone index over them in the same way as the
+ * association pipeline does (inserting every chunk entry, then sorting zones).
+ * It also times a pass over the sorted index that dereferences every entry,
+ * which has the scattered access pattern of the subsequent match. Page modes
+ * the system cannot provide are reported as unavailable.
+ *
+ * @ingroup associate
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+#include "lsst/afw/math/Random.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/ChunkManager.h"
+#include "lsst/ap/Object.h"
+#include "lsst/ap/RectangularRegion.h"
+#include "lsst/ap/SpatialUtil.h"
+#include "lsst/ap/Time.h"
+#include "lsst/ap/ZoneTypes.h"
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+
+namespace {
+
+typedef SharedObjectChunkManager::ObjectChunk ObjectChunk;
+typedef ZoneEntry<ObjectChunk> Entry;
+typedef ZoneIndex<Entry>       Index;
+
+/// Keeps the compiler from discarding index scans.
+double volatile sScanSink = 0.0;
+
+
+struct BenchParams {
+    int _numObjects;
+    int _numTrials;
+    int _zonesPerDegree;
+    double _fovRadius;
+    unsigned long _seed;
+    std::string _hugetlbfsDir;
+};
+
+
+void fillChunks(
+    std::vector<ObjectChunk> & chunks,
+    ZoneStripeChunkDecomposition const & zsc,
+    RectangularRegion const & fov,
+    BenchParams const & params
+) {
+    std::map<int, int> slots;
+    for (std::vector<ObjectChunk>::size_type i = 0; i < chunks.size(); ++i) {
+        slots[chunks[i].getId()] = static_cast<int>(i);
+    }
+    Random rng(Random::MT19937, params._seed);
+    Object obj;
+    std::memset(&obj, 0, sizeof(Object));
+    for (int i = 0; i < params._numObjects; ++i) {
+        obj._objectId = i;
+        obj._ra   = rng.flat(fov.getMinRa(), fov.getMaxRa());
+        obj._decl = rng.flat(fov.getMinDec(), fov.getMaxDec());
+        std::map<int, int>::const_iterator s = slots.find(zsc.radecToChunk(obj._ra, obj._decl));
+        if (s != slots.end()) {
+            chunks[s->second].insert(obj);
+        }
+    }
+    for (std::vector<ObjectChunk>::iterator c = chunks.begin(); c != chunks.end(); ++c) {
+        c->setUsable();
+    }
+}
+
+
+/** Mirrors the insertion and sort performed by the load stage when building its object index. */
+void buildIndex(Index & index, std::vector<ObjectChunk> & chunks, RectangularRegion const & fov) {
+    index.clear();
+    index.setDecBounds(std::max(fov.getMinDec() - 0.5, -90.0), std::min(fov.getMaxDec() + 0.5, 90.0));
+    for (std::vector<ObjectChunk>::iterator c = chunks.begin(); c != chunks.end(); ++c) {
+        int const numBlocks = c->blocks();
+        int i = 0;
+        for (int b = 0; b < numBlocks; ++b) {
+            int const numEntries = c->entries(b);
+            Object * const block = c->getBlock(b);
+            for (int e = 0; e < numEntries; ++e, ++i) {
+                index.insert(block[e].getRa(), block[e].getDec(), &block[e], &*c, i);
+            }
+        }
+    }
+    index.sort();
+}
+
+
+/** Visits every object through the sorted index, i.e. in position rather than storage order. */
+double scanIndex(Index & index) {
+    double sum = 0.0;
+    for (int z = index.getMinZone(); z <= index.getMaxZone(); ++z) {
+        ZoneEntryArray<Entry> const * zone = index.getZone(z);
+        for (int e = 0; e < zone->_size; ++e) {
+            Object const * obj = zone->_entries[e]._data;
+            sum += obj->_muRa + obj->_muDecl;
+        }
+    }
+    return sum;
+}
+
+
+int runBenchmark(SharedObjectChunkManager::PageMode const mode, BenchParams const & params) {
+    std::ostringstream name;
+    name << "chunkPageBenchmark_" << ::getpid();
+
+    SharedObjectChunkManager::setPageMode(mode, params._hugetlbfsDir);
+    SharedObjectChunkManager manager(name.str());
+    // the mapping outlives the name, so nothing is leaked if the benchmark dies
+    SharedObjectChunkManager::destroyInstance(name.str());
+
+    std::cout << SharedObjectChunkManager::getPageModeName(mode) << '\t';
+    if (manager.getPageMode() != mode) {
+        std::cout << "unavailable" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    Index index(params._zonesPerDegree, 63,
+                static_cast<int>(params._numObjects/(2.0*params._fovRadius*params._zonesPerDegree)) + 1);
+    RectangularRegion const fov(45.0, 0.0, params._fovRadius);
+    std::vector<int> chunkIds;
+    computeChunkIds(chunkIds, fov, index.getDecomposition());
+
+    std::vector<ObjectChunk> toRead;
+    std::vector<ObjectChunk> toWaitFor;
+    manager.registerVisit(1);
+    manager.startVisit(toRead, toWaitFor, 1, chunkIds);
+    fillChunks(toRead, index.getDecomposition(), fov, params);
+
+    double best[2] = { 1e300, 1e300 };
+    for (int trial = 0; trial < params._numTrials; ++trial) {
+        Stopwatch watch(true);
+        buildIndex(index, toRead, fov);
+        watch.stop();
+        best[0] = std::min(best[0], watch.seconds());
+        watch.start();
+        sScanSink = scanIndex(index);
+        watch.stop();
+        best[1] = std::min(best[1], watch.seconds());
+    }
+    manager.endVisit(1, true);
+
+    std::cout << manager.getPageSize() << '\t' << best[0] << '\t' << best[1] << std::endl;
+    return EXIT_SUCCESS;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char * argv[]) {
+
+    using namespace boost::program_options;
+
+    try {
+
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "print usage help")
+            ("objects,n", value<int>()->default_value(2000000),
+                "the number of objects in the field of view")
+            ("trials,t", value<int>()->default_value(3),
+                "the number of timing trials per page mode")
+            ("zones-per-degree,z", value<int>()->default_value(180),
+                "the number of zones per degree of declination")
+            ("fov-radius,r", value<double>()->default_value(1.75),
+                "half the side length (deg) of the square field of view")
+            ("seed,s", value<unsigned long>()->default_value(1),
+                "the random number generator seed")
+            ("hugetlbfs-dir,H", value<std::string>()->default_value("/dev/hugepages"),
+                "directory of the hugetlbfs mount to allocate explicit huge pages from");
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        BenchParams params;
+        params._numObjects     = vm["objects"].as<int>();
+        params._numTrials      = vm["trials"].as<int>();
+        params._zonesPerDegree = vm["zones-per-degree"].as<int>();
+        params._fovRadius      = vm["fov-radius"].as<double>();
+        params._seed           = vm["seed"].as<unsigned long>();
+        params._hugetlbfsDir   = vm["hugetlbfs-dir"].as<std::string>();
+
+        std::cout << "objects: " << params._numObjects << ", zones per degree: " <<
+                     params._zonesPerDegree << ", trials: " << params._numTrials << std::endl;
+        std::cout << "page mode\tpage size (bytes)\tindex build (sec)\tindex scan (sec)" << std::endl;
+
+        SharedObjectChunkManager::PageMode const modes[3] = {
+            SharedObjectChunkManager::NORMAL_PAGES,
+            SharedObjectChunkManager::TRANSPARENT_HUGE_PAGES,
+            SharedObjectChunkManager::HUGETLBFS_PAGES
+        };
+        // each page mode gets a fresh process, since a process maps at most one chunk store
+        for (int m = 0; m < 3; ++m) {
+            std::cout.flush();
+            pid_t const pid = ::fork();
+            if (pid < 0) {
+                std::cerr << "fork() failed" << std::endl;
+                return EXIT_FAILURE;
+            } else if (pid == 0) {
+                int result = EXIT_FAILURE;
+                try {
+                    result = runBenchmark(modes[m], params);
+                } catch (std::exception & except) {
+                    std::cout << "failed" << std::endl;
+                    std::cerr << except.what() << std::endl;
+                }
+                std::cout.flush();
+                ::_exit(result);
+            }
+            int status = 0;
+            if (::waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+
+    } catch (std::exception & except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
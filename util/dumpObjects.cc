@@ -44,8 +44,10 @@ static char const* SVNid __attribute__((unused)) = "$Id$";
 #include <cstdlib>
 #include <cerrno>
 #include <fcntl.h>
+#include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <vector>
 #include <unistd.h>
 
 #include "mysql/mysql.h"
@@ -55,7 +57,9 @@ static char const* SVNid __attribute__((unused)) = "$Id$";
 #include "boost/program_options.hpp"
 
 #include "lsst/ap/Chunk.h"
+#include "lsst/ap/ChunkFormat.h"
 #include "lsst/ap/Object.h"
+#include "lsst/ap/io/FileIo.h"
 #include "lsst/afw/image/Filter.h"
 #include "lsst/pex/exceptions.h"
 #include "lsst/daf/persistence/DbAuth.h"
@@ -69,6 +73,7 @@ using lsst::pex::policy::Policy;
 using lsst::daf::persistence::DbAuth;
 using lsst::afw::image::Filter;
 using lsst::ap::BinChunkHeader;
+using lsst::ap::ColumnarFormat;
 using lsst::ap::Object;
 
 
@@ -110,6 +115,29 @@ static void conflictingOptions(
     }
 }
 
+// Orders objects by 1 arcminute declination zone, then by right ascension within a zone.
+// Neighbouring objects in this order are close on the sky, so their positions delta encode well.
+struct ZoneRaLess {
+    static int zone(Object const & o) {
+        return static_cast<int>(std::floor((o._decl + 90.0) * 60.0));
+    }
+    bool operator()(Object const & o1, Object const & o2) const {
+        int const z1 = zone(o1);
+        int const z2 = zone(o2);
+        return z1 < z2 || (z1 == z2 && o1._ra < o2._ra);
+    }
+};
+
+// Spatially sorts the objects of a chunk and writes them to a columnar chunk file.
+static void writeColumnarChunk(std::string const & fileName, std::vector<Object> & objects) {
+    std::sort(objects.begin(), objects.end(), ZoneRaLess());
+    lsst::ap::io::SequentialFileWriter writer(fileName, true);
+    Object const * block = objects.empty() ? 0 : &objects[0];
+    // all objects are in a single contiguous block
+    ColumnarFormat<Object>::write(writer, &block, 30, static_cast<int>(objects.size()));
+    writer.finish();
+}
+
 static void requiredOption(
     options_description const & desc,
     variables_map const & vm,
@@ -127,6 +155,8 @@ int main(int argc, char** argv) {
 
     // Number of chunks in this stripe.
     int numChunks = -1;
+    // Chunk file format version
+    int format = 2;
     // RA and declination minimum and maximum (initialized to bogus values)
     double minRa = -1000.0, maxRa = -1000.0;
     double minDecl = -1000.0, maxDecl = -1000.0;
@@ -140,7 +170,9 @@ int main(int argc, char** argv) {
 
     options_description generalOptions("General options");
     generalOptions.add_options()
-        ("help,h", "print usage help");
+        ("help,h", "print usage help")
+        ("format,f", value(&format)->default_value(2),
+            "Chunk file format version: 1 (raw records) or 2 (columnar)");
 
     options_description requiredOptions("Required (either -n OR -r/-R must be specified)");
     requiredOptions.add_options()
@@ -198,6 +230,11 @@ int main(int argc, char** argv) {
                      std::endl << desc << std::endl;
         return 1;
     }
+    if (format != 1 && format != 2) {
+        std::cerr << "Chunk file format version must be 1 or 2" <<
+                     std::endl << desc << std::endl;
+        return 1;
+    }
     // Check declination limits
     if (minDecl < -90.0 || maxDecl > 90.0 || minDecl >= maxDecl) {
         std::cerr << "Illegal declination limits" <<
@@ -325,6 +362,7 @@ int main(int argc, char** argv) {
     int fd = -1;                 // File descriptor for output file
     int chunkNum = -1;           // Current chunk number
     double chunkBoundary = -1.0; // Upper RA boundary of current chunk
+    std::vector<Object> objects; // Objects in current chunk (columnar format only)
 
     while ((err = mysql_stmt_fetch(stmt)) == 0) {
         // Check for nulls.
@@ -336,7 +374,12 @@ int main(int argc, char** argv) {
 
         // Check for new chunk.
         if (obj._ra > chunkBoundary) {
-            if (fd != -1) {
+            if (format == 2) {
+                if (!fileName.empty()) {
+                    writeColumnarChunk(fileName, objects);
+                    objects.clear();
+                }
+            } else if (fd != -1) {
                 // Rewrite the header, now that we know how many rows we have.
                 off_t pos = lseek(fd, 0, SEEK_SET);
                 if (pos == static_cast<off_t>(-1)) {
@@ -359,16 +402,23 @@ int main(int argc, char** argv) {
                 chunkBoundary = (360.0 * (chunkNum + 1)) / numChunks;
             }
 
-            // Open the new output file.
-            fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            ioAssert(fd >= 0, "Unable to open output file");
+            if (format == 1) {
+                // Open the new output file.
+                fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                ioAssert(fd >= 0, "Unable to open output file");
 
-            // Write the output file header.
-            header._numRecords = 0;
-            ssize_t bytes = write(fd, &header, sizeof(header));
-            ioAssert(bytes == sizeof(header), "Unable to write header");
+                // Write the output file header.
+                header._numRecords = 0;
+                ssize_t bytes = write(fd, &header, sizeof(header));
+                ioAssert(bytes == sizeof(header), "Unable to write header");
+            }
         }
 
+        if (format == 2) {
+            // Buffer the object - columnar chunk files are written once a chunk is complete.
+            objects.push_back(obj);
+            continue;
+        }
         // Write the object and increment the count.
         ssize_t bytes = write(fd, &obj, sizeof(obj));
         ioAssert(bytes == sizeof(obj), "Unable to write object");
@@ -385,7 +435,11 @@ int main(int argc, char** argv) {
     }
 
     // Finish the final chunk.
-    if (fd != -1) {
+    if (format == 2) {
+        if (!fileName.empty()) {
+            writeColumnarChunk(fileName, objects);
+        }
+    } else if (fd != -1) {
         // Rewrite the header, now that we know how many rows we have.
         off_t pos = lseek(fd, 0, SEEK_SET);
         if (pos == static_cast<off_t>(-1)) {
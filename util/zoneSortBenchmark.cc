@@ -0,0 +1,203 @@
+// -*- lsst-c++ -*-
+
+/* 
+ * LSST Data Management System
+ * Copyright 2008, 2009, 2010 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+ 
+ 
+
+/**
+ * @file
+ * @brief   Benchmarks ZoneIndex::sort() against a per-zone std::sort of the zone entries.
+ *
+ * Builds an object sized zone index covering a 10x10 degree region for each requested
+ * number of entries, and times sorting it both ways. The first timing corresponds to the
+ * zone sort used before zones were radix sorted: a comparison sort of each zone followed
+ * by a rebuild of the zone columns, statically scheduled across threads.
+ *
+ * @ingroup associate
+ */
+
+#if LSST_AP_HAVE_OPEN_MP
+#   include <omp.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+#include "lsst/afw/math/Random.h"
+
+#include "lsst/ap/Common.h"
+#include "lsst/ap/Time.h"
+#include "lsst/ap/ZoneTypes.h"
+
+using lsst::afw::math::Random;
+using namespace lsst::ap;
+
+
+namespace {
+
+struct BenchDatum {
+    double _ra;
+    double _dec;
+
+    double getRa()  const { return _ra;  }
+    double getDec() const { return _dec; }
+};
+
+struct BenchChunk {
+    typedef BenchDatum Entry;
+};
+
+typedef ZoneEntry<BenchChunk> Entry;
+typedef ZoneIndex<Entry>      Index;
+
+
+void generateData(std::vector<BenchDatum> & data, int const numEntries, unsigned long const seed) {
+    Random rng(Random::MT19937, seed);
+    data.resize(numEntries);
+    for (int i = 0; i < numEntries; ++i) {
+        data[i]._ra  = rng.flat(0.0, 10.0);
+        data[i]._dec = rng.flat(-5.0, 5.0);
+    }
+}
+
+
+void buildIndex(Index & index, std::vector<BenchDatum> & data) {
+    index.clear();
+    index.setDecBounds(-5.0, 5.0);
+    int const numEntries = static_cast<int>(data.size());
+    for (int i = 0; i < numEntries; ++i) {
+        index.insert(data[i]._ra, data[i]._dec, &data[i], 0, i);
+    }
+}
+
+
+void comparisonSort(Index & index) {
+    int const minZone = index.getMinZone();
+    int const numZones = index.getMaxZone() - minZone + 1;
+#if LSST_AP_HAVE_OPEN_MP
+#   pragma omp parallel for default(shared) \
+               schedule(static,8)
+#endif
+    for (int t = 0; t < numZones; ++t) {
+        ZoneEntryArray<Entry> * zone = index.getZone(minZone + t);
+        std::sort(zone->_entries, zone->_entries + zone->_size);
+        zone->buildColumns();
+    }
+}
+
+
+bool isSorted(Index & index) {
+    for (int z = index.getMinZone(); z <= index.getMaxZone(); ++z) {
+        ZoneEntryArray<Entry> const * zone = index.getZone(z);
+        for (int e = 1; e < zone->_size; ++e) {
+            if (zone->_ra[e] < zone->_ra[e - 1]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char * argv[]) {
+
+    using namespace boost::program_options;
+
+    try {
+
+        std::vector<int> sizes;
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "print usage help")
+            ("zones-per-degree,z", value<int>()->default_value(180),
+                "the number of zones per degree of declination")
+            ("trials,t", value<int>()->default_value(3),
+                "the number of timing trials per index size")
+            ("seed,s", value<unsigned long>()->default_value(1),
+                "the random number generator seed")
+            ("entries,n", value<std::vector<int> >(&sizes)->multitoken(),
+                "index sizes to benchmark (default: 1M, 5M, 10M and 50M entries)");
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        if (sizes.empty()) {
+            sizes.push_back(1000000);
+            sizes.push_back(5000000);
+            sizes.push_back(10000000);
+            sizes.push_back(50000000);
+        }
+        int const zonesPerDegree = vm["zones-per-degree"].as<int>();
+        int const numTrials = vm["trials"].as<int>();
+        unsigned long const seed = vm["seed"].as<unsigned long>();
+
+        int numThreads = 1;
+#if LSST_AP_HAVE_OPEN_MP
+        numThreads = omp_get_max_threads();
+#endif
+        std::cout << "threads: " << numThreads << ", zones per degree: " << zonesPerDegree <<
+                     ", trials: " << numTrials << std::endl;
+        std::cout << "entries\tstd::sort (sec)\tradix sort (sec)\tspeedup" << std::endl;
+
+        for (std::vector<int>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+            Index index(zonesPerDegree, 63, *i/(10*zonesPerDegree) + 1);
+            std::vector<BenchDatum> data;
+            double best[2] = { 1e300, 1e300 };
+            for (int trial = 0; trial < numTrials; ++trial) {
+                generateData(data, *i, seed + trial);
+                for (int method = 0; method < 2; ++method) {
+                    buildIndex(index, data);
+                    Stopwatch watch(true);
+                    if (method == 0) {
+                        comparisonSort(index);
+                    } else {
+                        index.sort();
+                    }
+                    watch.stop();
+                    if (!isSorted(index)) {
+                        std::cerr << "zone index not sorted!" << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    best[method] = std::min(best[method], watch.seconds());
+                }
+            }
+            std::cout << *i << '\t' << best[0] << '\t' << best[1] << '\t' <<
+                         best[0]/best[1] << std::endl;
+        }
+
+    } catch (std::exception & except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}